@@ -220,12 +220,8 @@ CMD="$CEXTRACT -U $DIR.selected.unassigned -o $DIR.unassigned"
 if [ $VERBOSE -gt 0 ]; then echo "megaclust.sh: $CMD"; fi
 $CMD >> $DIR.cextract.log
 
-CMD="cat $DIR.clusters $DIR.unassigned"
-if [ $VERBOSE -gt 0 ]; then echo "$CMD | sed -e s/,.*,/,/g | sort -g > $DIR.clusters.sort"; fi
-$CMD | sed -e s/,.*,/,/g | sort -g > $DIR.clusters.sort
-
-if [ -f $DIR.leftover.clusters ]; then
- mv $DIR.clusters.sort $DIR.clusters.sort.noleftover
- cat $DIR.clusters.sort.noleftover $DIR.leftover.clusters  | sort -g > $DIR.clusters.sort
-fi
+# rowid,cluster of every event (assigned, unassigned and leftover) sorted by rowid
+CMD="$CEXTRACT -f $DIR -F $DIR.clusters.sort"
+if [ $VERBOSE -gt 0 ]; then echo "megaclust.sh: $CMD"; fi
+$CMD >> $DIR.cextract.log
 
@@ -77,6 +77,12 @@
 #include <pthread.h>
 #include <float.h>
 #include "dclust.h"
+#include "dclustfile.h"
+
+/* ------------------------------------------------------------------------------------ */
+
+#define kMaxFormatThreads 64
+#define kFormatBufSize (4*1024*1024)	/* csv text formatted by a thread before it is written */
 
 /* ------------------------------------------------------------------------------------ */
 
@@ -94,8 +100,56 @@ struct	FACSDATA_struct
 };
 
 
+/* a block of consecutive rows formatted as csv by one thread */
+typedef	struct	FORMATBLOCK_struct	FORMATBLOCK;
+struct	FORMATBLOCK_struct
+{
+	const DCLUSTFILE *df;
+	unsigned int first;
+	unsigned int last;
+	unsigned int cid;		/* -1 for every cluster */
+	unsigned int printCID;
+	char *buf;
+	size_t size;
+	size_t rowmax;
+	size_t len;
+	unsigned int cnt;
+	int err;
+};
+
+/* a row of RootName.selected standing for cnt more events, collapsed by dselect -D */
+typedef	struct	DUPLICATEROW_struct	DUPLICATEROW;
+struct	DUPLICATEROW_struct
+{
+	CELLNAMEIDX cellnameidx;
+	unsigned int cnt;
+	unsigned long long first;	/* of its events in the duplicate section */
+};
+
+
+/* rowid,cluster lines of the final table; rowids may repeat and are not dense */
+typedef	struct	FINALROW_struct	FINALROW;
+struct	FINALROW_struct
+{
+	unsigned int rowid;
+	unsigned int cid;
+};
+
+typedef	struct	FINALTABLE_struct	FINALTABLE;
+struct	FINALTABLE_struct
+{
+	FINALROW *row;
+	size_t cnt;
+	size_t cap;
+};
+
+
 static int firsttime = 1;
 static unsigned int extractedcnt = 0;
+static unsigned int formatthreadcnt = 1;
+static DCLUSTFILE dupfile;
+static DUPLICATEROW *duprow = NULL;
+static unsigned int duprowcnt = 0;
 /* ------------------------------------------------------------------------------------ */
 
 static void PrintSummaryTable(FILE *f,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *summary,unsigned int maxclusterid)
@@ -117,233 +171,384 @@ static void PrintSummaryTable(FILE *f,FACSNAME *uniquecellnames,unsigned short c
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned int GetMaxClusterId(FILE *f,unsigned short cellnamecnt,unsigned int **summary)
+static char *PutUInt(char *p,unsigned int v)
 {
-	unsigned int rowcnt;
-	unsigned int colcnt;
-	char	hdr[kHeaderSize];
-	unsigned int maxclusterid;
-	int endian;
-	
-	fread(&hdr,sizeof(char),kHeaderSize,f);
-	if (strcmp(hdr,"dclust assigned file v1.0     \n") != 0)
-	{
-		printf("Error: input is not a dclust assigned file\n");
-		return(0);
-	}	
-	fread(&endian,sizeof(int),1,f);
-	if (endian != 1)
-	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
-		return(0);
-	}
-	fread(&rowcnt,sizeof(int),1,f);
-	fread(&colcnt,sizeof(int),1,f);
-	if (colcnt > kMaxInputCol)
+	char digits[10];
+	unsigned int n = 0;
+
+	do
 	{
-		printf("Error: number of requested data columns exceed maximum allowed (%d > %d)\n",colcnt,kMaxInputCol);
-		return(0);
-	}	
+		digits[n++] = (char)('0' + v%10);
+		v /= 10;
+	} while (v > 0);
+	while (n > 0)
+		*p++ = digits[--n];
+	return(p);
 
-	fread(&maxclusterid,sizeof(int),1,f);
+} /* PutUInt */
 
+/* ------------------------------------------------------------------------------------ */
 
-	if (!*summary)
+/* same text as printf %d */
+static char *PutInt(char *p,int v)
+{
+	if (v < 0)
 	{
-		*summary = calloc(cellnamecnt*(maxclusterid+1),sizeof(unsigned int));
-		if (!*summary)
-		{
-			printf("Error:Cannot Allocate Memory for Summary Table.\n");
-			return(0);
-		}
+		*p++ = '-';
+		return(PutUInt(p,0u-(unsigned int)v));
 	}
+	return(PutUInt(p,(unsigned int)v));
 
-	return(maxclusterid);
-	
-} /* GetMaxClusterId */
+} /* PutInt */
 
 /* ------------------------------------------------------------------------------------ */
-static unsigned short ExtractDataFromUnassigned(FILE *f, FILE *of,unsigned int printCID)
+
+static int CompareDuplicateRows(const void *a,const void *b)
 {
-	unsigned int rowcnt,rcnt;
-	unsigned int colcnt;
-	char	header[kMaxLineBuf];
-	char	hdr[kHeaderSize];
-	unsigned int mcid;
-	int endian;
+	CELLNAMEIDX ia = ((const DUPLICATEROW *)a)->cellnameidx;
+	CELLNAMEIDX ib = ((const DUPLICATEROW *)b)->cellnameidx;
 
+	return((ia > ib) - (ia < ib));
+
+} /* CompareDuplicateRows */
+
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeDuplicates(void)
+{
+	if (duprow)
+		DclustFileClose(&dupfile);
+	free(duprow);
+	duprow = NULL;
+	duprowcnt = 0;
 
-	fread(&hdr,sizeof(char),kHeaderSize,f);
-	if (strcmp(hdr,"dclust unassigned file v1.0   \n") != 0)
+} /* FreeDuplicates */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* note the rows of a selected file standing for several identical events, so that each event is written back */
+static int LoadDuplicates(const char *fn)
+{
+	unsigned long long first = 0;
+	unsigned int r,n;
+
+	if (DclustFileOpen(&dupfile,fn,kDclustSelectedFile,0) != 0)
+		return(0);
+	if ((dupfile.hdr.weightoffset == 0) || DclustFileMap(&dupfile))
 	{
-		printf("Error: input is not a dclust unassigned file\n");
-		return(1);
-	}	
-	fread(&endian,sizeof(int),1,f);
-	if (endian != 1)
+		DclustFileClose(&dupfile);
+		return(0);
+	}
+	n = 0;
+	for (r = 0; r < dupfile.hdr.rowcnt; r++)
+		if (DclustFileWeight(&dupfile,r) > 1)
+			n++;
+	duprow = malloc((size_t)(n+1)*sizeof(DUPLICATEROW));
+	if (!duprow)
 	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
+		printf("Error:Cannot Allocate Memory.\n");
+		DclustFileClose(&dupfile);
 		return(1);
 	}
-	fread(&rowcnt,sizeof(int),1,f);
-	fread(&colcnt,sizeof(int),1,f);
-	if (colcnt > kMaxInputCol)
+	for (r = 0; r < dupfile.hdr.rowcnt; r++)
 	{
-		printf("Error: number of requested data columns exceed maximum allowed (%d > %d)\n",colcnt,kMaxInputCol);
+		unsigned int weight = DclustFileWeight(&dupfile,r);
+
+		if (weight > 1)
+		{
+			duprow[duprowcnt].cellnameidx = DclustFileCellNameIdx(&dupfile,r);
+			duprow[duprowcnt].cnt = weight-1;
+			duprow[duprowcnt].first = first;
+			duprowcnt++;
+			first += weight-1;
+		}
+	}
+	if (first != dupfile.hdr.duplicatecnt)
+	{
+		printf("Error: %s: row weights stand for %llu collapsed events, %llu found\n",fn,first,dupfile.hdr.duplicatecnt);
+		FreeDuplicates();
 		return(1);
-	}	
+	}
+	qsort(duprow,duprowcnt,sizeof(DUPLICATEROW),CompareDuplicateRows);
+	return(0);
 
-	fread(&mcid,sizeof(int),1,f);
+} /* LoadDuplicates */
 
-	/* skip header */
-	fread(&header,sizeof(char),kMaxLineBuf,f);
+/* ------------------------------------------------------------------------------------ */
 
-	if (of)
-	{
-		for (rcnt = 0; rcnt < rowcnt; rcnt++)
-		{
-			CELLNAMEIDX cellnameidx;
-			unsigned short col;
-			float value[kMaxInputCol]; 
+static const DUPLICATEROW *FindDuplicates(CELLNAMEIDX cellnameidx)
+{
+	DUPLICATEROW key;
 
-			/* skip cellname */
-			fread(&cellnameidx,sizeof(CELLNAMEIDX),1,f);
+	if (duprowcnt == 0)
+		return(NULL);
+	key.cellnameidx = cellnameidx;
+	return((const DUPLICATEROW *)bsearch(&key,duprow,duprowcnt,sizeof(DUPLICATEROW),CompareDuplicateRows));
 
-			fread(&value[0],sizeof(float),colcnt,f);
+} /* FindDuplicates */
 
-			fprintf(of,"%u",cellnameidx);
+/* ------------------------------------------------------------------------------------ */
 
-			for(col=0;col<colcnt;col++)
-				fprintf(of,",%d",(int)value[col]);
-			if (printCID)
-				fprintf(of,",0\n");
-			else
-				fprintf(of,"\n");
-			extractedcnt++;
+/* room for one more row in the text of a block; rows standing for several events can overflow it */
+static int GrowFormatBuf(FORMATBLOCK *fb,size_t len)
+{
+	char *buf;
 
-		} 
-	}	
+	if (len+fb->rowmax <= fb->size)
+		return(0);
+	buf = realloc(fb->buf,2*fb->size);
+	if (!buf)
+	{
+		fb->err = 1;
+		return(1);
+	}
+	fb->buf = buf;
+	fb->size *= 2;
 	return(0);
-	
-	
-} /* ExtractDataFromUnassigned */
+
+} /* GrowFormatBuf */
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned int loaddatabinary(FILE *f,FILE *of,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int cid)
+static void *FormatRows(void *arg)
 {
-	unsigned int rowcnt,rcnt;
-	unsigned int colcnt;
-	char	header[kMaxLineBuf];
-	char	hdr[kHeaderSize];
-	unsigned int mcid;
-	int endian;
+	FORMATBLOCK *fb = (FORMATBLOCK *)arg;
+	const DCLUSTFILE *df = fb->df;
+	unsigned int colcnt = df->hdr.colcnt;
+	unsigned int rcnt;
+	size_t len = 0;
+
+	fb->cnt = 0;
+	fb->err = 0;
+	for (rcnt = fb->first; rcnt < fb->last; rcnt++)
+	{
+		unsigned short col;
+		float value[kMaxInputCol]; 
+		unsigned int clusterid = DclustFileClusterId(df,rcnt);
+		CELLNAMEIDX cellnameidx;
+		const DUPLICATEROW *dr;
+		size_t values;
+		unsigned int d;
+		char *p;
+
+		if ((fb->cid != -1) && (clusterid != fb->cid))
+			continue;
+		if (GrowFormatBuf(fb,len))
+			break;
+		cellnameidx = DclustFileCellNameIdx(df,rcnt);
+		DclustFileGetRow(df,rcnt,&value[0]);
+		p = PutUInt(fb->buf+len,cellnameidx);
+		values = p-fb->buf;
+		for(col=0;col<colcnt;col++)
+		{
+			*p++ = ',';
+			p = PutInt(p,(int)value[col]);
+		}
+		if (fb->printCID)
+		{
+			*p++ = ',';
+			p = PutInt(p,(int)clusterid);
+		}
+		*p++ = '\n';
+		len = p-fb->buf;
+		fb->cnt++;
 
+		/* the events collapsed into this row get the same line under their own rowid */
+		dr = FindDuplicates(cellnameidx);
+		for (d = 0; dr && (d < dr->cnt); d++)
+		{
+			size_t vlen = len-values;
+
+			if (GrowFormatBuf(fb,len))
+				break;
+			p = PutUInt(fb->buf+len,DclustFileDuplicate(&dupfile,dr->first+d));
+			memcpy(p,fb->buf+values,vlen);
+			values = p-fb->buf;
+			len = values+vlen;
+			fb->cnt++;
+		}
+		if (fb->err)
+			break;
+	}
+	fb->len = (fb->err) ? 0 : len;
+	return(NULL);
+
+} /* FormatRows */
 
-	fread(&hdr,sizeof(char),kHeaderSize,f);
-	if (strcmp(hdr,"dclust assigned file v1.0     \n") != 0)
+/* ------------------------------------------------------------------------------------ */
+
+/* print the rows firstrow to lastrow-1 of cluster cid (every row if -1) as csv: blocks of rows */
+/* are formatted by formatthreadcnt threads at a time, then written in row order */
+static unsigned int WriteCSVRows(const DCLUSTFILE *df,FILE *of,unsigned int firstrow,unsigned int lastrow,unsigned int cid,unsigned int printCID)
+{
+	FORMATBLOCK fb[kMaxFormatThreads];
+	pthread_t thread[kMaxFormatThreads];
+	int started[kMaxFormatThreads];
+	unsigned int rowcnt = lastrow-firstrow;
+	size_t rowmax = (size_t)(df->hdr.colcnt+2)*12;	/* up to 11 characters and a separator per value */
+	unsigned int blockrows = kFormatBufSize/rowmax;
+	unsigned int threadcnt = formatthreadcnt;
+	unsigned int first;
+	unsigned int t,n;
+	unsigned int err = 0;
+
+	if (blockrows < 1)
+		blockrows = 1;
+	if (threadcnt > kMaxFormatThreads)
+		threadcnt = kMaxFormatThreads;
+	if (threadcnt > (rowcnt+blockrows-1)/blockrows)
+		threadcnt = (rowcnt+blockrows-1)/blockrows;
+	if (threadcnt < 1)
+		threadcnt = 1;
+	for (t = 0; t < threadcnt; t++)
 	{
-		printf("Error: input is not a dclust assigned file\n");
-		return(1);
-	}	
-	fwrite(&hdr,sizeof(char),kHeaderSize,of);
-	
-	fread(&endian,sizeof(int),1,f);
-	if (endian != 1)
+		fb[t].df = df;
+		fb[t].cid = cid;
+		fb[t].printCID = printCID;
+		fb[t].size = blockrows*rowmax;
+		fb[t].rowmax = rowmax;
+		fb[t].buf = malloc(fb[t].size);
+		if (!fb[t].buf)
+			break;
+	}
+	if (t == 0)
 	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
+		printf("Error:Cannot Allocate Memory.\n");
 		return(1);
 	}
-	fwrite(&endian,sizeof(int),1,of);
-	
-	fread(&rowcnt,sizeof(int),1,f);
-	fwrite(&rowcnt,sizeof(int),1,of);
+	threadcnt = t;
 
-	fread(&colcnt,sizeof(int),1,f);
-	if (colcnt > kMaxInputCol)
+	for (first = firstrow; first < lastrow; )
 	{
-		printf("Error: number of requested data columns exceed maximum allowed (%d > %d)\n",colcnt,kMaxInputCol);
-		return(1);
-	}	
-	fwrite(&colcnt,sizeof(int),1,of);
+		for (n = 0; (n < threadcnt) && (first < lastrow); n++)
+		{
+			fb[n].first = first;
+			fb[n].last = (lastrow-first > blockrows) ? first+blockrows : lastrow;
+			first = fb[n].last;
+		}
+		for (t = 1; t < n; t++)
+			started[t] = (pthread_create(&thread[t],NULL,&FormatRows,&fb[t]) == 0);
+		FormatRows(&fb[0]);
+		for (t = 1; t < n; t++)
+		{
+			if (started[t])
+				pthread_join(thread[t],NULL);
+			else
+				FormatRows(&fb[t]);
+		}
+		for (t = 0; t < n; t++)
+		{
+			if (fb[t].err)
+				printf("Error:Cannot Allocate Memory.\n");
+			if (fb[t].err || (fwrite(fb[t].buf,1,fb[t].len,of) != fb[t].len))
+				err = 1;
+			extractedcnt += fb[t].cnt;
+		}
+		if (err)
+			break;
+	}
 
-	fread(&mcid,sizeof(int),1,f);
-	mcid=1; /* we extract only  one cluster */
-	fwrite(&mcid,sizeof(int),1,of);
+	for (t = 0; t < threadcnt; t++)
+		free(fb[t].buf);
+	if (err)
+		printf("Error:Cannot Write Output File\n");
+	return(err);
 
+} /* WriteCSVRows */
 
-	/* skip header */
-	fread(&header,sizeof(char),kMaxLineBuf,f);
-	fwrite(&header,sizeof(char),kMaxLineBuf,of);
+/* ------------------------------------------------------------------------------------ */
 
-	for (rcnt = 0; rcnt < rowcnt; rcnt++)
-	{
-		CELLNAMEIDX cellnameidx;
-		float value[kMaxInputCol]; 
-		unsigned int clusterid;
+static unsigned int GetMaxClusterId(DCLUSTFILE *df,unsigned short cellnamecnt,unsigned int **summary)
+{
+	unsigned int maxclusterid = df->hdr.maxclusterid;
 
-		/* skip cellname */
-		fread(&cellnameidx,sizeof(CELLNAMEIDX),1,f);
-		fread(&value[0],sizeof(float),colcnt,f);
-		fread(&clusterid,sizeof(unsigned int),1,f);
-		if (clusterid == cid)
+	if (!*summary)
+	{
+		*summary = calloc(cellnamecnt*(maxclusterid+1),sizeof(unsigned int));
+		if (!*summary)
 		{
-			fwrite(&cellnameidx,sizeof(CELLNAMEIDX),1,of);
-			fwrite(&value[0],sizeof(float),colcnt,of);
-			clusterid=1;
-			fwrite(&clusterid,sizeof(unsigned int),1,of);
-			extractedcnt++;
+			printf("Error:Cannot Allocate Memory for Summary Table.\n");
+			return(0);
 		}
-	} 
-
-	/* adjust number of events assigned  in cluster */
-	fseek(of,(kHeaderSize+sizeof(int)),SEEK_SET);
-	fwrite(&extractedcnt,sizeof(unsigned int),1,of);
+	}
 
-	return(0);
+	return(maxclusterid);
 	
-} /* loaddatabinary */
+} /* GetMaxClusterId */
 
 /* ------------------------------------------------------------------------------------ */
-static unsigned int loaddata(FILE *f,FILE *of,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *summary,unsigned int maxclusterid,unsigned int cid,unsigned int nid,unsigned int printCID)
+static unsigned short ExtractDataFromUnassigned(DCLUSTFILE *df, FILE *of,unsigned int printCID)
 {
-	unsigned int rowcnt,rcnt;
-	unsigned int colcnt;
-	char	header[kMaxLineBuf];
-	char	hdr[kHeaderSize];
-	unsigned int mcid;
-	int endian;
+	/* unassigned files have no clusterid, which reads as 0 */
+	if (of)
+		return(WriteCSVRows(df,of,0,(unsigned int)df->hdr.rowcnt,-1,printCID));
+	return(0);
+	
+	
+} /* ExtractDataFromUnassigned */
 
+/* ------------------------------------------------------------------------------------ */
 
-	fread(&hdr,sizeof(char),kHeaderSize,f);
-	if (strcmp(hdr,"dclust assigned file v1.0     \n") != 0)
+/* write the events of cluster cid as a v2 assigned file holding a single cluster */
+static unsigned int loaddatabinary(DCLUSTFILE *df,FILE *of,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int cid)
+{
+	unsigned long long first = 0;
+	unsigned long long last = df->hdr.rowcnt;
+	unsigned long long firstrow[3];
+	unsigned int rcnt;
+	DCLUSTHEADER hdr;
+	DCLUSTWRITER w;
+
+	DclustFileInitHeader(&hdr,kDclustAssignedFile,df->hdr.datatype,df->hdr.colcnt,df->hdr.header);
+	hdr.maxclusterid = 1; /* we extract only  one cluster */
+	if (DclustFileClusterRows(df,cid,&first,&last) == 0)
+		hdr.rowcnt = last-first;
+	else
 	{
-		printf("Error: input is not a dclust assigned file\n");
+		for (rcnt = 0; rcnt < last; rcnt++)
+		{
+			if (DclustFileClusterId(df,rcnt) == cid)
+				hdr.rowcnt++;
+		}
+	}
+	if (DclustFileCreate(&w,of,&hdr,NULL))
 		return(1);
-	}	
-	fread(&endian,sizeof(int),1,f);
-	if (endian != 1)
+	firstrow[0] = 0;
+	firstrow[1] = 0;
+	firstrow[2] = hdr.rowcnt;
+	DclustFileSetClusterRows(&w,firstrow);
+
+	for (rcnt = (unsigned int)first; rcnt < last; rcnt++)
 	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
-		return(1);
-	}
-	fread(&rowcnt,sizeof(int),1,f);
-	fread(&colcnt,sizeof(int),1,f);
-	if (colcnt > kMaxInputCol)
+		if (DclustFileClusterId(df,rcnt) == cid)
+		{
+			DclustFilePutRow(&w,DclustFileCellNameIdx(df,rcnt),DclustFileData(df,rcnt),1);
+			extractedcnt++;
+		}
+	} 
+
+	if (DclustFileFinish(&w))
 	{
-		printf("Error: number of requested data columns exceed maximum allowed (%d > %d)\n",colcnt,kMaxInputCol);
+		printf("Error:Cannot Write Output File\n");
 		return(1);
-	}	
+	}
+	return(0);
+	
+} /* loaddatabinary */
+
+/* ------------------------------------------------------------------------------------ */
+static unsigned int loaddata(DCLUSTFILE *df,FILE *of,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *summary,unsigned int maxclusterid,unsigned int cid,unsigned int nid,unsigned int printCID)
+{
+	char	header[kMaxLineBuf];
+	unsigned int mcid = df->hdr.maxclusterid;
 
-	fread(&mcid,sizeof(int),1,f);
 	if ((mcid > 0) && (mcid != maxclusterid))
 	{
 		printf("Error: Maximum ClusterID=%d differs from Maximum ClusterID=%d from .assigned file\n",mcid,maxclusterid);
 		return(1);
 	}	
 
-	/* skip header */
-	fread(&header,sizeof(char),kMaxLineBuf,f);
+	strcpy(header,df->hdr.header);
 
 	if (of)
 	{
@@ -354,48 +559,284 @@ static unsigned int loaddata(FILE *f,FILE *of,FACSNAME *uniquecellnames,unsigned
 			fprintf(of,"%s\n",header);
 			firsttime = 0;
 		}
-		for (rcnt = 0; rcnt < rowcnt; rcnt++)
+		unsigned long long first = 0;
+		unsigned long long last = df->hdr.rowcnt;
+
+		/* a single cluster is read from its rows only when they are grouped */
+		if (cid != -1)
+			DclustFileClusterRows(df,cid,&first,&last);
+		return(WriteCSVRows(df,of,(unsigned int)first,(unsigned int)last,cid,printCID));
+	}
+	
+	return(0);
+	
+} /* loaddata */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* open and map a v1 or v2 dclust binary file */
+static int OpenBinaryFile(DCLUSTFILE *df,char *fn,unsigned int filetype)
+{
+	int err = DclustFileOpen(df,fn,filetype,1);
+
+	if ((err == 0) && DclustFileMap(df))
+	{
+		DclustFileClose(df);
+		err = -1;
+	}
+	if (err < 0)
+		printf("Error:Cannot Open Input File %s\n",fn);
+	return(err != 0);
+
+} /* OpenBinaryFile */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* make sure the final table can hold more rows */
+static int GrowFinalTable(FINALTABLE *t,size_t more)
+{
+	FINALROW *newrow;
+	size_t newcap;
+
+	if (t->cnt+more <= t->cap)
+		return(0);
+	newcap = (t->cap < 1024) ? 1024 : t->cap;
+	while (newcap < t->cnt+more)
+		newcap *= 2;
+	newrow = realloc(t->row,newcap*sizeof(FINALROW));
+	if (!newrow)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		return(1);
+	}
+	t->row = newrow;
+	t->cap = newcap;
+	return(0);
+
+} /* GrowFinalTable */
+
+/* ------------------------------------------------------------------------------------ */
+
+static int AddFinalRow(FINALTABLE *t,unsigned int rowid,unsigned int cid)
+{
+	if (GrowFinalTable(t,1))
+		return(1);
+	t->row[t->cnt].rowid = rowid;
+	t->row[t->cnt].cid = cid;
+	t->cnt++;
+	return(0);
+
+} /* AddFinalRow */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* same order as sort -g on the rowid,cluster lines: by rowid, then by the text of the line */
+static int CompareFinalRows(const void *a,const void *b)
+{
+	const FINALROW *ra = (const FINALROW *)a;
+	const FINALROW *rb = (const FINALROW *)b;
+	char ta[16],tb[16];
+
+	if (ra->rowid != rb->rowid)
+		return((ra->rowid < rb->rowid) ? -1 : 1);
+	if (ra->cid == rb->cid)
+		return(0);
+	*PutUInt(ta,ra->cid) = 0;
+	*PutUInt(tb,rb->cid) = 0;
+	return(strcmp(ta,tb));
+
+} /* CompareFinalRows */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* enter the rowids of an .assigned or .unassigned file in the final table */
+static int AddBinaryToFinalTable(const DCLUSTFILE *df,FINALTABLE *t)
+{
+	unsigned int rowcnt = (unsigned int)df->hdr.rowcnt;
+	unsigned int rcnt;
+
+	if (GrowFinalTable(t,rowcnt))
+		return(1);
+	for (rcnt = 0; rcnt < rowcnt; rcnt++)
+	{
+		CELLNAMEIDX idx = DclustFileCellNameIdx(df,rcnt);
+		unsigned int cid = DclustFileClusterId(df,rcnt);
+		const DUPLICATEROW *dr = FindDuplicates(idx);
+		unsigned int d;
+
+		if (AddFinalRow(t,idx,cid))
+			return(1);
+		for (d = 0; dr && (d < dr->cnt); d++)
 		{
-			CELLNAMEIDX cellnameidx;
-			unsigned short col;
-			float value[kMaxInputCol]; 
-			unsigned int clusterid;
+			if (AddFinalRow(t,DclustFileDuplicate(&dupfile,dr->first+d),cid))
+				return(1);
+		}
+	}
+	return(0);
 
-			/* skip cellname */
-			fread(&cellnameidx,sizeof(CELLNAMEIDX),1,f);
-			fread(&value[0],sizeof(float),colcnt,f);
-			fread(&clusterid,sizeof(unsigned int),1,f);
+} /* AddBinaryToFinalTable */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* enter the rowid,cluster lines written by dclust -L in the final table */
+static int AddLeftoverToFinalTable(FILE *f,FINALTABLE *t)
+{
+	char *buf;
+	size_t len,i;
+	unsigned int v = 0;
+	unsigned int idx = 0;
+	unsigned int field = 0;
+
+	buf = malloc(kFormatBufSize);
+	if (!buf)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		return(1);
+	}
+	while ((len = fread(buf,1,kFormatBufSize,f)) > 0)
+	{
+		for (i = 0; i < len; i++)
+		{
+			char c = buf[i];
 
-			if ((cid == -1) || (clusterid == cid))
+			if ((c >= '0') && (c <= '9'))
+				v = v*10 + (unsigned int)(c-'0');
+			else if (c == ',')
 			{
-				fprintf(of,"%u",cellnameidx);
-				for(col=0;col<colcnt;col++)
-					fprintf(of,",%d",(int)value[col]);
-				if (printCID)
-					fprintf(of,",%d\n",clusterid);
-				else
-					fprintf(of,"\n");
-				extractedcnt++;
+				idx = v;
+				v = 0;
+				field = 1;
 			}
-		} 
+			else if (c == '\n')
+			{
+				if (field == 1)
+				{
+					if (AddFinalRow(t,idx,v))
+					{
+						free(buf);
+						return(1);
+					}
+				}
+				v = 0;
+				field = 0;
+			}
+		}
 	}
-	else
+	free(buf);
+	return(0);
+
+} /* AddLeftoverToFinalTable */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* write the rowid,cluster table of every event of RootName sorted by rowid, */
+/* i.e. the unassigned (cluster 0), assigned and leftover events together */
+static int WriteFinalTable(char *rfn,char *ofn)
+{
+	DCLUSTFILE df;
+	char fn[kMaxFilename];
+	FINALTABLE t;
+	size_t n;
+	char *header,*last;
+	char *buf = NULL;
+	char *p;
+	FILE *f;
+	FILE *of = NULL;
+	int err;
+
+	memset(&t,0,sizeof(FINALTABLE));
+
+	sprintf(fn,"%s.selected.assigned",rfn);
+	if (OpenBinaryFile(&df,fn,kDclustAssignedFile))
+		return(1);
+	err = AddBinaryToFinalTable(&df,&t);
+	header = strdup(df.hdr.header);
+	DclustFileClose(&df);
+	if (err || !header)
+		goto bail;
+
+	sprintf(fn,"%s.selected.unassigned",rfn);
+	err = DclustFileOpen(&df,fn,kDclustUnassignedFile,1);
+	if (err > 0)
+		goto bail;
+	if (err == 0)
 	{
-		for (rcnt = 0; rcnt < rowcnt; rcnt++)
+		if (DclustFileMap(&df))
 		{
-			CELLNAMEIDX cellnameidx;
-			unsigned int clusterid;
+			printf("Error:Cannot Open Input File %s\n",fn);
+			DclustFileClose(&df);
+			goto bail;
+		}
+		err = AddBinaryToFinalTable(&df,&t);
+		DclustFileClose(&df);
+		if (err)
+			goto bail;
+	}
+
+	sprintf(fn,"%s.leftover.clusters",rfn);
+	f = fopen(fn,"r");
+	if (f)
+	{
+		err = AddLeftoverToFinalTable(f,&t);
+		fclose(f);
+		if (err)
+			goto bail;
+	}
+
+	/* .assigned keeps the rows of a cluster together: sort on the rowid */
+	qsort(t.row,t.cnt,sizeof(FINALROW),CompareFinalRows);
+
+	of = fopen(ofn,"w");
+	buf = malloc(kFormatBufSize);
+	if (!of || !buf)
+	{
+		printf("Error:Cannot Write File %s\n",ofn);
+		goto bail;
+	}
+
+	/* keep the rowid and cluster column names */
+	last = strrchr(header,',');
+	p = strchr(header,',');
+	if (p && (p != last))
+		memmove(p,last,strlen(last)+1);
+	fprintf(of,"%s\n",header);
 
-			/* skip cellname */
-			fread(&cellnameidx,sizeof(CELLNAMEIDX),1,f);
-			fseek(f,colcnt*sizeof(float),SEEK_CUR);
-			fread(&clusterid,sizeof(unsigned int),1,f);
+	p = buf;
+	for (n = 0; n < t.cnt; n++)
+	{
+		if (p-buf > kFormatBufSize-24)
+		{
+			fwrite(buf,1,p-buf,of);
+			p = buf;
 		}
+		p = PutUInt(p,t.row[n].rowid);
+		*p++ = ',';
+		p = PutUInt(p,t.row[n].cid);
+		*p++ = '\n';
 	}
-	
+	fwrite(buf,1,p-buf,of);
+	if (fclose(of))
+	{
+		of = NULL;
+		printf("Error:Cannot Write File %s\n",ofn);
+		goto bail;
+	}
+	printf("Extracted %12u events to %s\n",(unsigned int)t.cnt,ofn);
+
+	free(buf);
+	free(header);
+	free(t.row);
 	return(0);
-	
-} /* loaddata */
+
+bail:
+	if (of)
+		fclose(of);
+	free(buf);
+	free(header);
+	free(t.row);
+	return(1);
+
+} /* WriteFinalTable */
 
 /* ------------------------------------------------------------------------------------ */
 
@@ -408,6 +849,7 @@ int main (int argc, char **argv)
 	char rfn[kMaxFilename];
 	char sfn[kMaxFilename];
 	char ofn[kMaxFilename];
+	char finalfn[kMaxFilename];
 	char extractcellname[kMaxCellName];
 	unsigned int maxclusterid = 0;
 	unsigned short cellnamecnt;
@@ -415,6 +857,7 @@ int main (int argc, char **argv)
 	unsigned int ExtractFromBinaryUnassigned = 0;
 	FACSNAME *uniquecellnames = NULL;
 	unsigned int *summary = NULL;
+	DCLUSTFILE df;
 	FILE *f = NULL;
 	FILE *of = NULL;
 	int c;
@@ -427,14 +870,16 @@ int main (int argc, char **argv)
 	rfn[0] = 0;
 	sfn[0] = 0;
 	ofn[0] = 0;
+	finalfn[0] = 0;
 	extractcellname[0] = 0;
 	clusterid = -1;
 	cellnameid = -1;
 	verbose = 0;
 	printCID = 1;
+	formatthreadcnt = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
 
 	opterr = 0;
-	while ((c = getopt (argc, argv, "f:as:o:c:n:i:v:0bU:")) != -1)
+	while ((c = getopt (argc, argv, "f:as:o:c:n:i:v:0bU:t:F:")) != -1)
 	switch (c)
 	{
       case 'f':
@@ -481,13 +926,22 @@ int main (int argc, char **argv)
 	  case 'v':
 			sscanf(optarg,"%d",&verbose);
         break;
+
+	  case 't':
+			sscanf(optarg,"%u",&formatthreadcnt);
+        break;
+
+	  case 'F':
+			strcpy(finalfn,optarg);
+        break;
 	}
 	
 	if ( (rfn[0] == 0) || ((clusterid >= 0) && (ofn[0] == 0)) )
 	{
 		printf("usage\n\n");
-		printf("cextract -f RootName [-a] [-s SummaryOutputFile] [-o OutputFile [-c ClusterID [-0|-b]] [-i CellNameID] [-n CellName]] [-v]  [-U UnassignedFile ]\n");
+		printf("cextract -f RootName [-a] [-s SummaryOutputFile] [-o OutputFile [-c ClusterID [-0|-b]] [-i CellNameID] [-n CellName]] [-v]  [-U UnassignedFile ] [-t threads] [-F FinalFile]\n");
 		printf("         -f RootName         : use dclust input file (RootName.selected) that contains the events selected for the clustering\n");
+		printf("                               when dselect -D collapsed identical events, each of them is written back with the csv and -F outputs\n");
 		printf("         -a                  : process dclust output file (RootName.selected.assigned) containing events with assigned clusterid\n");
 		printf("         -s SummaryOutputFile: Write a comma separated file with the number of events for each cluster and cellname\n");
 		printf("         -c ClusterID        : specifies which ClusterID to extract in OutputFile. Default is -1 for all.\n");
@@ -503,7 +957,11 @@ int main (int argc, char **argv)
 		printf("         -v level            : specifies the verbose level; default is 0.\n");
 		printf("                               level 1 lists the available CellNameIDs\n");
 		printf("         -U UnassignedFile   : extract events from a dclust .unassigned output file. Clusterid will be 0 for every event.\n");
-		printf("                               This option is incompatible with any other option.\n\n");
+		printf("                               This option is incompatible with any other option.\n");
+		printf("         -t threads          : number of threads formatting the csv output; default is the number of online processors.\n");
+		printf("         -F FinalFile        : write the rowid,cluster table of all events sorted by rowid, taken from RootName.selected.assigned,\n");
+		printf("                               RootName.selected.unassigned (cluster 0) and RootName.leftover.clusters (when present).\n");
+		printf("                               This option is only combined with -f RootName.\n\n");
 		printf("VERSION\n");
 		printf("\n%s\n",version);
 		printf("Author:  Nicolas Guex; 2008-2019\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, released under GPL2+ and you are welcome to redistribute it under certain conditions.\n");
@@ -513,6 +971,38 @@ int main (int argc, char **argv)
 	}
 
 
+	/* events collapsed by dselect -D are written back under their own rowid */
+	if (ExtractFromBinaryUnassigned)
+	{
+		size_t len = strlen(rfn);
+
+		if ((len > 11) && (strcmp(&rfn[len-11],".unassigned") == 0))
+		{
+			strcpy(fn,rfn);
+			fn[len-11] = 0;
+			if (LoadDuplicates(fn))
+				return(1);
+		}
+	}
+	else
+	{
+		sprintf(fn,"%s.selected",rfn);
+		if (LoadDuplicates(fn))
+			return(1);
+	}
+
+	if (finalfn[0])
+	{
+		if (ExtractFromBinaryUnassigned)
+		{
+			printf("Error: option -F requires option -f RootName.\n");
+			return(1);
+		}
+		c = WriteFinalTable(rfn,finalfn);
+		FreeDuplicates();
+		return(c);
+	}
+
 	if ((sfn[0] == 0) && (ofn[0]==0))
 	{
 		printf("Warning: no SummaryOutputFile or OutputFile specified.\n");		
@@ -562,14 +1052,10 @@ int main (int argc, char **argv)
 
 	if (ExtractFromBinaryUnassigned)
 	{
-		f = fopen(rfn,"r");
-		if (!f)
-		{
-			printf("Error:Cannot Open Input File %s\n",rfn);
+		if (OpenBinaryFile(&df,rfn,kDclustUnassignedFile))
 			goto bail;
-		}
-		ExtractDataFromUnassigned(f,of,printCID);
-		fclose(f);
+		ExtractDataFromUnassigned(&df,of,printCID);
+		DclustFileClose(&df);
 		cellnamecnt = 0;
 	}
 	else
@@ -606,29 +1092,24 @@ int main (int argc, char **argv)
 		
 		
 		sprintf(fn,"%s.selected.assigned",rfn);
-		f = fopen(fn,"r");
-		if (!f)
-		{
-			printf("Error:Cannot Open Input File %s\n",fn);
+		if (OpenBinaryFile(&df,fn,kDclustAssignedFile))
 			goto bail;
-		}
-		maxclusterid = GetMaxClusterId(f,cellnamecnt,&summary);
+		maxclusterid = GetMaxClusterId(&df,cellnamecnt,&summary);
 
 		if (processAssigned)
 		{
 			unsigned int err;
 			printf("Processing %s  (cluster id = %d)\n",fn,clusterid);
-			rewind(f);
 			if (binary)
-				err = loaddatabinary(f,of,uniquecellnames,cellnamecnt,clusterid);
+				err = loaddatabinary(&df,of,uniquecellnames,cellnamecnt,clusterid);
 			else
-				err = loaddata(f,of,uniquecellnames,cellnamecnt,summary,maxclusterid,clusterid,cellnameid,printCID);
-			fclose(f);
+				err = loaddata(&df,of,uniquecellnames,cellnamecnt,summary,maxclusterid,clusterid,cellnameid,printCID);
+			DclustFileClose(&df);
 			if (err)
 				goto bail;
 		}
 		else
-			fclose(f);
+			DclustFileClose(&df);
 			
 		if (ofn[0])
 			printf("Extracted %12d events to %s\n",extractedcnt,ofn);
@@ -652,6 +1133,7 @@ int main (int argc, char **argv)
 	if (summary)
 		free(summary);
 	free(uniquecellnames);
+	FreeDuplicates();
 	return(0);
 	
 	/* abort */
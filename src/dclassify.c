@@ -0,0 +1,754 @@
+/*	------------------------------------------------------------------------------------
+
+		                          * megaclust *
+      unbiased hierarchical density based parallel clustering of large datasets
+
+
+    Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+    Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+	Code:       Nicolas Guex, 2008-2019
+	Contact:    Nicolas.Guex@unil.ch
+	Repository: https://github.com/sib-swiss/megaclust
+
+
+	Articles:   megaclust was used here
+                    https://www.ncbi.nlm.nih.gov/pubmed/29241546
+                    https://www.ncbi.nlm.nih.gov/pubmed/23396282
+
+
+
+
+	Machine :	Unix
+	Language:	C
+	Requires:	mpi, pthread
+
+	Version information
+
+	Version:	1.0  Dec.  2019 Public release of code under GPL2+ license
+
+
+
+
+	Compiling:   (you will need mpi on your system)
+
+	
+	make all
+
+
+
+	Testing:
+
+    ./test/unit_test1.sh
+    ./test/unit_test2.sh
+
+	------------------------------------------------------------------------------------
+
+*/
+
+	/*------------------------- I N T E R F A C E ----------------------- */
+
+/*
+
+	dclassify.c: Assigns the events of a dselect binary file (a new acquisition, or a leftover file)
+				 to the clusters of a model written by dclust -m, without MPI.
+
+	An event goes to the cluster of the closest model event if that event is within the model
+	distance and no event of another cluster is as close; otherwise it is left unassigned (0),
+	as dclust -L does. The model events are sorted in a grid on the (up to) kGridCols columns
+	of largest spread, with cells as wide as the distance, so only the events of the
+	neighbouring cells are compared.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "dclust.h"
+#include "dclustfile.h"
+
+/* ------------------------------------------------------------------------------------ */
+
+#define kGridCols 3
+#define kGridBits 21					/* bits of a cell coordinate in a cell key */
+#define kMaxClassifyThreads 64
+#define kClassifyBlockRows 65536		/* rows classified by a thread before its output is written */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* model events sorted by grid cell */
+typedef	struct	MODEL_struct	MODEL;
+struct	MODEL_struct
+{
+	unsigned int colcnt;
+	unsigned int rowcnt;
+	unsigned int maxclusterid;
+	unsigned int testdist;
+	float distcutoff;
+	unsigned short *data;			/* colcnt values per row */
+	unsigned int *clusterid;
+	unsigned int gridcnt;
+	unsigned int gridcol[kGridCols];
+	unsigned int cellsize;
+	unsigned int cellcnt;
+	unsigned long long *cellkey;
+	unsigned int *cellfirst;		/* cellcnt+1 first rows */
+};
+
+typedef	struct	CELLROW_struct	CELLROW;
+struct	CELLROW_struct
+{
+	unsigned long long key;
+	unsigned int row;
+};
+
+/* closest model event found so far */
+typedef	struct	NEAREST_struct	NEAREST;
+struct	NEAREST_struct
+{
+	unsigned int limit;				/* squared distance still accepted */
+	unsigned int clusterid;
+	unsigned int found;
+	unsigned int ambiguous;
+};
+
+/* a block of consecutive input rows classified by one thread */
+typedef	struct	CLASSIFYBLOCK_struct	CLASSIFYBLOCK;
+struct	CLASSIFYBLOCK_struct
+{
+	const MODEL *model;
+	const DCLUSTFILE *df;
+	const unsigned int *col;		/* input column of each model column */
+	unsigned int first;
+	unsigned int last;
+	unsigned long long dup;			/* first collapsed event of row first */
+	char *buf;
+	size_t size;
+	size_t len;
+	unsigned int cnt;
+	unsigned int assigned;
+	int err;
+};
+
+/* ------------------------------------------------------------------------------------ */
+
+/* names of the colcnt columns of a csv header, skipping the cellname column */
+static void ColumnNames(const char *header,unsigned int colcnt,char name[][kMaxColumnName])
+{
+	const char *p = strchr(header,',');
+	unsigned int col;
+
+	for (col = 0; col < colcnt; col++)
+	{
+		unsigned int len = 0;
+
+		name[col][0] = 0;
+		if (p)
+		{
+			p++;
+			while ((p[len] != ',') && (p[len] != 0))
+				len++;
+			if (len >= kMaxColumnName)
+				len = kMaxColumnName-1;
+			memcpy(name[col],p,len);
+			name[col][len] = 0;
+			p = strchr(p,',');
+		}
+	}
+
+} /* ColumnNames */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned long long CellKey(const unsigned int *cell)
+{
+	return(((unsigned long long)cell[0] << (2*kGridBits)) | ((unsigned long long)cell[1] << kGridBits) | cell[2]);
+
+} /* CellKey */
+/* ------------------------------------------------------------------------------------ */
+
+static void GridCell(const MODEL *m,const unsigned short *val,unsigned int *cell)
+{
+	unsigned int g;
+
+	cell[0] = cell[1] = cell[2] = 0;
+	for (g = 0; g < m->gridcnt; g++)
+		cell[g] = val[m->gridcol[g]]/m->cellsize;
+
+} /* GridCell */
+/* ------------------------------------------------------------------------------------ */
+
+static int CompareCellRows(const void *a,const void *b)
+{
+	const CELLROW *ca = (const CELLROW *)a;
+	const CELLROW *cb = (const CELLROW *)b;
+
+	if (ca->key != cb->key)
+		return((ca->key < cb->key) ? -1 : 1);
+	return((ca->row < cb->row) ? -1 : (ca->row > cb->row));
+
+} /* CompareCellRows */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeModel(MODEL *m)
+{
+	free(m->data);
+	free(m->clusterid);
+	free(m->cellkey);
+	free(m->cellfirst);
+	memset(m,0,sizeof(MODEL));
+
+} /* FreeModel */
+/* ------------------------------------------------------------------------------------ */
+
+/* loads the model events sorted by grid cell; dist > 0 replaces the distance of the model */
+static int LoadModel(MODEL *m,const char *fn,float dist,char name[][kMaxColumnName],int verbose)
+{
+	DCLUSTFILE df;
+	CELLROW *cr = NULL;
+	unsigned int cell[kGridCols];
+	unsigned int i,g,col;
+	int err;
+
+	memset(m,0,sizeof(MODEL));
+	err = DclustFileOpen(&df,fn,kDclustModelFile,1);
+	if (err < 0)
+		printf("Error: Cannot open model file %s\n",fn);
+	if (err)
+		return(1);
+	if (DclustFileMap(&df))
+	{
+		printf("Error:Cannot map model file %s\n",fn);
+		goto bail;
+	}
+	m->colcnt = df.hdr.colcnt;
+	m->rowcnt = (unsigned int)df.hdr.rowcnt;
+	m->maxclusterid = df.hdr.maxclusterid;
+	m->distcutoff = df.hdr.distcutoff;
+	m->testdist = df.hdr.testdist;
+	if (dist > 0.0)
+	{
+		m->distcutoff = dist;
+		m->testdist = (unsigned int)(dist*dist*m->colcnt);
+	}
+	ColumnNames(df.hdr.header,m->colcnt,name);
+
+	/* the widest columns split the events best; a cell is at least as wide as the distance */
+	m->gridcnt = (m->colcnt < kGridCols) ? m->colcnt : kGridCols;
+	for (g = 0; g < m->gridcnt; g++)
+	{
+		int best = -1;
+		for (col = 0; col < m->colcnt; col++)
+		{
+			unsigned int k;
+			for (k = 0; (k < g) && (m->gridcol[k] != col); k++)
+				;
+			if ((k == g) && ((best < 0) || (df.column[col].stdev > df.column[best].stdev)))
+				best = col;
+		}
+		m->gridcol[g] = best;
+	}
+	m->cellsize = (unsigned int)sqrt((double)m->testdist);
+	while ((unsigned long long)m->cellsize*m->cellsize < m->testdist)
+		m->cellsize++;
+	if (m->cellsize < 1)
+		m->cellsize = 1;
+
+	m->data = malloc(((size_t)m->rowcnt+1)*m->colcnt*sizeof(unsigned short));
+	m->clusterid = malloc(((size_t)m->rowcnt+1)*sizeof(unsigned int));
+	m->cellkey = malloc(((size_t)m->rowcnt+1)*sizeof(unsigned long long));
+	m->cellfirst = malloc(((size_t)m->rowcnt+2)*sizeof(unsigned int));
+	cr = malloc(((size_t)m->rowcnt+1)*sizeof(CELLROW));
+	if (!m->data || !m->clusterid || !m->cellkey || !m->cellfirst || !cr)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		goto bail;
+	}
+	for (i = 0; i < m->rowcnt; i++)
+	{
+		GridCell(m,(const unsigned short *)DclustFileData(&df,i),cell);
+		cr[i].key = CellKey(cell);
+		cr[i].row = i;
+	}
+	qsort(cr,m->rowcnt,sizeof(CELLROW),CompareCellRows);
+	for (i = 0; i < m->rowcnt; i++)
+	{
+		memcpy(&m->data[(size_t)i*m->colcnt],DclustFileData(&df,cr[i].row),m->colcnt*sizeof(unsigned short));
+		m->clusterid[i] = DclustFileClusterId(&df,cr[i].row);
+		if ((i == 0) || (cr[i].key != cr[i-1].key))
+		{
+			m->cellkey[m->cellcnt] = cr[i].key;
+			m->cellfirst[m->cellcnt++] = i;
+		}
+	}
+	m->cellfirst[m->cellcnt] = m->rowcnt;
+	free(cr);
+	DclustFileClose(&df);
+
+	if (verbose > 0)
+	{
+		printf("LOG: model of %u clusters, %u events in %u cells of %u units on columns",m->maxclusterid,m->rowcnt,m->cellcnt,m->cellsize);
+		for (g = 0; g < m->gridcnt; g++)
+			printf(" %s",name[m->gridcol[g]]);
+		printf("\n");
+	}
+	return(0);
+
+bail:
+	free(cr);
+	FreeModel(m);
+	DclustFileClose(&df);
+	return(1);
+
+} /* LoadModel */
+/* ------------------------------------------------------------------------------------ */
+
+/* first cell of key at least key */
+static unsigned int FindCell(const MODEL *m,unsigned long long key)
+{
+	unsigned int lo = 0;
+	unsigned int hi = m->cellcnt;
+
+	while (lo < hi)
+	{
+		unsigned int mid = lo+(hi-lo)/2;
+		if (m->cellkey[mid] < key)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return(lo);
+
+} /* FindCell */
+/* ------------------------------------------------------------------------------------ */
+
+/* squared distance from val to the closest point of cell c along grid column g */
+static unsigned int CellGap(const MODEL *m,const unsigned short *val,unsigned int g,unsigned int c)
+{
+	unsigned int v = val[m->gridcol[g]];
+	unsigned int gap;
+
+	if (g >= m->gridcnt)
+		return(0);
+	if (c*m->cellsize > v)
+		gap = c*m->cellsize-v;
+	else if ((c+1)*m->cellsize <= v)
+		gap = v-((c+1)*m->cellsize-1);
+	else
+		return(0);
+	return(gap*gap);
+
+} /* CellGap */
+/* ------------------------------------------------------------------------------------ */
+
+/* compares val to the events of cell i; ties between clusters at the smallest distance make val ambiguous */
+static void ScanCell(const MODEL *m,const unsigned short *val,unsigned int i,NEAREST *n)
+{
+	unsigned int r;
+
+	for (r = m->cellfirst[i]; r < m->cellfirst[i+1]; r++)
+	{
+		const unsigned short *mv = &m->data[(size_t)r*m->colcnt];
+		unsigned int d = 0;
+		unsigned int col;
+
+		for (col = 0; col < m->colcnt; col++)
+		{
+			int diff = (int)mv[col] - val[col];
+			d += diff*diff;
+			if (d > n->limit)
+				break;
+		}
+		if (d > n->limit)
+			continue;
+		if (!n->found || (d < n->limit))
+		{
+			n->limit = d;
+			n->clusterid = m->clusterid[r];
+			n->found = 1;
+			n->ambiguous = 0;
+		}
+		else if (m->clusterid[r] != n->clusterid)
+			n->ambiguous = 1;
+	}
+
+} /* ScanCell */
+/* ------------------------------------------------------------------------------------ */
+
+/* the cell of val is scanned first so that the distance limit drops early; the cells next to it */
+/* are contiguous along the last grid column, and skipped when they are further than the limit */
+static unsigned int ClassifyEvent(const MODEL *m,const unsigned short *val)
+{
+	unsigned int cell[kGridCols];
+	unsigned int lo[kGridCols];
+	unsigned int hi[kGridCols];
+	unsigned int own;
+	unsigned int g,c0,c1;
+	NEAREST n;
+
+	n.limit = m->testdist;
+	n.clusterid = 0;
+	n.found = 0;
+	n.ambiguous = 0;
+	GridCell(m,val,cell);
+	own = FindCell(m,CellKey(cell));
+	if ((own < m->cellcnt) && (m->cellkey[own] == CellKey(cell)))
+		ScanCell(m,val,own,&n);
+	else
+		own = m->cellcnt;
+	for (g = 0; g < kGridCols; g++)
+	{
+		lo[g] = (cell[g] > 0) ? cell[g]-1 : 0;
+		hi[g] = (g < m->gridcnt) ? cell[g]+1 : 0;
+	}
+	for (c0 = lo[0]; c0 <= hi[0]; c0++)
+	{
+		unsigned int gap0 = CellGap(m,val,0,c0);
+
+		if (gap0 > n.limit)
+			continue;
+		for (c1 = lo[1]; c1 <= hi[1]; c1++)
+		{
+			unsigned int gap1 = gap0+CellGap(m,val,1,c1);
+			unsigned int from[kGridCols];
+			unsigned int to[kGridCols];
+			unsigned long long last;
+			unsigned int i;
+
+			if (gap1 > n.limit)
+				continue;
+			from[0] = to[0] = c0;
+			from[1] = to[1] = c1;
+			from[2] = lo[2];
+			to[2] = hi[2];
+			last = CellKey(to);
+			for (i = FindCell(m,CellKey(from)); (i < m->cellcnt) && (m->cellkey[i] <= last); i++)
+			{
+				if ((i != own) && (gap1+CellGap(m,val,2,(unsigned int)(m->cellkey[i] & ((1ULL << kGridBits)-1))) <= n.limit))
+					ScanCell(m,val,i,&n);
+			}
+		}
+	}
+	return(n.ambiguous ? 0 : n.clusterid);
+
+} /* ClassifyEvent */
+/* ------------------------------------------------------------------------------------ */
+
+static int GrowClassifyBuf(CLASSIFYBLOCK *cb,size_t len)
+{
+	char *buf;
+
+	if (cb->len+len <= cb->size)
+		return(0);
+	buf = realloc(cb->buf,2*(cb->len+len));
+	if (!buf)
+	{
+		cb->err = 1;
+		return(1);
+	}
+	cb->buf = buf;
+	cb->size = 2*(cb->len+len);
+	return(0);
+
+} /* GrowClassifyBuf */
+/* ------------------------------------------------------------------------------------ */
+
+static void PutResult(CLASSIFYBLOCK *cb,CELLNAMEIDX cellnameidx,unsigned int clusterid)
+{
+	if (GrowClassifyBuf(cb,24))
+		return;
+	cb->len += sprintf(&cb->buf[cb->len],"%u,%u\n",cellnameidx,clusterid);
+	cb->cnt++;
+
+} /* PutResult */
+/* ------------------------------------------------------------------------------------ */
+
+/* events collapsed by dselect -D get the cluster of their row */
+static void *ClassifyRows(void *arg)
+{
+	CLASSIFYBLOCK *cb = (CLASSIFYBLOCK *)arg;
+	const MODEL *m = cb->model;
+	unsigned long long dup = cb->dup;
+	unsigned int i,col;
+
+	cb->len = 0;
+	cb->cnt = 0;
+	cb->assigned = 0;
+	cb->err = 0;
+	for (i = cb->first; (i < cb->last) && !cb->err; i++)
+	{
+		float in[kMaxInputCol];
+		unsigned short val[kMaxInputCol];
+		unsigned int clusterid;
+		unsigned int w;
+
+		DclustFileGetRow(cb->df,i,in);
+		for (col = 0; col < m->colcnt; col++)
+		{
+			float v = in[cb->col[col]];
+			val[col] = (v <= 0.0) ? 0 : ((v >= 65535.0) ? 65535 : (unsigned short)v);
+		}
+		clusterid = ClassifyEvent(m,val);
+		w = DclustFileWeight(cb->df,i);
+		if (clusterid > 0)
+			cb->assigned += w;
+		PutResult(cb,DclustFileCellNameIdx(cb->df,i),clusterid);
+		for ( ; w > 1; w--)
+			PutResult(cb,DclustFileDuplicate(cb->df,dup++),clusterid);
+	}
+	return(NULL);
+
+} /* ClassifyRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* blocks of rows are classified by threadcnt threads at a time, then written in row order */
+static int ClassifyFile(const MODEL *m,const DCLUSTFILE *df,const unsigned int *col,FILE *of,unsigned int threadcnt,unsigned long long *events,unsigned long long *assigned)
+{
+	CLASSIFYBLOCK cb[kMaxClassifyThreads];
+	pthread_t thread[kMaxClassifyThreads];
+	int started[kMaxClassifyThreads];
+	unsigned int rowcnt = (unsigned int)df->hdr.rowcnt;
+	unsigned long long dup = 0;
+	unsigned int first;
+	unsigned int t,n;
+	int err = 0;
+
+	if (threadcnt > kMaxClassifyThreads)
+		threadcnt = kMaxClassifyThreads;
+	if (threadcnt > (rowcnt+kClassifyBlockRows-1)/kClassifyBlockRows)
+		threadcnt = (rowcnt+kClassifyBlockRows-1)/kClassifyBlockRows;
+	if (threadcnt < 1)
+		threadcnt = 1;
+	memset(cb,0,sizeof(cb));
+	for (t = 0; t < threadcnt; t++)
+	{
+		cb[t].model = m;
+		cb[t].df = df;
+		cb[t].col = col;
+	}
+
+	for (first = 0; first < rowcnt; )
+	{
+		for (n = 0; (n < threadcnt) && (first < rowcnt); n++)
+		{
+			cb[n].first = first;
+			cb[n].last = (rowcnt-first > kClassifyBlockRows) ? first+kClassifyBlockRows : rowcnt;
+			cb[n].dup = dup;
+			if (df->hdr.weightoffset)
+			{
+				unsigned int i;
+				for (i = cb[n].first; i < cb[n].last; i++)
+					dup += DclustFileWeight(df,i)-1;
+			}
+			first = cb[n].last;
+		}
+		for (t = 1; t < n; t++)
+			started[t] = (pthread_create(&thread[t],NULL,&ClassifyRows,&cb[t]) == 0);
+		ClassifyRows(&cb[0]);
+		for (t = 1; t < n; t++)
+		{
+			if (started[t])
+				pthread_join(thread[t],NULL);
+			else
+				ClassifyRows(&cb[t]);
+		}
+		for (t = 0; t < n; t++)
+		{
+			if (cb[t].err)
+				printf("Error:Cannot Allocate Memory.\n");
+			if (cb[t].err || (fwrite(cb[t].buf,1,cb[t].len,of) != cb[t].len))
+				err = 1;
+			*events += cb[t].cnt;
+			*assigned += cb[t].assigned;
+		}
+		if (err)
+			break;
+	}
+
+	for (t = 0; t < threadcnt; t++)
+		free(cb[t].buf);
+	if (err)
+		printf("Error:Cannot Write Output File\n");
+	return(err);
+
+} /* ClassifyFile */
+/* ------------------------------------------------------------------------------------ */
+
+/* any dselect or dclust binary file can be classified */
+static int OpenInputFile(DCLUSTFILE *df,const char *fn)
+{
+	int err;
+
+	err = DclustFileOpen(df,fn,kDclustSelectedFile,0);
+	if (err > 0)
+		err = DclustFileOpen(df,fn,kDclustUnassignedFile,0);
+	if (err > 0)
+		err = DclustFileOpen(df,fn,kDclustAssignedFile,0);
+	if (err < 0)
+		printf("Error: Cannot open input file %s\n",fn);
+	else if (err > 0)
+		printf("Error: %s is not a dselect or dclust binary file\n",fn);
+	else if (DclustFileMap(df))
+	{
+		printf("Error:Cannot map input file %s\n",fn);
+		DclustFileClose(df);
+		err = 1;
+	}
+	return(err);
+
+} /* OpenInputFile */
+/* ------------------------------------------------------------------------------------ */
+
+int main (int argc, char **argv)
+{	
+	char	*version="VERSION 1.0; 2019-12-26";
+	char mfn[kMaxFilename];
+	char fn[kMaxFilename];
+	char ofn[kMaxFilename];
+	char modelname[kMaxInputCol][kMaxColumnName];
+	char inputname[kMaxInputCol][kMaxColumnName];
+	unsigned int col[kMaxInputCol];
+	unsigned int threadcnt;
+	unsigned long long events = 0;
+	unsigned long long assigned = 0;
+	unsigned int i,j;
+	float dist = 0.0;
+	MODEL model;
+	DCLUSTFILE df;
+	FILE *of = NULL;
+	struct timeval ts,te;
+	double seconds;
+	int verbose = 0;
+	int err = 1;
+	int c;
+
+	/* --------- process arguments */
+
+	mfn[0] = 0;
+	fn[0] = 0;
+	ofn[0] = 0;
+	threadcnt = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	opterr = 0;
+	while ((c = getopt (argc, argv, "m:i:o:d:t:v:")) != -1)
+	switch (c)
+	{
+      case 'm':
+			strcpy(mfn,optarg);
+        break;
+
+	  case 'i':
+			strcpy(fn,optarg);
+        break;
+
+	  case 'o':
+			strcpy(ofn,optarg);
+        break;
+
+	  case 'd':
+			sscanf(optarg,"%f",&dist);
+        break;
+
+	  case 't':
+			sscanf(optarg,"%u",&threadcnt);
+        break;
+
+	  case 'v':
+			sscanf(optarg,"%d",&verbose);
+        break;
+	}
+
+	if ((mfn[0] == 0) || (fn[0] == 0))
+	{
+		printf("usage\n\n");
+		printf("dclassify -m ModelFile -i InputFile [-o OutputFile] [-d DistanceCutoff] [-t threads] [-v level]\n");
+		printf("         -m ModelFile        : cluster model written by dclust -m (OutputFile.model)\n");
+		printf("         -i InputFile        : dselect binary file (.selected or .leftover) of the events to classify; its columns\n");
+		printf("                               are matched to those of the model by name and must be scaled as for the model\n");
+		printf("         -o OutputFile       : rowid,cluster of every event (0 if unassigned). Default is InputFile.clusters\n");
+		printf("         -d DistanceCutoff   : assign events up to this distance instead of the distance of the model\n");
+		printf("         -t threads          : number of threads; default is the number of online processors.\n");
+		printf("         -v level            : specifies the verbose level; default is 0.\n\n");
+		printf("VERSION\n");
+		printf("\n%s\n",version);
+		printf("Author:  Nicolas Guex; 2008-2019\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, released under GPL2+ and you are welcome to redistribute it under certain conditions.\n");
+		printf("CONTACT: Nicolas.Guex@unil.ch\n");
+		printf("SEE ALSO\n");
+		printf("      dselect dclust cextract\n\n");
+		return(1);
+	}
+	if (ofn[0] == 0)
+		sprintf(ofn,"%s.clusters",fn);
+
+	gettimeofday(&ts, NULL);
+	if (LoadModel(&model,mfn,dist,modelname,verbose))
+		return(1);
+	if (OpenInputFile(&df,fn))
+	{
+		FreeModel(&model);
+		return(1);
+	}
+
+	ColumnNames(df.hdr.header,df.hdr.colcnt,inputname);
+	for (i = 0; i < model.colcnt; i++)
+	{
+		for (j = 0; j < df.hdr.colcnt; j++)
+			if (strcmp(modelname[i],inputname[j]) == 0)
+				break;
+		if (j == df.hdr.colcnt)
+		{
+			printf("Error: column %s of the model is not in %s\n",modelname[i],fn);
+			goto bail;
+		}
+		col[i] = j;
+	}
+
+	of = fopen(ofn,"w");
+	if (!of)
+	{
+		printf("Error:Cannot Create Output File %s\n",ofn);
+		goto bail;
+	}
+	if (verbose > 0)
+		printf("LOG: classifying %llu rows of %s at distance %.3f\n",df.hdr.rowcnt,fn,model.distcutoff);
+	gettimeofday(&te, NULL);
+	seconds = (te.tv_sec-ts.tv_sec)+(te.tv_usec-ts.tv_usec)/1000000.0;
+	err = ClassifyFile(&model,&df,col,of,threadcnt,&events,&assigned);
+	if (fclose(of) != 0)
+		err = 1;
+	gettimeofday(&ts, NULL);
+	if (err == 0)
+	{
+		double classify = (ts.tv_sec-te.tv_sec)+(ts.tv_usec-te.tv_usec)/1000000.0;
+
+		printf("LOG: %12llu TotalEvents\n",events);
+		printf("LOG: %12llu Assigned    (%5.1f %%)\n",assigned,(events > 0) ? 100.0*assigned/events : 0.0);
+		printf("LOG: %12llu Unassigned  (%5.1f %%)\n",events-assigned,(events > 0) ? 100.0*(events-assigned)/events : 0.0);
+		printf("LOG: model loaded in %.2f sec, events classified in %.2f sec\n",seconds,classify);
+	}
+
+bail:
+	DclustFileClose(&df);
+	FreeModel(&model);
+	return(err);
+
+} /* main */
+/* ------------------------------------------------------------------------------------ */
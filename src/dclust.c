@@ -75,11 +75,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include "mpi.h"
 #include "dclust.h"
+#include "dclustfile.h"
 #include <pthread.h>
 
 /* ------------------------------------------------------------------------------------ */
@@ -88,6 +92,8 @@
 #define kMaxCluster 1000000
 
 #define kMaxCPU 129
+#define kMaxSweepValues 16	/* values in each list of -k, -n and -p */
+#define kChunksPerCPU 2   /* one chunk computing and one queued on each slave */
 
 #define kRawPrint   0x01
 #define kSplitPrint 0x02
@@ -97,6 +103,24 @@
 #define kChunkStatusToDo 0
 #define kChunkStatusComputing 1
 
+#define kCostSamples 16			/* rows of a chunk sampled to estimate its cost */
+#define kSplitCostFraction 4	/* split chunks costing more than 1/(kSplitCostFraction*slaves) of a pass */
+#define kMinSplitRows 256		/* do not split blocks below that many rows */
+#define kMaxSplitChunks 4096	/* room for the extra chunks created by splitting */
+
+#define kMaxWriteThreads 8			/* threads writing the .assigned and .unassigned files */
+#define kMinWriteRowsPerThread 65536
+
+/* per-distance <ofn>-<dist> files: runs of cluster labels, older files are raw int arrays */
+#define kIndexMagic "dclust index rle v1.0\n"
+#define kIndexMagicSize 24
+#define kIndexBufSize 65536
+
+/* -w: what happens to the per-distance labels kept in memory by the master */
+#define kIndexFilesNone 0		/* kept in memory only */
+#define kIndexFilesAsync 1		/* also written to <ofn>-<dist> by a background thread */
+#define kIndexFilesSync 2		/* also written to <ofn>-<dist> before the scan goes on */
+
 /* MPI messages */
 #define kWhichBlocksToCompute 0
 #define kClusterMsg1 1
@@ -117,8 +141,27 @@
 #define kLeftoverDataLength 32769
 #define kLeftoverClusters 65536
 
+#define kHaloLabelsMsg 131073
+#define kHaloFoldMsg 131074
+
+/* -O: operations the master sends to the slaves holding the labels, after each pass and at the end */
+#define kLabelsEndPass 0		/* back to computing, or done */
+#define kLabelsRelabel 1		/* apply the clustersnum tables that follow */
+#define kLabelsCollapsed 2		/* number the collapsed rows nothing linked to */
+#define kLabelsCount 3			/* events of every label of the clustersnum tables */
+#define kLabelsAssigned 4		/* events in clusters 1 to arg */
+#define kLabelsKeep 5			/* keep the labels under dist */
+#define kLabelsRename 6			/* labels kept under dist now belong to dist2 */
+#define kLabelsShift 7			/* move the labels to the space of slave #1 for the next pass */
+#define kLabelsSelect 8			/* label the rows with the arg clusters of the history that follow */
+#define kLabelsFlag 9			/* flag the rows to reassign, from the labels kept under dist */
+#define kLabelsUnassigned 10	/* give the flagged rows the closest of clusters 1 to arg */
+#define kLabelsWrite 11			/* write the rows in the .assigned and .unassigned files, clusters 1 to arg */
+#define kLabelsLeftover 12		/* closest cluster of the leftover rows that follow, within arg */
+
+#define kClosestBatch 16384		/* rows looked for in the clusters of every slave at once */
+
 /* status of cpu nodes */
-#define kCPU_availaible 2147483647
 #define kNoMoreBlocks   2147483647
 
 #define kMaskedEvent 0
@@ -152,6 +195,17 @@ struct	CHUNK_struct
 	unsigned int iilast;
 	unsigned int jjlast;
 	unsigned int status;
+	float pairs;			/* estimated number of pairs to test */
+	float cost;				/* expected computing time, in pairs */
+};
+
+/* list of chunks of a pass */
+typedef	struct	CHUNKPLAN_struct	CHUNKPLAN;
+struct	CHUNKPLAN_struct
+{
+	CHUNK *chunk;
+	unsigned int chunkcap;
+	unsigned int blocksize;
 };
 
 typedef	struct	MERGECLUSTER_struct	MERGECLUSTER;
@@ -193,6 +247,59 @@ struct	CPU_struct
 	unsigned int jjlast;
 };
 
+/* chunks sent to a slave: the one being computed, followed by the ones already queued */
+typedef	struct	CPUQUEUE_struct	CPUQUEUE;
+struct	CPUQUEUE_struct
+{
+	CPU chunk[kChunksPerCPU];
+	MPI_Request req[kChunksPerCPU][3];
+	unsigned int head;
+	unsigned int cnt;
+};
+
+/* next chunk being received by a slave while it computes the current one */
+typedef	struct	PREFETCH_struct	PREFETCH;
+struct	PREFETCH_struct
+{
+	CPU next;
+	MPI_Request req[3];
+	unsigned int slicesposted;
+	FACSDATA *facs;
+	unsigned int privfirst;		/* -H: rows whose labels stay on this slave for the pass */
+	unsigned int privlast;
+};
+
+/* -H: each slave owns a contiguous range of the sorted rows and computes the chunks starting in it, which reach */
+/* the next rows on the key (its halo); for a pass, it computes on its own copy of the labels of both */
+typedef	struct	HALO_struct	HALO;
+struct	HALO_struct
+{
+	unsigned int first[kMaxCPU];	/* rows owned by each slave: [first..last[ */
+	unsigned int last[kMaxCPU];
+	unsigned int reach[kMaxCPU];	/* end of the rows its chunks touch */
+	unsigned int privfirst[kMaxCPU];
+	unsigned int privlast[kMaxCPU];
+};
+
+/* -O: operation broadcast by the master to the slaves holding the labels */
+typedef	struct	LABELOP_struct	LABELOP;
+struct	LABELOP_struct
+{
+	unsigned int op;
+	unsigned int arg;
+	float dist;
+	float dist2;
+};
+
+/* -O: closest cluster of a row among the rows of a slave, reduced over the slaves */
+typedef	struct	CLOSEST_struct	CLOSEST;
+struct	CLOSEST_struct
+{
+	unsigned int dmin;
+	unsigned int cluster;
+	unsigned int ambiguous;		/* another cluster is as close */
+};
+
 typedef	struct	STATS_struct	STATS;
 struct	STATS_struct
 {
@@ -202,6 +309,24 @@ struct	STATS_struct
 	int trimmedClustersCnt;
 };
 
+/* state of the distance scan saved after each pass, to resume an interrupted run */
+typedef	struct	CHECKPOINT_struct	CHECKPOINT;
+struct	CHECKPOINT_struct
+{
+	unsigned int loaded;
+	unsigned int colcnt;
+	unsigned int passcnt;
+	float distcutoff;		/* next distance to compute */
+	float distcutoffincreasestep;
+	float bestdistcutoff;
+	float distOfLastClusterIndices;
+	int highesttrimmedclustercnt;
+	int initialClusterCnt;
+	STATS stats;
+	unsigned int clusterhistorycnt;
+	unsigned int hasZeroIndices;	/* a copy of <ofn>-0.000000 follows the clusterid */
+};
+
 typedef	struct	CLUSTERHISTORY_struct	CLUSTERHISTORY;
 struct	CLUSTERHISTORY_struct
 {
@@ -221,10 +346,180 @@ struct EXECUTIONPLAN_struct
 	CPU chunk;
 };
 
+/* one thread's range of rows written by WriteSplitBinFile, into its own part of both files */
+typedef	struct SPLITWRITE_struct  SPLITWRITE;
+struct SPLITWRITE_struct
+{
+	FACSNAME *facsname;
+	FACSDATA *facs;
+	unsigned int *clusterid;
+	unsigned int *order;		/* assigned rows grouped by clusterid, NULL to keep the row order */
+	unsigned int first;
+	unsigned int last;
+	unsigned int assigned;		/* assigned rows of the range */
+	unsigned int afirst;		/* range of order written to the assigned file */
+	unsigned int alast;
+	unsigned int maxclusterid;
+	DCLUSTWRITER aw;
+	DCLUSTWRITER uw;
+};
+
+
+/* run encoded labels of one distance, laid out as the <ofn>-<dist> file */
+typedef	struct INDEXSNAPSHOT_struct  INDEXSNAPSHOT;
+struct INDEXSNAPSHOT_struct
+{
+	float dist;
+	unsigned int len;
+	unsigned char *data;
+};
+
+/* streaming reader of the labels of one distance, from memory or from its file */
+typedef	struct INDEXREADER_struct  INDEXREADER;
+struct INDEXREADER_struct
+{
+	FILE *f;
+	const unsigned char *p;	/* either buf or the snapshot data */
+	unsigned int raw;		/* file written before the run encoding */
+	unsigned int label;		/* label of the current run */
+	unsigned int left;		/* rows left in the current run */
+	unsigned int pos;
+	unsigned int len;
+	unsigned char buf[kIndexBufSize];
+};
+
+/* distance search of -a: the step grows while the retained cluster count stays the same, and a step */
+/* over which it changes is bisected, going back to the labels of the last accepted distance */
+typedef	struct ADAPTIVESCAN_struct  ADAPTIVESCAN;
+struct ADAPTIVESCAN_struct
+{
+	unsigned int probesteps;	/* steps of -s from the last accepted distance to the one computed */
+	unsigned int bracketsteps;	/* the count is known to change within that many steps, 0 if not */
+	unsigned int *clusterid;	/* labels of the last accepted distance, as sent for the next pass */
+	CLUSTERHISTORY *history;	/* its clusterhistory entries, which the next pass marks when merging */
+	unsigned int historyfirst;
+	unsigned int historycnt;
+	int initialClusterCnt;
+	unsigned int rejected;		/* distances computed then dropped */
+};
+
+/* a range of SUBSCAN.row clustered again at level */
+typedef	struct SUBSET_struct  SUBSET;
+struct SUBSET_struct
+{
+	unsigned int level;
+	unsigned int first;
+	unsigned int cnt;
+};
+
+/* -d: every cluster found is clustered again in the same job, down to depth levels; the rows of */
+/* a cluster are made contiguous by a stable sort of the rows of its parent, keeping the key order */
+typedef	struct SUBSCAN_struct  SUBSCAN;
+struct SUBSCAN_struct
+{
+	unsigned int depth;
+	unsigned int rowcnt;
+	unsigned int *row;			/* rows of the InputFile, the rows of every subset contiguous (master) */
+	unsigned int *label;		/* depth+1 cluster ids per row of the InputFile, one per level (master) */
+	SUBSET *stack;				/* subsets left to cluster (master) */
+	unsigned int stackcnt;
+	SUBSET cur;					/* being clustered; level 0 is the whole InputFile */
+	FACSDATA *facs;				/* rows of cur, copied from the InputFile by every rank */
+	unsigned int *weight;		/* events standing behind the rows of cur (master), NULL if rows were not collapsed */
+	unsigned int *topweight;	/* and behind the rows of the InputFile */
+};
+
+/* an InputFile listed in the JobFile of -j */
+typedef	struct BATCHJOB_struct  BATCHJOB;
+struct BATCHJOB_struct
+{
+	char fn[kMaxFilename];
+	char ofn[kMaxFilename];
+	unsigned int rowcnt;
+	int group;					/* of ranks clustering it, -1 if it cannot be read */
+};
+
+/* -j: the ranks are split into groups sized by the rows of their InputFiles, each group clustering its files in turn */
+typedef	struct BATCH_struct  BATCH;
+struct BATCH_struct
+{
+	BATCHJOB *job;
+	unsigned int jobcnt;
+	int groupcnt;
+	int group;					/* of this rank */
+	unsigned int next;			/* job to look at next */
+	int savedstdout;			/* the group master logs each job to OutputFile.dclust */
+};
+
+/* one combination of -k or -n with -p, replayed on the clusters of the shared scan */
+typedef	struct SWEEPRUN_struct  SWEEPRUN;
+struct SWEEPRUN_struct
+{
+	char ofn[kMaxFilename];
+	float pctEventsToKeepCluster;
+	unsigned int cntcutoff;
+	float stopWhenPctAssigned;
+	unsigned int *clusterid;	/* labels at the last distance taken, numbered as the scan would */
+	unsigned int labelcnt;
+	CLUSTERHISTORY *clusterhistory;
+	unsigned int clusterhistorycnt;
+	INDEXSNAPSHOT *indexsnapshot;
+	unsigned int indexsnapshotcnt;
+	STATS stats[2];
+	float distcutoff;			/* next distance this run takes */
+	float distcutoffincreasestep;
+	float bestdistcutoff;
+	float distOfLastClusterIndices;
+	int highesttrimmedclustercnt;
+	unsigned int passcnt;
+	int done;
+};
+
+/* lists given to -k, -n or -p: the scan visits every Step and each combination takes the distances it would take alone */
+typedef	struct SWEEP_struct  SWEEP;
+struct SWEEP_struct
+{
+	float cut[kMaxSweepValues];		/* -n counts, or else -k percents */
+	unsigned int cutcnt;
+	int cutIsCount;
+	float stop[kMaxSweepValues];	/* -p */
+	unsigned int stopcnt;
+	unsigned int cnt;				/* combinations, 0 without lists */
+	SWEEPRUN *run;
+	unsigned int active;
+	unsigned int events;
+	float first;
+	float step;
+	float direction;
+	unsigned int pass;
+	unsigned int *comp;				/* cluster of each row at the distance of the pass, 0 if none */
+	unsigned int *root;				/* per cluster: smallest label of the run it contains */
+	unsigned int *size;
+	unsigned int *newid;
+	unsigned int compmax;
+	unsigned int *bylabel;			/* per label of the run: the cluster containing it */
+	unsigned int labelmax;
+};
+
+/* file written in the background when -w 1 */
+typedef	struct INDEXWRITE_struct  INDEXWRITE;
+struct INDEXWRITE_struct
+{
+	char fn[kMaxFilename];
+	unsigned char *data;
+	unsigned int len;
+};
 
 /* ------------------------------------------------------------------------------------ */
 
 static unsigned int gTestDist;
+static unsigned int gOutOfCore;	/* -O: slaves page in only the rows of the chunks they compute */
+static unsigned int gHalo;		/* -H: chunks go to the slave owning their rows, private rows stay there */
+static unsigned int gRangeLabels;	/* -O: every slave keeps the labels of its own rows from pass to pass, the master has none */
+static unsigned int gLabelOps;	/* -O, master: the functions on labels send the operation to the slaves instead */
+static unsigned int ownfirst;	/* -O: rows whose labels this rank keeps, none on the master */
+static unsigned int ownlast;
+static MPI_Comm gComm;		/* ranks clustering the current InputFile: every rank, or a group of them with -j */
 static volatile unsigned int clustercnt;
 static unsigned int mergerequestcnt;
 static MERGECLUSTER mergerequest[kMaxMergeRequests];
@@ -239,6 +534,14 @@ static char headerWithCluster[kMaxLineBuf];
 
 
 static int *clustersnum[kMaxCPU];
+static INDEXSNAPSHOT *indexsnapshot = NULL;
+static unsigned int indexsnapshotcnt = 0;
+static unsigned int indexfiles = kIndexFilesSync;
+static INDEXWRITE indexwrite;
+static pthread_t indexwriter;
+static unsigned int indexwriterbusy = 0;
+static unsigned int *rowweight = NULL;	/* events standing behind each row, NULL if rows were not collapsed */
+static unsigned int rowweightfirst = 0;	/* row of rowweight[0]: with -O, each slave holds the weights of its own rows */
 static 	CLUSTERHISTORY *clusterhistory = NULL;
 static unsigned int clusterhistorycnt = 0;
 static int printwarnmergereq = 1;
@@ -251,12 +554,118 @@ static pthread_mutex_t mergingrequestmutex;
 
 static pthread_mutex_t clustercntmutex;
 static unsigned short sortkey;
+static FACSDATA *modelfacs;		/* rows sorted by CompareModelRows */
+static unsigned int *modelclusterid;
+static unsigned int modelcolcnt;
+static unsigned int modelcell;
 static unsigned int thread_mergerequestcnt;
 
 static MERGECLUSTER thread_mergerequest[kMaxMergeRequests];
 
 /* ------------------------------------------------------------------------------------ */
 
+/* -O: the master sends the next operation on labels to the slaves waiting in ServeLabels */
+static void SendLabelOp(unsigned int op,unsigned int arg,float dist,float dist2)
+{
+	LABELOP lo;
+
+	lo.op = op;
+	lo.arg = arg;
+	lo.dist = dist;
+	lo.dist2 = dist2;
+	MPI_Bcast(&lo, 4, MPI_INT, 0, gComm);
+
+} /* SendLabelOp */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: total on the master of what every rank counted on its own rows */
+static unsigned int SumOverRanks(unsigned int cnt)
+{
+	unsigned int total = 0;
+
+	MPI_Reduce(&cnt, &total, 1, MPI_UNSIGNED, MPI_SUM, 0, gComm);
+	return(total);
+
+} /* SumOverRanks */
+/* ------------------------------------------------------------------------------------ */
+
+/* MPI_Op: the same as scanning the rows of both ranks in turn; only the distance and the clusters at it matter */
+static void ReduceClosest(void *in,void *inout,int *len,MPI_Datatype *type)
+{
+	CLOSEST *a = (CLOSEST *)in;
+	CLOSEST *b = (CLOSEST *)inout;
+	int k;
+
+	for (k = 0; k < *len; k++, a++, b++)
+	{
+		if (a->dmin < b->dmin)
+			*b = *a;
+		else if (a->dmin == b->dmin)
+		{
+			if (a->cluster != b->cluster)
+				b->ambiguous = 1;
+			b->ambiguous |= a->ambiguous;
+		}
+	}
+
+} /* ReduceClosest */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: closest row labelled 1 to maxclusterid of each of the cnt rows, over the own rows of every rank; */
+/* the result is known by root, and the cluster of a row is init when no rank has any labelled row */
+static void ReduceClosestRows(FACSDATA *facs,unsigned int *clusterid,unsigned int colcnt,unsigned int maxclusterid,FACSDATA *rows,unsigned int cnt,unsigned int init,CLOSEST *closest,int root)
+{
+	CLOSEST *local = malloc(((size_t)cnt+1)*sizeof(CLOSEST));
+	MPI_Datatype type;
+	MPI_Op op;
+	unsigned int i,j,col;
+
+	if (!local)
+	{
+		printf("LOG: ERROR: not enough memory to look for the closest clusters\n");
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		FACSDATA *facspi = &rows[i];
+		CLOSEST *c = &local[i];
+
+		c->dmin = 0xffffffff;
+		c->cluster = init;
+		c->ambiguous = 0;
+		for (j = ownfirst; j < ownlast; j++)
+		{
+			if ((clusterid[j] > 0) && (clusterid[j] <= maxclusterid))
+			{
+				unsigned int d = 0;
+				FACSDATA *facspj = &facs[j];
+				for (col=0;col<colcnt;col++)
+				{
+					int diff = (int)facspj->data[col] - facspi->data[col];
+					d += diff*diff;
+				}
+				if (d < c->dmin)
+				{
+					c->dmin = d;
+					c->cluster = clusterid[j];
+					c->ambiguous = 0;
+				}
+				else if ((d == c->dmin) && (clusterid[j] != c->cluster))
+					c->ambiguous = 1;
+			}
+		}
+	}
+	MPI_Type_contiguous(3, MPI_UNSIGNED, &type);
+	MPI_Type_commit(&type);
+	MPI_Op_create(ReduceClosest, 1, &op);
+	MPI_Reduce(local, closest, cnt, type, op, root, gComm);
+	MPI_Op_free(&op);
+	MPI_Type_free(&type);
+	free(local);
+
+} /* ReduceClosestRows */
+/* ------------------------------------------------------------------------------------ */
+
 static void DistributeLeftoverToClosestCluster(FACSDATA *facs, unsigned int *clusterid,unsigned int loaded, unsigned int colcnt,FACSDATA *leftoverfacs,unsigned int *leftoverclusterid,unsigned int leftoverloaded)
 {
 	unsigned int i,j,col;
@@ -309,15 +718,65 @@ static void DistributeLeftoverToClosestCluster(FACSDATA *facs, unsigned int *clu
 
 } // DistributeLeftoverToClosestCluster
 
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: the master reads the leftover rows and sends them in batches, every rank looking for them in the clusters */
+/* of its own rows; the master writes the closest cluster of each, within testdist and not ambiguous, or 0 */
+static void RangeLeftoverBatches(FACSDATA *facs,unsigned int *clusterid,unsigned int colcnt,unsigned int testdist,DCLUSTFILE *lf,FILE *of)
+{
+	FACSDATA *batch = calloc(kClosestBatch,sizeof(FACSDATA));
+	CLOSEST *closest = malloc(kClosestBatch*sizeof(CLOSEST));
+	unsigned int first = 0;
+	unsigned int cnt,i,j;
+
+	if (!batch || !closest)
+	{
+		printf("LOG: ERROR: not enough memory for the leftover rows\n");
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	do
+	{
+		cnt = 0;
+		if (lf)
+		{
+			cnt = (unsigned int)lf->hdr.rowcnt - first;
+			if (cnt > kClosestBatch)
+				cnt = kClosestBatch;
+			for (i = 0; i < cnt; i++)
+			{
+				float val[kMaxInputCol];
+				DclustFileGetRow(lf,first+i,val);
+				for (j = 0; j < colcnt; j++)
+					batch[i].data[j] = (unsigned short)val[j];
+			}
+		}
+		MPI_Bcast(&cnt, 1, MPI_INT, 0, gComm);
+		if (cnt == 0)
+			break;
+		MPI_Bcast(batch, cnt*sizeof(FACSDATA), MPI_CHAR, 0, gComm);
+		ReduceClosestRows(facs,clusterid,colcnt,UINT_MAX,batch,cnt,0,closest,0);
+		if (of)
+		{
+			for (i = 0; i < cnt; i++)
+			{
+				unsigned int cl = (closest[i].ambiguous || (closest[i].dmin > testdist)) ? 0 : closest[i].cluster;
+				fprintf(of,"%u,%u\n",DclustFileCellNameIdx(lf,first+i),cl);
+			}
+		}
+		first += cnt;
+	} while (1);
+	free(batch);
+	free(closest);
+
+} /* RangeLeftoverBatches */
 /* ------------------------------------------------------------------------------------ */
 static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clusterid,unsigned int loaded,unsigned int colcnt,int nproc,unsigned int verbose)
 {
-	unsigned int i,ccnt,leftoverrowcnt;
-	int endian;
-	char hdr[kHeaderSize];
+	unsigned int i,leftoverrowcnt;
+	int err;
 	char lfn[kMaxFilename];
 	char ofn[kMaxFilename];
-	FILE *f = NULL;
+	DCLUSTFILE lf;
 	FILE *of = NULL;
 	FACSDATA *leftoverfacs = NULL;
 	FACSNAME *leftovername = NULL;
@@ -329,36 +788,49 @@ static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clu
 		p = strstr(lfn,"selected");
 		if (p)
 			strcpy(p,"leftover");
-		f = fopen(lfn,"rb");
-		if (!f)
+		err = DclustFileOpen(&lf,lfn,kDclustUnassignedFile,1);
+		if (err < 0)
 		{
 			printf("LOG: Warning: no leftover file to treat (%s)\n",lfn);
 			goto bail;
 		}
-		
-		fread(&hdr[0],sizeof(char),kHeaderSize,f);
-		if (strcmp(hdr,"dclust unassigned file v1.0   \n") != 0)
-		{
-			printf("Error: input is not a dclust unassigned file\n");
+		if (err)
 			return(0);
-		}	
-		fread(&endian,sizeof(int),1,f);
-		if (endian != 1)
+		if (lf.hdr.colcnt != colcnt)
 		{
-			printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
+			printf("Error: column count in binary file=%u, expected=%u\n",lf.hdr.colcnt,colcnt);
+			DclustFileClose(&lf);
 			return(0);
 		}
-		fread(&leftoverrowcnt,sizeof(int),1,f);
-		fread(&ccnt,sizeof(int),1,f);
-		if (ccnt != colcnt)
+		if (DclustFileMap(&lf))
+		{
+			printf("Error:Cannot map leftover file %s\n",lfn);
+			goto bail;
+		}
+		leftoverrowcnt = (unsigned int)lf.hdr.rowcnt;
+
+		sprintf(ofn,"%s",fn);
+		p = strstr(ofn,"selected");
+		if (p)
+			strcpy(p,"leftover.clusters");
+		of = fopen(ofn,"w");
+		if (!of)
+		{
+			printf("Error:Cannot Create Leftover Cluster results File %s\n",ofn);
+			goto bail;
+		}
+
+		if (gLabelOps)
 		{
-			printf("Error: column count in binary file=%u, expected=%u\n",ccnt,colcnt);
+			if (verbose > 0)
+				printf("LOG: processing leftover file %s which contains %u events\n",lfn,leftoverrowcnt);
+			fflush(stdout);
+			SendLabelOp(kLabelsLeftover,gTestDist,0.0,0.0);
+			RangeLeftoverBatches(facs,clusterid,colcnt,gTestDist,&lf,of);
+			DclustFileClose(&lf);
+			fclose(of);
 			return(0);
 		}
-		/* read spacer */
-		fread(&endian,sizeof(int),1,f);
-		/* skip header */
-		fseek(f,kMaxLineBuf,SEEK_CUR);
 
 		leftoverfacs = calloc(leftoverrowcnt,sizeof(FACSDATA));
 		if (!leftoverfacs)
@@ -379,44 +851,31 @@ static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clu
 			goto bail;
 		}
 
-		sprintf(ofn,"%s",fn);
-		p = strstr(ofn,"selected");
-		if (p)
-			strcpy(p,"leftover.clusters");
-		of = fopen(ofn,"w");
-		if (!of)
-		{
-			printf("Error:Cannot Create Leftover Cluster results File %s\n",ofn);
-			goto bail;
-		}
-
 		if (verbose > 0)
 			printf("LOG: reading leftover file %s which contains %u events\n",lfn,leftoverrowcnt);
 		fflush(stdout);
 		for (i = 0; i < leftoverrowcnt; i++)
 		{
 			unsigned int j;
-			float tmpfloat;
-			fread(&leftovername[i],sizeof(CELLNAMEIDX),1,f);
-			for (j = 0; j < ccnt; j++)
-			{
-				fread(&tmpfloat,sizeof(float),1,f);
-				leftoverfacs[i].data[j] = (unsigned short)tmpfloat;
-			}
+			float val[kMaxInputCol];
+			leftovername[i].condition = DclustFileCellNameIdx(&lf,i);
+			DclustFileGetRow(&lf,i,val);
+			for (j = 0; j < colcnt; j++)
+				leftoverfacs[i].data[j] = (unsigned short)val[j];
 		}
-		fclose(f);
+		DclustFileClose(&lf);
 
 		if (verbose > 0)
 			printf("LOG: processing leftover file %s which contains %u events\n",lfn,leftoverrowcnt);
 		fflush(stdout);
-		MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, gComm);
 		if (leftoverrowcnt > 0)
 		{
 			unsigned int ii;
 			unsigned int starti,lasti;
 			unsigned int datachunk = 1+(leftoverrowcnt/nproc);
 			unsigned int actualChunkSize;
-			MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, MPI_COMM_WORLD);
+			MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, gComm);
 
 			for (ii = 1; ii<nproc; ii++)
 			{
@@ -427,8 +886,8 @@ static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clu
 					if (lasti > leftoverrowcnt)
 						lasti = leftoverrowcnt;
 					actualChunkSize = (lasti-starti);				
-					MPI_Send(&actualChunkSize, 1, MPI_INT,  ii, kLeftoverDataLength, MPI_COMM_WORLD);
-					MPI_Send(&leftoverfacs[starti].data[0], actualChunkSize*sizeof(FACSDATA),MPI_CHAR,  ii, kLeftoverData, MPI_COMM_WORLD);
+					MPI_Send(&actualChunkSize, 1, MPI_INT,  ii, kLeftoverDataLength, gComm);
+					MPI_Send(&leftoverfacs[starti].data[0], actualChunkSize*sizeof(FACSDATA),MPI_CHAR,  ii, kLeftoverData, gComm);
 				}
 			}
 			fflush(stdout);
@@ -444,7 +903,7 @@ static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clu
 					if (lasti > leftoverrowcnt)
 						lasti = leftoverrowcnt;
 					fflush(stdout);
-					MPI_Recv(&leftoverclusterid[starti], (lasti-starti), MPI_INT,  ii, kLeftoverClusters, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+					MPI_Recv(&leftoverclusterid[starti], (lasti-starti), MPI_INT,  ii, kLeftoverClusters, gComm,MPI_STATUS_IGNORE);
 				}
 			}
 			
@@ -466,9 +925,9 @@ static int DoProcessLeftoverbinaryFile(char *fn,FACSDATA *facs,unsigned int *clu
 
 bail :
 		fflush(stdout);
-		MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-		if (f)
-			fclose(f);
+		if (!gLabelOps)
+			MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, gComm);
+		DclustFileClose(&lf);
 		if (leftovername)
 			free(leftovername);
 		if (leftovername)
@@ -557,6 +1016,23 @@ static void thread_InsertMergeRequest(unsigned int cluster1, unsigned int cluste
 } /* thread_InsertMergeRequest */
 /* ------------------------------------------------------------------------------------ */
 
+/* largest difference on the sort key that can still be within gTestDist (rows are sorted on that key) */
+static unsigned int KeyReach(unsigned int testdist)
+{
+	unsigned int r = 0;
+	unsigned int bit;
+
+	/* integer square root, testdist fits on 32 bits so the root fits on 17 */
+	for (bit = (1 << 16); bit > 0; bit >>= 1)
+	{
+		if ((unsigned long long)(r|bit)*(r|bit) <= testdist)
+			r |= bit;
+	}
+	return(r);
+
+} /* KeyReach */
+/* ------------------------------------------------------------------------------------ */
+
 static void *computesim_funcion(void *ep)
 {
 	FACSDATA *facspi;
@@ -571,6 +1047,8 @@ static void *computesim_funcion(void *ep)
 	FACSDATA *facs = ((EXECUTIONPLAN*)ep)->facsdata;
 	unsigned int *clusterid = ((EXECUTIONPLAN*)ep)->clusterid;
 	CPU *chunk = &((EXECUTIONPLAN*)ep)->chunk;
+	unsigned int keyreach = KeyReach(gTestDist);
+	unsigned int keylimit;
 
 	starti = chunk->ii;
 	lasti  = chunk->iilast;
@@ -608,11 +1086,15 @@ static void *computesim_funcion(void *ep)
 				actualstartj = startj;
 			facspj = &facs[actualstartj];
 			clusterpj = &clusterid[actualstartj];
+			keylimit = facspi->data[sortkey] + keyreach;
 			for(j = actualstartj;  j< lastj; j++)
 			{
 				int diff;
 				unsigned int d;
 
+				/* rows are sorted on the key: no further row of this block can be close enough */
+				if (facspj->data[sortkey] > keylimit)
+					break;
 				if ((*clusterpj) && (*clusterpj == *clusterpi))
 					goto straight2next;
 
@@ -833,8 +1315,8 @@ static void DoMergeLists(int nproc,int verbose)
 					break;
 				joinRequest.getFromCPU = cpu + sendingCPUoffset;
 				joinRequest.sendToCPU = cpu;				
-				MPI_Send(&joinRequest, 2, MPI_INT,  joinRequest.sendToCPU,  kJoinListRequest, MPI_COMM_WORLD);
-				MPI_Send(&joinRequest, 2, MPI_INT,  joinRequest.getFromCPU, kJoinListRequest, MPI_COMM_WORLD);
+				MPI_Send(&joinRequest, 2, MPI_INT,  joinRequest.sendToCPU,  kJoinListRequest, gComm);
+				MPI_Send(&joinRequest, 2, MPI_INT,  joinRequest.getFromCPU, kJoinListRequest, gComm);
 				cpu += sendingCPUoffset+sendingCPUoffset;
 				joiningprocesses++;
 			} while (1);
@@ -847,7 +1329,7 @@ static void DoMergeLists(int nproc,int verbose)
 				unsigned int done;
 				if ((cpu + sendingCPUoffset) >= nproc)
 					break;
-				MPI_Recv(&done, 1, MPI_INT,  cpu, kJoinListRequestDone, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
+				MPI_Recv(&done, 1, MPI_INT,  cpu, kJoinListRequestDone, gComm, MPI_STATUS_IGNORE/*&status*/);
 				cpu += sendingCPUoffset+sendingCPUoffset;
 			} while (++received < joiningprocesses);
 
@@ -858,500 +1340,2724 @@ static void DoMergeLists(int nproc,int verbose)
 		joinRequest.getFromCPU  = 0;
 		joinRequest.sendToCPU = 0;
 		for (cpu = 1; cpu < nproc; cpu++)
-			MPI_Send(&joinRequest, 2, MPI_INT,  cpu,  kJoinListRequest, MPI_COMM_WORLD);
+			MPI_Send(&joinRequest, 2, MPI_INT,  cpu,  kJoinListRequest, gComm);
 
 } /* DoMergeLists */
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned int dclustFileReadHeader(FILE *f,int idproc,unsigned int *rcnt,unsigned int *ccnt,unsigned short *colkey,unsigned int *loadEveryNsample)
+/* read the header of a v1 or v2 dclust input file; the file is closed again */
+static unsigned int dclustFileReadHeader(char *fn,int idproc,unsigned int *rcnt,unsigned int *ccnt,unsigned short *colkey,unsigned int *loadEveryNsample)
 {
-	unsigned int rowcnt;
-	unsigned int colcnt;
-	unsigned short cellnamecnt,key;
-	int endian;
-	unsigned int skip;
-	char hdr[kHeaderSize];
-	int err = 1 /* always pessimist*/ ;
-
-	fread(&hdr[0],sizeof(char),kHeaderSize,f);
-	if (strcmp(hdr,"dclust input file v1.0        \n") != 0)
-	{
-		if (idproc == 0)
-			printf("Error: input is not a dclust input file\n");
-		return(err);
-	}	
+	DCLUSTFILE df;
+	int err;
 
-	fread(&endian,sizeof(int),1,f);
-	if (endian != 1)
+	err = DclustFileOpen(&df,fn,kDclustSelectedFile,(idproc == 0));
+	if (err < 0)
 	{
 		if (idproc == 0)
-			printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
-		return(err);
+			printf("LOG:Cannot Open InputFile %s\n",fn);
+		return(1);
 	}
-	fread(&rowcnt,sizeof(int),1,f);
-	fread(&colcnt,sizeof(float),1,f);
-	if (colcnt > kMaxInputCol)
+	if (err)
+		return(1);
+	if (df.hdr.rowcnt > UINT_MAX)
 	{
 		if (idproc == 0)
-			printf("LOG:Fatal: number of requested columns exceed maximum allowed (%u > %d)\n",colcnt,kMaxInputCol);
-		return(err);
-	}	
-	fread(&skip,sizeof(int),1,f);
+			printf("LOG:Fatal: number of rows exceed maximum allowed (%llu > %u)\n",df.hdr.rowcnt,UINT_MAX);
+		DclustFileClose(&df);
+		return(1);
+	}
 
-	/* read header */
-	fread(&header,sizeof(char),kMaxLineBuf,f);
+	strcpy(header,df.hdr.header);
 	sprintf(headerWithCluster,"%s,cluster",header);
-
-	/* read column key used to sort data */
-	fread(&key,sizeof(unsigned short),1,f);
-	/* read number of unique cellnames */
-	fread(&cellnamecnt,sizeof(unsigned short),1,f);
-
-	/* skip cellnames to point on actual data */
-	fseek(f,((unsigned int)cellnamecnt*kMaxCellName*sizeof(char)),SEEK_CUR);
-
-	err = 0;
-	*rcnt = rowcnt;
-	*ccnt = colcnt;
-	*colkey = key;
-	*loadEveryNsample = skip;
-	return(err);
+	*rcnt = (unsigned int)df.hdr.rowcnt;
+	*ccnt = df.hdr.colcnt;
+	*colkey = (unsigned short)df.hdr.key;
+	*loadEveryNsample = df.hdr.loadEveryNsample;
+	DclustFileClose(&df);
+	return(0);
 	
 } /* dclustFileReadHeader */
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned int loaddata(FILE *f, FACSNAME *facsname, FACSDATA *facs,unsigned int rowcnt,unsigned int colcnt,int idproc)
+static unsigned int loaddata(DCLUSTFILE *df,FACSNAME *facsname,FACSDATA *facs,unsigned int firstrow,unsigned int lastrow,unsigned int colcnt)
 {
-	FACSDATA *facsp;
-	FACSNAME *facsnamep;
-	unsigned int cnt;
-
-	cnt = 0;
+	unsigned int r;
 
-	facsp = &facs[0];	
-	if (idproc == 0)
-	{
-		facsnamep = &facsname[0];
-		for (cnt = 0; cnt < rowcnt; cnt++)
-		{
-			fread(facsnamep,sizeof(CELLNAMEIDX),1,f);
-			fread(facsp,sizeof(short),colcnt,f);
-			facsp++;
-			facsnamep++;
-		}
-	}
-	else
+	/* rows are copied from a mapping of the file, whatever its version */
+	if (DclustFileMap(df) || (df->hdr.datatype != kDclustUShort))
+		return(0);
+	for (r = firstrow; r < lastrow; r++)
 	{
-		for (cnt = 0; cnt < rowcnt; cnt++)
-		{
-			/* skip nameindex */
-			fseek(f,sizeof(CELLNAMEIDX),SEEK_CUR);
-			fread(facsp,sizeof(short),colcnt,f);
-			facsp++;
-		}
+		if (facsname)
+			facsname[r].condition = DclustFileCellNameIdx(df,r);
+		memcpy(&facs[r],DclustFileData(df,r),colcnt*sizeof(short));
 	}
-	
-	return(cnt);
-	
+
+	return(lastrow-firstrow);
+
 } /* loaddata */
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned int CountAssigned(unsigned int *clusterid,unsigned int rowcnt,unsigned int maxclusterid)
+/* all ranks running on the same node map a single read-only copy of the data, allocated by the node leader */
+/* cellnames are only needed by the master, and are shared between the ranks of the master node */
+static FACSDATA *AllocateSharedFacsData(unsigned int rowcnt,MPI_Comm *nodecomm,MPI_Comm *leadercomm,MPI_Win *facswin,FACSNAME **facsname,MPI_Win *namewin,int *nodecnt)
 {
-	unsigned int *clusteridp;
-	unsigned int i;
-	unsigned int assigned = 0;
+	FACSDATA *facs = NULL;
+	MPI_Aint winsize;
+	int dispunit;
+	int idproc;
+	int noderank;
+	int nodeleader;
+	int err,anyerr;
+
+	MPI_Comm_rank(gComm,&idproc);
+	MPI_Comm_split_type(gComm,MPI_COMM_TYPE_SHARED,0,MPI_INFO_NULL,nodecomm);
+	MPI_Comm_rank(*nodecomm,&noderank);
+	nodeleader = idproc;
+	MPI_Bcast(&nodeleader,1,MPI_INT,0,*nodecomm);
+
+	/* only node leaders take part in the broadcast of the data; world rank 0 is always the leader of its node */
+	MPI_Comm_split(gComm,(noderank == 0) ? 0 : MPI_UNDEFINED,0,leadercomm);
+	*nodecnt = (noderank == 0);
+	MPI_Allreduce(MPI_IN_PLACE,nodecnt,1,MPI_INT,MPI_SUM,gComm);
+
+	MPI_Comm_set_errhandler(*nodecomm,MPI_ERRORS_RETURN);
+	*facsname = NULL;
+	*namewin = MPI_WIN_NULL;
+	winsize = (noderank == 0) ? (MPI_Aint)rowcnt*sizeof(FACSDATA) : 0;
+	err = (MPI_Win_allocate_shared(winsize,sizeof(FACSDATA),MPI_INFO_NULL,*nodecomm,&facs,facswin) != MPI_SUCCESS);
+	if ((err == 0) && (noderank != 0))
+		err = (MPI_Win_shared_query(*facswin,0,&winsize,&dispunit,&facs) != MPI_SUCCESS);
+	if (err == 0)
+	{
+		winsize = ((noderank == 0) && (nodeleader == 0)) ? (MPI_Aint)rowcnt*sizeof(FACSNAME) : 0;
+		err = (MPI_Win_allocate_shared(winsize,sizeof(FACSNAME),MPI_INFO_NULL,*nodecomm,facsname,namewin) != MPI_SUCCESS);
+		if ((err == 0) && (noderank != 0))
+			err = (MPI_Win_shared_query(*namewin,0,&winsize,&dispunit,facsname) != MPI_SUCCESS);
+		if (nodeleader != 0)
+			*facsname = NULL;
+	}
+	MPI_Allreduce(&err,&anyerr,1,MPI_INT,MPI_MAX,gComm);
+	if (anyerr)
+	{
+		if (*namewin != MPI_WIN_NULL)
+			MPI_Win_free(namewin);
+		if (*facswin != MPI_WIN_NULL)
+			MPI_Win_free(facswin);
+		*facsname = NULL;
+		return(NULL);
+	}
 
-			clusteridp = &clusterid[0];
-			for(i = 0;  i< rowcnt; i++)
-			{
-					if ((*clusteridp > 0) && (*clusteridp<=maxclusterid))
-						assigned++;
-					clusteridp++;
-			}//i
+	return(facs);
 
-		return(assigned);
-} /* CountAssigned */
+} /* AllocateSharedFacsData */
 /* ------------------------------------------------------------------------------------ */
-static void WriteClusterIndices(unsigned int *clusterid,unsigned int rowcnt,float distcutoff,char *dir)
+
+static void BroadcastSharedFacsData(FACSDATA *facs,unsigned int rowcnt,MPI_Comm leadercomm,MPI_Win facswin)
 {
-	unsigned int *clusteridp;
-	FILE *af;
-	char fn[kMaxFilename];
+	unsigned int tosend = rowcnt;
+	unsigned int sendfrom = 0;
 
-		sprintf(fn,"%s-%.6f",dir,distcutoff);
-		af=fopen(fn,"wb");
-		if (af)
+	if (leadercomm != MPI_COMM_NULL)
+	{
+		while(tosend > 0)
 		{
-			clusteridp = &clusterid[0];
-			fwrite(clusteridp,sizeof(int),rowcnt,af);
-			fclose(af);
+			unsigned int smallchunk;
+			if (tosend <= 1000000)
+			{
+				smallchunk = tosend;
+				tosend = 0;
+			}
+			else
+			{
+				smallchunk = 1000000;
+				tosend -= 1000000;
+			}
+			MPI_Bcast (&facs[sendfrom], smallchunk*sizeof(FACSDATA), MPI_CHAR, 0, leadercomm);
+			sendfrom += 1000000;
 		}
-		else
-			printf("LOG: Error writing %s\n",fn);
-	
-} /* WriteClusterIndices */
+	}
+
+	/* make data written by the node leader visible to the other ranks of the node */
+	MPI_Win_fence(0,facswin);
+
+} /* BroadcastSharedFacsData */
 /* ------------------------------------------------------------------------------------ */
-static unsigned int WriteSplitBinFile(FACSNAME *facsname,FACSDATA *facs,unsigned int *clusterid,unsigned int rowcnt,unsigned int colcnt,unsigned int maxclusterid,char *ofn)
+
+/* the data block of a v2 input file has the layout of FACSDATA: every rank then uses it in place from */
+/* a read-only mapping of the file, the pages being shared by the ranks of a node through the page cache */
+static FACSDATA *MapFacsData(DCLUSTFILE *df,char *fn,unsigned int rowcnt,unsigned int colcnt,unsigned short key,int idproc,FACSNAME **facsname)
 {
-	unsigned short *usp;
-	unsigned int *clusteridp;
-	unsigned int i;
-	unsigned int col;
-	FILE *uf;
-	FILE *af;
-	FACSDATA *facsp;
-	FACSNAME *facsnamep;
-	char fn[kMaxFilename];
-	char hdr[kHeaderSize];
-	float val[kMaxInputCol];
-	unsigned int assigned = 0;
-	int endian = 1;
+	int ok = 0;
+	int allok;
 
-		sprintf(fn,"%s.assigned",ofn);
-		af=fopen(fn,"wb");
-		sprintf(fn,"%s.unassigned",ofn);
-		uf=fopen(fn,"wb");
+	if (DclustFileOpen(df,fn,kDclustSelectedFile,0) == 0)
+	{
+		ok = ((df->hdr.version == kDclustFileVersion) && (df->hdr.datatype == kDclustUShort) && (df->hdr.stride == sizeof(FACSDATA)) &&
+			(df->hdr.rowcnt == rowcnt) && (df->hdr.colcnt == colcnt) && (df->hdr.key == key) && (DclustFileMap(df) == 0));
+		if (!ok)
+			DclustFileClose(df);
+	}
+	MPI_Allreduce(&ok,&allok,1,MPI_INT,MPI_MIN,gComm);
+	if (!allok)
+	{
+		if (ok)
+			DclustFileClose(df);
+		return(NULL);
+	}
 
-		if (af && uf)
+	*facsname = (FACSNAME *)&df->map[df->hdr.indexoffset];
+	return((FACSDATA *)DclustFileData(df,0));
+
+} /* MapFacsData */
+/* ------------------------------------------------------------------------------------ */
+
+/* every rank reads its share of the rows directly from the input file into the node shared copy */
+static unsigned int DirectLoadSharedFacsData(char *fn,FACSDATA *facs,FACSNAME *facsname,unsigned int rowcnt,unsigned int colcnt,unsigned short key,int idproc,MPI_Comm nodecomm,MPI_Win facswin,MPI_Win namewin)
+{
+	DCLUSTFILE df;
+	int ok = 0;
+	int allok;
+	unsigned int share,firstrow,lastrow;
+	int noderank,nodesize;
+
+	/* make sure that every rank sees the same file before relying on it */
+	if (DclustFileOpen(&df,fn,kDclustSelectedFile,0) == 0)
+	{
+		if ((df.hdr.rowcnt == rowcnt) && (df.hdr.colcnt == colcnt) && (df.hdr.key == key))
+			ok = 1;
+		else
+			DclustFileClose(&df);
+	}
+	MPI_Allreduce(&ok,&allok,1,MPI_INT,MPI_MIN,gComm);
+	if (!allok)
+	{
+		if (ok)
+			DclustFileClose(&df);
+		return(0);
+	}
+
+	MPI_Comm_rank(nodecomm,&noderank);
+	MPI_Comm_size(nodecomm,&nodesize);
+	share = rowcnt/nodesize + 1;
+	firstrow = noderank*share;
+	if (firstrow > rowcnt)
+		firstrow = rowcnt;
+	lastrow = firstrow+share;
+	if (lastrow > rowcnt)
+		lastrow = rowcnt;
+	ok = (loaddata(&df,facsname,facs,firstrow,lastrow,colcnt) == (lastrow-firstrow));
+	DclustFileClose(&df);
+
+	MPI_Win_fence(0,facswin);
+	MPI_Win_fence(0,namewin);
+	MPI_Allreduce(&ok,&allok,1,MPI_INT,MPI_MIN,gComm);
+	if ((!allok) && (idproc == 0))
+		printf("LOG:Error reading %s\n",fn);
+
+	return((allok) ? rowcnt : 0);
+
+} /* DirectLoadSharedFacsData */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned int RowWeight(unsigned int row)
+{
+	return((rowweight) ? rowweight[row-rowweightfirst] : 1);
+
+} /* RowWeight */
+/* ------------------------------------------------------------------------------------ */
+
+/* events of an input file where dselect -D collapsed identical rows; the master counts clusters in events, not rows */
+/* the weights of rows first to last are kept (with -O, each slave keeps those of its own rows), the events are those of every row */
+static unsigned int LoadRowWeights(char *fn,unsigned int rowcnt,unsigned int first,unsigned int last)
+{
+	DCLUSTFILE df;
+	unsigned int events = rowcnt;
+	unsigned int r;
+
+	if (DclustFileOpen(&df,fn,kDclustSelectedFile,0) != 0)
+		return(events);
+	if ((df.hdr.weightoffset > 0) && (df.hdr.rowcnt == rowcnt) && (DclustFileMap(&df) == 0))
+	{
+		rowweight = malloc(((size_t)(last-first)+1)*sizeof(unsigned int));
+		rowweightfirst = first;
+		if (rowweight)
 		{
+			events = 0;
+			for (r = 0; r < rowcnt; r++)
+			{
+				unsigned int w = DclustFileWeight(&df,r);
+				if ((r >= first) && (r < last))
+					rowweight[r-first] = w;
+				events += w;
+			}
+		}
+		else
+			printf("LOG:Warning: not enough memory for the row weights, counting rows instead of events\n");
+	}
+	DclustFileClose(&df);
+	return(events);
 
-			strcpy(hdr,"dclust assigned file v1.0     \n");
-			fwrite(&hdr[0],sizeof(char),kHeaderSize,af);
-			strcpy(hdr,"dclust unassigned file v1.0   \n");
-			fwrite(&hdr[0],sizeof(char),kHeaderSize,uf);
+} /* LoadRowWeights */
+/* ------------------------------------------------------------------------------------ */
 
-			fwrite(&endian,sizeof(int),1,af);
-			fwrite(&endian,sizeof(int),1,uf);
-			endian--;
-			fwrite(&endian,sizeof(int),1,af); // keep space for number of rows
-			fwrite(&endian,sizeof(int),1,uf); // keep space for number of rows
+static unsigned int CountAssignedEvents(unsigned int *clusterid,unsigned int rowcnt,unsigned int maxclusterid)
+{
+	unsigned int i;
+	unsigned int assigned = 0;
 
-			fwrite(&colcnt,sizeof(int),1,af);
-			fwrite(&colcnt,sizeof(int),1,uf);
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsAssigned,maxclusterid,0.0,0.0);
+		return(SumOverRanks(0));
+	}
+	for (i = 0; i < rowcnt; i++)
+		if ((clusterid[i] > 0) && (clusterid[i] <= maxclusterid))
+			assigned += RowWeight(i);
+	return(assigned);
 
-			fwrite(&maxclusterid,sizeof(int),1,af); 
-			fwrite(&maxclusterid,sizeof(int),1,uf);
+} /* CountAssignedEvents */
+/* ------------------------------------------------------------------------------------ */
 
-			fwrite(&header,sizeof(char),kMaxLineBuf,uf);
-			fwrite(&headerWithCluster,sizeof(char),kMaxLineBuf,af);
+static unsigned int CountAssigned(unsigned int *clusterid,unsigned int rowcnt,unsigned int maxclusterid)
+{
+	unsigned int *clusteridp;
+	unsigned int i;
+	unsigned int assigned = 0;
 
 			clusteridp = &clusterid[0];
-			facsp = &facs[0];
-			facsnamep = &facsname[0];
 			for(i = 0;  i< rowcnt; i++)
 			{
-					usp = &facsp->data[0];
 					if ((*clusteridp > 0) && (*clusteridp<=maxclusterid))
-					{
-						fwrite(facsnamep,sizeof(CELLNAMEIDX),1,af);
-						for (col=0;col<colcnt;col++)
-						{
-								val[col] = (float)(*usp);
-								usp++;
-						}
-						fwrite(val,sizeof(float),colcnt,af);
-						fwrite(clusteridp,sizeof(int),1,af);
 						assigned++;
-					}
-					else
-					{
-						fwrite(facsnamep,sizeof(CELLNAMEIDX),1,uf);
-						for (col=0;col<colcnt;col++)
-						{
-								val[col] = (float)(*usp);
-								usp++;
-						}
-						fwrite(val,sizeof(float),colcnt,uf);
-					}
 					clusteridp++;
-					facsp++;
-					facsnamep++;
 			}//i
-		}
-		if (af)
-		{
-			fseek(af,36L,SEEK_SET);
-			fwrite(&assigned,sizeof(int),1,af);
-			fclose(af);
-		}
-		else
-			printf("LOG: Cannot write results to %s.assigned\n",ofn);
-		if (uf)
-		{
-			fseek(uf,36L,SEEK_SET);
-			rowcnt -= assigned;
-			fwrite(&rowcnt,sizeof(int),1,uf);
-			fclose(uf);
-		}
-		else
-			printf("LOG: Cannot write results to %s.unassigned\n",ofn);
-		return(assigned);
 
-} /* WriteSplitBinFile */
+		return(assigned);
+} /* CountAssigned */
 /* ------------------------------------------------------------------------------------ */
-
-static void removeclustersnum(int id)
+static unsigned int PutIndexVarint(unsigned char *p,unsigned int v)
 {
-	int *cnp;
-	int cpu =   id / kStartLocalCluster ;
-	int cluster = id - cpu*kStartLocalCluster;
-	cnp = clustersnum[cpu];
-	cnp[cluster] = kClusterEliminated;  /* flag this specific cluster id as being removed */
+	unsigned int n = 0;
 
-} /* removeclustersnum */
+	while (v >= 0x80)
+	{
+		p[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char)v;
+	return(n);
+
+} /* PutIndexVarint */
 /* ------------------------------------------------------------------------------------ */
-static void AdjustClustersID(unsigned int *clusters, unsigned int loaded,unsigned int nproc,int verbose,int trimmedclustercnt,int *firstAvailClusterID)
+
+/* each run is the varint of label*2+(run > 1) followed, for longer runs, by the varint of its length */
+static unsigned char *EncodeClusterIndices(unsigned int *clusterid,unsigned int rowcnt,unsigned int *len)
 {
+	unsigned char *data;
+	unsigned char *p;
+	unsigned int size = kIndexBufSize;
 	unsigned int i;
-	int j;
-	int *cnp;
-	unsigned int clusterid = 1; /* first cluster will have id=1 */
-	unsigned int tinyClustersId = trimmedclustercnt +1 ;  /* start to pile up number of clusters too small to pass the min size cutoff after "good" clusters */
-	unsigned int ii;
 
-	/* loop over each cpu, which has attributed its own ids */
-	for (i = 1; i < nproc; i++)
+	data = malloc(size);
+	if (!data)
+		return(NULL);
+	memset(data,0,kIndexMagicSize);
+	strcpy((char *)data,kIndexMagic);
+	memcpy(&data[kIndexMagicSize],&rowcnt,sizeof(int));
+	*len = kIndexMagicSize+sizeof(int);
+	for (i = 0; i < rowcnt; )
 	{
-		cnp = clustersnum[i];
-		for (j = 1; j<=cnp[0]; j++)
-		{
-			if (cnp[j]==kClusterLargeEnough)
-			{
-				/* rename clusterid (attribute clusterid as a new id) */
-				if (verbose > 2)
-					printf("LOG:Renaming clusterid %u to %u\n",i*kStartLocalCluster+j,clusterid);
-				cnp[j]=clusterid++;
-			}
-			else if (cnp[j]==kClusterTooSmall)
-			{
-				cnp[j]=tinyClustersId++;
-			}
-			else
-				cnp[j] = 0;
-		}
+		unsigned int label = clusterid[i];
+		unsigned int run = 1;
 
-		for(ii = 0;  ii< loaded; ii++)
+		while ((i+run < rowcnt) && (clusterid[i+run] == label))
+			run++;
+		if (*len > size-10)
 		{
-			if ((int)clusters[ii] >= i*kStartLocalCluster)
+			size *= 2;
+			p = realloc(data,size);
+			if (!p)
 			{
-				int idx = (int)clusters[ii] - i*kStartLocalCluster;
-				if (idx < kStartLocalCluster)
-				{
-					clusters[ii] = cnp[idx];
-				}
+				free(data);
+				return(NULL);
 			}
+			data = p;
 		}
-		
+		/* labels stay well under 2^31 (kStartLocalCluster * kMaxCPU) */
+		*len += PutIndexVarint(&data[*len],(label << 1) | (run > 1));
+		if (run > 1)
+			*len += PutIndexVarint(&data[*len],run);
+		i += run;
 	}
-	
+	p = realloc(data,*len);
+	return(p ? p : data);
 
-	*firstAvailClusterID = tinyClustersId-1;
-	
-} /* AdjustClustersID */
+} /* EncodeClusterIndices */
 /* ------------------------------------------------------------------------------------ */
-static unsigned int RemoveSmallClusters(unsigned int *clusters,unsigned int loaded,unsigned int nproc,unsigned int minevents)
+static void WriteClusterIndices(char *fn,unsigned char *data,unsigned int len)
 {
-	unsigned int ii;
-	int i,j;
-	int *cnp;
-	unsigned int retainedClusterCnt = 0;
-
-	/* loop over each cpu, which has attributed its own ids */
-	for (i = 1; i < nproc; i++)
-	{
-		unsigned int *cnt;
-		cnp = clustersnum[i];
-		cnt = calloc((cnp[0]+1),sizeof(unsigned int));
+	FILE *af;
 
-		for(ii = 0;  ii< loaded; ii++)
-		{
-			int idx = (int)clusters[ii] - i*kStartLocalCluster;
-			if ((idx >= 0) && (idx <= cnp[0])) /* cluster belongs to proc i */
-				cnt[idx]++;
-		}
-		for (j = 1; j<=cnp[0]; j++)
+		af=fopen(fn,"wb");
+		if (!af)
 		{
-			if (cnt[j] < minevents)
-			{
-				if (cnp[j] != kClusterEliminated)
-					cnp[j]=kClusterTooSmall;  /* flag this specific cluster id as being removed */
-			}
-			else
-			{
-				retainedClusterCnt++;
-			}
+			printf("LOG: Error writing %s\n",fn);
+			return;
 		}
-		free(cnt);
-	}
-	return(retainedClusterCnt);
+		if ((fwrite(data,sizeof(char),len,af) != len) | (fclose(af) != 0))
+			printf("LOG: Error writing %s\n",fn);
 	
-} /* RemoveSmallClusters */
+} /* WriteClusterIndices */
 /* ------------------------------------------------------------------------------------ */
+static void *WriteClusterIndicesThread(void *arg)
+{
+	INDEXWRITE *iw = (INDEXWRITE *)arg;
 
-static void PrintClusterStatus(CLUSTERHISTORY *clusterhistory,unsigned int clusterhistorycnt)
+	WriteClusterIndices(iw->fn,iw->data,iw->len);
+	return(NULL);
+
+} /* WriteClusterIndicesThread */
+/* ------------------------------------------------------------------------------------ */
+
+/* the background write must be over before the snapshots or the files change */
+static void WaitClusterIndicesWriter(void)
 {
-	unsigned int ii;
-	for (ii = 0; ii<clusterhistorycnt; ii++)
-		printf("LOG: %4u %6.2f | %3d ^ %3d -> %3d | %c\n",clusterhistory[ii].pass,clusterhistory[ii].dist,clusterhistory[ii].cluster,clusterhistory[ii].descendfrom,clusterhistory[ii].mergedto,clusterhistory[ii].retain);
-		
-				
-} /* PrintClusterStatus */
+	if (indexwriterbusy)
+	{
+		if (pthread_join(indexwriter,NULL))
+			printf("Error: Failed pthread_join\n");
+		indexwriterbusy = 0;
+	}
+
+} /* WaitClusterIndicesWriter */
 /* ------------------------------------------------------------------------------------ */
+static int FindClusterIndices(float dist)
+{
+	unsigned int i;
 
-static void DistributeUnassignedToClosestCluster(FACSDATA *facs, unsigned int *clusterid,unsigned int loaded, unsigned int colcnt,unsigned int maxclusterid,unsigned int starti,unsigned int lasti)
+	for (i = 0; i < indexsnapshotcnt; i++)
+		if (indexsnapshot[i].dist == dist)
+			return(i);
+	return(-1);
+
+} /* FindClusterIndices */
+/* ------------------------------------------------------------------------------------ */
+
+/* keep the labels of a pass in memory under dist (0.0 for the pass not yet named), and write <dir>-<dist> as -w asks */
+static void KeepClusterIndices(unsigned int *clusterid,unsigned int rowcnt,float dist,char *dir)
 {
-	unsigned int i,j,col;
-	unsigned int dmin;
-	unsigned int jmin;
-	unsigned int ambiguousFlag;
-	unsigned int ambiguousCnt = 0;
-	unsigned int reassigned = 0;
+	INDEXSNAPSHOT *is;
+	unsigned char *data;
+	unsigned int len;
+	int i;
 
-	for (i = starti; i < lasti; i++)
+	if (gLabelOps)
 	{
-		if (clusterid[i] == 9999999) /* flagged for reassignment */
+		SendLabelOp(kLabelsKeep,0,dist,0.0);
+		return;
+	}
+	WaitClusterIndicesWriter();
+	data = EncodeClusterIndices(clusterid,rowcnt,&len);
+	if (!data)
+	{
+		printf("LOG: ERROR: not enough memory to keep the labels at distance %.3f\n",dist);
+		return;
+	}
+	i = FindClusterIndices(dist);
+	if (i < 0)
+	{
+		is = realloc(indexsnapshot,(indexsnapshotcnt+1)*sizeof(INDEXSNAPSHOT));
+		if (!is)
 		{
-			FACSDATA *facspi = &facs[i];
-			dmin = 0xffffffff;
-			jmin = i; // just to initialize something.
-			ambiguousFlag = 0;
+			printf("LOG: ERROR: not enough memory to keep the labels at distance %.3f\n",dist);
+			free(data);
+			return;
+		}
+		indexsnapshot = is;
+		i = indexsnapshotcnt++;
+	}
+	else
+		free(indexsnapshot[i].data);
+	is = &indexsnapshot[i];
+	is->dist = dist;
+	is->len = len;
+	is->data = data;
+
+	if (indexfiles == kIndexFilesNone)
+		return;
+	sprintf(indexwrite.fn,"%s-%.6f",dir,dist);
+	indexwrite.data = data;
+	indexwrite.len = len;
+	if ((indexfiles == kIndexFilesAsync) && (pthread_create(&indexwriter,NULL,&WriteClusterIndicesThread,&indexwrite) == 0))
+		indexwriterbusy = 1;
+	else
+		WriteClusterIndices(indexwrite.fn,data,len);
 
-			// compute distance of unassigned (facspi) to each assigned (facspj) and record closest event of each cluster.
-			for (j = 0; j < loaded; j++)
-			{
-				if ((clusterid[j] > 0) && (clusterid[j] <= maxclusterid)) /* assigned */
-				{
-					unsigned int d = 0;
-					FACSDATA *facspj = &facs[j];
-					for (col=0;col<colcnt;col++)
-					{
-						int diff = (int)facspj->data[col] - facspi->data[col];
-						d += diff*diff;
-					}
-					// record closest distance
-					if (d < dmin)
-					{
-						dmin = d;
-						jmin = j;
-						ambiguousFlag = 0;
-					}
-					else if ((d == dmin) && (clusterid[j] != clusterid[jmin]))
-					{
-						ambiguousFlag = 1;
-					}
-				}
-			}
-			// set the id of the closest cluster (but with an offset to make sure it will not affect loop above - cluster > maxclusterid for now)
-			if (ambiguousFlag)
-			{
-				clusterid[i] = 0 + maxclusterid + 1;
-				ambiguousCnt++;
-			}
-			else
-			{
-				clusterid[i] = clusterid[jmin] + maxclusterid + 1;
-				reassigned++;
-			}
+} /* KeepClusterIndices */
+/* ------------------------------------------------------------------------------------ */
+
+/* labels kept under olddist now belong to newdist; nothing happens when there are none */
+static void RenameClusterIndices(float olddist,float newdist,char *dir)
+{
+	char oldfn[kMaxFilename];
+	char newfn[kMaxFilename];
+	int i;
+	int j;
+
+	if (gLabelOps)
+		SendLabelOp(kLabelsRename,0,olddist,newdist);
+	WaitClusterIndicesWriter();
+	i = FindClusterIndices(olddist);
+	if (i >= 0)
+	{
+		j = FindClusterIndices(newdist);
+		if ((j >= 0) && (j != i))
+		{
+			free(indexsnapshot[j].data);
+			indexsnapshot[j] = indexsnapshot[--indexsnapshotcnt];
+			if (i == indexsnapshotcnt)
+				i = j;
 		}
+		indexsnapshot[i].dist = newdist;
 	}
-	// adjust clusterid of reassigned sequences.
-	for (i = starti; i < lasti; i++)
+	if (indexfiles != kIndexFilesNone)
 	{
-		if (clusterid[i] > maxclusterid)
-			clusterid[i] -= (maxclusterid + 1);
+		sprintf(oldfn,"%s-%.6f",dir,olddist);
+		sprintf(newfn,"%s-%.6f",dir,newdist);
+		rename(oldfn,newfn);
 	}
 
+} /* RenameClusterIndices */
+/* ------------------------------------------------------------------------------------ */
+static void FreeClusterIndices(void)
+{
+	unsigned int i;
 
-} // DistributeUnassignedToClosestCluster
+	WaitClusterIndicesWriter();
+	for (i = 0; i < indexsnapshotcnt; i++)
+		free(indexsnapshot[i].data);
+	free(indexsnapshot);
+	indexsnapshot = NULL;
+	indexsnapshotcnt = 0;
 
+} /* FreeClusterIndices */
 /* ------------------------------------------------------------------------------------ */
-static unsigned int FlagSequencesToReassign(unsigned int *clusterid,unsigned int loaded,char *fn)
+
+/* labels at dist come from memory, or from <dir>-<dist> when this run did not keep them (resumed scan) */
+static int OpenClusterIndices(INDEXREADER *r,char *dir,float dist,unsigned int rowcnt)
 {
-	unsigned int i;
-	unsigned int cnt = 0;
+	char fn[kMaxFilename];
+	unsigned int cnt;
+	int i;
+
+	r->f = NULL;
+	r->raw = 0;
+	r->left = 0;
+	r->pos = 0;
+	r->len = 0;
+	r->p = r->buf;
+	i = FindClusterIndices(dist);
+	if (i >= 0)
+	{
+		memcpy(&cnt,&indexsnapshot[i].data[kIndexMagicSize],sizeof(int));
+		if (cnt != rowcnt)
+			return(-1);
+		r->p = indexsnapshot[i].data;
+		r->pos = kIndexMagicSize+sizeof(int);
+		r->len = indexsnapshot[i].len;
+		return(0);
+	}
 
-	FILE *f=fopen(fn,"rb");
-	if (!f)
+	sprintf(fn,"%s-%.6f",dir,dist);
+	r->f = fopen(fn,"rb");
+	if (!r->f)
+		return(-1);
+	if ((fread(r->buf,sizeof(char),kIndexMagicSize,r->f) == kIndexMagicSize) && (memcmp(r->buf,kIndexMagic,strlen(kIndexMagic)) == 0))
 	{
-		printf("LOG: ERROR Cannot open last clustering distance status file (%s)\n",fn);
+		if ((fread(&cnt,sizeof(int),1,r->f) == 1) && (cnt == rowcnt))
+			return(0);
+	}
+	else
+	{
+		r->raw = 1;
+		rewind(r->f);
+		return(0);
+	}
+	fclose(r->f);
+	r->f = NULL;
+	return(-1);
+
+} /* OpenClusterIndices */
+/* ------------------------------------------------------------------------------------ */
+
+static int GetIndexVarint(INDEXREADER *r,unsigned int *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	for (;;)
+	{
+		unsigned char c;
+
+		if (r->pos == r->len)
+		{
+			if (!r->f)
+				return(-1);
+			r->len = fread(r->buf,sizeof(char),kIndexBufSize,r->f);
+			r->pos = 0;
+			if (r->len == 0)
+				return(-1);
+		}
+		c = r->p[r->pos++];
+		*v |= (unsigned int)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return(0);
+		shift += 7;
+		if (shift > 28)
+			return(-1);
+	}
+
+} /* GetIndexVarint */
+/* ------------------------------------------------------------------------------------ */
+
+/* label of the next row */
+static int NextClusterIndex(INDEXREADER *r,unsigned int *label)
+{
+	unsigned int v;
+
+	if (r->raw)
+		return((fread(label,sizeof(int),1,r->f) == 1) ? 0 : -1);
+	if (r->left == 0)
+	{
+		if (GetIndexVarint(r,&v))
+			return(-1);
+		r->label = v >> 1;
+		r->left = 1;
+		if ((v & 1) && (GetIndexVarint(r,&r->left) || (r->left == 0)))
+			return(-1);
+	}
+	r->left--;
+	*label = r->label;
+	return(0);
+
+} /* NextClusterIndex */
+/* ------------------------------------------------------------------------------------ */
+
+static void CloseClusterIndices(INDEXREADER *r)
+{
+	if (r->f)
+		fclose(r->f);
+	r->f = NULL;
+
+} /* CloseClusterIndices */
+/* ------------------------------------------------------------------------------------ */
+
+/* save the scan state; written under a temporary name then renamed so that a kill never leaves a partial checkpoint */
+static void WriteCheckpoint(CHECKPOINT *cp,unsigned int *clusterid,char *ofn)
+{
+	char fn[kMaxFilename];
+	char tmpfn[kMaxFilename];
+	char hdr[kHeaderSize];
+	unsigned int *zeroindices = NULL;
+	unsigned int ok;
+	INDEXREADER ir;
+	FILE *f;
+
+	/* indices of the last pass still under the 0.0 name are overwritten by the next pass, keep a copy */
+	cp->hasZeroIndices = 0;
+	if (OpenClusterIndices(&ir,ofn,0.0,cp->loaded) == 0)
+	{
+		unsigned int i;
+
+		zeroindices = malloc(cp->loaded*sizeof(int));
+		if (zeroindices)
+		{
+			for (i = 0; i < cp->loaded; i++)
+				if (NextClusterIndex(&ir,&zeroindices[i]))
+					break;
+			cp->hasZeroIndices = (i == cp->loaded);
+		}
+		CloseClusterIndices(&ir);
+	}
+
+	sprintf(fn,"%s.checkpoint",ofn);
+	sprintf(tmpfn,"%s.checkpoint.tmp",ofn);
+	f = fopen(tmpfn,"wb");
+	if (!f)
+	{
+		printf("LOG: Error writing %s\n",tmpfn);
+		free(zeroindices);
+		return;
+	}
+	memset(hdr,0,kHeaderSize);
+	strcpy(hdr,"dclust checkpoint file v1.0   \n");
+	ok = (fwrite(&hdr[0],sizeof(char),kHeaderSize,f) == kHeaderSize);
+	ok &= (fwrite(cp,sizeof(CHECKPOINT),1,f) == 1);
+	ok &= (fwrite(clusterhistory,sizeof(CLUSTERHISTORY),cp->clusterhistorycnt,f) == cp->clusterhistorycnt);
+	ok &= (fwrite(clusterid,sizeof(int),cp->loaded,f) == cp->loaded);
+	if (cp->hasZeroIndices)
+		ok &= (fwrite(zeroindices,sizeof(int),cp->loaded,f) == cp->loaded);
+	if (fclose(f) != 0)
+		ok = 0;
+	free(zeroindices);
+
+	if (ok && (rename(tmpfn,fn) == 0))
+		return;
+	printf("LOG: Error writing %s\n",fn);
+	unlink(tmpfn);
+
+} /* WriteCheckpoint */
+/* ------------------------------------------------------------------------------------ */
+
+/* reload the scan state saved by WriteCheckpoint; returns 1 when the scan can go on from there */
+static unsigned int ReadCheckpoint(CHECKPOINT *cp,unsigned int *clusterid,unsigned int loaded,unsigned int colcnt,char *ofn)
+{
+	char fn[kMaxFilename];
+	char hdr[kHeaderSize];
+	unsigned int *zeroindices;
+	unsigned int ok = 0;
+	FILE *f;
+
+	sprintf(fn,"%s.checkpoint",ofn);
+	f = fopen(fn,"rb");
+	if (!f)
+		return(0);
+	if ((fread(&hdr[0],sizeof(char),kHeaderSize,f) != kHeaderSize) || (strcmp(hdr,"dclust checkpoint file v1.0   \n") != 0))
+	{
+		printf("LOG: %s is not a dclust checkpoint file\n",fn);
+		goto bail;
+	}
+	if ((fread(cp,sizeof(CHECKPOINT),1,f) != 1) || (cp->loaded != loaded) || (cp->colcnt != colcnt) || (cp->clusterhistorycnt > kMaxCluster))
+	{
+		printf("LOG: %s does not match the input file\n",fn);
+		goto bail;
+	}
+	if ((fread(clusterhistory,sizeof(CLUSTERHISTORY),cp->clusterhistorycnt,f) != cp->clusterhistorycnt) ||
+		(fread(clusterid,sizeof(int),loaded,f) != loaded))
+	{
+		printf("LOG: Error reading %s\n",fn);
+		goto bail;
+	}
+	clusterhistorycnt = cp->clusterhistorycnt;
+
+	/* the interrupted pass may have overwritten the indices still kept under the 0.0 name */
+	if (cp->hasZeroIndices)
+	{
+		zeroindices = malloc(loaded*sizeof(int));
+		if (!zeroindices || (fread(zeroindices,sizeof(int),loaded,f) != loaded))
+		{
+			printf("LOG: Error reading %s\n",fn);
+			free(zeroindices);
+			goto bail;
+		}
+		KeepClusterIndices(zeroindices,loaded,0.0,ofn);
+		free(zeroindices);
+	}
+	ok = 1;
+
+bail:
+	fclose(f);
+	if (!ok)
+	{
+		memset(clusterid,0,loaded*sizeof(int));
+		clusterhistorycnt = 0;
+	}
+	return(ok);
+
+} /* ReadCheckpoint */
+/* ------------------------------------------------------------------------------------ */
+static void *SplitWriteRows(void *arg)
+{
+	SPLITWRITE *sw = (SPLITWRITE *)arg;
+	unsigned int i;
+
+	for (i = sw->first; i < sw->last; i++)
+	{
+		unsigned int cid = sw->clusterid[i];
+
+		if ((cid > 0) && (cid <= sw->maxclusterid))
+		{
+			if (!sw->order)
+				DclustFilePutRow(&sw->aw,sw->facsname[i].condition,&sw->facs[i].data[0],cid);
+		}
+		else
+			DclustFilePutRow(&sw->uw,sw->facsname[i].condition,&sw->facs[i].data[0],0);
+	}
+	if (sw->order)
+	{
+		for (i = sw->afirst; i < sw->alast; i++)
+		{
+			unsigned int r = sw->order[i];
+			DclustFilePutRow(&sw->aw,sw->facsname[r].condition,&sw->facs[r].data[0],sw->clusterid[r]);
+		}
+	}
+	return(NULL);
+
+} /* SplitWriteRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* list the assigned rows grouped by clusterid, keeping the row order within a cluster; */
+/* firstrow[c] receives the position of the first row of cluster c, for c = 0 to maxclusterid+1 */
+static unsigned int *OrderByCluster(unsigned int *clusterid,unsigned int rowcnt,unsigned int maxclusterid,unsigned long long **firstrow)
+{
+	unsigned int *order;
+	unsigned long long *next;
+	unsigned int c,i;
+
+	order = malloc(((size_t)CountAssigned(clusterid,rowcnt,maxclusterid)+1)*sizeof(unsigned int));
+	*firstrow = calloc(maxclusterid+2,sizeof(unsigned long long));
+	next = calloc(maxclusterid+2,sizeof(unsigned long long));
+	if (!order || !*firstrow || !next)
+	{
+		free(order);
+		free(*firstrow);
+		free(next);
+		*firstrow = NULL;
+		return(NULL);
+	}
+	for (i = 0; i < rowcnt; i++)
+	{
+		if ((clusterid[i] > 0) && (clusterid[i] <= maxclusterid))
+			(*firstrow)[clusterid[i]+1]++;
+	}
+	for (c = 1; c <= maxclusterid; c++)
+		(*firstrow)[c+1] += (*firstrow)[c];
+	memcpy(next,*firstrow,(maxclusterid+2)*sizeof(unsigned long long));
+	for (i = 0; i < rowcnt; i++)
+	{
+		if ((clusterid[i] > 0) && (clusterid[i] <= maxclusterid))
+			order[next[clusterid[i]]++] = i;
+	}
+	free(next);
+	return(order);
+
+} /* OrderByCluster */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: rows, error and column statistics of the part of a file written by a slave, as sent to the master */
+static void PackWriterStats(const DCLUSTWRITER *w,unsigned int colcnt,double *p)
+{
+	p[0] = (double)w->rows;
+	p[1] = (double)w->err;
+	memcpy(&p[2],w->min,colcnt*sizeof(double));
+	memcpy(&p[2+colcnt],w->max,colcnt*sizeof(double));
+	memcpy(&p[2+2*colcnt],w->sum,colcnt*sizeof(double));
+	memcpy(&p[2+3*colcnt],w->sum2,colcnt*sizeof(double));
+
+} /* PackWriterStats */
+/* ------------------------------------------------------------------------------------ */
+
+static void UnpackWriterStats(DCLUSTWRITER *part,const DCLUSTHEADER *hdr,unsigned int colcnt,const double *p)
+{
+	memset(part,0,sizeof(DCLUSTWRITER));
+	memcpy(&part->hdr,hdr,sizeof(DCLUSTHEADER));
+	part->fd = -1;
+	part->rows = (unsigned long long)p[0];
+	part->err = (int)p[1];
+	memcpy(part->min,&p[2],colcnt*sizeof(double));
+	memcpy(part->max,&p[2+colcnt],colcnt*sizeof(double));
+	memcpy(part->sum,&p[2+2*colcnt],colcnt*sizeof(double));
+	memcpy(part->sum2,&p[2+3*colcnt],colcnt*sizeof(double));
+
+} /* UnpackWriterStats */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: the master writes the headers of both files and every slave its own rows, the unassigned ones after those of */
+/* the slaves before, and the rows of each cluster after those the slaves before have in it; the file is the same as */
+/* written from every label, as the slaves own consecutive ranges of rows */
+static unsigned int RangeWriteSplitBinFile(FACSNAME *facsname,FACSDATA *facs,unsigned int *clusterid,unsigned int colcnt,unsigned int maxclusterid,char *ofn)
+{
+	FILE *uf = NULL;
+	FILE *af = NULL;
+	char fn[kMaxFilename];
+	DCLUSTHEADER hdr;
+	DCLUSTWRITER aw;
+	DCLUSTWRITER uw;
+	DCLUSTWRITER part;
+	unsigned int len = maxclusterid+2;
+	unsigned int statlen = 2+4*colcnt;
+	unsigned long long *cnt = calloc(len,sizeof(unsigned long long));
+	unsigned long long *before = calloc(len,sizeof(unsigned long long));
+	unsigned long long *total = calloc(len,sizeof(unsigned long long));
+	unsigned long long *firstrow = calloc(len,sizeof(unsigned long long));
+	double *stats = calloc(2*statlen,sizeof(double));
+	double *allstats = NULL;
+	unsigned int assigned = 0;
+	unsigned int i,c;
+	int idproc,nproc,r;
+	int aerr = 1;
+	int uerr = 1;
+	int ok = 0;
+
+	MPI_Comm_rank(gComm,&idproc);
+	MPI_Comm_size(gComm,&nproc);
+	memset(&aw,0,sizeof(DCLUSTWRITER));
+	memset(&uw,0,sizeof(DCLUSTWRITER));
+	if (!cnt || !before || !total || !firstrow || !stats)
+	{
+		printf("LOG: ERROR: not enough memory to write the results\n");
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+
+	/* rows of each cluster, the unassigned ones under 0 */
+	for (i = ownfirst; i < ownlast; i++)
+		cnt[((clusterid[i] > 0) && (clusterid[i] <= maxclusterid)) ? clusterid[i] : 0]++;
+	MPI_Exscan(cnt, before, len, MPI_UNSIGNED_LONG_LONG, MPI_SUM, gComm);
+	MPI_Reduce(cnt, total, len, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, gComm);
+
+	if (idproc == 0)
+	{
+		for (c = 1; c <= maxclusterid; c++)
+			firstrow[c+1] = firstrow[c]+total[c];
+		assigned = (unsigned int)firstrow[maxclusterid+1];
+
+		sprintf(fn,"%s.assigned",ofn);
+		af=fopen(fn,"wb");
+		sprintf(fn,"%s.unassigned",ofn);
+		uf=fopen(fn,"wb");
+		if (af && uf)
+		{
+			DclustFileInitHeader(&hdr,kDclustAssignedFile,kDclustUShort,colcnt,headerWithCluster);
+			hdr.rowcnt = assigned;
+			hdr.maxclusterid = maxclusterid;
+			aerr = DclustFileCreate(&aw,af,&hdr,NULL);
+			DclustFileInitHeader(&hdr,kDclustUnassignedFile,kDclustUShort,colcnt,header);
+			hdr.rowcnt = total[0];
+			hdr.maxclusterid = maxclusterid;
+			uerr = DclustFileCreate(&uw,uf,&hdr,NULL);
+			ok = ((aerr == 0) && (uerr == 0));
+		}
+	}
+	MPI_Bcast(&ok, 1, MPI_INT, 0, gComm);
+
+	if (ok)
+	{
+		MPI_Bcast(&aw.hdr, sizeof(DCLUSTHEADER), MPI_CHAR, 0, gComm);
+		MPI_Bcast(&uw.hdr, sizeof(DCLUSTHEADER), MPI_CHAR, 0, gComm);
+		MPI_Bcast(firstrow, len, MPI_UNSIGNED_LONG_LONG, 0, gComm);
+		if (idproc != 0)
+		{
+			DCLUSTWRITER aacc;
+			DCLUSTWRITER uacc;
+			unsigned int *order = NULL;
+			unsigned long long *orderfirst = NULL;
+			unsigned long long k;
+
+			memset(&aacc,0,sizeof(DCLUSTWRITER));
+			memcpy(&aacc.hdr,&aw.hdr,sizeof(DCLUSTHEADER));
+			memset(&uacc,0,sizeof(DCLUSTWRITER));
+			memcpy(&uacc.hdr,&uw.hdr,sizeof(DCLUSTHEADER));
+			sprintf(fn,"%s.assigned",ofn);
+			aw.fd = open(fn,O_WRONLY);
+			sprintf(fn,"%s.unassigned",ofn);
+			uw.fd = open(fn,O_WRONLY);
+			aw.row = uw.row = NULL;
+			if ((aw.fd < 0) || (uw.fd < 0))
+				aacc.err = uacc.err = 1;
+			else
+			{
+				if (DclustFileCreatePart(&part,&uw,before[0]) == 0)
+				{
+					for (i = ownfirst; i < ownlast; i++)
+						if ((clusterid[i] == 0) || (clusterid[i] > maxclusterid))
+							DclustFilePutRow(&part,facsname[i].condition,&facs[i].data[0],0);
+				}
+				DclustFileFinishPart(&uacc,&part);
+
+				order = OrderByCluster(&clusterid[ownfirst],ownlast-ownfirst,maxclusterid,&orderfirst);
+				if (!order)
+					aacc.err = 1;
+				for (c = 1; order && (c <= maxclusterid); c++)
+				{
+					if (orderfirst[c+1] == orderfirst[c])
+						continue;
+					if (DclustFileCreatePart(&part,&aw,firstrow[c]+before[c]) == 0)
+					{
+						for (k = orderfirst[c]; k < orderfirst[c+1]; k++)
+						{
+							i = ownfirst+order[k];
+							DclustFilePutRow(&part,facsname[i].condition,&facs[i].data[0],c);
+						}
+					}
+					DclustFileFinishPart(&aacc,&part);
+				}
+				free(order);
+				free(orderfirst);
+			}
+			if (aw.fd >= 0)
+				close(aw.fd);
+			if (uw.fd >= 0)
+				close(uw.fd);
+			PackWriterStats(&aacc,colcnt,stats);
+			PackWriterStats(&uacc,colcnt,&stats[statlen]);
+		}
+		else
+		{
+			allstats = calloc((size_t)nproc*2*statlen,sizeof(double));
+			if (!allstats)
+			{
+				printf("LOG: ERROR: not enough memory to write the results\n");
+				MPI_Abort(MPI_COMM_WORLD,1);
+			}
+		}
+		MPI_Gather(stats, 2*statlen, MPI_DOUBLE, allstats, 2*statlen, MPI_DOUBLE, 0, gComm);
+		if (idproc == 0)
+		{
+			for (r = 1; r < nproc; r++)
+			{
+				UnpackWriterStats(&part,&aw.hdr,colcnt,&allstats[r*2*statlen]);
+				DclustFileFinishPart(&aw,&part);
+				UnpackWriterStats(&part,&uw.hdr,colcnt,&allstats[r*2*statlen+statlen]);
+				DclustFileFinishPart(&uw,&part);
+			}
+			DclustFileSetClusterRows(&aw,firstrow);
+		}
+	}
+	if (idproc == 0)
+	{
+		if (aerr == 0)
+			aerr = DclustFileFinish(&aw);
+		if (uerr == 0)
+			uerr = DclustFileFinish(&uw);
+		if (af)
+			fclose(af);
+		if (aerr)
+			printf("LOG: Cannot write results to %s.assigned\n",ofn);
+		if (uf)
+			fclose(uf);
+		if (uerr)
+			printf("LOG: Cannot write results to %s.unassigned\n",ofn);
+	}
+	free(cnt);
+	free(before);
+	free(total);
+	free(firstrow);
+	free(stats);
+	free(allstats);
+	return(assigned);
+
+} /* RangeWriteSplitBinFile */
+/* ------------------------------------------------------------------------------------ */
+
+/* every thread writes a range of rows; where its rows go in each file is known from the assigned counts of the previous ranges */
+/* the assigned file is written grouped by clusterid, each thread taking a range of the ordered rows */
+static unsigned int WriteSplitBinFile(FACSNAME *facsname,FACSDATA *facs,unsigned int *clusterid,unsigned int rowcnt,unsigned int colcnt,unsigned int maxclusterid,char *ofn)
+{
+	FILE *uf;
+	FILE *af;
+	char fn[kMaxFilename];
+	DCLUSTHEADER hdr;
+	DCLUSTWRITER aw;
+	DCLUSTWRITER uw;
+	SPLITWRITE *sw = NULL;
+	unsigned int *order;
+	unsigned long long *firstrow = NULL;
+	pthread_t thread[kMaxWriteThreads];
+	int started[kMaxWriteThreads];
+	unsigned int threadcnt;
+	unsigned int share,ashare;
+	unsigned int t;
+	unsigned int assigned = 0;
+	int aerr = 1;
+	int uerr = 1;
+
+		if (gLabelOps)
+		{
+			SendLabelOp(kLabelsWrite,maxclusterid,0.0,0.0);
+			return(RangeWriteSplitBinFile(facsname,facs,clusterid,colcnt,maxclusterid,ofn));
+		}
+		/* without memory for the order, the assigned rows keep the row order */
+		order = OrderByCluster(clusterid,rowcnt,maxclusterid,&firstrow);
+
+		threadcnt = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threadcnt > kMaxWriteThreads)
+			threadcnt = kMaxWriteThreads;
+		if (threadcnt > rowcnt/kMinWriteRowsPerThread)
+			threadcnt = rowcnt/kMinWriteRowsPerThread;
+		if (threadcnt < 1)
+			threadcnt = 1;
+		share = rowcnt/threadcnt + 1;
+		sw = calloc(threadcnt,sizeof(SPLITWRITE));
+		if (sw)
+		{
+			for (t = 0; t < threadcnt; t++)
+			{
+				sw[t].facsname = facsname;
+				sw[t].facs = facs;
+				sw[t].clusterid = clusterid;
+				sw[t].maxclusterid = maxclusterid;
+				sw[t].first = (t*share < rowcnt) ? t*share : rowcnt;
+				sw[t].last = (sw[t].first+share < rowcnt) ? sw[t].first+share : rowcnt;
+				sw[t].assigned = CountAssigned(&clusterid[sw[t].first],sw[t].last-sw[t].first,maxclusterid);
+				assigned += sw[t].assigned;
+			}
+			ashare = assigned/threadcnt + 1;
+			for (t = 0; t < threadcnt; t++)
+			{
+				sw[t].order = order;
+				sw[t].afirst = (t*ashare < assigned) ? t*ashare : assigned;
+				sw[t].alast = (sw[t].afirst+ashare < assigned) ? sw[t].afirst+ashare : assigned;
+			}
+		}
+		else
+		{
+			printf("LOG: Cannot Allocate Memory.\n");
+			assigned = CountAssigned(clusterid,rowcnt,maxclusterid);
+		}
+
+		sprintf(fn,"%s.assigned",ofn);
+		af=fopen(fn,"wb");
+		sprintf(fn,"%s.unassigned",ofn);
+		uf=fopen(fn,"wb");
+
+		if (af && uf && sw)
+		{
+			unsigned int assignedbefore = 0;
+			int parterr = 0;
+
+			DclustFileInitHeader(&hdr,kDclustAssignedFile,kDclustUShort,colcnt,headerWithCluster);
+			hdr.rowcnt = assigned;
+			hdr.maxclusterid = maxclusterid;
+			aerr = DclustFileCreate(&aw,af,&hdr,NULL);
+			DclustFileInitHeader(&hdr,kDclustUnassignedFile,kDclustUShort,colcnt,header);
+			hdr.rowcnt = rowcnt-assigned;
+			hdr.maxclusterid = maxclusterid;
+			uerr = DclustFileCreate(&uw,uf,&hdr,NULL);
+
+			if ((aerr == 0) && (uerr == 0))
+			{
+				for (t = 0; t < threadcnt; t++)
+				{
+					parterr |= DclustFileCreatePart(&sw[t].aw,&aw,order ? sw[t].afirst : assignedbefore);
+					parterr |= DclustFileCreatePart(&sw[t].uw,&uw,sw[t].first-assignedbefore);
+					assignedbefore += sw[t].assigned;
+				}
+				/* the first range is written by this thread, as are the ranges of threads that cannot be started */
+				if (parterr == 0)
+				{
+					for (t = 1; t < threadcnt; t++)
+						started[t] = (pthread_create(&thread[t],NULL,&SplitWriteRows,&sw[t]) == 0);
+					SplitWriteRows(&sw[0]);
+					for (t = 1; t < threadcnt; t++)
+					{
+						if (started[t])
+							pthread_join(thread[t],NULL);
+						else
+							SplitWriteRows(&sw[t]);
+					}
+				}
+				for (t = 0; t < threadcnt; t++)
+				{
+					DclustFileFinishPart(&aw,&sw[t].aw);
+					DclustFileFinishPart(&uw,&sw[t].uw);
+				}
+				if (order)
+					DclustFileSetClusterRows(&aw,firstrow);
+			}
+			if (aerr == 0)
+				aerr = DclustFileFinish(&aw);
+			if (uerr == 0)
+				uerr = DclustFileFinish(&uw);
+		}
+		free(sw);
+		free(order);
+		free(firstrow);
+		if (af)
+			fclose(af);
+		if (aerr)
+			printf("LOG: Cannot write results to %s.assigned\n",ofn);
+		if (uf)
+			fclose(uf);
+		if (uerr)
+			printf("LOG: Cannot write results to %s.unassigned\n",ofn);
+		return(assigned);
+
+} /* WriteSplitBinFile */
+/* ------------------------------------------------------------------------------------ */
+
+/* orders rows by clusterid, then by the cell of modelcell units their values fall in, then by row */
+static int CompareModelRows(const void *a,const void *b)
+{
+	unsigned int ra = *(const unsigned int *)a;
+	unsigned int rb = *(const unsigned int *)b;
+	unsigned int col;
+
+	if (modelclusterid[ra] != modelclusterid[rb])
+		return((modelclusterid[ra] < modelclusterid[rb]) ? -1 : 1);
+	for (col = 0; col < modelcolcnt; col++)
+	{
+		unsigned int ca = modelfacs[ra].data[col]/modelcell;
+		unsigned int cb = modelfacs[rb].data[col]/modelcell;
+		if (ca != cb)
+			return((ca < cb) ? -1 : 1);
+	}
+	return((ra < rb) ? -1 : (ra > rb));
+
+} /* CompareModelRows */
+/* ------------------------------------------------------------------------------------ */
+
+static int SameModelCell(unsigned int ra,unsigned int rb)
+{
+	unsigned int col;
+
+	if (modelclusterid[ra] != modelclusterid[rb])
+		return(0);
+	for (col = 0; col < modelcolcnt; col++)
+	{
+		if (modelfacs[ra].data[col]/modelcell != modelfacs[rb].data[col]/modelcell)
+			return(0);
+	}
+	return(1);
+
+} /* SameModelCell */
+/* ------------------------------------------------------------------------------------ */
+
+/* the first assigned event of each cluster falling in a cell of cell units is written to <ofn>.model, */
+/* with the distance used to assign leftover events; cell 1 only drops identical events and dclassify then */
+/* assigns new events exactly as -L does */
+static void WriteClusterModel(FACSNAME *facsname,FACSDATA *facs,unsigned int *clusterid,unsigned int rowcnt,unsigned int colcnt,unsigned int maxclusterid,float distcutoff,unsigned int cell,char *ofn)
+{
+	FILE *f = NULL;
+	char fn[kMaxFilename];
+	DCLUSTHEADER hdr;
+	DCLUSTWRITER w;
+	unsigned int *order;
+	unsigned long long *firstrow;
+	unsigned int assigned = 0;
+	unsigned int kept = 0;
+	unsigned int c,i;
+	int err = 1;
+
+		order = malloc(((size_t)CountAssigned(clusterid,rowcnt,maxclusterid)+1)*sizeof(unsigned int));
+		firstrow = calloc(maxclusterid+2,sizeof(unsigned long long));
+		if (!order || !firstrow)
+		{
+			printf("LOG: Cannot Allocate Memory.\n");
+			goto bail;
+		}
+		for (i = 0; i < rowcnt; i++)
+		{
+			if ((clusterid[i] > 0) && (clusterid[i] <= maxclusterid))
+				order[assigned++] = i;
+		}
+		modelfacs = facs;
+		modelclusterid = clusterid;
+		modelcolcnt = colcnt;
+		modelcell = cell;
+		qsort(order,assigned,sizeof(unsigned int),CompareModelRows);
+		for (i = 0; i < assigned; i++)
+		{
+			if ((kept == 0) || !SameModelCell(order[kept-1],order[i]))
+			{
+				order[kept++] = order[i];
+				firstrow[clusterid[order[i]]+1]++;
+			}
+		}
+		for (c = 1; c <= maxclusterid; c++)
+			firstrow[c+1] += firstrow[c];
+
+		sprintf(fn,"%s.model",ofn);
+		f = fopen(fn,"wb");
+		if (!f)
+			goto bail;
+		DclustFileInitHeader(&hdr,kDclustModelFile,kDclustUShort,colcnt,header);
+		hdr.rowcnt = kept;
+		hdr.maxclusterid = maxclusterid;
+		hdr.stride = colcnt*sizeof(unsigned short);
+		hdr.distcutoff = distcutoff;
+		hdr.testdist = gTestDist;
+		err = DclustFileCreate(&w,f,&hdr,NULL);
+		if (err == 0)
+		{
+			for (i = 0; i < kept; i++)
+				DclustFilePutRow(&w,facsname[order[i]].condition,&facs[order[i]].data[0],clusterid[order[i]]);
+			DclustFileSetClusterRows(&w,firstrow);
+		}
+		err |= DclustFileFinish(&w);
+		printf("LOG: %u of %u assigned events kept as the model of %u clusters at distance %.3f\n",kept,assigned,maxclusterid,distcutoff);
+
+bail:
+		if (f)
+			fclose(f);
+		if (err)
+			printf("LOG: Cannot write cluster model to %s.model\n",ofn);
+		free(order);
+		free(firstrow);
+
+} /* WriteClusterModel */
+/* ------------------------------------------------------------------------------------ */
+
+static void removeclustersnum(int id)
+{
+	int *cnp;
+	int cpu =   id / kStartLocalCluster ;
+	int cluster = id - cpu*kStartLocalCluster;
+	cnp = clustersnum[cpu];
+	cnp[cluster] = kClusterEliminated;  /* flag this specific cluster id as being removed */
+
+} /* removeclustersnum */
+/* ------------------------------------------------------------------------------------ */
+
+/* give the rows first to last the label held by the clustersnum table of the slave which numbered theirs */
+static void RelabelRows(unsigned int *clusterid,unsigned int first,unsigned int last)
+{
+	unsigned int ii;
+
+	for (ii = first; ii < last; ii++)
+	{
+		if (clusterid[ii] >= kStartLocalCluster)
+		{
+			int cpuid = (int)clusterid[ii] / kStartLocalCluster;
+			int hashidx = (int)clusterid[ii] - cpuid * kStartLocalCluster;
+
+			clusterid[ii] = clustersnum[cpuid][hashidx];
+		}
+	}
+
+} /* RelabelRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: the slaves receive the clustersnum tables of the master */
+static void BcastClusterTables(unsigned int nproc)
+{
+	unsigned int i;
+	int cnt = 0;
+	int idproc;
+
+	MPI_Comm_rank(gComm,&idproc);
+	for (i = 1; i < nproc; i++)
+	{
+		if (idproc == 0)
+			cnt = clustersnum[i][0];
+		MPI_Bcast(&cnt, 1, MPI_INT, 0, gComm);
+		if (idproc != 0)
+		{
+			int *cnp = realloc(clustersnum[i],(cnt+1)*sizeof(int));
+
+			if (!cnp)
+			{
+				printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+				MPI_Abort(MPI_COMM_WORLD,1);
+			}
+			clustersnum[i] = cnp;
+		}
+		MPI_Bcast(clustersnum[i], cnt+1, MPI_INT, 0, gComm);
+	}
+
+} /* BcastClusterTables */
+/* ------------------------------------------------------------------------------------ */
+
+/* apply the clustersnum tables to every row; with -O, the slaves apply them to their own rows */
+static void RelabelClusters(unsigned int *clusterid,unsigned int loaded,unsigned int nproc)
+{
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsRelabel,0,0.0,0.0);
+		BcastClusterTables(nproc);
+	}
+	else
+		RelabelRows(clusterid,0,loaded);
+
+} /* RelabelClusters */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: the collapsed rows of the slaves are numbered in row order, as the master numbers them from every label */
+static unsigned int RangeLabelCollapsedRows(unsigned int *clusters)
+{
+	unsigned int ii;
+	unsigned int cnt = 0;
+	unsigned int total = 0;
+	unsigned int start = 0;
+	unsigned int *cnts = NULL;
+	unsigned int *starts = NULL;
+	int idproc,nproc,r;
+
+	MPI_Comm_rank(gComm,&idproc);
+	MPI_Comm_size(gComm,&nproc);
+	for (ii = ownfirst; ii < ownlast; ii++)
+	{
+		if ((clusters[ii] == 0) && (RowWeight(ii) > 1))
+			cnt++;
+	}
+	if (idproc == 0)
+	{
+		cnts = calloc(nproc,sizeof(unsigned int));
+		starts = calloc(nproc,sizeof(unsigned int));
+		if (!cnts || !starts)
+		{
+			printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+			MPI_Abort(MPI_COMM_WORLD,1);
+		}
+	}
+	MPI_Gather(&cnt, 1, MPI_UNSIGNED, cnts, 1, MPI_UNSIGNED, 0, gComm);
+	if (idproc == 0)
+	{
+		int *cnp;
+
+		for (r = 0; r < nproc; r++)
+			total += cnts[r];
+		cnp = (total > 0) ? realloc(clustersnum[1],(clustersnum[1][0]+total+1)*sizeof(int)) : NULL;
+		if (cnp)
+		{
+			clustersnum[1] = cnp;
+			memset(&cnp[cnp[0]+1],0,total*sizeof(int));
+			start = cnp[0];
+			for (r = 0; r < nproc; r++)
+			{
+				starts[r] = start;
+				start += cnts[r];
+			}
+			cnp[0] += total;
+		}
+		else if (total > 0)
+		{
+			printf("LOG:Not enough memory to number the clusters of %u collapsed rows\n",total);
+			total = 0;
+		}
+	}
+	MPI_Bcast(&total, 1, MPI_UNSIGNED, 0, gComm);
+	if (total > 0)
+	{
+		MPI_Scatter(starts, 1, MPI_UNSIGNED, &start, 1, MPI_UNSIGNED, 0, gComm);
+		for (ii = ownfirst; ii < ownlast; ii++)
+		{
+			if ((clusters[ii] == 0) && (RowWeight(ii) > 1))
+				clusters[ii] = 1*kStartLocalCluster+(++start);
+		}
+	}
+	free(cnts);
+	free(starts);
+	return(total);
+
+} /* RangeLabelCollapsedRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* -D: a row standing for identical events that nothing linked to is a cluster of its own, as its events would */
+/* have linked to each other without the collapse; it is numbered as a new cluster of slave #1 */
+static unsigned int LabelCollapsedRows(unsigned int *clusters,unsigned int loaded)
+{
+	unsigned int ii;
+	unsigned int cnt = 0;
+	int *cnp;
+
+	if (!rowweight)
+		return(0);
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsCollapsed,0,0.0,0.0);
+		return(RangeLabelCollapsedRows(clusters));
+	}
+	for (ii = 0; ii < loaded; ii++)
+	{
+		if ((clusters[ii] == 0) && (RowWeight(ii) > 1))
+			cnt++;
+	}
+	if (cnt == 0)
+		return(0);
+	cnp = realloc(clustersnum[1],(clustersnum[1][0]+cnt+1)*sizeof(int));
+	if (!cnp)
+	{
+		printf("LOG:Not enough memory to number the clusters of %u collapsed rows\n",cnt);
+		return(0);
+	}
+	clustersnum[1] = cnp;
+	memset(&cnp[cnp[0]+1],0,cnt*sizeof(int));
+	for (ii = 0; ii < loaded; ii++)
+	{
+		if ((clusters[ii] == 0) && (RowWeight(ii) > 1))
+			clusters[ii] = 1*kStartLocalCluster+(++cnp[0]);
+	}
+	return(cnt);
+
+} /* LabelCollapsedRows */
+/* ------------------------------------------------------------------------------------ */
+static void AdjustClustersID(unsigned int *clusters, unsigned int loaded,unsigned int nproc,int verbose,int trimmedclustercnt,int *firstAvailClusterID)
+{
+	unsigned int i;
+	int j;
+	int *cnp;
+	unsigned int clusterid = 1; /* first cluster will have id=1 */
+	unsigned int tinyClustersId = trimmedclustercnt +1 ;  /* start to pile up number of clusters too small to pass the min size cutoff after "good" clusters */
+
+	/* loop over each cpu, which has attributed its own ids */
+	for (i = 1; i < nproc; i++)
+	{
+		cnp = clustersnum[i];
+		for (j = 1; j<=cnp[0]; j++)
+		{
+			if (cnp[j]==kClusterLargeEnough)
+			{
+				/* rename clusterid (attribute clusterid as a new id) */
+				if (verbose > 2)
+					printf("LOG:Renaming clusterid %u to %u\n",i*kStartLocalCluster+j,clusterid);
+				cnp[j]=clusterid++;
+			}
+			else if (cnp[j]==kClusterTooSmall)
+			{
+				cnp[j]=tinyClustersId++;
+			}
+			else
+				cnp[j] = 0;
+		}
+	}
+	RelabelClusters(clusters,loaded,nproc);
+	
+
+	*firstAvailClusterID = tinyClustersId-1;
+	
+} /* AdjustClustersID */
+/* ------------------------------------------------------------------------------------ */
+/* -O: events of every label of the clustersnum tables over the rows of every slave, known by the master; */
+/* the cnp[0]+1 counts of the table of cpu i follow those of the cpus before */
+static unsigned int *RangeClusterEvents(unsigned int *clusters,unsigned int nproc)
+{
+	int size[kMaxCPU];
+	unsigned int offset[kMaxCPU];
+	unsigned int total = 0;
+	unsigned int *cnt;
+	unsigned int *sum = NULL;
+	unsigned int i,ii;
+	int idproc;
+
+	MPI_Comm_rank(gComm,&idproc);
+	for (i = 1; i < nproc; i++)
+		size[i] = (idproc == 0) ? clustersnum[i][0] : 0;
+	MPI_Bcast(&size[1], nproc-1, MPI_INT, 0, gComm);
+	for (i = 1; i < nproc; i++)
+	{
+		offset[i] = total;
+		total += size[i]+1;
+	}
+	cnt = calloc(total,sizeof(unsigned int));
+	if (idproc == 0)
+		sum = calloc(total,sizeof(unsigned int));
+	if (!cnt || ((idproc == 0) && !sum))
+	{
+		printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	for (ii = ownfirst; ii < ownlast; ii++)
+	{
+		if (clusters[ii] >= kStartLocalCluster)
+		{
+			int idx;
+
+			i = clusters[ii] / kStartLocalCluster;
+			idx = (int)clusters[ii] - i*kStartLocalCluster;
+			if ((i < nproc) && (idx <= size[i]))
+				cnt[offset[i]+idx] += RowWeight(ii);
+		}
+	}
+	MPI_Reduce(cnt, sum, total, MPI_UNSIGNED, MPI_SUM, 0, gComm);
+	free(cnt);
+	return(sum);
+
+} /* RangeClusterEvents */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned int RemoveSmallClusters(unsigned int *clusters,unsigned int loaded,unsigned int nproc,unsigned int minevents)
+{
+	unsigned int ii;
+	int i,j;
+	int *cnp;
+	unsigned int retainedClusterCnt = 0;
+	unsigned int *events = NULL;	/* -O: counted by the slaves */
+	unsigned int offset = 0;
+
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsCount,0,0.0,0.0);
+		events = RangeClusterEvents(clusters,nproc);
+	}
+
+	/* loop over each cpu, which has attributed its own ids */
+	for (i = 1; i < nproc; i++)
+	{
+		unsigned int *cnt;
+		cnp = clustersnum[i];
+		if (events)
+			cnt = &events[offset];
+		else
+		{
+			cnt = calloc((cnp[0]+1),sizeof(unsigned int));
+
+			for(ii = 0;  ii< loaded; ii++)
+			{
+				int idx = (int)clusters[ii] - i*kStartLocalCluster;
+				if ((idx >= 0) && (idx <= cnp[0])) /* cluster belongs to proc i */
+					cnt[idx] += RowWeight(ii);
+			}
+		}
+		offset += cnp[0]+1;
+		for (j = 1; j<=cnp[0]; j++)
+		{
+			if (cnt[j] < minevents)
+			{
+				if (cnp[j] != kClusterEliminated)
+					cnp[j]=kClusterTooSmall;  /* flag this specific cluster id as being removed */
+			}
+			else
+			{
+				retainedClusterCnt++;
+			}
+		}
+		if (!events)
+			free(cnt);
+	}
+	free(events);
+	return(retainedClusterCnt);
+	
+} /* RemoveSmallClusters */
+/* ------------------------------------------------------------------------------------ */
+
+static void PrintClusterStatus(CLUSTERHISTORY *clusterhistory,unsigned int clusterhistorycnt)
+{
+	unsigned int ii;
+	for (ii = 0; ii<clusterhistorycnt; ii++)
+		printf("LOG: %4u %6.2f | %3d ^ %3d -> %3d | %c\n",clusterhistory[ii].pass,clusterhistory[ii].dist,clusterhistory[ii].cluster,clusterhistory[ii].descendfrom,clusterhistory[ii].mergedto,clusterhistory[ii].retain);
+		
+				
+} /* PrintClusterStatus */
+/* ------------------------------------------------------------------------------------ */
+
+static void DistributeUnassignedToClosestCluster(FACSDATA *facs, unsigned int *clusterid,unsigned int loaded, unsigned int colcnt,unsigned int maxclusterid,unsigned int starti,unsigned int lasti)
+{
+	unsigned int i,j,col;
+	unsigned int dmin;
+	unsigned int jmin;
+	unsigned int ambiguousFlag;
+	unsigned int ambiguousCnt = 0;
+	unsigned int reassigned = 0;
+
+	for (i = starti; i < lasti; i++)
+	{
+		if (clusterid[i] == 9999999) /* flagged for reassignment */
+		{
+			FACSDATA *facspi = &facs[i];
+			dmin = 0xffffffff;
+			jmin = i; // just to initialize something.
+			ambiguousFlag = 0;
+
+			// compute distance of unassigned (facspi) to each assigned (facspj) and record closest event of each cluster.
+			for (j = 0; j < loaded; j++)
+			{
+				if ((clusterid[j] > 0) && (clusterid[j] <= maxclusterid)) /* assigned */
+				{
+					unsigned int d = 0;
+					FACSDATA *facspj = &facs[j];
+					for (col=0;col<colcnt;col++)
+					{
+						int diff = (int)facspj->data[col] - facspi->data[col];
+						d += diff*diff;
+					}
+					// record closest distance
+					if (d < dmin)
+					{
+						dmin = d;
+						jmin = j;
+						ambiguousFlag = 0;
+					}
+					else if ((d == dmin) && (clusterid[j] != clusterid[jmin]))
+					{
+						ambiguousFlag = 1;
+					}
+				}
+			}
+			// set the id of the closest cluster (but with an offset to make sure it will not affect loop above - cluster > maxclusterid for now)
+			if (ambiguousFlag)
+			{
+				clusterid[i] = 0 + maxclusterid + 1;
+				ambiguousCnt++;
+			}
+			else
+			{
+				clusterid[i] = clusterid[jmin] + maxclusterid + 1;
+				reassigned++;
+			}
+		}
+	}
+	// adjust clusterid of reassigned sequences.
+	for (i = starti; i < lasti; i++)
+	{
+		if (clusterid[i] > maxclusterid)
+			clusterid[i] -= (maxclusterid + 1);
+	}
+
+
+} // DistributeUnassignedToClosestCluster
+
+/* ------------------------------------------------------------------------------------ */
+
+/* -U with -O: every slave in turn sends the rows it flagged, in batches; each rank looks for their closest cluster among */
+/* its own rows and the owner labels them, with the same offset as above until every slave is done */
+static void DistributeUnassignedInRanges(FACSDATA *facs,unsigned int *clusterid,unsigned int colcnt,unsigned int maxclusterid)
+{
+	unsigned int *rows = malloc(kClosestBatch*sizeof(unsigned int));
+	FACSDATA *batch = malloc(kClosestBatch*sizeof(FACSDATA));
+	CLOSEST *closest = malloc(kClosestBatch*sizeof(CLOSEST));
+	unsigned int i,next,cnt;
+	int idproc,nproc,t;
+
+	MPI_Comm_rank(gComm,&idproc);
+	MPI_Comm_size(gComm,&nproc);
+	if (!rows || !batch || !closest)
+	{
+		printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	for (t = 1; t < nproc; t++)
+	{
+		next = ownfirst;
+		do
+		{
+			cnt = 0;
+			if (idproc == t)
+			{
+				for (; (next < ownlast) && (cnt < kClosestBatch); next++)
+					if (clusterid[next] == 9999999) /* flagged for reassignment */
+						rows[cnt++] = next;
+			}
+			MPI_Bcast(&cnt, 1, MPI_INT, t, gComm);
+			if (cnt == 0)
+				break;
+			MPI_Bcast(rows, cnt, MPI_INT, t, gComm);
+			for (i = 0; i < cnt; i++)
+				batch[i] = facs[rows[i]];
+			/* a flagged row with no cluster in reach keeps its flag, as it does above */
+			ReduceClosestRows(facs,clusterid,colcnt,maxclusterid,batch,cnt,9999999,closest,t);
+			if (idproc == t)
+			{
+				for (i = 0; i < cnt; i++)
+					clusterid[rows[i]] = (closest[i].ambiguous) ? 0 + maxclusterid + 1 : closest[i].cluster + maxclusterid + 1;
+			}
+		} while (1);
+	}
+	if (idproc != 0)
+	{
+		for (i = ownfirst; i < ownlast; i++)
+		{
+			if (clusterid[i] > maxclusterid)
+				clusterid[i] -= (maxclusterid + 1);
+		}
+	}
+	free(rows);
+	free(batch);
+	free(closest);
+
+} /* DistributeUnassignedInRanges */
+/* ------------------------------------------------------------------------------------ */
+static unsigned int FlagSequencesToReassign(unsigned int *clusterid,unsigned int loaded,char *dir,float dist)
+{
+	char fn[kMaxFilename];
+	INDEXREADER ir;
+	unsigned int i;
+	unsigned int cnt = 0;
+
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsFlag,0,dist,0.0);
+		return(SumOverRanks(0));
+	}
+	sprintf(fn,"%s-%.6f",dir,dist);
+	if (OpenClusterIndices(&ir,dir,dist,loaded))
+	{
+		printf("LOG: ERROR Cannot open last clustering distance status file (%s)\n",fn);
 		return(0);
 	}
 	
 	for(i = 0;  i< loaded; i++)
 	{
-		unsigned int cl;
-		fread(&cl,sizeof(int),1,f);
-		if (cl == 0) // make sure that sequence was assigned at last step.
-			continue;
-		if (clusterid[i]==0) // need to reassign.
+		unsigned int cl;
+		if (NextClusterIndex(&ir,&cl))
+		{
+			printf("LOG: ERROR reading last clustering distance status file (%s)\n",fn);
+			break;
+		}
+		if (cl == 0) // make sure that sequence was assigned at last step.
+			continue;
+		if (clusterid[i]==0) // need to reassign.
+		{
+			clusterid[i] = 9999999;
+			cnt++;
+		}
+	}
+	CloseClusterIndices(&ir);
+	return(cnt);
+	
+} /* FlagSequencesToReassign */
+/* ------------------------------------------------------------------------------------ */
+static void UpdateClusterHistory(unsigned int pass, int clustercnt,int prevclustercnt, float dist,int verbose)
+{
+	unsigned int ii;
+	unsigned int prevcnt = clusterhistorycnt;
+	
+		if (verbose > 1)
+			printf("LOG: clusterhistorycnt = %u  (pass %u)\n",clusterhistorycnt,pass);
+		if (pass == 0)
+		{
+			for (ii = 1; ii<=clustercnt; ii++)
+			{
+				clusterhistory[clusterhistorycnt].pass = pass;
+				clusterhistory[clusterhistorycnt].dist = dist;
+				clusterhistory[clusterhistorycnt].cluster = ii;
+				clusterhistory[clusterhistorycnt].descendfrom = 0;
+				clusterhistory[clusterhistorycnt].mergedto = 0;
+				clusterhistory[clusterhistorycnt].retain = ' ';
+				clusterhistorycnt++;
+			}
+		}
+		else
+		{			
+			int parent = 1;
+			for (ii = 1; ii<=clustercnt; ii++)
+			{
+				unsigned int x;
+				
+				if (parent <= prevclustercnt)
+				{
+					for (x = 0; x<prevcnt; x++)
+					{
+						if ((clusterhistory[x].pass == (pass-1)) && (clusterhistory[x].cluster == parent))
+						{
+							if (clusterhistory[x].mergedto != 0)
+								parent++;
+						}
+					}
+					if (parent <= prevclustercnt)
+						clusterhistory[clusterhistorycnt].descendfrom = parent;
+					else
+						clusterhistory[clusterhistorycnt].descendfrom = 0;
+					parent++;
+				}
+				else
+					clusterhistory[clusterhistorycnt].descendfrom = 0;
+				clusterhistory[clusterhistorycnt].pass = pass;
+				clusterhistory[clusterhistorycnt].dist = dist;
+				clusterhistory[clusterhistorycnt].cluster = ii;
+				clusterhistory[clusterhistorycnt].mergedto = 0;
+				clusterhistory[clusterhistorycnt].retain = ' ';
+				clusterhistorycnt++;
+			}
+		}
+		
+		
+} /* UpdateClusterHistory */
+/* ------------------------------------------------------------------------------------ */
+
+static int InitAdaptiveScan(ADAPTIVESCAN *as,unsigned int loaded)
+{
+	memset(as,0,sizeof(ADAPTIVESCAN));
+	as->probesteps = 1;
+	as->clusterid = malloc((size_t)loaded*sizeof(unsigned int));
+	if (!as->clusterid)
+	{
+		printf("LOG: ERROR: not enough memory for the adaptive distance search\n");
+		return(1);
+	}
+	return(0);
+
+} /* InitAdaptiveScan */
+/* ------------------------------------------------------------------------------------ */
+
+/* remember the state a rejected distance goes back to: the labels and the history of the last pass */
+static int SaveAcceptedPass(ADAPTIVESCAN *as,unsigned int *clusterid,unsigned int loaded,unsigned int pass,int initialClusterCnt)
+{
+	unsigned int first = clusterhistorycnt;
+	CLUSTERHISTORY *history;
+
+	while ((first > 0) && (clusterhistory[first-1].pass == pass))
+		first--;
+	history = realloc(as->history,(clusterhistorycnt-first+1)*sizeof(CLUSTERHISTORY));
+	if (!history)
+	{
+		printf("LOG: ERROR: not enough memory for the adaptive distance search\n");
+		return(1);
+	}
+	as->history = history;
+	memcpy(as->history,&clusterhistory[first],(clusterhistorycnt-first)*sizeof(CLUSTERHISTORY));
+	as->historyfirst = first;
+	as->historycnt = clusterhistorycnt;
+	memcpy(as->clusterid,clusterid,(size_t)loaded*sizeof(unsigned int));
+	as->initialClusterCnt = initialClusterCnt;
+	return(0);
+
+} /* SaveAcceptedPass */
+/* ------------------------------------------------------------------------------------ */
+
+static void RestoreAcceptedPass(ADAPTIVESCAN *as,unsigned int *clusterid,unsigned int loaded,int *initialClusterCnt)
+{
+	memcpy(&clusterhistory[as->historyfirst],as->history,(as->historycnt-as->historyfirst)*sizeof(CLUSTERHISTORY));
+	clusterhistorycnt = as->historycnt;
+	memcpy(clusterid,as->clusterid,(size_t)loaded*sizeof(unsigned int));
+	*initialClusterCnt = as->initialClusterCnt;
+
+} /* RestoreAcceptedPass */
+/* ------------------------------------------------------------------------------------ */
+
+/* a step of several -s over which something changed is halved, the change lying within it */
+static int AdaptiveProbeRejected(ADAPTIVESCAN *as,int changed)
+{
+	if (!changed || (as->probesteps <= 1))
+		return(0);
+	as->rejected++;
+	as->bracketsteps = as->probesteps;
+	as->probesteps /= 2;
+	return(1);
+
+} /* AdaptiveProbeRejected */
+/* ------------------------------------------------------------------------------------ */
+
+/* steps to the next distance once one is accepted: bisect the bracket left, or double the step on a plateau */
+static void AdaptiveNextSteps(ADAPTIVESCAN *as,int changed)
+{
+	if (changed)
+	{
+		as->bracketsteps = 0;
+		as->probesteps = 1;
+	}
+	else if (as->bracketsteps > 0)
+	{
+		as->bracketsteps -= as->probesteps;
+		as->probesteps = (as->bracketsteps > 1) ? as->bracketsteps/2 : 1;
+	}
+	else
+		as->probesteps *= 2;
+
+} /* AdaptiveNextSteps */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeAdaptiveScan(ADAPTIVESCAN *as)
+{
+	free(as->clusterid);
+	free(as->history);
+	memset(as,0,sizeof(ADAPTIVESCAN));
+
+} /* FreeAdaptiveScan */
+/* ------------------------------------------------------------------------------------ */
+
+/* slaves go on with a pass at distcutoff, slave #1 numbering the new clusters after initialClusterCnt */
+/* the labels of a pass are kept as labels of slave #1 for the next one, which numbers its new clusters after them */
+static void ShiftLabels(unsigned int *clusterid,unsigned int first,unsigned int last)
+{
+	unsigned int ii;
+
+	if (gLabelOps)
+	{
+		SendLabelOp(kLabelsShift,0,0.0,0.0);
+		return;
+	}
+	for (ii = first; ii < last; ii++)
+	{
+		if (clusterid[ii] > 0)
+			clusterid[ii] += 1*kStartLocalCluster;
+	}
+
+} /* ShiftLabels */
+/* ------------------------------------------------------------------------------------ */
+
+static void SendNextDistance(float distcutoff,unsigned int colcnt,unsigned int nproc,int initialClusterCnt)
+{
+	unsigned int ii;
+
+	if (gLabelOps)
+		SendLabelOp(kLabelsEndPass,0,0.0,0.0);
+	gTestDist = (unsigned int)(distcutoff*distcutoff*colcnt);
+	for (ii = 1; ii<nproc; ii++)
+		MPI_Send(&gTestDist, 1, MPI_INT,  ii,  kRepeatWithNewDistMsg, gComm);
+	MPI_Send(&initialClusterCnt, 1, MPI_INT,  1,  kInitialClusterCntMsg, gComm); // send starting clustercount to slave node #1
+	MPI_Barrier(gComm);
+
+} /* SendNextDistance */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned int ParseSweepList(char *list,float *value)
+{
+	unsigned int cnt = 0;
+	char *end;
+
+	while (list && (*list != 0) && (cnt < kMaxSweepValues))
+	{
+		value[cnt] = strtof(list,&end);
+		if (end == list)
+			break;
+		cnt++;
+		list = (*end == ',') ? end+1 : NULL;
+	}
+	return(cnt);
+
+} /* ParseSweepList */
+/* ------------------------------------------------------------------------------------ */
+
+/* every rank reads the lists, the slaves only need the number of results */
+static void InitSweep(SWEEP *sweep,char *pctlist,char *cntlist,char *stoplist,float pct,float stop)
+{
+	memset(sweep,0,sizeof(SWEEP));
+	sweep->cutIsCount = (cntlist != NULL);
+	sweep->cutcnt = ParseSweepList(sweep->cutIsCount ? cntlist : pctlist,sweep->cut);
+	if (sweep->cutcnt == 0)
+	{
+		sweep->cut[0] = pct;
+		sweep->cutcnt = 1;
+	}
+	sweep->stopcnt = ParseSweepList(stoplist,sweep->stop);
+	if (sweep->stopcnt == 0)
+	{
+		sweep->stop[0] = stop;
+		sweep->stopcnt = 1;
+	}
+	sweep->cnt = sweep->cutcnt*sweep->stopcnt;
+	if (sweep->cnt == 1)
+		sweep->cnt = 0;
+
+} /* InitSweep */
+/* ------------------------------------------------------------------------------------ */
+
+/* the master sets up one run per combination, written to OutputFile-k<pct>-p<pct> or OutputFile-n<cnt>-p<pct> */
+static int StartSweep(SWEEP *sweep,unsigned int loaded,unsigned int events,float distcutoff,float step,float lastdistcutoff,char *ofn)
+{
+	unsigned int k;
+
+	sweep->run = calloc(sweep->cnt,sizeof(SWEEPRUN));
+	sweep->comp = malloc(((size_t)loaded+1)*sizeof(unsigned int));
+	if (!sweep->run || !sweep->comp)
+		goto bail;
+	sweep->active = sweep->cnt;
+	sweep->events = events;
+	sweep->first = distcutoff;
+	sweep->step = step;
+	sweep->direction = (lastdistcutoff < distcutoff) ? -1.0 : 1.0;
+	sweep->pass = 0;
+	for (k = 0; k < sweep->cnt; k++)
+	{
+		SWEEPRUN *r = &sweep->run[k];
+		float cut = sweep->cut[k / sweep->stopcnt];
+
+		r->stopWhenPctAssigned = sweep->stop[k % sweep->stopcnt];
+		if (sweep->cutIsCount)
+		{
+			r->cntcutoff = (unsigned int)cut;
+			r->pctEventsToKeepCluster = (float)r->cntcutoff / (float)(events)*100.0;
+			sprintf(r->ofn,"%s-n%u-p%g",ofn,r->cntcutoff,r->stopWhenPctAssigned);
+		}
+		else
+		{
+			r->pctEventsToKeepCluster = cut;
+			r->cntcutoff = (unsigned int)(((float)(events) / 100.0 * cut ) );
+			sprintf(r->ofn,"%s-k%g-p%g",ofn,cut,r->stopWhenPctAssigned);
+		}
+		r->clusterid = calloc((size_t)loaded+1,sizeof(unsigned int));
+		r->clusterhistory = malloc(kMaxCluster*sizeof(CLUSTERHISTORY));
+		if (!r->clusterid || !r->clusterhistory)
+			goto bail;
+		r->stats[0].dist = 0.0;
+		r->stats[0].rawClustersCnt = -1;
+		r->stats[0].trimmedClustersCnt = -1;
+		r->stats[0].pctAssigned = 0.0;
+		r->distcutoff = distcutoff;
+		r->distcutoffincreasestep = step;
+		r->highesttrimmedclustercnt = -1;
+		printf("LOG: %s: PctEventsToKeepCluster=%.3f (%u events), pctAssigned=%.3f\n",r->ofn,r->pctEventsToKeepCluster,r->cntcutoff,r->stopWhenPctAssigned);
+	}
+	return(0);
+
+bail:
+	printf("LOG: ERROR: not enough memory for %u combinations of -k/-n/-p\n",sweep->cnt);
+	return(1);
+
+} /* StartSweep */
+/* ------------------------------------------------------------------------------------ */
+
+/* the history and the kept labels of a run take the place of those of the scan, and back */
+static void SwapSweepRun(SWEEPRUN *r)
+{
+	CLUSTERHISTORY *history = clusterhistory;
+	unsigned int historycnt = clusterhistorycnt;
+	INDEXSNAPSHOT *snapshot = indexsnapshot;
+	unsigned int snapshotcnt = indexsnapshotcnt;
+
+	WaitClusterIndicesWriter();
+	clusterhistory = r->clusterhistory;
+	clusterhistorycnt = r->clusterhistorycnt;
+	indexsnapshot = r->indexsnapshot;
+	indexsnapshotcnt = r->indexsnapshotcnt;
+	r->clusterhistory = history;
+	r->clusterhistorycnt = historycnt;
+	r->indexsnapshot = snapshot;
+	r->indexsnapshotcnt = snapshotcnt;
+
+} /* SwapSweepRun */
+/* ------------------------------------------------------------------------------------ */
+
+static int GrowSweepScratch(SWEEP *sweep,unsigned int compcnt,unsigned int labelcnt)
+{
+	unsigned int *p;
+
+	if (compcnt > sweep->compmax)
+	{
+		p = realloc(sweep->root,(size_t)compcnt*sizeof(unsigned int));
+		if (!p)
+			return(1);
+		sweep->root = p;
+		p = realloc(sweep->size,(size_t)compcnt*sizeof(unsigned int));
+		if (!p)
+			return(1);
+		sweep->size = p;
+		p = realloc(sweep->newid,(size_t)compcnt*sizeof(unsigned int));
+		if (!p)
+			return(1);
+		sweep->newid = p;
+		sweep->compmax = compcnt;
+	}
+	if (labelcnt > sweep->labelmax)
+	{
+		p = realloc(sweep->bylabel,(size_t)labelcnt*sizeof(unsigned int));
+		if (!p)
+			return(1);
+		sweep->bylabel = p;
+		sweep->labelmax = labelcnt;
+	}
+	return(0);
+
+} /* GrowSweepScratch */
+/* ------------------------------------------------------------------------------------ */
+
+/* one pass of a run, with its own history swapped in: the clusters of the scan are numbered as a scan */
+/* would number them after its own previous distance (clusters carried over first, by their smallest label), */
+/* and trimmed, kept and tested for the end of the scan with the options of the run */
+static void SweepRunPass(SWEEP *sweep,SWEEPRUN *r,unsigned int loaded,unsigned int compcnt,int rawclustercnt,float lastdistcutoff,int goOnEvenIfClusterCntDecreases)
+{
+	unsigned int *label = r->clusterid;
+	unsigned int *comp = sweep->comp;
+	unsigned int i,c,q,id = 0;
+	int x,pass,keep;
+	int trimmedclustercnt = 0;
+	int prevclustercnt = r->stats[0].trimmedClustersCnt;
+	unsigned int isMergingPreexistingClusters = 0;
+	int done = 0;
+
+	r->stats[1].dist = r->distcutoff;
+	r->stats[1].rawClustersCnt = -1;
+	r->stats[1].trimmedClustersCnt = -1;
+	r->stats[1].pctAssigned = 0.0;
+
+	for (c = 0; c < compcnt; c++)
+	{
+		sweep->root[c] = UINT_MAX;
+		sweep->size[c] = 0;
+	}
+	for (i = 0; i < loaded; i++)
+	{
+		if (comp[i] == 0)
+			continue;
+		sweep->size[comp[i]] += RowWeight(i);
+		if (label[i] > 0)
+		{
+			sweep->bylabel[label[i]] = comp[i];
+			if (label[i] < sweep->root[comp[i]])
+				sweep->root[comp[i]] = label[i];
+		}
+	}
+
+	/* a cluster retained at the previous distance is merged into the one with the smallest label */
+	for (x = (int)clusterhistorycnt-1; (prevclustercnt > -1) && (x >= 0) && (clusterhistory[x].pass == r->passcnt-1); x--)
+	{
+		q = clusterhistory[x].cluster;
+		if ((q <= (unsigned int)prevclustercnt) && (sweep->root[sweep->bylabel[q]] != q))
+		{
+			clusterhistory[x].mergedto = sweep->root[sweep->bylabel[q]];
+			isMergingPreexistingClusters = 1;
+		}
+	}
+
+	/* retained clusters first, then those too small, each in the order of their labels */
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (q = 1; q <= r->labelcnt; q++)
+		{
+			c = sweep->bylabel[q];
+			keep = (sweep->size[c] >= r->cntcutoff);
+			if ((sweep->root[c] == q) && (keep == (pass == 0)))
+				sweep->newid[c] = ++id;
+		}
+		for (c = 1; c < compcnt; c++)
+		{
+			keep = (sweep->size[c] >= r->cntcutoff);
+			if ((sweep->size[c] > 0) && (sweep->root[c] == UINT_MAX) && (keep == (pass == 0)))
+				sweep->newid[c] = ++id;
+		}
+		if (pass == 0)
+			trimmedclustercnt = id;
+	}
+	for (i = 0; i < loaded; i++)
+		label[i] = (comp[i] > 0) ? sweep->newid[comp[i]] : 0;
+	r->labelcnt = id;
+	r->stats[1].trimmedClustersCnt = trimmedclustercnt;
+	UpdateClusterHistory(r->passcnt,trimmedclustercnt,prevclustercnt,r->distcutoff,0);
+
+	if (trimmedclustercnt > 0)
+	{
+		if (trimmedclustercnt > r->highesttrimmedclustercnt)
+		{
+			r->highesttrimmedclustercnt = trimmedclustercnt;
+			r->bestdistcutoff = r->distcutoff;
+		}
+		else if ((trimmedclustercnt == r->highesttrimmedclustercnt) && (lastdistcutoff >= r->distcutoff))
+			r->bestdistcutoff = r->distcutoff;
+		if (isMergingPreexistingClusters == 1)
+		{
+			RenameClusterIndices(0.0,r->distOfLastClusterIndices,r->ofn);
+			KeepClusterIndices(label,loaded,r->distcutoff,r->ofn);
+		}
+		else
+			KeepClusterIndices(label,loaded,0.0,r->ofn);
+		r->distOfLastClusterIndices = r->distcutoff;
+		r->stats[1].pctAssigned = 100.0*CountAssignedEvents(label,loaded,trimmedclustercnt)/sweep->events;
+	}
+	printf("LOG: %s: %d clusters retained at distance %.3f, %.1f %% events assigned\n",r->ofn,trimmedclustercnt,r->distcutoff,r->stats[1].pctAssigned);
+
+	/* the end of the scan, as without -k/-n/-p lists (see main) */
+	if (lastdistcutoff == r->distcutoff)
+		done = 1;
+	else if (lastdistcutoff < r->distcutoff)
+	{
+		if (trimmedclustercnt == 0)
+			done = 1;
+		else
+		{
+			r->distcutoff -= r->distcutoffincreasestep;
+			if (r->distcutoff < lastdistcutoff)
+				done = 1;
+			if ((goOnEvenIfClusterCntDecreases == 0) && (trimmedclustercnt < r->highesttrimmedclustercnt))
+				done = 1;
+		}
+	}
+	else
+	{
+		if (((rawclustercnt == 1) && (trimmedclustercnt >= 1) && (r->passcnt > 0)) || (r->stats[1].pctAssigned >= r->stopWhenPctAssigned))
+			done = 1;
+		else
+		{
+			if ((  (trimmedclustercnt == 1) && (r->stats[1].pctAssigned > 50.0) && ((r->stats[1].pctAssigned - r->stats[0].pctAssigned) <= 0.1) )
+			|| ((r->stats[1].pctAssigned >= 99.0) && (r->stats[1].trimmedClustersCnt == r->stats[0].trimmedClustersCnt) && ((r->stats[1].pctAssigned - r->stats[0].pctAssigned) <= 0.1)))
+				r->distcutoffincreasestep *= 2.0;
+			r->distcutoff += r->distcutoffincreasestep;
+			if ((rawclustercnt == 0) && (r->stats[0].rawClustersCnt == 0))
+				r->distcutoff += r->distcutoffincreasestep;
+			r->stats[1].rawClustersCnt = rawclustercnt;
+			if (r->distcutoff > lastdistcutoff)
+				done = 1;
+			if ((goOnEvenIfClusterCntDecreases == 0) && (trimmedclustercnt < r->highesttrimmedclustercnt))
+				done = 1;
+		}
+	}
+	if (done)
+	{
+		r->done = 1;
+		sweep->active--;
+		printf("LOG: %s: done after %u distances, a max of %d clusters at distance %.3f\n",r->ofn,r->passcnt+1,r->highesttrimmedclustercnt,r->bestdistcutoff);
+	}
+	else
+	{
+		r->stats[0] = r->stats[1];
+		r->passcnt++;
+	}
+
+} /* SweepRunPass */
+/* ------------------------------------------------------------------------------------ */
+
+/* called by the master once the merge requests of a pass at dist are processed: the runs due at */
+/* dist take it; rawclustercnt does not depend on what the runs kept */
+static void SweepPass(SWEEP *sweep,unsigned int *clusterid,unsigned int loaded,unsigned int nproc,float dist,int rawclustercnt,float lastdistcutoff,int goOnEvenIfClusterCntDecreases)
+{
+	unsigned int offset[kMaxCPU];
+	unsigned int i,k,cpu;
+	unsigned int compcnt = 1;
+	unsigned int labelcnt = 1;
+
+	/* clusters are numbered by the rank which found them: give them consecutive numbers */
+	for (i = 1; i < nproc; i++)
+	{
+		offset[i] = compcnt-1;
+		compcnt += clustersnum[i][0];
+	}
+	for (k = 0; k < sweep->cnt; k++)
+	{
+		if (sweep->run[k].labelcnt+1 > labelcnt)
+			labelcnt = sweep->run[k].labelcnt+1;
+	}
+	if (GrowSweepScratch(sweep,compcnt,labelcnt))
+	{
+		printf("LOG: ERROR: not enough memory for the combinations of -k/-n/-p; stopping them\n");
+		sweep->active = 0;
+		return;
+	}
+	for (i = 0; i < loaded; i++)
+	{
+		cpu = clusterid[i] / kStartLocalCluster;
+		sweep->comp[i] = (clusterid[i] > 0) ? offset[cpu]+clusterid[i]-cpu*kStartLocalCluster : 0;
+	}
+
+	for (k = 0; k < sweep->cnt; k++)
+	{
+		SWEEPRUN *r = &sweep->run[k];
+
+		if (r->done || ((r->distcutoff - dist)*sweep->direction > 0.5*sweep->step))
+			continue;
+		SwapSweepRun(r);
+		SweepRunPass(sweep,r,loaded,compcnt,rawclustercnt,lastdistcutoff,goOnEvenIfClusterCntDecreases);
+		SwapSweepRun(r);
+	}
+
+} /* SweepPass */
+/* ------------------------------------------------------------------------------------ */
+
+/* the master keeps the parsed lists for the next InputFile of -j */
+static void FreeSweep(SWEEP *sweep)
+{
+	unsigned int k;
+
+	for (k = 0; sweep->run && (k < sweep->cnt); k++)
+	{
+		SwapSweepRun(&sweep->run[k]);
+		FreeClusterIndices();
+		SwapSweepRun(&sweep->run[k]);
+		free(sweep->run[k].clusterid);
+		free(sweep->run[k].clusterhistory);
+	}
+	free(sweep->run);
+	free(sweep->comp);
+	free(sweep->root);
+	free(sweep->size);
+	free(sweep->newid);
+	free(sweep->bylabel);
+	sweep->run = NULL;
+	sweep->comp = NULL;
+	sweep->root = NULL;
+	sweep->size = NULL;
+	sweep->newid = NULL;
+	sweep->bylabel = NULL;
+	sweep->compmax = 0;
+	sweep->labelmax = 0;
+
+} /* FreeSweep */
+/* ------------------------------------------------------------------------------------ */
+
+static int InitSubScan(SUBSCAN *sub,unsigned int depth,unsigned int rowcnt,int idproc)
+{
+	unsigned int i;
+
+	memset(sub,0,sizeof(SUBSCAN));
+	sub->depth = depth;
+	sub->rowcnt = rowcnt;
+	sub->cur.cnt = rowcnt;
+	sub->topweight = rowweight;
+	if ((depth == 0) || (idproc != 0))
+		return(0);
+	sub->row = malloc(((size_t)rowcnt+1)*sizeof(unsigned int));
+	sub->label = calloc((size_t)rowcnt*(depth+1)+1,sizeof(unsigned int));
+	sub->stack = malloc(((size_t)rowcnt+1)*sizeof(SUBSET));
+	if (!sub->row || !sub->label || !sub->stack)
+	{
+		printf("LOG: ERROR: not enough memory to cluster the clusters again\n");
+		return(1);
+	}
+	for (i = 0; i < rowcnt; i++)
+		sub->row[i] = i;
+	return(0);
+
+} /* InitSubScan */
+/* ------------------------------------------------------------------------------------ */
+
+/* keep the labels of the subset just clustered and, above depth, queue its clusters in order */
+static void PushSubsets(SUBSCAN *sub,unsigned int *clusterid)
+{
+	SUBSET *cur = &sub->cur;
+	unsigned int *row = &sub->row[cur->first];
+	unsigned int *sorted = NULL;
+	unsigned int *first = NULL;
+	unsigned int maxlabel = 0;
+	unsigned int c,i;
+
+	for (i = 0; i < cur->cnt; i++)
+	{
+		sub->label[(size_t)row[i]*(sub->depth+1)+cur->level] = clusterid[i];
+		if (clusterid[i] > maxlabel)
+			maxlabel = clusterid[i];
+	}
+	if ((cur->level == sub->depth) || (maxlabel == 0))
+		return;
+
+	sorted = malloc(((size_t)cur->cnt+1)*sizeof(unsigned int));
+	first = calloc(maxlabel+2,sizeof(unsigned int));
+	if (!sorted || !first)
+	{
+		printf("LOG: ERROR: not enough memory to cluster the clusters of level %u again\n",cur->level);
+		free(sorted);
+		free(first);
+		return;
+	}
+	for (i = 0; i < cur->cnt; i++)
+		first[clusterid[i]+1]++;
+	for (c = 1; c <= maxlabel; c++)
+		first[c+1] += first[c];
+	for (i = 0; i < cur->cnt; i++)
+		sorted[first[clusterid[i]]++] = row[i];
+	memcpy(row,sorted,cur->cnt*sizeof(unsigned int));
+	/* first[c] is now the end of cluster c; the unassigned rows (0) come first */
+	for (c = maxlabel; c >= 1; c--)
+	{
+		SUBSET *s = &sub->stack[sub->stackcnt++];
+		s->level = cur->level+1;
+		s->first = cur->first+first[c-1];
+		s->cnt = first[c]-first[c-1];
+	}
+	free(sorted);
+	free(first);
+
+} /* PushSubsets */
+/* ------------------------------------------------------------------------------------ */
+
+/* collective: the master sends the next subset to cluster, and every rank copies its rows from facs; */
+/* returns 0 once every subset down to depth has been clustered */
+static int NextSubset(SUBSCAN *sub,FACSDATA *facs,unsigned int *clusterid,int idproc,unsigned int *events)
+{
+	unsigned int *row = NULL;
+	unsigned int i;
+
+	if (sub->depth == 0)
+		return(0);
+	if (idproc == 0)
+	{
+		PushSubsets(sub,clusterid);
+		if (sub->stackcnt > 0)
+			sub->cur = sub->stack[--sub->stackcnt];
+		else
+			sub->cur.cnt = 0;
+	}
+	MPI_Bcast(&sub->cur, 3, MPI_INT, 0, gComm);
+	if (sub->cur.cnt == 0)
+		return(0);
+
+	if (idproc == 0)
+		row = &sub->row[sub->cur.first];
+	else
+		row = malloc(sub->cur.cnt*sizeof(unsigned int));
+	free(sub->facs);
+	sub->facs = malloc(sub->cur.cnt*sizeof(FACSDATA));
+	if (!row || !sub->facs)
+	{
+		printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+	MPI_Bcast(row, sub->cur.cnt, MPI_INT, 0, gComm);
+	for (i = 0; i < sub->cur.cnt; i++)
+		memcpy(&sub->facs[i],&facs[row[i]],sizeof(FACSDATA));
+	memset(clusterid,0,sub->cur.cnt*sizeof(unsigned int));
+
+	*events = sub->cur.cnt;
+	if (idproc == 0)
+	{
+		unsigned int level;
+
+		if (sub->topweight)
+		{
+			free(sub->weight);
+			sub->weight = malloc(sub->cur.cnt*sizeof(unsigned int));
+			if (!sub->weight)
+			{
+				printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+				MPI_Abort(MPI_COMM_WORLD,1);
+			}
+			*events = 0;
+			for (i = 0; i < sub->cur.cnt; i++)
+			{
+				sub->weight[i] = sub->topweight[row[i]];
+				*events += sub->weight[i];
+			}
+			rowweight = sub->weight;
+		}
+		printf("LOG:**************************************************************\n");
+		printf("LOG:Clustering again the %u rows of cluster ",sub->cur.cnt);
+		for (level = 0; level < sub->cur.level; level++)
+			printf("%s%u",(level > 0) ? "." : "",sub->label[(size_t)row[0]*(sub->depth+1)+level]);
+		printf(" (level %u of %u)\n",sub->cur.level,sub->depth);
+	}
+	else
+		free(row);
+	return(1);
+
+} /* NextSubset */
+/* ------------------------------------------------------------------------------------ */
+
+/* rowid and the cluster of every level of each row of the InputFile, 0 where a row was not assigned */
+static void WriteSubclusters(SUBSCAN *sub,FACSNAME *facsname,char *ofn)
+{
+	char fn[kMaxFilename];
+	char *p;
+	FILE *f;
+	unsigned int i,level;
+
+	sprintf(fn,"%s.subclusters",ofn);
+	f = fopen(fn,"w");
+	if (!f)
+	{
+		printf("LOG: Cannot write results to %s\n",fn);
+		return;
+	}
+	p = strchr(header,',');
+	fprintf(f,"%.*s,cluster",p ? (int)(p-header) : (int)strlen(header),header);
+	for (level = 1; level <= sub->depth; level++)
+		fprintf(f,",subcluster%u",level);
+	fprintf(f,"\n");
+	for (i = 0; i < sub->rowcnt; i++)
+	{
+		unsigned int *label = &sub->label[(size_t)i*(sub->depth+1)];
+
+		fprintf(f,"%u",facsname[i].condition);
+		for (level = 0; level <= sub->depth; level++)
+			fprintf(f,",%u",label[level]);
+		fprintf(f,"\n");
+	}
+	if (fclose(f))
+		printf("LOG: Cannot write results to %s\n",fn);
+
+} /* WriteSubclusters */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeSubScan(SUBSCAN *sub)
+{
+	free(sub->row);
+	free(sub->label);
+	free(sub->stack);
+	free(sub->facs);
+	free(sub->weight);
+	free(sub->topweight);
+	rowweight = NULL;
+	rowweightfirst = 0;
+	memset(sub,0,sizeof(SUBSCAN));
+
+} /* FreeSubScan */
+/* ------------------------------------------------------------------------------------ */
+
+/* one "InputFile [OutputFile]" per line; lines starting with # are skipped */
+static int ReadBatchFile(BATCH *batch,char *fn)
+{
+	char line[kMaxLineBuf];
+	FILE *f;
+
+	f = fopen(fn,"r");
+	if (!f)
+	{
+		printf("LOG:Cannot Open JobFile %s\n",fn);
+		return(1);
+	}
+	while (fgets(line,kMaxLineBuf,f))
+	{
+		BATCHJOB *job;
+		DCLUSTFILE df;
+		char ifn[kMaxFilename];
+		char ofn[kMaxFilename];
+		int n;
+
+		n = sscanf(line,"%1023s %1023s",ifn,ofn);
+		if ((n < 1) || (ifn[0] == '#'))
+			continue;
+		job = realloc(batch->job,(batch->jobcnt+1)*sizeof(BATCHJOB));
+		if (!job)
+		{
+			printf("LOG: ERROR: not enough memory\n");
+			fclose(f);
+			return(1);
+		}
+		batch->job = job;
+		job = &batch->job[batch->jobcnt++];
+		memset(job,0,sizeof(BATCHJOB));
+		strcpy(job->fn,ifn);
+		strcpy(job->ofn,(n > 1) ? ofn : ifn);
+		job->group = -1;
+		if (DclustFileOpen(&df,job->fn,kDclustSelectedFile,1) == 0)
+		{
+			if (df.hdr.rowcnt <= UINT_MAX)
+				job->rowcnt = (unsigned int)df.hdr.rowcnt;
+			DclustFileClose(&df);
+		}
+		if (job->rowcnt == 0)
+			printf("LOG:Skipping %s (cannot be read or has no rows)\n",job->fn);
+	}
+	fclose(f);
+	return(0);
+
+} /* ReadBatchFile */
+/* ------------------------------------------------------------------------------------ */
+
+/* the largest files go first to the group with the fewest rows, then every group gets a master and */
+/* a slave, and each rank left goes to the group with the most rows per slave */
+static void PlanBatch(BATCH *batch,int nproc,int *groupsize)
+{
+	double load[kMaxCPU];
+	unsigned int *order;
+	unsigned int i,j;
+	unsigned int readable = 0;
+	int g,best;
+
+	memset(load,0,sizeof(load));
+	/* unreadable or empty InputFiles get no group, which would leave its ranks idle */
+	for (i = 0; i < batch->jobcnt; i++)
+		readable += (batch->job[i].rowcnt > 0);
+	batch->groupcnt = (nproc >= 4) ? nproc/2 : 1;
+	if (batch->groupcnt > (int)readable)
+		batch->groupcnt = (readable > 0) ? readable : 1;
+	order = malloc((batch->jobcnt+1)*sizeof(unsigned int));
+	if (!order)
+		batch->groupcnt = 1;
+	for (i = 0; order && (i < batch->jobcnt); i++)
+		order[i] = i;
+	for (i = 1; order && (i < batch->jobcnt); i++)
+	{
+		unsigned int o = order[i];
+		for (j = i; (j > 0) && (batch->job[order[j-1]].rowcnt < batch->job[o].rowcnt); j--)
+			order[j] = order[j-1];
+		order[j] = o;
+	}
+	for (i = 0; i < batch->jobcnt; i++)
+	{
+		BATCHJOB *job = &batch->job[order ? order[i] : i];
+
+		if (job->rowcnt == 0)
+			continue;
+		best = 0;
+		for (g = 1; g < batch->groupcnt; g++)
+			if (load[g] < load[best])
+				best = g;
+		job->group = best;
+		load[best] += job->rowcnt;
+	}
+	free(order);
+
+	for (g = 0; g < batch->groupcnt; g++)
+		groupsize[g] = (batch->groupcnt > 1) ? 2 : nproc;
+	for (i = 2*batch->groupcnt; (batch->groupcnt > 1) && (i < (unsigned int)nproc); i++)
+	{
+		best = 0;
+		for (g = 1; g < batch->groupcnt; g++)
+			if (load[g]/(groupsize[g]-1) > load[best]/(groupsize[best]-1))
+				best = g;
+		groupsize[best]++;
+	}
+
+} /* PlanBatch */
+/* ------------------------------------------------------------------------------------ */
+
+/* collective on every rank: the JobFile read by rank 0 is planned and sent to all, and gComm */
+/* becomes the group of ranks this rank belongs to */
+static int InitBatch(BATCH *batch,char *fn,int idproc,int nproc)
+{
+	int groupsize[kMaxCPU];
+	unsigned int i,clustered = 0;
+	int g,first,err = 0;
+
+	memset(batch,0,sizeof(BATCH));
+	batch->savedstdout = -1;
+	if (idproc == 0)
+	{
+		err = ReadBatchFile(batch,fn);
+		if (err == 0)
+		{
+			PlanBatch(batch,nproc,groupsize);
+			for (i = 0; i < batch->jobcnt; i++)
+				clustered += (batch->job[i].group >= 0);
+			printf("LOG:%u InputFiles clustered by %d groups of ranks\n",clustered,batch->groupcnt);
+			for (i = 0; i < batch->jobcnt; i++)
+			{
+				if (batch->job[i].group >= 0)
+					printf("LOG:  %s: %u rows, group %d of %d ranks\n",batch->job[i].fn,batch->job[i].rowcnt,batch->job[i].group,groupsize[batch->job[i].group]);
+			}
+			fflush(stdout);
+		}
+	}
+	MPI_Bcast(&err, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (err)
+		return(1);
+	MPI_Bcast(&batch->jobcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(&batch->groupcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	MPI_Bcast(groupsize, batch->groupcnt, MPI_INT, 0, MPI_COMM_WORLD);
+	if (idproc != 0)
+	{
+		batch->job = malloc((batch->jobcnt+1)*sizeof(BATCHJOB));
+		if (!batch->job)
 		{
-			clusterid[i] = 9999999;
-			cnt++;
+			printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+			MPI_Abort(MPI_COMM_WORLD,1);
 		}
 	}
-	fclose(f);
-	return(cnt);
-	
-} /* FlagSequencesToReassign */
+	MPI_Bcast(batch->job, batch->jobcnt*sizeof(BATCHJOB), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	/* groups take consecutive ranks */
+	for (g = 0, first = 0; (g < batch->groupcnt-1) && (idproc >= first+groupsize[g]); g++)
+		first += groupsize[g];
+	batch->group = g;
+	MPI_Comm_split(MPI_COMM_WORLD,batch->group,idproc,&gComm);
+	return(0);
+
+} /* InitBatch */
 /* ------------------------------------------------------------------------------------ */
-static void UpdateClusterHistory(unsigned int pass, int clustercnt,int prevclustercnt, float dist,int verbose)
+
+/* the next InputFile of the group of this rank; its master logs to OutputFile.dclust */
+static int NextBatchJob(BATCH *batch,char *fn,char *ofn,int idproc)
 {
-	unsigned int ii;
-	unsigned int prevcnt = clusterhistorycnt;
-	
-		if (verbose > 1)
-			printf("LOG: clusterhistorycnt = %u  (pass %u)\n",clusterhistorycnt,pass);
-		if (pass == 0)
+	char lfn[kMaxFilename+8];
+	int fd;
+
+	while ((batch->next < batch->jobcnt) && (batch->job[batch->next].group != batch->group))
+		batch->next++;
+	if (batch->next == batch->jobcnt)
+		return(0);
+	strcpy(fn,batch->job[batch->next].fn);
+	strcpy(ofn,batch->job[batch->next].ofn);
+	batch->next++;
+
+	if (idproc == 0)
+	{
+		fflush(stdout);
+		if (batch->savedstdout < 0)
+			batch->savedstdout = dup(STDOUT_FILENO);
+		sprintf(lfn,"%s.dclust",ofn);
+		fd = open(lfn,O_WRONLY | O_CREAT | O_TRUNC,0644);
+		if (fd >= 0)
 		{
-			for (ii = 1; ii<=clustercnt; ii++)
-			{
-				clusterhistory[clusterhistorycnt].pass = pass;
-				clusterhistory[clusterhistorycnt].dist = dist;
-				clusterhistory[clusterhistorycnt].cluster = ii;
-				clusterhistory[clusterhistorycnt].descendfrom = 0;
-				clusterhistory[clusterhistorycnt].mergedto = 0;
-				clusterhistory[clusterhistorycnt].retain = ' ';
-				clusterhistorycnt++;
-			}
+			dup2(fd,STDOUT_FILENO);
+			close(fd);
 		}
 		else
-		{			
-			int parent = 1;
-			for (ii = 1; ii<=clustercnt; ii++)
-			{
-				unsigned int x;
-				
-				if (parent <= prevclustercnt)
-				{
-					for (x = 0; x<prevcnt; x++)
-					{
-						if ((clusterhistory[x].pass == (pass-1)) && (clusterhistory[x].cluster == parent))
-						{
-							if (clusterhistory[x].mergedto != 0)
-								parent++;
-						}
-					}
-					if (parent <= prevclustercnt)
-						clusterhistory[clusterhistorycnt].descendfrom = parent;
-					else
-						clusterhistory[clusterhistorycnt].descendfrom = 0;
-					parent++;
-				}
-				else
-					clusterhistory[clusterhistorycnt].descendfrom = 0;
-				clusterhistory[clusterhistorycnt].pass = pass;
-				clusterhistory[clusterhistorycnt].dist = dist;
-				clusterhistory[clusterhistorycnt].cluster = ii;
-				clusterhistory[clusterhistorycnt].mergedto = 0;
-				clusterhistory[clusterhistorycnt].retain = ' ';
-				clusterhistorycnt++;
-			}
-		}
-		
-		
-} /* UpdateClusterHistory */
+			printf("LOG:Cannot Create %s; logging here\n",lfn);
+	}
+	return(1);
+
+} /* NextBatchJob */
+/* ------------------------------------------------------------------------------------ */
+
+static void EndBatchJob(BATCH *batch)
+{
+	fflush(stdout);
+	if (batch->savedstdout >= 0)
+		dup2(batch->savedstdout,STDOUT_FILENO);
+
+} /* EndBatchJob */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeBatch(BATCH *batch)
+{
+	if (batch->savedstdout >= 0)
+		close(batch->savedstdout);
+	free(batch->job);
+	if (gComm != MPI_COMM_WORLD)
+		MPI_Comm_free(&gComm);
+	memset(batch,0,sizeof(BATCH));
+
+} /* FreeBatch */
 /* ------------------------------------------------------------------------------------ */
 static char CheckClusterNotYetRetained(int from,int cluster)
 {
@@ -1372,8 +4078,58 @@ static char CheckClusterNotYetRetained(int from,int cluster)
 } /* CheckClusterNotYetRetained */
 /* ------------------------------------------------------------------------------------ */
 
+/* -O: the slaves label their own rows from the kept labels of the n retained clusters, the master reports their events */
+static void RangeSelectClusters(unsigned int *clusterid,char *dir,unsigned int n,float *dist,int *cluster)
+{
+	INDEXREADER ir;
+	unsigned int i,ii;
+	int idproc;
+
+	MPI_Comm_rank(gComm,&idproc);
+	MPI_Bcast(dist, n, MPI_FLOAT, 0, gComm);
+	MPI_Bcast(cluster, n, MPI_INT, 0, gComm);
+	if (idproc != 0)
+		memset(&clusterid[ownfirst],0,(ownlast-ownfirst)*sizeof(unsigned int));
+	for (ii = 0; ii < n; ii++)
+	{
+		char fn[kMaxFilename];
+		unsigned int evtcnt = 0;
+
+		sprintf(fn,"%s-%.6f",dir,dist[ii]);
+		if (idproc != 0)
+		{
+			if (OpenClusterIndices(&ir,dir,dist[ii],ownlast-ownfirst) == 0)
+			{
+				for (i = ownfirst; i < ownlast; i++)
+				{
+					unsigned int cl;
+					if (NextClusterIndex(&ir,&cl))
+					{
+						printf("LOG: Error reading %s\n",fn);
+						break;
+					}
+					if (cl == cluster[ii])
+					{
+						clusterid[i] = ii+1;
+						evtcnt += RowWeight(i);
+					}
+				}
+				CloseClusterIndices(&ir);
+			}
+			else
+				printf("LOG: Error reading %s\n",fn);
+		}
+		evtcnt = SumOverRanks(evtcnt);
+		if (idproc == 0)
+			printf("LOG: Cluster %5d: %10u events\n",ii+1,evtcnt);
+	}
+
+} /* RangeSelectClusters */
+/* ------------------------------------------------------------------------------------ */
+
 static int SelectClusterHistory(unsigned int rowcnt, unsigned int *clusterid,char *dir,int verbose)
 {
+	INDEXREADER ir;
 	unsigned int ii;
 	int x;
 	int cnt = 1;
@@ -1412,32 +4168,61 @@ static int SelectClusterHistory(unsigned int rowcnt, unsigned int *clusterid,cha
 	
 	
 	printf("LOG:**************************************************************\n");
+	if (gLabelOps)
+	{
+		float *dist = malloc((clusterhistorycnt+1)*sizeof(float));
+		int *cluster = malloc((clusterhistorycnt+1)*sizeof(int));
+		unsigned int n = 0;
+
+		if (!dist || !cluster)
+		{
+			printf("LOG:CPU 0 Error:Cannot Allocate Memory.\n");
+			MPI_Abort(MPI_COMM_WORLD,1);
+		}
+		for (ii = 0; ii<clusterhistorycnt; ii++)
+		{
+			if (clusterhistory[ii].retain == 'y')
+			{
+				if (verbose > 1)
+					printf("%s-%.6f.%d\n",dir,clusterhistory[ii].dist,clusterhistory[ii].cluster);
+				dist[n] = clusterhistory[ii].dist;
+				cluster[n++] = clusterhistory[ii].cluster;
+			}
+		}
+		SendLabelOp(kLabelsSelect,n,0.0,0.0);
+		RangeSelectClusters(clusterid,dir,n,dist,cluster);
+		free(dist);
+		free(cluster);
+		return(n);
+	}
 	for (ii = 0; ii<clusterhistorycnt; ii++)
 	{
 		if (clusterhistory[ii].retain == 'y')
 		{
 			char fn[kMaxFilename];
-			FILE *f = NULL;
 			unsigned int evtcnt = 0;
 			
 			sprintf(fn,"%s-%.6f",dir,clusterhistory[ii].dist);
-			f=fopen(fn,"rb");
 			if (verbose > 1)
 				printf("%s.%d\n",fn,clusterhistory[ii].cluster);
-			if (f)
+			if (OpenClusterIndices(&ir,dir,clusterhistory[ii].dist,rowcnt) == 0)
 			{
 				unsigned int i;
 				for(i = 0;  i< rowcnt; i++)
 				{
 					unsigned int cl;
-					fread(&cl,sizeof(int),1,f);
+					if (NextClusterIndex(&ir,&cl))
+					{
+						printf("LOG: Error reading %s\n",fn);
+						break;
+					}
 					if (cl == clusterhistory[ii].cluster)
 					{
 						clusterid[i] = cnt;
-						evtcnt++;
+						evtcnt += RowWeight(i);
 					}
 				} 
-				fclose(f);
+				CloseClusterIndices(&ir);
 			}
 			else
 				printf("LOG: Error reading %s\n",fn);
@@ -1501,17 +4286,7 @@ static unsigned int ProcessMergeRequests(unsigned int *clusterid,unsigned int lo
 		}
 	}
 	// update clusterids
-	for(ii = 0;  ii< loaded; ii++)
-	{
-		if (clusterid[ii] > 0)
-		{
-			int cpuid = (int)clusterid[ii] / kStartLocalCluster;
-			int hashidx = (int)clusterid[ii] - cpuid * kStartLocalCluster;
-			int *cnp = clustersnum[cpuid];
-			
-			clusterid[ii] = cnp[hashidx];
-		}
-	}
+	RelabelClusters(clusterid,loaded,nproc);
 
 	// get back to calloc state
 	for (i = 1; i < nproc; i++)
@@ -1663,6 +4438,8 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 	unsigned int starti,startj;
 	unsigned int lasti,lastj;
 	unsigned  int actualstartj;
+	unsigned int keyreach = KeyReach(gTestDist);
+	unsigned int keylimit;
 	
 	starti = chunk->ii;
 	startj = chunk->jj;
@@ -1678,12 +4455,17 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 			actualstartj = startj;
 		facspj = &facs[actualstartj];
 		clusterpj = &clusterid[actualstartj];
+		keylimit = facspi->data[sortkey] + keyreach;
 		for(j = actualstartj;  j< lastj; j++)
 		{
 			FACSBLOCK32DATA  *facspi32 = (FACSBLOCK32DATA*)facspi;
 			FACSBLOCK32DATA  *facspj32 = (FACSBLOCK32DATA*)facspj;
 			unsigned int b = kBLOCK32CNT;
 			unsigned int dsum = 0;
+
+			/* rows are sorted on the key: no further row of this block can be close enough */
+			if (facspj->data[sortkey] > keylimit)
+				break;
 			while(b-- > 0)  /* do 32 dimensions blocks */
 			{ 
 				int diff;
@@ -1803,8 +4585,10 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 				{
 					if (*clusterpj == 0)   /* i=not yes assigned, j=not yet assigned */
 					{
+						pthread_mutex_lock(&clustercntmutex);
 						*clusterpi = ++clustercnt;
 						*clusterpj = clustercnt;
+						pthread_mutex_unlock(&clustercntmutex);
 					}
 					else /* i=not yes assigned, j=assigned */
 					{
@@ -1832,6 +4616,8 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 	unsigned int starti,startj;
 	unsigned int lasti,lastj;
 	unsigned  int actualstartj;
+	unsigned int keyreach = KeyReach(gTestDist);
+	unsigned int keylimit;
 
 
 	starti = chunk->ii;
@@ -1869,11 +4655,15 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 				actualstartj = startj;
 			facspj = &facs[actualstartj];
 			clusterpj = &clusterid[actualstartj];
+			keylimit = facspi->data[sortkey] + keyreach;
 			for(j = actualstartj;  j< lastj; j++)
 			{
 				int diff;
 				unsigned int d;
 
+				/* rows are sorted on the key: no further row of this block can be close enough */
+				if (facspj->data[sortkey] > keylimit)
+					break;
 				if ((*clusterpj) && (*clusterpj == *clusterpi))
 					goto straight2next;
 
@@ -2016,168 +4806,478 @@ static void computesim(FACSDATA *facs, unsigned int *clusterid, CPU *chunk)
 	
 				if (d <= gTestDist) 
 				{
-					if (*clusterpi)
-					{
-						if (*clusterpj == 0)
-						{
-							*clusterpj = *clusterpi;
-						}
-						else /* i=assigned, j=assigned */
-						{
-							unsigned int cluster1,cluster2;
-							if(*clusterpj > *clusterpi)
-							{
-								cluster1 = *clusterpi;
-								cluster2 = *clusterpj;
-							}
-							else
-							{
-								cluster1 = *clusterpj;
-								cluster2 = *clusterpi;
-							}
-							InsertMergeRequest(cluster1,cluster2);
-						}
-						
-					}
-					else
-					{
-						if (*clusterpj == 0)   /* i=not yes assigned, j=not yet assigned */
-						{
-							pthread_mutex_lock(&clustercntmutex);
-							*clusterpi = ++clustercnt;
-							*clusterpj = clustercnt;
-							pthread_mutex_unlock(&clustercntmutex);
-						}
-						else /* i=not yes assigned, j=assigned */
-						{
-							*clusterpi = *clusterpj;
-						}
-					}
+					if (*clusterpi)
+					{
+						if (*clusterpj == 0)
+						{
+							*clusterpj = *clusterpi;
+						}
+						else /* i=assigned, j=assigned */
+						{
+							unsigned int cluster1,cluster2;
+							if(*clusterpj > *clusterpi)
+							{
+								cluster1 = *clusterpi;
+								cluster2 = *clusterpj;
+							}
+							else
+							{
+								cluster1 = *clusterpj;
+								cluster2 = *clusterpi;
+							}
+							InsertMergeRequest(cluster1,cluster2);
+						}
+						
+					}
+					else
+					{
+						if (*clusterpj == 0)   /* i=not yes assigned, j=not yet assigned */
+						{
+							pthread_mutex_lock(&clustercntmutex);
+							*clusterpi = ++clustercnt;
+							*clusterpj = clustercnt;
+							pthread_mutex_unlock(&clustercntmutex);
+						}
+						else /* i=not yes assigned, j=assigned */
+						{
+							*clusterpi = *clusterpj;
+						}
+					}
+				}
+		straight2next:		
+				facspj++;
+				clusterpj++;
+			}
+			facspi++;
+			clusterpi++;
+		}
+skipthischunk: ;
+	
+} /* computesim */
+#endif
+
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: the rows of a chunk are read ahead from the mapped InputFile when it is queued, and dropped with */
+/* their labels once sent back; dropped labels read as 0, as after the reset of each pass */
+static void AdviseChunkRows(FACSDATA *facs,unsigned int *clusterid,unsigned int first,unsigned int last,int advice)
+{
+	uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t from,to;
+
+	if (!gOutOfCore || (first >= last))
+		return;
+	/* pages shared with rows of other chunks come back from the page cache: the mapping is read-only */
+	from = (uintptr_t)&facs[first] & ~(pagesize-1);
+	to = (uintptr_t)&facs[last];
+	madvise((void *)from,to-from,advice);
+	if (clusterid && (advice == MADV_DONTNEED))
+	{
+		/* only the label pages within the rows: the others may already hold labels of the next chunk */
+		from = ((uintptr_t)&clusterid[first] + pagesize-1) & ~(pagesize-1);
+		to = (uintptr_t)&clusterid[last] & ~(pagesize-1);
+		if (to > from)
+			madvise((void *)from,to-from,MADV_DONTNEED);
+	}
+
+} /* AdviseChunkRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* with -O, the labels of a slave are reserved but only take memory for the rows of its chunks */
+static unsigned int *AllocateLabels(unsigned int rowcnt,int paged)
+{
+	void *p;
+
+	if (!paged)
+		return(calloc(rowcnt,sizeof(MPI_INT)));
+	p = mmap(NULL,(size_t)rowcnt*sizeof(MPI_INT),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+	return((p == MAP_FAILED) ? NULL : (unsigned int *)p);
+
+} /* AllocateLabels */
+/* ------------------------------------------------------------------------------------ */
+
+static void ClearLabels(unsigned int *clusterid,unsigned int rowcnt,int paged)
+{
+	if (!paged || (madvise(clusterid,(size_t)rowcnt*sizeof(MPI_INT),MADV_DONTNEED) != 0))
+		memset(clusterid,0,(size_t)rowcnt*sizeof(MPI_INT));
+
+} /* ClearLabels */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: forget the labels of rows first to last, giving back the pages within them */
+static void ClearLabelRange(unsigned int *clusterid,unsigned int first,unsigned int last)
+{
+	uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t from,to;
+
+	if (first >= last)
+		return;
+	from = ((uintptr_t)&clusterid[first] + pagesize-1) & ~(pagesize-1);
+	to = (uintptr_t)&clusterid[last] & ~(pagesize-1);
+	if ((to <= from) || (madvise((void *)from,to-from,MADV_DONTNEED) != 0))
+	{
+		memset(&clusterid[first],0,(size_t)(last-first)*sizeof(MPI_INT));
+		return;
+	}
+	memset(&clusterid[first],0,from-(uintptr_t)&clusterid[first]);
+	memset((void *)to,0,(uintptr_t)&clusterid[last]-to);
+
+} /* ClearLabelRange */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeLabels(unsigned int *clusterid,unsigned int rowcnt,int paged)
+{
+	if (!clusterid)
+		return;
+	if (paged)
+		munmap(clusterid,(size_t)rowcnt*sizeof(MPI_INT));
+	else
+		free(clusterid);
+
+} /* FreeLabels */
+/* ------------------------------------------------------------------------------------ */
+
+/* -H: the labels of private rows do not travel with the chunks, only between the slaves at the start and at the end of a pass */
+static int PrivateRows(unsigned int privfirst,unsigned int privlast,unsigned int first,unsigned int last)
+{
+	return(gHalo && (first >= privfirst) && (last <= privlast) && (first < last));
+
+} /* PrivateRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* post the receives of the clusterid slices of the next chunk, as soon as its assignment is known */
+static void PostNextChunkReceives(PREFETCH *pf,unsigned int *clusterid)
+{
+	pf->req[1] = MPI_REQUEST_NULL;
+	pf->req[2] = MPI_REQUEST_NULL;
+	if (pf->next.ii != kNoMoreBlocks)
+	{
+		if (!PrivateRows(pf->privfirst,pf->privlast,pf->next.ii,pf->next.iilast))
+			MPI_Irecv(&clusterid[pf->next.ii],(pf->next.iilast-pf->next.ii), MPI_INT,  0, kClusterMsg1, gComm, &pf->req[1]);
+		if ((pf->next.jj != pf->next.ii) && !PrivateRows(pf->privfirst,pf->privlast,pf->next.jj,pf->next.jjlast))
+			MPI_Irecv(&clusterid[pf->next.jj],(pf->next.jjlast-pf->next.jj), MPI_INT,  0, kClusterMsg2, gComm, &pf->req[2]);
+		AdviseChunkRows(pf->facs,NULL,pf->next.ii,pf->next.iilast,MADV_WILLNEED);
+		if (pf->next.jj != pf->next.ii)
+			AdviseChunkRows(pf->facs,NULL,pf->next.jj,pf->next.jjlast,MADV_WILLNEED);
+	}
+	pf->slicesposted = 1;
+
+} /* PostNextChunkReceives */
+/* ------------------------------------------------------------------------------------ */
+
+/* called between computation steps to let the transfer of the next chunk progress */
+static void ProgressPrefetch(PREFETCH *pf,unsigned int *clusterid)
+{
+	int flag;
+
+	if (!pf)
+		return;
+	if (pf->slicesposted)
+	{
+		MPI_Testall(2,&pf->req[1],&flag,MPI_STATUSES_IGNORE);
+		return;
+	}
+	MPI_Test(&pf->req[0],&flag,MPI_STATUS_IGNORE);
+	if (flag)
+		PostNextChunkReceives(pf,clusterid);
+
+} /* ProgressPrefetch */
+/* ------------------------------------------------------------------------------------ */
+
+static void ComputeChunk(FACSDATA *facsdata,unsigned int *clusterid,CPU *cpudata,PREFETCH *pf)
+{
+	if ((cpudata->jj != cpudata->ii))
+	{
+		pthread_t thread;
+		EXECUTIONPLAN ep;
+		CPU			cpudatasection;
+		unsigned int tmpl;
+		unsigned int where;
+
+		ep.facsdata = facsdata;
+		ep.clusterid = clusterid;
+		
+		// block 1 against 1
+		ep.chunk.ii = ep.chunk.iilast = cpudata->ii;
+		ep.chunk.iilast += ((cpudata->iilast - cpudata->ii) >> 1);
+		ep.chunk.jj = ep.chunk.jjlast = cpudata->jj;
+		ep.chunk.jjlast += ((cpudata->jjlast - cpudata->jj) >> 1);
+
+		thread_mergerequestcnt = 0;
+		thread_mergerequest[0].cluster2 = UINT_MAX;  /* to avoid need for initial test thread_mergerequestcnt == 0 in thread_InsertMergeRequest */
+		if (pthread_create (&thread, NULL, &computesim_funcion, &ep)) 
+			printf("Error: Failed creating thread\n");
+
+		// block 2 against 2
+		cpudatasection.ii = cpudata->ii + ((cpudata->iilast - cpudata->ii) >> 1) ;
+		cpudatasection.iilast = cpudata->iilast;
+		cpudatasection.jj = cpudata->jj + ((cpudata->jjlast - cpudata->jj) >> 1) ;
+		cpudatasection.jjlast = cpudata->jjlast;
+		computesim(facsdata,clusterid,&cpudatasection);
+
+		if (pthread_join (thread, NULL))
+			printf("Error: Failed pthread_join\n");
+		ProgressPrefetch(pf,clusterid);
+		where = 0;
+		for (tmpl = 0; tmpl < thread_mergerequestcnt; tmpl++)
+		{
+			InsertMergeRequestWhere(thread_mergerequest[tmpl].cluster1,thread_mergerequest[tmpl].cluster2,&where);
+		}
+
+		// block 1 against 2
+		ep.chunk.jj = ep.chunk.jjlast;
+		ep.chunk.jjlast = cpudata->jjlast;
+
+		thread_mergerequestcnt = 0;
+		if (pthread_create (&thread, NULL, &computesim_funcion, &ep)) 
+			printf("Error: Failed creating thread\n");
+
+		// block 2 against 1
+		cpudatasection.jjlast = cpudatasection.jj;
+		cpudatasection.jj = cpudata->jj;
+		computesim(facsdata,clusterid,&cpudatasection);
+
+		if (pthread_join (thread, NULL))
+			printf("Error: Failed pthread_join\n");
+		ProgressPrefetch(pf,clusterid);
+
+		where = 0;
+		for (tmpl = 0; tmpl < thread_mergerequestcnt; tmpl++)
+		{
+			InsertMergeRequestWhere(thread_mergerequest[tmpl].cluster1,thread_mergerequest[tmpl].cluster2,&where);
+		}
+
+	}
+	else if ((cpudata->iilast - cpudata->ii) >= 2)
+	{
+		pthread_t thread;
+		EXECUTIONPLAN ep;
+		CPU			cpudatasection;
+		unsigned int mid = cpudata->ii + ((cpudata->iilast - cpudata->ii) >> 1);
+		unsigned int tmpl;
+		unsigned int where;
+
+		ep.facsdata = facsdata;
+		ep.clusterid = clusterid;
+
+		// half 1 against itself
+		ep.chunk.ii = ep.chunk.jj = cpudata->ii;
+		ep.chunk.iilast = ep.chunk.jjlast = mid;
+
+		thread_mergerequestcnt = 0;
+		thread_mergerequest[0].cluster2 = UINT_MAX;
+		if (pthread_create (&thread, NULL, &computesim_funcion, &ep)) 
+			printf("Error: Failed creating thread\n");
+
+		// half 2 against itself
+		cpudatasection.ii = cpudatasection.jj = mid;
+		cpudatasection.iilast = cpudatasection.jjlast = cpudata->iilast;
+		computesim(facsdata,clusterid,&cpudatasection);
+
+		if (pthread_join (thread, NULL))
+			printf("Error: Failed pthread_join\n");
+		ProgressPrefetch(pf,clusterid);
+		where = 0;
+		for (tmpl = 0; tmpl < thread_mergerequestcnt; tmpl++)
+		{
+			InsertMergeRequestWhere(thread_mergerequest[tmpl].cluster1,thread_mergerequest[tmpl].cluster2,&where);
+		}
+
+		// half 1 against half 2
+		cpudatasection.ii = cpudata->ii;
+		cpudatasection.iilast = mid;
+		computesim(facsdata,clusterid,&cpudatasection);
+		ProgressPrefetch(pf,clusterid);
+	}
+	else 
+		computesim(facsdata,clusterid,cpudata);
+
+} /* ComputeChunk */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: first row owned by slave i; the rows are cut in equal ranges, the same for every pass */
+static unsigned int RangeFirstRow(unsigned int loaded,unsigned int nproc,unsigned int i)
+{
+	return((unsigned int)(((unsigned long long)loaded*(i-1))/(nproc-1)));
+
+} /* RangeFirstRow */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: rows of slave t in the halo of slave s */
+static int HaloRows(HALO *h,unsigned int s,unsigned int t,unsigned int *first,unsigned int *last)
+{
+	*first = (h->last[s] > h->first[t]) ? h->last[s] : h->first[t];
+	*last = (h->reach[s] < h->last[t]) ? h->reach[s] : h->last[t];
+	return(*first < *last);
+
+} /* HaloRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: a slave computes its chunks on its own copy of the labels of its halo; it takes their current labels */
+/* from the slaves owning them at the start of a pass */
+static void PullHaloLabels(unsigned int *clusterid,HALO *h,unsigned int nproc,unsigned int idproc)
+{
+	MPI_Request req[kMaxCPU];
+	unsigned int first,last;
+	unsigned int t;
+	int n = 0;
+
+	for (t = 1; t < nproc; t++)
+	{
+		if ((t > idproc) && HaloRows(h,idproc,t,&first,&last))
+			MPI_Irecv(&clusterid[first], last-first, MPI_INT,  t, kHaloLabelsMsg, gComm, &req[n++]);
+		else if ((t < idproc) && HaloRows(h,t,idproc,&first,&last))
+			MPI_Isend(&clusterid[first], last-first, MPI_INT,  t, kHaloLabelsMsg, gComm, &req[n++]);
+	}
+	MPI_Waitall(n,req,MPI_STATUSES_IGNORE);
+
+} /* PullHaloLabels */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: at the end of a pass, the halo labels go back to the owners of the rows, which link them to their own */
+/* labels with merge requests; the rows of the slaves before are folded in turn, as the master would relay them */
+static void FoldHaloLabels(unsigned int *clusterid,HALO *h,unsigned int nproc,unsigned int idproc)
+{
+	MPI_Request req[kMaxCPU];
+	unsigned int first,last,r;
+	unsigned int s,t;
+	int n = 0;
+
+	for (t = idproc+1; t < nproc; t++)
+	{
+		if (HaloRows(h,idproc,t,&first,&last))
+			MPI_Isend(&clusterid[first], last-first, MPI_INT,  t, kHaloFoldMsg, gComm, &req[n++]);
+	}
+	for (s = 1; s < idproc; s++)
+	{
+		if (HaloRows(h,s,idproc,&first,&last))
+		{
+			unsigned int *shadow = malloc((size_t)(last-first)*sizeof(unsigned int));
+			unsigned int prev1 = 0;
+			unsigned int prev2 = 0;
+
+			if (!shadow)
+			{
+				printf("LOG:CPU %u Error:Cannot Allocate Memory.\n",idproc);
+				MPI_Abort(MPI_COMM_WORLD,1);
+			}
+			MPI_Recv(shadow, last-first, MPI_INT,  s, kHaloFoldMsg, gComm, MPI_STATUS_IGNORE);
+			for (r = first; r < last; r++)
+			{
+				unsigned int l = shadow[r-first];
+
+				if ((l == 0) || (l == clusterid[r]))
+					continue;
+				if (clusterid[r] == 0)
+					clusterid[r] = l;
+				else
+				{
+					unsigned int cluster1 = (l < clusterid[r]) ? l : clusterid[r];
+					unsigned int cluster2 = (l < clusterid[r]) ? clusterid[r] : l;
+
+					/* neighbouring rows mostly link the same pair of clusters */
+					if ((cluster1 != prev1) || (cluster2 != prev2))
+						InsertMergeRequest(cluster1,cluster2);
+					prev1 = cluster1;
+					prev2 = cluster2;
 				}
-		straight2next:		
-				facspj++;
-				clusterpj++;
 			}
-			facspi++;
-			clusterpi++;
+			free(shadow);
 		}
-skipthischunk: ;
-	
-} /* computesim */
-#endif
+	}
+	MPI_Waitall(n,req,MPI_STATUSES_IGNORE);
+	ClearLabelRange(clusterid,h->last[idproc],h->reach[idproc]);
 
+} /* FoldHaloLabels */
 /* ------------------------------------------------------------------------------------ */
+
 static void DoComputingSlave(FACSDATA *facsdata,unsigned int *clusterid,int idproc,unsigned int initialClusterCnt)
 {
 			CPU	  cpudata;
-			MPI_Request mpireq;
+			PREFETCH pf;
+			HALO halo;
 
 			/* determine the first value to use to start recording new clusterids for this processor */
 			clustercnt = (idproc*kStartLocalCluster+initialClusterCnt);
-			
+
+			/* the master sends the next chunk while the current one is computed, receive it in the background */
+			MPI_Irecv(&pf.next, 4, MPI_INT,  0, kWhichBlocksToCompute, gComm, &pf.req[0]);
+			pf.slicesposted = 0;
+			pf.facs = facsdata;
+			pf.privfirst = pf.privlast = 0;
+			if (gHalo)
+			{
+				int nproc;
+
+				/* every row we touch is ours for the pass: our own range, whose labels the master sends */
+				/* unless we keep them (-O), and our halo, whose labels come from the slaves owning it */
+				MPI_Comm_size(gComm,&nproc);
+				MPI_Bcast(halo.first, nproc, MPI_INT, 0, gComm);
+				MPI_Bcast(halo.last, nproc, MPI_INT, 0, gComm);
+				MPI_Bcast(halo.reach, nproc, MPI_INT, 0, gComm);
+				pf.privfirst = halo.first[idproc];
+				pf.privlast = halo.reach[idproc];
+				if (!gRangeLabels && (halo.last[idproc] > halo.first[idproc]))
+					MPI_Recv(&clusterid[halo.first[idproc]], halo.last[idproc]-halo.first[idproc], MPI_INT,  0, kHaloLabelsMsg, gComm, MPI_STATUS_IGNORE);
+				PullHaloLabels(clusterid,&halo,nproc,idproc);
+			}
 			do
 			{
-				MPI_Recv(&cpudata, 4, MPI_INT,  0, kWhichBlocksToCompute, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+				MPI_Wait(&pf.req[0],MPI_STATUS_IGNORE);
+				if (!pf.slicesposted)
+					PostNextChunkReceives(&pf,clusterid);
+				cpudata = pf.next;
 				if (cpudata.ii != kNoMoreBlocks)
 				{
-					int sndcnt,rcvcnt;
+					int sndcnt;
 
 					/* ------ update clusterid for each data of that might be touched by the process */
 
-					rcvcnt =  (cpudata.iilast-cpudata.ii);
-					MPI_Recv(&clusterid[cpudata.ii],rcvcnt, MPI_INT,  0, kClusterMsg1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-					if (cpudata.jj != cpudata.ii)
-					{
-						rcvcnt =  (cpudata.jjlast-cpudata.jj);
-						MPI_Recv(&clusterid[cpudata.jj],rcvcnt, MPI_INT,  0, kClusterMsg2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-					}
+					MPI_Waitall(2,&pf.req[1],MPI_STATUSES_IGNORE);
+					MPI_Irecv(&pf.next, 4, MPI_INT,  0, kWhichBlocksToCompute, gComm, &pf.req[0]);
+					pf.slicesposted = 0;
 
 					/* ------ do the heavy computation */
 
-					{
-						
-						if ((cpudata.jj != cpudata.ii))
-						{
-							pthread_t thread;
-							EXECUTIONPLAN ep;
-							CPU			cpudatasection;
-							unsigned int tmpl;
-							unsigned int where;
-
-							ep.facsdata = facsdata;
-							ep.clusterid = clusterid;
-							
-							// block 1 against 1
-							ep.chunk.ii = ep.chunk.iilast = cpudata.ii;
-							ep.chunk.iilast += ((cpudata.iilast - cpudata.ii) >> 1);
-							ep.chunk.jj = ep.chunk.jjlast = cpudata.jj;
-							ep.chunk.jjlast += ((cpudata.jjlast - cpudata.jj) >> 1);
-
-							thread_mergerequestcnt = 0;
-							thread_mergerequest[0].cluster2 = UINT_MAX;  /* to avoid need for initial test thread_mergerequestcnt == 0 in thread_InsertMergeRequest */
-							if (pthread_create (&thread, NULL, &computesim_funcion, &ep)) 
-								printf("Error: Failed creating thread\n");
-
-							// block 2 against 2
-							cpudatasection.ii = cpudata.ii + ((cpudata.iilast - cpudata.ii) >> 1) ;
-							cpudatasection.iilast = cpudata.iilast;
-							cpudatasection.jj = cpudata.jj + ((cpudata.jjlast - cpudata.jj) >> 1) ;
-							cpudatasection.jjlast = cpudata.jjlast;
-							computesim(facsdata,clusterid,&cpudatasection);
-
-							if (pthread_join (thread, NULL))
-								printf("Error: Failed pthread_join\n");
-							where = 0;
-							for (tmpl = 0; tmpl < thread_mergerequestcnt; tmpl++)
-							{
-								InsertMergeRequestWhere(thread_mergerequest[tmpl].cluster1,thread_mergerequest[tmpl].cluster2,&where);
-							}
-
-							// block 1 against 2
-							ep.chunk.jj = ep.chunk.jjlast;
-							ep.chunk.jjlast = cpudata.jjlast;
-
-							thread_mergerequestcnt = 0;
-							if (pthread_create (&thread, NULL, &computesim_funcion, &ep)) 
-								printf("Error: Failed creating thread\n");
-
-							// block 2 against 1
-							cpudatasection.jjlast = cpudatasection.jj;
-							cpudatasection.jj = cpudata.jj;
-							computesim(facsdata,clusterid,&cpudatasection);
-
-							if (pthread_join (thread, NULL))
-								printf("Error: Failed pthread_join\n");
-
-							where = 0;
-							for (tmpl = 0; tmpl < thread_mergerequestcnt; tmpl++)
-							{
-								InsertMergeRequestWhere(thread_mergerequest[tmpl].cluster1,thread_mergerequest[tmpl].cluster2,&where);
-							}
-
-						}
-						else 
-							computesim(facsdata,clusterid,&cpudata);
-
-					}
-
+					ComputeChunk(facsdata,clusterid,&cpudata,&pf);
 
 					/* ------ send back updated data */
 
-					MPI_Isend(&idproc, 1, MPI_INT,  0, kCPUdoneMsg, MPI_COMM_WORLD,&mpireq);
-					sndcnt = cpudata.iilast-cpudata.ii;
-					MPI_Send(&clusterid[cpudata.ii], sndcnt, MPI_INT,  0, kClusterMsg1, MPI_COMM_WORLD);
+					MPI_Send(&idproc, 1, MPI_INT,  0, kCPUdoneMsg, gComm);
+					if (PrivateRows(pf.privfirst,pf.privlast,cpudata.ii,cpudata.iilast))
+						AdviseChunkRows(facsdata,NULL,cpudata.ii,cpudata.iilast,MADV_DONTNEED);
+					else
+					{
+						sndcnt = cpudata.iilast-cpudata.ii;
+						MPI_Send(&clusterid[cpudata.ii], sndcnt, MPI_INT,  0, kClusterMsg1, gComm);
+						AdviseChunkRows(facsdata,clusterid,cpudata.ii,cpudata.iilast,MADV_DONTNEED);
+					}
 					if (cpudata.jj != cpudata.ii)
 					{
-						sndcnt = cpudata.jjlast-cpudata.jj;
-						MPI_Send(&clusterid[cpudata.jj], sndcnt, MPI_INT,  0, kClusterMsg2, MPI_COMM_WORLD);
+						if (PrivateRows(pf.privfirst,pf.privlast,cpudata.jj,cpudata.jjlast))
+							AdviseChunkRows(facsdata,NULL,cpudata.jj,cpudata.jjlast,MADV_DONTNEED);
+						else
+						{
+							sndcnt = cpudata.jjlast-cpudata.jj;
+							MPI_Send(&clusterid[cpudata.jj], sndcnt, MPI_INT,  0, kClusterMsg2, gComm);
+							AdviseChunkRows(facsdata,clusterid,cpudata.jj,cpudata.jjlast,MADV_DONTNEED);
+						}
 					}
 				}
 				else /* send the final count of "new clusters" allocated by this proc. */
 				{
 					if (cpudata.jj != kNoMoreBlocks)
 					{
-						MPI_Send((void *)&clustercnt, 1, MPI_INT,  0, kFinalCntRequest, MPI_COMM_WORLD);
+						if (gHalo)
+						{
+							int nproc;
+
+							MPI_Comm_size(gComm,&nproc);
+							FoldHaloLabels(clusterid,&halo,nproc,idproc);
+						}
+						MPI_Send((void *)&clustercnt, 1, MPI_INT,  0, kFinalCntRequest, gComm);
+						if (gHalo && !gRangeLabels && (halo.last[idproc] > halo.first[idproc]))
+							MPI_Send(&clusterid[halo.first[idproc]], halo.last[idproc]-halo.first[idproc], MPI_INT,  0, kHaloLabelsMsg, gComm);
 					}
 				}
 			} while (cpudata.ii != kNoMoreBlocks);
@@ -2188,15 +5288,15 @@ static void DoComputingSlave(FACSDATA *facsdata,unsigned int *clusterid,int idpr
 			{
 				JOINREQUEST joinRequest;
 
-				MPI_Recv(&joinRequest, 2, MPI_INT,  0, kJoinListRequest, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
+				MPI_Recv(&joinRequest, 2, MPI_INT,  0, kJoinListRequest, gComm, MPI_STATUS_IGNORE/*&status*/);
 			if (joinRequest.getFromCPU == 0)
 				break;
 				
 				if (joinRequest.getFromCPU == idproc) /*  we are  the one to send */
 				{
-					MPI_Send(&mergerequestcnt, 1, MPI_INT,  joinRequest.sendToCPU, kFinalMergeRequestCntRequest, MPI_COMM_WORLD);
+					MPI_Send(&mergerequestcnt, 1, MPI_INT,  joinRequest.sendToCPU, kFinalMergeRequestCntRequest, gComm);
 					if (mergerequestcnt > 0)
-						MPI_Send(&mergerequest, mergerequestcnt*2, MPI_INT,  joinRequest.sendToCPU, kSendFinalMergeRequestRequest, MPI_COMM_WORLD);
+						MPI_Send(&mergerequest, mergerequestcnt*2, MPI_INT,  joinRequest.sendToCPU, kSendFinalMergeRequestRequest, gComm);
 				}
 				else /* we are the one receiving */
 				{
@@ -2204,79 +5304,503 @@ static void DoComputingSlave(FACSDATA *facsdata,unsigned int *clusterid,int idpr
 					unsigned int cpumergerequestcnt;
 					unsigned int where;
 					int tmpl;
-					MPI_Recv(&cpumergerequestcnt, 1, MPI_INT,  joinRequest.getFromCPU, kFinalMergeRequestCntRequest, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+					MPI_Recv(&cpumergerequestcnt, 1, MPI_INT,  joinRequest.getFromCPU, kFinalMergeRequestCntRequest, gComm,MPI_STATUS_IGNORE);
 					if (cpumergerequestcnt > 0)
-						MPI_Recv(&cpumergerequest, cpumergerequestcnt*2, MPI_INT,  joinRequest.getFromCPU, kSendFinalMergeRequestRequest, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+						MPI_Recv(&cpumergerequest, cpumergerequestcnt*2, MPI_INT,  joinRequest.getFromCPU, kSendFinalMergeRequestRequest, gComm,MPI_STATUS_IGNORE);
 					where = 0;
 					for (tmpl = 0; tmpl < cpumergerequestcnt; tmpl++)
 					{
 						InsertMergeRequestWhere(cpumergerequest[tmpl].cluster1,cpumergerequest[tmpl].cluster2,&where);
 					}
-					MPI_Send(&mergerequestcnt,1, MPI_INT,  0, kJoinListRequestDone, MPI_COMM_WORLD);
+					MPI_Send(&mergerequestcnt,1, MPI_INT,  0, kJoinListRequestDone, gComm);
 				}
 			} while(1);
 			
 			if (idproc == 1) /* send final list to master */
 			{
-				MPI_Send(&mergerequestcnt, 1, MPI_INT,  0, kFinalMergeRequestCntRequest, MPI_COMM_WORLD);
+				MPI_Send(&mergerequestcnt, 1, MPI_INT,  0, kFinalMergeRequestCntRequest, gComm);
 				if (mergerequestcnt > 0)
-					MPI_Send(&mergerequest, mergerequestcnt*2, MPI_INT,  0, kSendFinalMergeRequestRequest, MPI_COMM_WORLD);
+					MPI_Send(&mergerequest, mergerequestcnt*2, MPI_INT,  0, kSendFinalMergeRequestRequest, gComm);
+			}
+
+	
+} /* DoComputingSlave */
+/* ------------------------------------------------------------------------------------ */
+
+/* chunks are split in uneven parts, compare row ranges and not only their start */
+static int RowsOverlap(unsigned int first1,unsigned int last1,unsigned int first2,unsigned int last2)
+{
+	return((first1 < last2) && (first2 < last1));
+
+} /* RowsOverlap */
+/* ------------------------------------------------------------------------------------ */
+
+/* first row in [first..last[ whose key is above keylimit (rows are sorted on the key) */
+static unsigned int FirstRowAbove(FACSDATA *facs,unsigned int first,unsigned int last,unsigned int keylimit)
+{
+	while (first < last)
+	{
+		unsigned int mid = first+((last-first) >> 1);
+
+		if (facs[mid].data[sortkey] > keylimit)
+			last = mid;
+		else
+			first = mid+1;
+	}
+	return(first);
+
+} /* FirstRowAbove */
+/* ------------------------------------------------------------------------------------ */
+
+/* estimate the number of pairs a chunk will really test, from the key of a few sampled rows */
+static float EstimateChunkPairs(FACSDATA *facs,CHUNK *c,unsigned int keyreach)
+{
+	unsigned int rows = c->iilast-c->ii;
+	unsigned int samples = (rows < kCostSamples) ? rows : kCostSamples;
+	unsigned int s;
+	double sum = 0.0;
+
+	for (s = 0; s < samples; s++)
+	{
+		unsigned int i = c->ii + (unsigned int)(((2ULL*s+1)*rows) / (2*samples));
+		unsigned int first = (c->jj > i) ? c->jj : i+1;
+
+		if (first < c->jjlast)
+			sum += FirstRowAbove(facs,first,c->jjlast,facs[i].data[sortkey]+keyreach)-first;
+	}
+	return((samples > 0) ? (float)(sum*rows/samples) : 0.0f);
+
+} /* EstimateChunkPairs */
+/* ------------------------------------------------------------------------------------ */
+
+/* number of block pairs of the grid not discarded on the key, ie the chunks to compute */
+static unsigned int CountLiveChunks(FACSDATA *facs,unsigned int loaded,unsigned int blocksize,unsigned int keyreach)
+{
+	unsigned int ii,iilast,reach;
+	unsigned int cnt = 0;
+
+	for (ii = 0; ii < loaded; ii += blocksize)
+	{
+		iilast = ((ii+blocksize) < loaded) ? ii+blocksize : loaded;
+		reach = FirstRowAbove(facs,iilast,loaded,facs[iilast-1].data[sortkey]+keyreach);
+		cnt += 1+(reach-ii-1)/blocksize;
+	}
+	return(cnt);
+
+} /* CountLiveChunks */
+/* ------------------------------------------------------------------------------------ */
+
+/* the cost only depends on the data, never on timings, so that every run plans the same chunks */
+static void SetChunkCost(FACSDATA *facs,CHUNK *c,unsigned int keyreach)
+{
+	c->pairs = EstimateChunkPairs(facs,c,keyreach);
+	c->cost = c->pairs;
+
+} /* SetChunkCost */
+/* ------------------------------------------------------------------------------------ */
+
+/* cut an expensive chunk in smaller ones; the first part replaces it, the others are appended */
+static unsigned int SplitChunk(FACSDATA *facs,CHUNK *chunk,unsigned int which,unsigned int chunkcnt,unsigned int keyreach)
+{
+	CHUNK c = chunk[which];
+	CHUNK *part[4];
+	unsigned int partcnt,n;
+	unsigned int imid = c.ii+((c.iilast-c.ii) >> 1);
+	unsigned int jmid = c.jj+((c.jjlast-c.jj) >> 1);
+
+	part[0] = &chunk[which];
+	part[1] = &chunk[chunkcnt];
+	part[2] = &chunk[chunkcnt+1];
+	part[3] = &chunk[chunkcnt+2];
+	for (n = 0; n < 4; n++)
+		*part[n] = c;
+	if (c.ii == c.jj)  /* both halves against themselves, then one half against the other */
+	{
+		part[0]->iilast = part[0]->jjlast = imid;
+		part[1]->ii = part[1]->jj = imid;
+		part[2]->iilast = imid;
+		part[2]->jj = imid;
+		partcnt = 3;
+	}
+	else
+	{
+		part[0]->iilast = imid; part[0]->jjlast = jmid;
+		part[1]->iilast = imid; part[1]->jj = jmid;
+		part[2]->ii = imid; part[2]->jjlast = jmid;
+		part[3]->ii = imid; part[3]->jj = jmid;
+		partcnt = 4;
+	}
+	for (n = 0; n < partcnt; n++)
+		SetChunkCost(facs,part[n],keyreach);
+	return(partcnt-1);
+
+} /* SplitChunk */
+/* ------------------------------------------------------------------------------------ */
+
+/* by rows, so that the parts of a split chunk are computed where the chunk would have been */
+static int CompareChunkRows(const void *a,const void *b)
+{
+	const CHUNK *ca = (const CHUNK *)a;
+	const CHUNK *cb = (const CHUNK *)b;
+
+	if (ca->ii != cb->ii)
+		return((ca->ii < cb->ii) ? -1 : 1);
+	if (ca->jj != cb->jj)
+		return((ca->jj < cb->jj) ? -1 : 1);
+	return(0);
+
+} /* CompareChunkRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* build the list of chunks of a pass: the block size follows the number of chunks surviving the key test, */
+/* each chunk gets a cost from its estimated number of pairs, the most expensive ones are split and the list */
+/* is sorted by rows. Nothing depends on timings so the same data always give the same plan. */
+/* Returns the number of chunks, 0 when out of memory */
+static unsigned int PlanChunks(FACSDATA *facs,unsigned int loaded,unsigned int nproc,unsigned int desiredBlockSize,CHUNKPLAN *plan,int verbose)
+{
+	unsigned int keyreach = KeyReach(gTestDist);
+	unsigned int blocksize = desiredBlockSize;
+	unsigned int cells,chunkcnt,splitcnt,n;
+	unsigned int ii,jj,iilast,reach;
+	double total;
+	float limit;
+
+	if (blocksize == 0)
+	{
+		/* arrange to keep each slave node busy with at least about 100 computations, but do not go below blocksize of 256 events */
+		blocksize = 131072;
+		while ((blocksize > 256) && ((CountLiveChunks(facs,loaded,blocksize,keyreach) / (nproc-1)) < 100))
+			blocksize >>= 1;
+	}
+	plan->blocksize = blocksize;
+
+	/* only the block pairs within reach on the key are listed: small blocks would make the whole triangle too large */
+	cells = CountLiveChunks(facs,loaded,blocksize,keyreach);
+	if (plan->chunkcap < cells+kMaxSplitChunks)
+	{
+		free(plan->chunk);
+		plan->chunkcap = cells+kMaxSplitChunks;
+		plan->chunk = calloc(plan->chunkcap,sizeof(CHUNK));
+		if (!plan->chunk)
+		{
+			plan->chunkcap = 0;
+			return(0);
+		}
+	}
+
+	chunkcnt = 0;
+	total = 0.0;
+	for (ii = 0; ii < loaded; ii += blocksize)
+	{
+		iilast = ((ii+blocksize) < loaded) ? ii+blocksize : loaded;
+		reach = FirstRowAbove(facs,iilast,loaded,facs[iilast-1].data[sortkey]+keyreach);
+		for (jj = ii; jj < reach; jj += blocksize)
+		{
+			CHUNK *c = &plan->chunk[chunkcnt];
+
+			c->ii = ii;
+			c->jj = jj;
+			c->iilast = iilast;
+			c->jjlast = ((jj+blocksize) < loaded) ? jj+blocksize : loaded;
+			c->status = kChunkStatusToDo;
+			SetChunkCost(facs,c,keyreach);
+			total += c->cost;
+			chunkcnt++;
+		}
+	}
+
+	splitcnt = 0;
+	limit = (float)(total/(kSplitCostFraction*(nproc-1)));
+	for (n = 0; n < chunkcnt; )
+	{
+		CHUNK *c = &plan->chunk[n];
+
+		if ((c->cost > limit) && ((c->iilast-c->ii) >= 2*kMinSplitRows) && ((c->jjlast-c->jj) >= 2*kMinSplitRows) && ((chunkcnt+3) <= plan->chunkcap))
+		{
+			unsigned int added = SplitChunk(facs,plan->chunk,n,chunkcnt,keyreach);
+
+			chunkcnt += added;
+			splitcnt += added;
+		}
+		else
+			n++;
+	}
+	qsort(plan->chunk,chunkcnt,sizeof(CHUNK),CompareChunkRows);
+	if (verbose > 0)
+		printf("LOG:BlockSize=%u, %u chunks (%u from splitting)\n",blocksize,chunkcnt,splitcnt);
+	return(chunkcnt);
+
+} /* PlanChunks */
+/* ------------------------------------------------------------------------------------ */
+
+
+/* -H: slave owning a row; the ranges are contiguous from the first row */
+static unsigned int HaloOwner(HALO *h,unsigned int row,unsigned int nproc)
+{
+	unsigned int i;
+
+	for (i = 1; i < (nproc-1); i++)
+		if (row < h->last[i])
+			break;
+	return(i);
+
+} /* HaloOwner */
+/* ------------------------------------------------------------------------------------ */
+
+/* -H: cut the rows in one contiguous range of blocks per slave, of about the same chunk cost, and find how far the */
+/* chunks of each range reach on the key; the slaves take the labels of their halo from each other, the master */
+/* only sends each slave the current labels of its own range */
+static void SendHalo(HALO *h,unsigned int *clusterid,CHUNK *chunk,unsigned int chunkcnt,unsigned int loaded,unsigned int nproc,unsigned int blocksize,int verbose)
+{
+	unsigned int blockcnt = (chunkcnt > 0) ? (loaded+blocksize-1)/blocksize : 0;
+	double *cost = NULL;
+	double total = 0.0;
+	double acc = 0.0;
+	unsigned int i,n,b;
+
+	if (gRangeLabels)
+	{
+		/* -O: the slaves hold the labels of their rows from pass to pass, the ranges do not move */
+		for (i = 1; i < nproc; i++)
+		{
+			h->first[i] = RangeFirstRow(loaded,nproc,i);
+			h->last[i] = RangeFirstRow(loaded,nproc,i+1);
+		}
+	}
+	else
+	{
+		cost = calloc(blockcnt+1,sizeof(double));
+		for (n = 0; cost && (n < chunkcnt); n++)
+		{
+			cost[chunk[n].ii/blocksize] += chunk[n].cost;
+			total += chunk[n].cost;
+		}
+		b = 0;
+		for (i = 1; i < nproc; i++)
+		{
+			h->first[i] = (b*blocksize < loaded) ? b*blocksize : loaded;
+			if (i == (nproc-1))
+				b = blockcnt;
+			else if (cost && (total > 0.0))
+			{
+				/* a block goes to the slave holding the larger part of its cost */
+				while ((b < blockcnt) && ((acc+cost[b]/2) < (total*i)/(nproc-1)))
+					acc += cost[b++];
+			}
+			else
+				b = (blockcnt*i)/(nproc-1);
+			h->last[i] = (b*blocksize < loaded) ? b*blocksize : loaded;
+		}
+		free(cost);
+	}
+	for (i = 1; i < nproc; i++)
+		h->reach[i] = h->last[i];
+
+	for (n = 0; n < chunkcnt; n++)
+	{
+		i = HaloOwner(h,chunk[n].ii,nproc);
+		if (chunk[n].iilast > h->reach[i])
+			h->reach[i] = chunk[n].iilast;
+		if (chunk[n].jjlast > h->reach[i])
+			h->reach[i] = chunk[n].jjlast;
+	}
+	/* every row a slave touches is its own for the pass: its range and its halo */
+	for (i = 1; i < nproc; i++)
+	{
+		h->privfirst[i] = h->first[i];
+		h->privlast[i] = h->reach[i];
+		if (verbose > 0)
+			printf("LOG:Slave %3u owns rows %10u to %10u, halo up to %10u\n",i,h->first[i],h->last[i],h->reach[i]);
+	}
+	MPI_Bcast(h->first, nproc, MPI_INT, 0, gComm);
+	MPI_Bcast(h->last, nproc, MPI_INT, 0, gComm);
+	MPI_Bcast(h->reach, nproc, MPI_INT, 0, gComm);
+	if (gRangeLabels)
+		return;
+	for (i = 1; i < nproc; i++)
+	{
+		if (h->last[i] > h->first[i])
+			MPI_Send(&clusterid[h->first[i]], h->last[i]-h->first[i], MPI_INT,  i, kHaloLabelsMsg, gComm);
+	}
+
+} /* SendHalo */
+/* ------------------------------------------------------------------------------------ */
+
+/* function repeatadly called only by the master to identify a suitable computing chunk to asign to an available slave */
+/* a slave receives its next chunk while still computing the current one, so that it does not wait for the master between chunks */
+static unsigned int AssignChunk(unsigned int *clusterid,CHUNK *chunk, CPUQUEUE *cpu, unsigned int nproc, HALO *halo)
+{
+	unsigned int i;
+	unsigned int k;
+	CPU *c;
+	MPI_Request *req;
+	unsigned int candidate = 0;
+	unsigned int busycandidate = 0;
+	unsigned int owner = (halo) ? HaloOwner(halo,chunk->ii,nproc) : 0;
+	unsigned int privfirst,privlast;
+
+	/* test if computing in already in progress or queued somewhere for one of those blocks */
+	// start from last to first proc, as according to lsf, first proc will have lowest load and we submit to the last identified avail proc.
+	for (i = (nproc-1); i>0; i--)
+	{
+		/* -H: each slave computes on its own copy of the labels of the rows it touches */
+		for (k = 0; (k < cpu[i].cnt) && !halo; k++)
+		{
+			c = &cpu[i].chunk[(cpu[i].head+k) % kChunksPerCPU];
+			if (RowsOverlap(c->ii,c->iilast,chunk->ii,chunk->iilast) || RowsOverlap(c->jj,c->jjlast,chunk->jj,chunk->jjlast) || 
+				RowsOverlap(c->ii,c->iilast,chunk->jj,chunk->jjlast) || RowsOverlap(c->jj,c->jjlast,chunk->ii,chunk->iilast))
+				return(0); 
+		}
+
+		if (cpu[i].cnt == 0)
+			candidate = i;
+		else if (cpu[i].cnt < kChunksPerCPU)
+			busycandidate = i;
+	}
+	/* -H: only the owner of the rows, otherwise idle slaves first, then queue behind a running chunk */
+	if (owner != 0)
+		candidate = (cpu[owner].cnt < kChunksPerCPU) ? owner : 0;
+	else if (candidate == 0)
+		candidate = busycandidate;
+	if (candidate == 0)
+		return(0);
+	privfirst = privlast = 0;
+	if (halo)
+	{
+		privfirst = halo->privfirst[candidate];
+		privlast = halo->privlast[candidate];
+	}
+
+	k = (cpu[candidate].head+cpu[candidate].cnt) % kChunksPerCPU;
+	c = &cpu[candidate].chunk[k];
+	req = cpu[candidate].req[k];
+	c->ii = chunk->ii;
+	c->jj = chunk->jj;
+	c->iilast = chunk->iilast;
+	c->jjlast = chunk->jjlast;
+	MPI_Isend(c, 4, MPI_INT,  candidate, kWhichBlocksToCompute, gComm,&req[0]);
+	req[1] = MPI_REQUEST_NULL;
+	req[2] = MPI_REQUEST_NULL;
+	if (!PrivateRows(privfirst,privlast,c->ii,c->iilast))
+		MPI_Isend(&clusterid[c->ii], c->iilast-c->ii, MPI_INT,  candidate, kClusterMsg1, gComm,&req[1]);
+	if ((c->ii != c->jj) && !PrivateRows(privfirst,privlast,c->jj,c->jjlast))
+		MPI_Isend(&clusterid[c->jj], c->jjlast-c->jj, MPI_INT,  candidate, kClusterMsg2, gComm,&req[2]);
+	cpu[candidate].cnt++;
+	chunk->status = kChunkStatusComputing;
+
+	return(candidate);
+	
+} /* AssignChunk */
+/* ------------------------------------------------------------------------------------ */
+
+/* -O: a slave applies the operations of the master to the labels of its own rows, until the pass ends */
+static void ServeLabels(FACSNAME *facsname,FACSDATA *facs,unsigned int *clusterid,unsigned int colcnt,unsigned int nproc,char *ofn)
+{
+	LABELOP op;
+	unsigned int own = ownlast-ownfirst;
+	unsigned int i;
+
+	do
+	{
+		MPI_Bcast(&op, 4, MPI_INT, 0, gComm);
+		switch (op.op)
+		{
+			case kLabelsRelabel:
+				BcastClusterTables(nproc);
+				RelabelRows(clusterid,ownfirst,ownlast);
+				break;
+
+			case kLabelsCollapsed:
+				RangeLabelCollapsedRows(clusterid);
+				break;
+
+			case kLabelsCount:
+				free(RangeClusterEvents(clusterid,nproc));
+				break;
+
+			case kLabelsAssigned:
+			{
+				unsigned int assigned = 0;
+
+				for (i = ownfirst; i < ownlast; i++)
+					if ((clusterid[i] > 0) && (clusterid[i] <= op.arg))
+						assigned += RowWeight(i);
+				SumOverRanks(assigned);
+				break;
 			}
 
-	
-} /* DoComputingSlave */
-/* ------------------------------------------------------------------------------------ */
+			case kLabelsKeep:
+				KeepClusterIndices(&clusterid[ownfirst],own,op.dist,ofn);
+				break;
+
+			case kLabelsRename:
+				RenameClusterIndices(op.dist,op.dist2,ofn);
+				break;
+
+			case kLabelsShift:
+				ShiftLabels(clusterid,ownfirst,ownlast);
+				break;
+
+			case kLabelsSelect:
+			{
+				float *dist = malloc((op.arg+1)*sizeof(float));
+				int *cluster = malloc((op.arg+1)*sizeof(int));
 
+				if (!dist || !cluster)
+				{
+					printf("LOG: Cannot Allocate Memory.\n");
+					MPI_Abort(MPI_COMM_WORLD,1);
+				}
+				RangeSelectClusters(clusterid,ofn,op.arg,dist,cluster);
+				free(dist);
+				free(cluster);
+				break;
+			}
 
-/* function repeatadly called only by the master to identify a suitable computing chunk to asign to an available slave */
-static unsigned int AssignChunk(unsigned int *clusterid,CHUNK *chunk, CPU *cpu, unsigned int nproc)
-{
-	unsigned int i;
-	int sndcnt;
-	MPI_Request mpireq;
-	unsigned int candidate = 0;
+			case kLabelsFlag:
+				SumOverRanks(FlagSequencesToReassign(&clusterid[ownfirst],own,ofn,op.dist));
+				break;
 
-	/* test if computing in already in progress somewhere for one of those blocks */
-	// start from last to first proc, as according to lsf, first proc will have lowest load and we submit to the last identified avail proc.
-	for (i = (nproc-1); i>0; i--)
-	{
-		if ((cpu[i].ii == chunk->ii) || (cpu[i].jj == chunk->jj) || (cpu[i].ii == chunk->jj) || (cpu[i].jj == chunk->ii))
-			return(0); 
+			case kLabelsUnassigned:
+				DistributeUnassignedInRanges(facs,clusterid,colcnt,op.arg);
+				break;
 
-		if (cpu[i].ii == kCPU_availaible)
-			candidate = i;
-	}
+			case kLabelsWrite:
+				RangeWriteSplitBinFile(facsname,facs,clusterid,colcnt,op.arg,ofn);
+				break;
 
-	cpu[candidate].ii = chunk->ii;
-	cpu[candidate].jj = chunk->jj;
-	cpu[candidate].iilast = chunk->iilast;
-	cpu[candidate].jjlast = chunk->jjlast;
-	MPI_Isend(&cpu[candidate], 4, MPI_INT,  candidate, kWhichBlocksToCompute, MPI_COMM_WORLD,&mpireq);
+			case kLabelsLeftover:
+				RangeLeftoverBatches(facs,clusterid,colcnt,op.arg,NULL,NULL);
+				break;
+		}
+	} while (op.op != kLabelsEndPass);
 
-	sndcnt = cpu[candidate].iilast-cpu[candidate].ii;
-	MPI_Send(&clusterid[cpu[candidate].ii], sndcnt, MPI_INT,  candidate, kClusterMsg1, MPI_COMM_WORLD);
-	if (cpu[candidate].ii != cpu[candidate].jj)
+	for (i = 1; i < nproc; i++)
 	{
-		sndcnt = cpu[candidate].jjlast-cpu[candidate].jj;
-		MPI_Send(&clusterid[cpu[candidate].jj], sndcnt, MPI_INT,  candidate, kClusterMsg2, MPI_COMM_WORLD);
+		free(clustersnum[i]);
+		clustersnum[i] = NULL;
 	}
-	chunk->status = kChunkStatusComputing;
 
-	return(candidate);
-	
-} /* AssignChunk */
+} /* ServeLabels */
 /* ------------------------------------------------------------------------------------ */
 int main (int argc, char **argv)
 {	
 
 	char	fn[kMaxFilename];
 	char	ofn[kMaxFilename];
+	char	jobfn[kMaxFilename];
 	unsigned int colcnt;
 	char	*version="VERSION 1.0; 2019-12-26";
 	FACSNAME *facsname = NULL;
 	FACSDATA *facsdata = NULL;
-	FILE	 *f=NULL;
+	MPI_Win  facswin = MPI_WIN_NULL;
+	MPI_Win  namewin = MPI_WIN_NULL;
+	MPI_Comm nodecomm = MPI_COMM_NULL;
+	MPI_Comm leadercomm = MPI_COMM_NULL;
+	int nodecnt = 0;
+	DCLUSTFILE inputfile;
 	unsigned int loaded;
+	unsigned int events;
 	float distcutoff;
 	float distcutoffincreasestep;
 	float lastdistcutoff;
@@ -2295,12 +5819,41 @@ int main (int argc, char **argv)
 	unsigned int printClusterStatus = 0;
 	unsigned int assignUnassigned = 0;
 	unsigned int assignLeftover = 0;
+	unsigned int broadcastData = 0;
+	unsigned int resume = 0;
+	unsigned int adaptive = 0;
+	unsigned int modelCell = 0;
+	unsigned int outOfCore = 0;
+	unsigned int haloOption = 0;
+	int labelspaged = 0;
+	unsigned int depth = 0;
+	unsigned int keepCntcutoff;
+	float firstdistcutoff;
+	float firstdistcutoffincreasestep;
+	SUBSCAN subscan;
+	FACSDATA *topfacs;
+	BATCH batch;
+	struct timeval tbatch;
+	float jobdistcutoff;
+	float jobdistcutoffincreasestep;
+	float jobPctEventsToKeepCluster;
+	unsigned int jobcntcutoff;
+	unsigned int jobresume;
+	unsigned int jobadaptive;
+	unsigned int jobindexfiles;
+	SWEEP sweep;
+	char *pctlist = NULL;
+	char *cntlist = NULL;
+	char *stoplist = NULL;
+	char scanofn[kMaxFilename];
 	
 	/* must be first instruction */
     if (MPI_Init(&argc, &argv))
 		return(1);
+	gComm = MPI_COMM_WORLD;
 
 	gettimeofday(&ts, NULL); 
+	tbatch = ts;
 
 	/* --------- process arguments */
 
@@ -2309,6 +5862,7 @@ int main (int argc, char **argv)
 
 	fn[0] = 0;
 	ofn[0] = 0;
+	jobfn[0] = 0;
 	distcutoff = 0.0;
 	distcutoffincreasestep = 0.5;
 	lastdistcutoff = -1.0;
@@ -2318,7 +5872,7 @@ int main (int argc, char **argv)
 	verbose = 0;
 	stopWhenPctAssigned = 95.0;
 	opterr = 0;
-	while ((c = getopt (argc, argv, "i:o:f:l:s:k:n:p:b:v:gMUL")) != -1)
+	while ((c = getopt (argc, argv, "i:o:j:f:l:s:k:n:p:b:v:w:m:d:gMULBraOH")) != -1)
 	switch (c)
 	{
       case 'i':
@@ -2328,6 +5882,10 @@ int main (int argc, char **argv)
 	  case 'o':
 			strcpy(ofn,optarg);
         break;
+
+	  case 'j':
+			strcpy(jobfn,optarg);
+        break;
       
 	  case 'f':
 			sscanf(optarg,"%f",&distcutoff);
@@ -2349,14 +5907,17 @@ int main (int argc, char **argv)
 
 	  case 'k':
 			sscanf(optarg,"%f",&pctEventsToKeepCluster);
+			pctlist = optarg;
         break;
 
 	  case 'n':
 			sscanf(optarg,"%u",&cntcutoff);
+			cntlist = optarg;
         break;
 
 	  case 'p':
 			sscanf(optarg,"%f",&stopWhenPctAssigned);
+			stoplist = optarg;
         break;
 		
 	  case 'b':
@@ -2375,6 +5936,40 @@ int main (int argc, char **argv)
 			assignLeftover = 1;
 		break;
 
+	  case 'B':
+			broadcastData = 1;
+		break;
+
+	  case 'O':
+			outOfCore = 1;
+		break;
+
+	  case 'H':
+			haloOption = 1;
+		break;
+
+	  case 'r':
+			resume = 1;
+		break;
+
+	  case 'a':
+			adaptive = 1;
+		break;
+
+	  case 'm':
+			sscanf(optarg,"%u",&modelCell);
+		break;
+
+	  case 'd':
+			sscanf(optarg,"%u",&depth);
+		break;
+
+	  case 'w':
+			sscanf(optarg,"%u",&indexfiles);
+			if (indexfiles > kIndexFilesSync)
+				indexfiles = kIndexFilesSync;
+		break;
+
 	  case 'v':
 			sscanf(optarg,"%d",&verbose);
         break;
@@ -2382,19 +5977,30 @@ int main (int argc, char **argv)
 	}
 	if (ofn[0] == 0)
 		strcpy(ofn,fn);
+	if (resume)
+		indexfiles = kIndexFilesSync;
+	InitSweep(&sweep,pctlist,cntlist,stoplist,pctEventsToKeepCluster,stopWhenPctAssigned);
 
-	if ((fn[0] == 0) || (distcutoff < 0.00001))
+	if (((fn[0] == 0) && (jobfn[0] == 0)) || (distcutoff < 0.00001))
 	{
 		printf("usage:\n\n");
-		printf("dclust -i InputFile -f FirstDistanceCutoff [-l LastDistanceCutoff [-s Step] [-g]] [-o OutputFile] [-k PctEventsToKeepCluster | -n numEventsToKeepCluster] [-p pctAssigned] [ -v level]\n\n");
+		printf("dclust -i InputFile | -j JobFile -f FirstDistanceCutoff [-l LastDistanceCutoff [-s Step] [-g] [-a]] [-o OutputFile] [-k PctEventsToKeepCluster | -n numEventsToKeepCluster] [-p pctAssigned] [-U] [-L] [-m cell] [-d depth] [-B | -O] [-H] [-r] [-w mode] [ -v level]\n\n");
 		printf("       -i InputFile              : dselect binary output file.\n");
+		printf("       -j JobFile                : cluster every InputFile listed in JobFile, one \"InputFile [OutputFile]\" per line, with the same\n");
+		printf("                                   options. The ranks are split into groups sized by the rows of their InputFiles,\n");
+		printf("                                   larger InputFiles getting more ranks; the log of each goes to OutputFile.dclust\n");
 		printf("       -f FirstDistanceCutoff    : First Floating point cutoff value used to place events in the same cluster.\n");
 		printf("       -l LastDistanceCutoff     : Last Distance cutoff to test. Defaults is the same as DistanceCutoff.\n");
 		printf("       -s Step                   : Floating point increment of DistanceCutoff to test. Default is %f\n",distcutoffincreasestep);
 		printf("                                   Must be positive. To scan decreasing distances, use a DistanceCutoff > LastDistanceCutoff\n");
 		printf("       -g                        : go on with scanning even if the number of clusters retained decreases. Default is to stop.\n");
-		printf("                                   Must be positive. To scan decreasing distances, use a DistanceCutoff > LastDistanceCutoff\n");
+		printf("       -a                        : adaptive scan of increasing distances: the step doubles while the number of clusters retained\n");
+		printf("                                   does not change, and a step over which it changes or pctAssigned is reached is bisected\n");
+		printf("                                   down to Step. Only the distances kept are recorded in the cluster history\n");
 		printf("       -p pctAssigned            : Stop sampling as soon as pctAssigned events have been assigned. Defaults to %f %%\n",stopWhenPctAssigned);
+		printf("                                   -k, -n and -p also take comma separated lists of up to %d values: the distances are computed\n",kMaxSweepValues);
+		printf("                                   once, and each combination is written to OutputFile-k<pct>-p<pct> (or -n<cnt>-p<pct>)\n");
+		printf("                                   as a run with those values alone would. -r, -a and -d are then ignored\n");
 		printf("       -o OutputFile             : Rootname for the output files. Various extensions will be added.\n");
 		printf("                                   Default is same name as InputFile\n");
 		printf("       -k PctEventsToKeepCluster : Keep only clusters with more than Percent Events. Default is 0.5\n");
@@ -2403,13 +6009,32 @@ int main (int argc, char **argv)
 		printf("       -M                        : Report cluster Merging history\n");
 		printf("       -U                        : assign Unassigned to discovered clusters\n");
 		printf("       -L                        : assign Leftover (see dselect) to discovered clusters\n");
+		printf("       -m cell                   : write the cluster model used by dclassify to OutputFile.model, keeping one event\n");
+		printf("                                   of a cluster per cell of cell units; 1 keeps every distinct event (same result as -L)\n");
+		printf("       -d depth                  : cluster the events of every cluster found again with the same options, down to depth\n");
+		printf("                                   levels, without leaving the job; writes the cluster of each level to OutputFile.subclusters\n");
+		printf("       -B                        : master loads the InputFile and broadcasts it (for InputFile not visible from every node)\n");
+		printf("                                   otherwise a v2 InputFile is mapped by every rank and its rows are used in place\n");
+		printf("       -O                        : out of core: each slave pages in only the rows of the chunks it computes, reading the\n");
+		printf("                                   next chunk ahead and dropping each one once done, and keeps the labels of its own range\n");
+		printf("                                   of the rows (as with -H) from one distance to the next; the master keeps none, so no rank\n");
+		printf("                                   needs memory for every row or label. Ignores -r, -a, -d, -m, -w and the lists of -k/-n/-p\n");
+		printf("       -H                        : each slave owns a contiguous range of the rows sorted on the key and computes only the\n");
+		printf("                                   chunks starting there, which reach the next rows within the distance (its halo). The\n");
+		printf("                                   labels of its range come from the master once per distance, those of its halo from\n");
+		printf("                                   the slaves owning them, which get them back at the end and merge the clusters they\n");
+		printf("                                   link; no label goes through the master with the chunks. With -O, a slave then holds\n");
+		printf("                                   about its share of the rows and labels\n");
+		printf("       -r                        : resume an interrupted scan from the OutputFile.checkpoint written after each distance\n");
+		printf("       -w mode                   : the labels of each distance are kept in memory by the master; also write them to OutputFile-<dist>\n");
+		printf("                                   0: never, 1: in the background, 2: before going on (default, needed by -r and for checkpoints)\n");
 		printf("       -v level                  : specifies the verbose level; default is 0.\n\n");
 		printf("VERSION\n");
 		printf("\n%s\n",version);
 		printf("Author:  Nicolas Guex; 2008-2019\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, released under GPL2+ and you are welcome to redistribute it under certain conditions.\n");
 		printf("CONTACT: Nicolas.Guex@unil.ch\n");
 		printf("SEE ALSO\n");
-		printf("      dselect cextract\n\n");
+		printf("      dselect cextract dclassify\n\n");
 		return(1);
 	}
 
@@ -2427,7 +6052,60 @@ int main (int argc, char **argv)
 		printf("Software has been compiled to run at most on %d cpus\n",(kMaxCPU-1));
 		return(1);
 	}
-	
+
+	if (sweep.cnt > 0)
+	{
+		if ((idproc == 0) && (resume || adaptive || depth))
+			printf("LOG: -r, -a and -d do not apply to lists of -k/-n/-p; ignored\n");
+		resume = 0;
+		adaptive = 0;
+		depth = 0;
+	}
+
+	memset(&batch,0,sizeof(BATCH));
+	if (jobfn[0] != 0)
+	{
+		if (InitBatch(&batch,jobfn,idproc,nproc))
+		{
+			MPI_Finalize();
+			return(1);
+		}
+		MPI_Comm_rank(gComm, &idproc);
+		MPI_Comm_size(gComm, &nproc);
+	}
+	/* every InputFile of -j starts from the options given */
+	jobdistcutoff = distcutoff;
+	jobdistcutoffincreasestep = distcutoffincreasestep;
+	jobPctEventsToKeepCluster = pctEventsToKeepCluster;
+	jobcntcutoff = cntcutoff;
+	jobresume = resume;
+	jobadaptive = adaptive;
+	jobindexfiles = indexfiles;
+
+nextJob:
+	if (jobfn[0] != 0)
+	{
+		if (!NextBatchJob(&batch,fn,ofn,idproc))
+		{
+			MPI_Barrier(MPI_COMM_WORLD);
+			gettimeofday(&ts, NULL);
+			MPI_Comm_rank(MPI_COMM_WORLD, &idproc);
+			if (idproc == 0)
+				printf("LOG:%s done in %d sec\n",jobfn,((int)ts.tv_sec-(int)tbatch.tv_sec));
+			FreeBatch(&batch);
+			MPI_Finalize();
+			return(0);
+		}
+		distcutoff = jobdistcutoff;
+		distcutoffincreasestep = jobdistcutoffincreasestep;
+		bestdistcutoff = 0.0;
+		cntcutoff = jobcntcutoff;
+		pctEventsToKeepCluster = jobPctEventsToKeepCluster;
+		resume = jobresume;
+		adaptive = jobadaptive;
+		indexfiles = jobindexfiles;
+		gettimeofday(&ts, NULL);
+	}
 
 	/* --------- process */
 	if (lastdistcutoff < 0.0)
@@ -2444,22 +6122,12 @@ int main (int argc, char **argv)
 		}
 	}
 
-	if (idproc == 0)
-	{
-		f = fopen(fn,"r");
-		if (!f)
-		{
-			printf("LOG:Cannot Open InputFile %s\n",fn);
-			rowcnt = 0;	/* signal slaves that they can bail */
-			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-		}
-	}		
+	memset(&inputfile,0,sizeof(DCLUSTFILE));
+	inputfile.fd = -1;
+	memset(&subscan,0,sizeof(SUBSCAN));
 
 	{
 		unsigned int ii;
-		unsigned int jj;
 		unsigned int *clusterid = NULL;
 		
 		int mrg;
@@ -2470,102 +6138,140 @@ int main (int argc, char **argv)
 
 		if (idproc == 0)
 		{
-			if (dclustFileReadHeader(f,idproc,&rowcnt,&colcnt,&key,&loadEveryNsample) != 0)
+			if (dclustFileReadHeader(fn,idproc,&rowcnt,&colcnt,&key,&loadEveryNsample) != 0)
+			{
+				rowcnt = 0;	/* signal slaves that they can bail */
+				MPI_Bcast (&rowcnt, 1, MPI_INT, 0, gComm);
+				MPI_Bcast (&rowcnt, 1, MPI_INT, 0, gComm);
+				MPI_Bcast (&rowcnt, 1, MPI_INT, 0, gComm);
 				goto abort;
-			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&colcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&key, 1, MPI_INT, 0, MPI_COMM_WORLD);
+			}
+			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, gComm);
+			MPI_Bcast (&colcnt, 1, MPI_INT, 0, gComm);
+			MPI_Bcast (&key, 1, MPI_INT, 0, gComm);
 		}
 		else
 		{
 			loadEveryNsample = 0; /* unused for slave, stop compiler warnings */
-			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&colcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-			MPI_Bcast (&key, 1, MPI_INT, 0, MPI_COMM_WORLD);
+			MPI_Bcast (&rowcnt, 1, MPI_INT, 0, gComm);
+			MPI_Bcast (&colcnt, 1, MPI_INT, 0, gComm);
+			MPI_Bcast (&key, 1, MPI_INT, 0, gComm);
 			if (rowcnt == 0)
 				goto abort;
 		}
 
 		sortkey = key;
 
-		/* --------- allocate memory */
-		facsdata = calloc(rowcnt,sizeof(FACSDATA));
-		if (!facsdata)
-			goto abort;
-
-		if (idproc == 0)
+		/* --------- use the rows of a v2 input file in place when every rank can map it */
+		facsdata = NULL;
+		loaded = 0;
+		gOutOfCore = 0;
+		if (broadcastData == 0)
+			facsdata = MapFacsData(&inputfile,fn,rowcnt,colcnt,key,idproc,&facsname);
+		if (facsdata)
 		{
-			facsname = calloc(rowcnt,sizeof(FACSNAME));
-			if (!facsname)
-				goto abort;
+			loaded = rowcnt;
+			gOutOfCore = outOfCore;
+			if ((idproc == 0) && (verbose > 0))
+				printf("LOG:Using mapped InputFile\n");
 		}
-		clusterid = calloc(rowcnt,sizeof(MPI_INT));
-
-		/* should test if calloc worked */
-		if (idproc == 0)
+		else
 		{
-			unsigned int tosend = rowcnt;
-			unsigned int sendfrom = 0;
-			loaded = loaddata(f,facsname,facsdata,rowcnt,colcnt,idproc);
-			if (loaded == 0)
+			/* --------- allocate memory (one copy of the data per node) */
+			facsdata = AllocateSharedFacsData(rowcnt,&nodecomm,&leadercomm,&facswin,&facsname,&namewin,&nodecnt);
+			if (!facsdata)
 			{
-				printf("LOG:error (no input data)\n");
+				if (idproc == 0)
+					printf("LOG:Cannot Allocate shared memory for %u rows\n",rowcnt);
 				goto abort;
 			}
-			while(tosend > 0)
+
+			/* --------- load data: each rank reads its share directly, unless the file is not visible from every node */
+			if (broadcastData == 0)
+				loaded = DirectLoadSharedFacsData(fn,facsdata,facsname,rowcnt,colcnt,key,idproc,nodecomm,facswin,namewin);
+			if (loaded == 0)
 			{
-	                    unsigned int smallchunk;
-			    if (tosend <= 1000000)
-			    {
-					smallchunk = tosend;
-					tosend = 0;
-			    }
-			    else
-			    {
-					smallchunk = 1000000;
-					tosend -= 1000000;
- 			    }
-			    MPI_Bcast (&facsdata[sendfrom], smallchunk*sizeof(FACSDATA), MPI_CHAR, 0, MPI_COMM_WORLD);
-			    sendfrom += 1000000;
+				if (idproc == 0)
+				{
+					if (broadcastData == 0)
+						printf("LOG:Input file not readable from every rank, master loads and broadcasts data\n");
+					if (DclustFileOpen(&inputfile,fn,kDclustSelectedFile,1) == 0)
+					{
+						loaded = loaddata(&inputfile,facsname,facsdata,0,rowcnt,colcnt);
+						DclustFileClose(&inputfile);
+					}
+					if (loaded != rowcnt)
+					{
+						printf("LOG:error (no input data)\n");
+						goto abort;
+					}
+				}
+				else
+					loaded=rowcnt;  // ???????? really useful for slave ?????
+				BroadcastSharedFacsData(facsdata,rowcnt,leadercomm,facswin);
+				MPI_Win_fence(0,namewin);
 			}
-			MPI_Bcast(&clusterid[0], rowcnt, MPI_INT,  0, MPI_COMM_WORLD);
+			if ((idproc == 0) && (verbose > 0))
+				printf("LOG:Sharing data between %d nodes\n",nodecnt);
 		}
-		else
-		{
-			unsigned int tosend = rowcnt;
-			unsigned int sendfrom = 0;
 
-			loaded=rowcnt;  // ???????? really useful for slave ?????
-			while(tosend > 0)
+		/* --------- -O: slaves keep in memory only the rows of their chunks and the labels of their own rows; the master none */
+		if (outOfCore && !gOutOfCore && (idproc == 0))
+			printf("LOG:-O needs a v2 InputFile mapped by every rank; the rows are held in memory\n");
+		gRangeLabels = gOutOfCore;
+		gLabelOps = (gRangeLabels && (idproc == 0));
+		gHalo = (haloOption || gRangeLabels);
+		ownfirst = ownlast = 0;
+		if (gRangeLabels)
+		{
+			if (idproc != 0)
 			{
-				unsigned int smallchunk;    
-				if (tosend <= 1000000)
-				{   
-					smallchunk = tosend;
-					tosend = 0;
-				}   
-				else
-				{   
-				   smallchunk = 1000000;
-					tosend -= 1000000;
-				}
-				MPI_Bcast (&facsdata[sendfrom], smallchunk*sizeof(FACSDATA), MPI_CHAR, 0, MPI_COMM_WORLD);
-				sendfrom += 1000000;
+				ownfirst = RangeFirstRow(rowcnt,nproc,idproc);
+				ownlast = RangeFirstRow(rowcnt,nproc,idproc+1);
 			}
-			MPI_Bcast(&clusterid[0], rowcnt, MPI_INT,  0, MPI_COMM_WORLD);
+			if ((idproc == 0) && (resume || adaptive || depth || modelCell || (sweep.cnt > 0)))
+				printf("LOG:-r, -a, -d, -m and the lists of -k/-n/-p do not apply with -O\n");
+			resume = 0;
+			adaptive = 0;
+			modelCell = 0;
+			sweep.cnt = 0;
+			indexfiles = kIndexFilesNone;  /* each slave keeps the labels of its own rows */
+			if (idproc == 0)
+				printf("LOG:Labels held by %d slaves of about %u rows each\n",nproc-1,rowcnt/(nproc-1));
 		}
-	
+		labelspaged = (gOutOfCore && (idproc != 0));
+		clusterid = (gLabelOps) ? NULL : AllocateLabels(rowcnt,labelspaged);
+		if (!clusterid && !gLabelOps)
+		{
+			printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+			MPI_Abort(MPI_COMM_WORLD,1);
+		}
+
+		events = rowcnt;
+		if (idproc == 0)
+			events = LoadRowWeights(fn,rowcnt,0,(gRangeLabels) ? 0 : rowcnt);
+		else if (gRangeLabels)
+			events = LoadRowWeights(fn,rowcnt,ownfirst,ownlast);
+		if (InitSubScan(&subscan,(gRangeLabels) ? 0 : depth,rowcnt,idproc))
+			subscan.depth = 0;
+		MPI_Bcast (&subscan.depth, 1, MPI_INT, 0, gComm);
+		topfacs = facsdata;
+		keepCntcutoff = cntcutoff;
+		firstdistcutoff = distcutoff;
+		firstdistcutoffincreasestep = distcutoffincreasestep;
+
+scanSubset:
 		if (cntcutoff > 0)
 		{
 			if (cntcutoff < colcnt)
 			{
 				printf("LOG:Warning:pctEventsToKeepCluster lower than column count (%u < %u)\n",cntcutoff,colcnt);
 			}
-			pctEventsToKeepCluster = (float)cntcutoff / (float)(rowcnt)*100.0;
+			pctEventsToKeepCluster = (float)cntcutoff / (float)(events)*100.0;
 		}
 		else /* compute cntctoff */
 		{
-			cntcutoff = (unsigned int)(((float)(rowcnt) / 100.0 * pctEventsToKeepCluster ) );
+			cntcutoff = (unsigned int)(((float)(events) / 100.0 * pctEventsToKeepCluster ) );
 			if (cntcutoff < colcnt)
 			{
 				printf("LOG:Warning:pctEventsToKeepCluster lower than column count (%u < %u)\n",cntcutoff,colcnt);
@@ -2575,73 +6281,94 @@ int main (int argc, char **argv)
 		
 		if (idproc == 0)  /* ---------------- master node ------------- */
 		{
-			printf("LOG:Loaded %u rows of %u columns from %s\n",rowcnt,colcnt,fn);
+			if (subscan.cur.level == 0)
+				printf("LOG:Loaded %u rows of %u columns from %s\n",rowcnt,colcnt,fn);
+			if (rowweight)
+				printf("LOG:The %u rows stand for %u events\n",rowcnt,events);
 			printf("LOG:PctEventsToKeepCluster=%.3f (%u events)\n",pctEventsToKeepCluster,cntcutoff);
 			printf("DBH:totseconds,cpus,loadEveryNsample,distcutoff,loaded,assigned,unassigned,pctassigned,pctunassigned,clustercnt,trimclustercnt\n");
-			fclose(f);
 		}
 		gTestDist = (unsigned int)(distcutoff*distcutoff*colcnt);
 
 		if (idproc == 0)  /* ---------------- master node ------------- */
 		{
 			CHUNK *chunk;
-			CPU	  cpu[kMaxCPU];
+			CHUNKPLAN plan;
+			CPUQUEUE cpu[kMaxCPU];
+			HALO halo;
+			CPU	  endmsg;
 			unsigned int whichcpu;
 			unsigned int alldone = 1;  // will be initialized, ignore compiler whining.
 			unsigned int submitted;
-			unsigned int chunkcnt;
 			unsigned int chunckcnt;
 			unsigned  int unassigned;
-			unsigned int processingBlockSize = 131072;
 			int trimmedclustercnt;
-			int initialClusterCnt;
+			int initialClusterCnt = 0;
 			int highesttrimmedclustercnt = -1;
 			unsigned int passcnt = 0;
 			unsigned int  isMergingPreexistingClusters;
 			float distOfLastClusterIndices = 0.0;
 			STATS stats[2];
+			ADAPTIVESCAN as;
+			int changed;
 
-			clusterhistory = malloc(kMaxCluster*sizeof(CLUSTERHISTORY));
+			if (!clusterhistory)
+				clusterhistory = malloc(kMaxCluster*sizeof(CLUSTERHISTORY));
+			clusterhistorycnt = 0;
 			if (!clusterhistory)
 			{
 				fprintf(stderr,"LOG: ERROR: not enough memory\n");
 				goto abort;
 			}
 
-			if (desiredBlockSize == 0)
-			{
-				
-				/* arrange to keep each slave node busy with at least about 100 computations, but do not go below blocksize of 256 events */
-				do 
-				{
-					chunkcnt = ((loaded/processingBlockSize+2)*(loaded/processingBlockSize+2))/2;
-					processingBlockSize >>= 1;
-				} while( ((chunkcnt / (nproc-1)) < 100) && (processingBlockSize > 128) );
-				processingBlockSize <<= 1;
-			}
-			else
+			memset(&plan,0,sizeof(CHUNKPLAN));
+			memset(&halo,0,sizeof(HALO));
+			memset(&as,0,sizeof(ADAPTIVESCAN));
+			if (adaptive && (lastdistcutoff <= distcutoff))
 			{
-				processingBlockSize = desiredBlockSize;
-				chunkcnt = ((loaded/processingBlockSize+2)*(loaded/processingBlockSize+2))/2;
+				printf("LOG: -a only applies to increasing distances; scanning every Step\n");
+				adaptive = 0;
 			}
-
-			chunk = calloc(chunkcnt,sizeof(CHUNK));
-			if (!chunk)
-			{
-				printf("LOG:Not enough memory to allocate %u chunks; recompile with larger processingBlockSize\n",chunkcnt);	
-				cpu[0].ii = kNoMoreBlocks;
-				cpu[0].jj = kNoMoreBlocks;
-				for (ii = 1; ii<nproc; ii++)
-					MPI_Send(&cpu[0], 4, MPI_INT,  ii, kWhichBlocksToCompute, MPI_COMM_WORLD);
+			if (adaptive && InitAdaptiveScan(&as,loaded))
+				goto abort;
+			if ((sweep.cnt > 0) && StartSweep(&sweep,loaded,events,distcutoff,distcutoffincreasestep,lastdistcutoff,ofn))
 				goto abort;
-			}				
-
 
-			
 			stats[0].dist = 0.0;
 			stats[0].rawClustersCnt = -1;
 			stats[0].trimmedClustersCnt = -1;
 			stats[0].pctAssigned = 0.0;
+
+			if (resume)
+			{
+				CHECKPOINT cp;
+
+				if (ReadCheckpoint(&cp,clusterid,loaded,colcnt,ofn))
+				{
+					distcutoff = cp.distcutoff;
+					distcutoffincreasestep = cp.distcutoffincreasestep;
+					bestdistcutoff = cp.bestdistcutoff;
+					distOfLastClusterIndices = cp.distOfLastClusterIndices;
+					highesttrimmedclustercnt = cp.highesttrimmedclustercnt;
+					initialClusterCnt = cp.initialClusterCnt;
+					passcnt = cp.passcnt;
+					stats[0] = cp.stats;
+					printf("LOG:Resuming scan at distance %.3f after %u passes\n",distcutoff,passcnt);
+					if (adaptive && (passcnt > 0))
+					{
+						as.probesteps = (unsigned int)((distcutoff-stats[0].dist)/distcutoffincreasestep + 0.5);
+						if (as.probesteps < 1)
+							as.probesteps = 1;
+						if (SaveAcceptedPass(&as,clusterid,loaded,passcnt-1,initialClusterCnt))
+							adaptive = 0;
+					}
+				}
+				else
+					printf("LOG:No checkpoint to resume from in %s.checkpoint; starting at first distance\n",ofn);
+				gTestDist = (unsigned int)(distcutoff*distcutoff*colcnt);
+				MPI_Bcast (&gTestDist, 1, MPI_INT, 0, gComm);
+				MPI_Bcast (&initialClusterCnt, 1, MPI_INT, 0, gComm);
+			}
 			
 repeatWithNewDist:
 			stats[1].dist = distcutoff;
@@ -2656,54 +6383,29 @@ repeatWithNewDist:
 			trimmedclustercnt = -1;
 			for (ii = 1; ii<nproc; ii++)
 			{
-				cpu[ii].ii = kCPU_availaible;
-				cpu[ii].jj = kCPU_availaible;
+				cpu[ii].head = 0;
+				cpu[ii].cnt = 0;
 			}
-			chunckcnt = 0;
-			for (ii = 0; ii < loaded; ii += processingBlockSize)
-			for (jj = ii; jj < loaded; jj += processingBlockSize)
+			chunckcnt = PlanChunks(facsdata,loaded,nproc,desiredBlockSize,&plan,verbose);
+			chunk = plan.chunk;
+			if (gHalo)
+				SendHalo(&halo,clusterid,chunk,chunckcnt,loaded,nproc,plan.blocksize,verbose);
+			if (!chunckcnt)
 			{
-				FACSDATA *facspi;
-				FACSDATA *facspj;
-				unsigned short valii,valjj;
-				
-				chunk[chunckcnt].ii = ii;
-				chunk[chunckcnt].jj = jj;
-				if ((ii+processingBlockSize) < loaded)
-					chunk[chunckcnt].iilast = ii+processingBlockSize; 
-				else
-					chunk[chunckcnt].iilast  = loaded;
-				if ((jj+processingBlockSize) < loaded)
-					chunk[chunckcnt].jjlast = jj+processingBlockSize;
-				else
-					chunk[chunckcnt].jjlast  = loaded;
-					
-				if (ii != jj)
-				{
-					facspi = &facsdata[chunk[chunckcnt].iilast-1];
-					facspj = &facsdata[jj];
-					valii = facspi->data[key];
-					valjj = facspj->data[key];
-					if (valjj > valii)
-					{
-						unsigned  int mindist = valjj-valii;
-						mindist *= mindist;
-						if (mindist > gTestDist)
-						{
-							continue;
-						}
-					}
-				}
-				chunk[chunckcnt].status = kChunkStatusToDo;
-				chunckcnt++;
-			}
+				printf("LOG:Not enough memory to allocate the chunks; use a larger block size (-b)\n");	
+				endmsg.ii = kNoMoreBlocks;
+				endmsg.jj = kNoMoreBlocks;
+				for (ii = 1; ii<nproc; ii++)
+					MPI_Send(&endmsg, 4, MPI_INT,  ii, kWhichBlocksToCompute, gComm);
+				goto abort;
+			}				
 
 			submitted = 0;
 			fflush(stdout);
 			do
 			{				
-				/* if at least one cpu idle, try to submit as many jobs as possible */
-				if (submitted < (nproc-1))
+				/* if at least one cpu idle or with an empty queue slot, try to submit as many jobs as possible */
+				if (submitted < (nproc-1)*kChunksPerCPU)
 				{
 					alldone = 1;
 					for (ii = 0; ii < chunckcnt; ii++)
@@ -2711,7 +6413,7 @@ repeatWithNewDist:
 						if (chunk[ii].status == kChunkStatusToDo)
 						{
 							alldone = 0;
-							if (AssignChunk(clusterid,&chunk[ii],cpu,nproc))
+							if (AssignChunk(clusterid,&chunk[ii],cpu,nproc,(gHalo) ? &halo : NULL))
 							{
 									if (verbose > 1)
 									{
@@ -2719,7 +6421,7 @@ repeatWithNewDist:
 										fflush(stdout);
 									}
 									submitted++;
-									if (submitted == (nproc-1))
+									if (submitted == (nproc-1)*kChunksPerCPU)
 										break;
 							}
 						}
@@ -2729,16 +6431,22 @@ repeatWithNewDist:
 				if (submitted)
 				{
 					int rcvcnt;
-
-					MPI_Recv(&whichcpu, 1, MPI_INT,  MPI_ANY_SOURCE, kCPUdoneMsg, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
-					rcvcnt =  (cpu[whichcpu].iilast-cpu[whichcpu].ii);
-					MPI_Recv(&clusterid[cpu[whichcpu].ii],rcvcnt, MPI_INT,  whichcpu, kClusterMsg1, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
-					if (cpu[whichcpu].jj != cpu[whichcpu].ii)
+					CPU *done;
+
+					/* slaves compute their chunks in the order they were sent, the finished one is at the head of the queue */
+					MPI_Recv(&whichcpu, 1, MPI_INT,  MPI_ANY_SOURCE, kCPUdoneMsg, gComm, MPI_STATUS_IGNORE/*&status*/);
+					done = &cpu[whichcpu].chunk[cpu[whichcpu].head];
+					rcvcnt =  (done->iilast-done->ii);
+					if (!PrivateRows(halo.privfirst[whichcpu],halo.privlast[whichcpu],done->ii,done->iilast))
+						MPI_Recv(&clusterid[done->ii],rcvcnt, MPI_INT,  whichcpu, kClusterMsg1, gComm, MPI_STATUS_IGNORE/*&status*/);
+					if ((done->jj != done->ii) && !PrivateRows(halo.privfirst[whichcpu],halo.privlast[whichcpu],done->jj,done->jjlast))
 					{
-						rcvcnt =  (cpu[whichcpu].jjlast-cpu[whichcpu].jj);
-						MPI_Recv(&clusterid[cpu[whichcpu].jj],rcvcnt, MPI_INT,  whichcpu, kClusterMsg2, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
+						rcvcnt =  (done->jjlast-done->jj);
+						MPI_Recv(&clusterid[done->jj],rcvcnt, MPI_INT,  whichcpu, kClusterMsg2, gComm, MPI_STATUS_IGNORE/*&status*/);
 					}
-					cpu[whichcpu].ii = cpu[whichcpu].jj = kCPU_availaible;
+					MPI_Waitall(3,cpu[whichcpu].req[cpu[whichcpu].head],MPI_STATUSES_IGNORE);
+					cpu[whichcpu].head = (cpu[whichcpu].head+1) % kChunksPerCPU;
+					cpu[whichcpu].cnt--;
 					submitted--;
 				}
 			} while ((submitted > 0) || (!alldone));
@@ -2753,14 +6461,17 @@ repeatWithNewDist:
 			
 			/* signal to all nodes that they should clean up */
 			/* collect cluster number assigned by each proc and adjust clusters from 1..clustercnt */
-			cpu[0].ii = kNoMoreBlocks;
-			cpu[0].jj = 0;
+			endmsg.ii = kNoMoreBlocks;
+			endmsg.jj = 0;
+			for (ii = 1; ii<nproc; ii++)  /* -O: the slaves fold their halos together before counting */
+				MPI_Send(&endmsg, 4, MPI_INT,  ii, kWhichBlocksToCompute, gComm);
 			for (ii = 1; ii<nproc; ii++)
 			{
 				int finalCPUcnt;
 
-				MPI_Send(&cpu[0], 4, MPI_INT,  ii, kWhichBlocksToCompute, MPI_COMM_WORLD);
-				MPI_Recv(&finalCPUcnt, 1, MPI_INT,  ii, kFinalCntRequest, MPI_COMM_WORLD, MPI_STATUS_IGNORE/*&status*/);
+				MPI_Recv(&finalCPUcnt, 1, MPI_INT,  ii, kFinalCntRequest, gComm, MPI_STATUS_IGNORE/*&status*/);
+				if (gHalo && !gRangeLabels && (halo.last[ii] > halo.first[ii]))
+					MPI_Recv(&clusterid[halo.first[ii]],halo.last[ii]-halo.first[ii], MPI_INT,  ii, kHaloLabelsMsg, gComm, MPI_STATUS_IGNORE);
 				finalCPUcnt -= (ii*kStartLocalCluster);
 				if (verbose > 2)
 				{
@@ -2787,9 +6498,9 @@ repeatWithNewDist:
 			}
 
 			DoMergeLists(nproc,verbose);
-			MPI_Recv(&mergerequestcnt, 1, MPI_INT,  1, kFinalMergeRequestCntRequest, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+			MPI_Recv(&mergerequestcnt, 1, MPI_INT,  1, kFinalMergeRequestCntRequest, gComm,MPI_STATUS_IGNORE);
 			if (mergerequestcnt > 0)
-				MPI_Recv(&mergerequest, mergerequestcnt*2, MPI_INT,  1, kSendFinalMergeRequestRequest, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+				MPI_Recv(&mergerequest, mergerequestcnt*2, MPI_INT,  1, kSendFinalMergeRequestRequest, gComm,MPI_STATUS_IGNORE);
 
 			if (verbose > 1)
 			{
@@ -2806,6 +6517,9 @@ repeatWithNewDist:
 			{
 				removeclustersnum(mergerequest[mrg].cluster2);
 			}
+			clustercnt += LabelCollapsedRows(clusterid,loaded);
+			if (sweep.cnt > 0)
+				SweepPass(&sweep,clusterid,loaded,nproc,distcutoff,(clustercnt-mergerequestcnt),lastdistcutoff,goOnEvenIfClusterCntDecreases);
 
 			/* Discarding clusters with too few events */
 			trimmedclustercnt = RemoveSmallClusters(clusterid,loaded,nproc,cntcutoff);
@@ -2815,7 +6529,33 @@ repeatWithNewDist:
 
 			UpdateClusterHistory(passcnt,trimmedclustercnt,stats[0].trimmedClustersCnt,distcutoff,verbose);
 			AdjustClustersID(clusterid,loaded,nproc,verbose,trimmedclustercnt,&initialClusterCnt);
-			unassigned = loaded;
+
+			/* -a: a distance several steps away where the clusters changed is dropped for one closer to the last kept */
+			changed = 1;
+			if (adaptive && (passcnt > 0))
+			{
+				unsigned int assigned = (trimmedclustercnt > 0) ? CountAssignedEvents(clusterid,loaded,trimmedclustercnt) : 0;
+				float pct = 100.0*assigned/events;
+
+				changed = (trimmedclustercnt != stats[0].trimmedClustersCnt) || (pct >= stopWhenPctAssigned) || (((clustercnt-mergerequestcnt) == 1) && (trimmedclustercnt >= 1));
+				if (AdaptiveProbeRejected(&as,changed))
+				{
+					gettimeofday(&te, NULL);
+					printf("DBV:%d,%d,%u,%.3f,%u,%u,%u,%.3f,%.3f,%u,%d\n",((int)te.tv_sec-(int)ts.tv_sec),nproc,loadEveryNsample,distcutoff,events,assigned,events-assigned,pct,(100.0 - pct),(clustercnt-mergerequestcnt),trimmedclustercnt);
+					printf("LOG: Bisecting between %.3f and %.3f, where the retained clusters change\n",stats[0].dist,distcutoff);
+					for (ii = 1; ii<nproc; ii++)
+					{
+						if (clustersnum[ii])
+							free(clustersnum[ii]);
+					}
+					RestoreAcceptedPass(&as,clusterid,loaded,&initialClusterCnt);
+					distcutoff = stats[0].dist + as.probesteps*distcutoffincreasestep;
+					SendNextDistance(distcutoff,colcnt,nproc,initialClusterCnt);
+					printf("LOG:**************************************************************\n");
+					goto repeatWithNewDist;
+				}
+			}
+			unassigned = events;
 			if (trimmedclustercnt == 0)
 			{
 				printf("LOG: %12d Assigned    (%5.1f %%)\n",0,0.0);	
@@ -2841,18 +6581,17 @@ repeatWithNewDist:
 						printf("LOG:Adjusting Cluster Numbers\n");
 						fflush(stdout);
 					}
-					if (isMergingPreexistingClusters == 1)  //here should write under correct name only if merging, otherwise, save status unde "last dist" just in case we were indeed last dist...
-					{
-						char oldfn[kMaxFilename];
-						char newfn[kMaxFilename];
-						sprintf(oldfn,"%s-%.6f",ofn,0.0);
-						sprintf(newfn,"%s-%.6f",ofn,distOfLastClusterIndices);
-						rename(oldfn,newfn);
-						WriteClusterIndices(clusterid,loaded,distcutoff,ofn);
-					}
-					else
+					if (sweep.cnt == 0)  /* each combination of -k/-n/-p keeps its own labels */
 					{
-						WriteClusterIndices(clusterid,loaded,0.0,ofn);
+						if (isMergingPreexistingClusters == 1)  //here should write under correct name only if merging, otherwise, save status unde "last dist" just in case we were indeed last dist...
+						{
+							RenameClusterIndices(0.0,distOfLastClusterIndices,ofn);
+							KeepClusterIndices(clusterid,loaded,distcutoff,ofn);
+						}
+						else
+						{
+							KeepClusterIndices(clusterid,loaded,0.0,ofn);
+						}
 					}
 					distOfLastClusterIndices = distcutoff;
 
@@ -2863,11 +6602,11 @@ repeatWithNewDist:
 							printf("LOG:Not Writing Results\n");
 							fflush(stdout);
 						}
-						unassigned = loaded-CountAssigned(clusterid,loaded,trimmedclustercnt);
+						unassigned = events-CountAssignedEvents(clusterid,loaded,trimmedclustercnt);
 					}
-					stats[1].pctAssigned = 100.0*(loaded-unassigned)/loaded;
-					printf("LOG: %12u TotalEvents\n",loaded);	
-					printf("LOG: %12u Assigned    (%5.1f %%)\n",(loaded-unassigned),stats[1].pctAssigned);	
+					stats[1].pctAssigned = 100.0*(events-unassigned)/events;
+					printf("LOG: %12u TotalEvents\n",events);	
+					printf("LOG: %12u Assigned    (%5.1f %%)\n",(events-unassigned),stats[1].pctAssigned);	
 					printf("LOG: %12u Unassigned  (%5.1f %%)\n",unassigned,100.0-stats[1].pctAssigned);	
 					fflush(stdout);
 				}
@@ -2881,12 +6620,20 @@ repeatWithNewDist:
 			}
 
 			gettimeofday(&te, NULL);
-			printf("DBV:%d,%d,%u,%.3f,%u,%u,%u,%.3f,%.3f,%u,%d\n",((int)te.tv_sec-(int)ts.tv_sec),nproc,loadEveryNsample,distcutoff,loaded,loaded-(unassigned),(unassigned),stats[1].pctAssigned,(100.0 - stats[1].pctAssigned),(clustercnt-mergerequestcnt),trimmedclustercnt);
+			printf("DBV:%d,%d,%u,%.3f,%u,%u,%u,%.3f,%.3f,%u,%d\n",((int)te.tv_sec-(int)ts.tv_sec),nproc,loadEveryNsample,distcutoff,events,events-(unassigned),(unassigned),stats[1].pctAssigned,(100.0 - stats[1].pctAssigned),(clustercnt-mergerequestcnt),trimmedclustercnt);
 			fflush(stdout);
 
 			/* test if should keep scanning */
 			ii = 0;
-			if (lastdistcutoff == distcutoff) 
+			if (sweep.cnt > 0)
+			{
+				/* every Step is computed until each combination of -k/-n/-p has taken the distances it takes alone */
+				sweep.pass++;
+				distcutoff = sweep.first + sweep.pass*sweep.step*sweep.direction;
+				if ((sweep.active == 0) || ((distcutoff-lastdistcutoff)*sweep.direction > 0.0))
+					ii = 1;
+			}
+			else if (lastdistcutoff == distcutoff) 
 				ii = 1;
 			else
 			{
@@ -2912,6 +6659,28 @@ repeatWithNewDist:
 					 or at least stopWhenPctAssigned % of events have been assigned to a retained cluster */
 					if (  (((clustercnt-mergerequestcnt) == 1) && (trimmedclustercnt >= 1) && (passcnt > 0)) || (stats[1].pctAssigned >= stopWhenPctAssigned)) 
 						ii = 1;
+					else if (adaptive)
+					{
+						AdaptiveNextSteps(&as,changed);
+						distcutoff = stats[1].dist + as.probesteps*distcutoffincreasestep;
+						if ((distcutoff > lastdistcutoff) && (stats[1].dist + distcutoffincreasestep <= lastdistcutoff))
+						{
+							while (stats[1].dist + as.probesteps*distcutoffincreasestep > lastdistcutoff)
+								as.probesteps /= 2;
+							distcutoff = stats[1].dist + as.probesteps*distcutoffincreasestep;
+						}
+						if (verbose > 0)
+							printf("LOG: Next distance %u steps away\n",as.probesteps);
+						stats[1].rawClustersCnt = (clustercnt-mergerequestcnt);
+
+						if (distcutoff > lastdistcutoff)  // all done.
+							ii = 1;
+						if ((goOnEvenIfClusterCntDecreases == 0) && (trimmedclustercnt < highesttrimmedclustercnt))
+						{
+							printf("LOG: Stopping. (number of clusters decreases)\n");	
+							ii = 1;
+						}
+					}
 					else
 					{
 						/* if less than 0.1% change between two tested distances and only 1 cluster left, with over 50% of events assigned, double sampling step. */
@@ -2942,29 +6711,55 @@ repeatWithNewDist:
 			if (ii == 1)  // all done.
 			{
 				char oldfn[kMaxFilename];
-				char newfn[kMaxFilename];
-				sprintf(oldfn,"%s-%.6f",ofn,0.0);
-				sprintf(newfn,"%s-%.6f",ofn,distOfLastClusterIndices);
-				rename(oldfn,newfn);
+				unsigned int result = 0;
+
+				strcpy(scanofn,ofn);
+nextResult:
+				if (sweep.cnt > 0)  /* each combination of -k/-n/-p in turn, as if it had been scanned alone */
+				{
+					SWEEPRUN *r = &sweep.run[result];
+
+					SwapSweepRun(r);
+					strcpy(ofn,r->ofn);
+					distOfLastClusterIndices = r->distOfLastClusterIndices;
+					highesttrimmedclustercnt = r->highesttrimmedclustercnt;
+					bestdistcutoff = r->bestdistcutoff;
+					distcutoff = r->distcutoff;
+					distcutoffincreasestep = r->distcutoffincreasestep;
+					printf("LOG:**************************************************************\n");
+					printf("LOG:Results of %s\n",ofn);
+				}
+				RenameClusterIndices(0.0,distOfLastClusterIndices,ofn);
 
-				memset(clusterid,0,rowcnt*sizeof(MPI_INT));  // reset all clusterid
+				if (clusterid)
+					memset(clusterid,0,rowcnt*sizeof(MPI_INT));  // reset all clusterid
 				trimmedclustercnt = SelectClusterHistory(loaded,clusterid,ofn,verbose);
 				if (printClusterStatus)
 					PrintClusterStatus(clusterhistory,clusterhistorycnt);
-				unassigned = loaded-WriteSplitBinFile(facsname,facsdata,clusterid,loaded,colcnt,trimmedclustercnt,ofn);
-				printf("LOG: %12u TotalEvents\n",loaded);	
-				printf("LOG: %12u Assigned    (%5.1f %%)\n",(loaded-unassigned),100.0*(loaded-unassigned)/loaded);	
-				printf("LOG: %12u Unassigned  (%5.1f %%)\n",unassigned,100.0*unassigned/loaded);	
+				if (subscan.cur.level == 0)
+					unassigned = loaded-WriteSplitBinFile(facsname,facsdata,clusterid,loaded,colcnt,trimmedclustercnt,ofn);
+				else
+					unassigned = loaded-CountAssigned(clusterid,loaded,trimmedclustercnt);
+				if (rowweight)
+					unassigned = events-CountAssignedEvents(clusterid,loaded,trimmedclustercnt);
+				printf("LOG: %12u TotalEvents\n",events);	
+				printf("LOG: %12u Assigned    (%5.1f %%)\n",(events-unassigned),100.0*(events-unassigned)/events);	
+				printf("LOG: %12u Unassigned  (%5.1f %%)\n",unassigned,100.0*unassigned/events);	
 				fflush(stdout);
 
 
 
-				free(chunk); 
 				gTestDist = 0;
 				printf("LOG: Master is all done and identified a max of %d clusters at distance %.3f; notifying slaves.\n",highesttrimmedclustercnt,bestdistcutoff);	
-				for (ii = 1; ii<nproc; ii++)
-					MPI_Send(&gTestDist, 1, MPI_INT,  ii,  kRepeatWithNewDistMsg, MPI_COMM_WORLD);
-				MPI_Barrier(MPI_COMM_WORLD); 
+				if (result == 0)
+				{
+					free(plan.chunk); 
+					if (gLabelOps)
+						SendLabelOp(kLabelsEndPass,0,0.0,0.0);
+					for (ii = 1; ii<nproc; ii++)
+						MPI_Send(&gTestDist, 1, MPI_INT,  ii,  kRepeatWithNewDistMsg, gComm);
+					MPI_Barrier(gComm); 
+				}
 
 				/* assign leftover */
 				{
@@ -2977,78 +6772,123 @@ repeatWithNewDist:
 					if (assignUnassigned)
 					{
 						unsigned int cnt2reassign;
-						cnt2reassign = FlagSequencesToReassign(clusterid,loaded,newfn);
+						cnt2reassign = FlagSequencesToReassign(clusterid,loaded,ofn,distOfLastClusterIndices);
 						printf("LOG:%d sec; Distributing %u events to the %d discovered clusters.\n",((int)te.tv_sec-(int)ts.tv_sec),cnt2reassign,trimmedclustercnt);
 					}
-					MPI_Bcast (&gTestDist, 1, MPI_INT, 0, MPI_COMM_WORLD); // in fact won't be used during DistributeUnassignedToClosestCluster.
-					MPI_Bcast (&trimmedclustercnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-					MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, MPI_COMM_WORLD);
-					lasti = 0 + datachunk;
-					if (lasti > loaded)
-						lasti = loaded;
-					DistributeUnassignedToClosestCluster(facsdata,clusterid,loaded,colcnt,trimmedclustercnt,0,lasti);
-					gettimeofday(&te, NULL);
-					printf("LOG:%d sec; Collecting Results\n",((int)te.tv_sec-(int)ts.tv_sec));	
-					for (ii = 1; ii<nproc; ii++)
+					if (gLabelOps)  /* -O: the slaves look for the closest clusters of the rows they flagged */
 					{
-						starti = ii*datachunk;
-						if (starti < loaded)
+						if (assignUnassigned)
 						{
-							lasti = starti + datachunk;
-							if (lasti > loaded)
-								lasti = loaded;
-							MPI_Recv(&clusterid[starti], (lasti-starti), MPI_INT,  ii, kClusterMsg1, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+							SendLabelOp(kLabelsUnassigned,trimmedclustercnt,0.0,0.0);
+							DistributeUnassignedInRanges(facsdata,clusterid,colcnt,trimmedclustercnt);
+						}
+						gettimeofday(&te, NULL);
+						printf("LOG:%d sec; Collecting Results\n",((int)te.tv_sec-(int)ts.tv_sec));	
+					}
+					else
+					{
+						MPI_Bcast (&gTestDist, 1, MPI_INT, 0, gComm); // in fact won't be used during DistributeUnassignedToClosestCluster.
+						MPI_Bcast (&trimmedclustercnt, 1, MPI_INT, 0, gComm);
+						MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, gComm);
+						lasti = 0 + datachunk;
+						if (lasti > loaded)
+							lasti = loaded;
+						DistributeUnassignedToClosestCluster(facsdata,clusterid,loaded,colcnt,trimmedclustercnt,0,lasti);
+						gettimeofday(&te, NULL);
+						printf("LOG:%d sec; Collecting Results\n",((int)te.tv_sec-(int)ts.tv_sec));	
+						for (ii = 1; ii<nproc; ii++)
+						{
+							starti = ii*datachunk;
+							if (starti < loaded)
+							{
+								lasti = starti + datachunk;
+								if (lasti > loaded)
+									lasti = loaded;
+								MPI_Recv(&clusterid[starti], (lasti-starti), MPI_INT,  ii, kClusterMsg1, gComm,MPI_STATUS_IGNORE);
+							}
 						}
+						MPI_Barrier(gComm); 
 					}
-					MPI_Barrier(MPI_COMM_WORLD); 
 
+					if ((modelCell > 0) && (subscan.cur.level == 0))
+						WriteClusterModel(facsname,facsdata,clusterid,loaded,colcnt,trimmedclustercnt,distcutoff,modelCell,ofn);
 					gettimeofday(&te, NULL);
-					if (assignLeftover)
+					if (assignLeftover && (subscan.cur.level == 0))
 					{
 						printf("LOG:%d sec; Processing leftover file\n",((int)te.tv_sec-(int)ts.tv_sec));
 						DoProcessLeftoverbinaryFile(fn,facsdata,clusterid,loaded,colcnt,nproc,verbose);
 					}
-					else
+					else if (!gLabelOps)
 					{
 						unsigned int leftoverrowcnt = 0;
-						MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
+						MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, gComm);
 					}
-					MPI_Barrier(MPI_COMM_WORLD); 
+					if (!gLabelOps)
+						MPI_Barrier(gComm); 
 
 					gettimeofday(&te, NULL);
 					printf("LOG:%d sec; Writing Clustering Results\n",((int)te.tv_sec-(int)ts.tv_sec));	
 
-					unassigned = loaded-WriteSplitBinFile(facsname,facsdata,clusterid,loaded,colcnt,trimmedclustercnt,ofn);
+					if (subscan.cur.level == 0)
+						unassigned = loaded-WriteSplitBinFile(facsname,facsdata,clusterid,loaded,colcnt,trimmedclustercnt,ofn);
+					else
+						unassigned = loaded-CountAssigned(clusterid,loaded,trimmedclustercnt);
+					if (rowweight)
+						unassigned = events-CountAssignedEvents(clusterid,loaded,trimmedclustercnt);
+
+					printf("LOG: %12u TotalEvents\n",events);
+					printf("LOG: %12u Assigned    (%5.1f %%)\n",(events-unassigned),100.0*(events-unassigned)/events);	
+					printf("LOG: %12u Unassigned  (%5.1f %%)\n",unassigned,100.0*unassigned/events);	
+					if (gLabelOps)
+						SendLabelOp(kLabelsEndPass,0,0.0,0.0);
+				}
 
-					printf("LOG: %12u TotalEvents\n",rowcnt);
-					printf("LOG: %12u Assigned    (%5.1f %%)\n",(rowcnt-unassigned),100.0*(rowcnt-unassigned)/rowcnt);	
-					printf("LOG: %12u Unassigned  (%5.1f %%)\n",unassigned,100.0*unassigned/rowcnt);	
+				FreeClusterIndices();
+				if (adaptive)
+					printf("LOG: %u distances kept, %u more computed while bisecting\n",passcnt+1,as.rejected);
+				FreeAdaptiveScan(&as);
+				if (sweep.cnt > 0)
+				{
+					SwapSweepRun(&sweep.run[result]);
+					if (++result < sweep.cnt)
+						goto nextResult;
+					strcpy(ofn,scanofn);
 				}
 
+				/* scan complete, nothing left to resume */
+				sprintf(oldfn,"%s.checkpoint",ofn);
+				unlink(oldfn);
+
 
 			}
 			else
 			{
-				gTestDist = (unsigned int)(distcutoff*distcutoff*colcnt);
-
 				/* if gDist increases, do as if computing node #1 had discovered valid clusters so keep resuls already valid and reduce the number of merging events */
-				for(ii = 0;  ii< rowcnt; ii++)
-				{
-					if ((clusterid[ii] > 0))
-					{
-						clusterid[ii] += 1*kStartLocalCluster;
-					}
-					else
-						clusterid[ii] = 0;
-					
-				}
+				ShiftLabels(clusterid,0,rowcnt);
 
-				for (ii = 1; ii<nproc; ii++)
-					MPI_Send(&gTestDist, 1, MPI_INT,  ii,  kRepeatWithNewDistMsg, MPI_COMM_WORLD);
-				MPI_Send(&initialClusterCnt, 1, MPI_INT,  1,  kInitialClusterCntMsg, MPI_COMM_WORLD); // send starting clustercount to slave node #1
-				MPI_Barrier(MPI_COMM_WORLD);
+				SendNextDistance(distcutoff,colcnt,nproc,initialClusterCnt);
 				stats[0] = stats[1];
 				passcnt++;
+				if (adaptive && SaveAcceptedPass(&as,clusterid,loaded,passcnt-1,initialClusterCnt))
+					adaptive = 0;	/* no going back: every distance computed is kept from now on */
+
+				if ((indexfiles == kIndexFilesSync) && (sweep.cnt == 0))  /* a resumed scan reads the labels of the earlier distances from their files */
+				{
+					CHECKPOINT cp;
+
+					cp.loaded = loaded;
+					cp.colcnt = colcnt;
+					cp.passcnt = passcnt;
+					cp.distcutoff = distcutoff;
+					cp.distcutoffincreasestep = distcutoffincreasestep;
+					cp.bestdistcutoff = bestdistcutoff;
+					cp.distOfLastClusterIndices = distOfLastClusterIndices;
+					cp.highesttrimmedclustercnt = highesttrimmedclustercnt;
+					cp.initialClusterCnt = initialClusterCnt;
+					cp.stats = stats[0];
+					cp.clusterhistorycnt = clusterhistorycnt;
+					WriteCheckpoint(&cp,clusterid,ofn);
+				}
 
 				printf("LOG:**************************************************************\n");
 				goto repeatWithNewDist;
@@ -3058,91 +6898,147 @@ repeatWithNewDist:
 		{
 			unsigned int initialClusterCnt = 0;
 
+			if (resume)  /* the master restarts the scan at the distance it checkpointed */
+			{
+				int resumedClusterCnt;
+
+				MPI_Bcast (&gTestDist, 1, MPI_INT, 0, gComm);
+				MPI_Bcast (&resumedClusterCnt, 1, MPI_INT, 0, gComm);
+				if (idproc == 1)
+					initialClusterCnt = resumedClusterCnt;
+			}
+
 			do
 			{
 				mergerequestcnt = 0;
 				mergerequest[0].cluster2 = UINT_MAX;  /* to avoid need for initial test mergerequestcnt == 0 in InsertMergeRequest */
 
 				DoComputingSlave(facsdata,clusterid,idproc,initialClusterCnt);
-				memset(clusterid,0,rowcnt*sizeof(MPI_INT));  // reset clusterid
+				if (gRangeLabels)  /* -O: our rows keep their labels, the master tells what to do with them */
+					ServeLabels(facsname,facsdata,clusterid,colcnt,nproc,ofn);
+				else
+					ClearLabels(clusterid,rowcnt,labelspaged);  // reset clusterid
 
-				MPI_Recv(&gTestDist, 1, MPI_INT,0, kRepeatWithNewDistMsg,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+				MPI_Recv(&gTestDist, 1, MPI_INT,0, kRepeatWithNewDistMsg,gComm,MPI_STATUS_IGNORE);
 				if ((idproc == 1) && (gTestDist > 0))
 				{
-					MPI_Recv(&initialClusterCnt, 1, MPI_INT,0, kInitialClusterCntMsg,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+					MPI_Recv(&initialClusterCnt, 1, MPI_INT,0, kInitialClusterCntMsg,gComm,MPI_STATUS_IGNORE);
 				}
 				fflush(stdout);			
 
-				MPI_Barrier(MPI_COMM_WORLD);
+				MPI_Barrier(gComm);
+				if ((gTestDist == 0) && gRangeLabels)
+				{
+					/* -U, -L and the results files, on the labels of our rows */
+					ServeLabels(facsname,facsdata,clusterid,colcnt,nproc,ofn);
+					break;
+				}
 				if (gTestDist == 0)
 				{
 					unsigned int leftoverrowcnt;
 					unsigned int trimmedclustercnt;
 					unsigned int starti,lasti;
 					unsigned int datachunk = 1+(loaded/nproc);
-					MPI_Bcast (&gTestDist, 1, MPI_INT, 0, MPI_COMM_WORLD);
-					MPI_Bcast (&trimmedclustercnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-					MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, MPI_COMM_WORLD);
-					starti = idproc*datachunk;
-					if (starti < loaded)
-					{
-						lasti = starti + datachunk;
-						if (lasti > loaded)
-							lasti = loaded;
-						DistributeUnassignedToClosestCluster(facsdata,clusterid,loaded,colcnt,trimmedclustercnt,starti,lasti);
-						MPI_Send(&clusterid[starti], (lasti-starti), MPI_INT,  0, kClusterMsg1, MPI_COMM_WORLD);
-					}
-					MPI_Barrier(MPI_COMM_WORLD); 
+					unsigned int results = (sweep.cnt > 0) ? sweep.cnt : 1;  /* one per combination of -k/-n/-p */
 
-					MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, MPI_COMM_WORLD);
-					fflush(stdout);
-					if (leftoverrowcnt > 0)
+					do
 					{
-						FACSDATA *leftoverfacs=NULL;
-						unsigned int *leftoverclusterid=NULL;
-						
-						MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, MPI_COMM_WORLD);
-						fflush(stdout);
-						MPI_Recv(&leftoverrowcnt, 1, MPI_INT,  0, kLeftoverDataLength, MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-						fflush(stdout);
-						leftoverfacs = calloc(leftoverrowcnt,sizeof(FACSDATA));
-						if (!leftoverfacs)
-						{
-							printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
-							goto bail;
-						}
-						leftoverclusterid = calloc(leftoverrowcnt,sizeof(FACSNAME));
-						if (!leftoverclusterid)
+						MPI_Bcast (&gTestDist, 1, MPI_INT, 0, gComm);
+						MPI_Bcast (&trimmedclustercnt, 1, MPI_INT, 0, gComm);
+						MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, gComm);
+						starti = idproc*datachunk;
+						if (starti < loaded)
 						{
-							printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
-							goto bail;
+							lasti = starti + datachunk;
+							if (lasti > loaded)
+								lasti = loaded;
+							DistributeUnassignedToClosestCluster(facsdata,clusterid,loaded,colcnt,trimmedclustercnt,starti,lasti);
+							MPI_Send(&clusterid[starti], (lasti-starti), MPI_INT,  0, kClusterMsg1, gComm);
 						}
-						MPI_Recv(leftoverfacs, (int)(leftoverrowcnt*sizeof(FACSDATA)),MPI_CHAR,0, kLeftoverData,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
-						fflush(stdout);
-						DistributeLeftoverToClosestCluster(facsdata,clusterid, loaded, colcnt, leftoverfacs, leftoverclusterid, leftoverrowcnt);
+						MPI_Barrier(gComm); 
+
+						MPI_Bcast (&leftoverrowcnt, 1, MPI_INT, 0, gComm);
 						fflush(stdout);
-						MPI_Send(&leftoverclusterid[0], leftoverrowcnt, MPI_INT,  0, kLeftoverClusters, MPI_COMM_WORLD);
-					bail:
-						if(leftoverfacs)
-							free(leftoverfacs);
-						if(leftoverclusterid)
-							free(leftoverclusterid);
+						if (leftoverrowcnt > 0)
+						{
+							FACSDATA *leftoverfacs=NULL;
+							unsigned int *leftoverclusterid=NULL;
+						
+							MPI_Bcast (&clusterid[0], loaded, MPI_INT, 0, gComm);
+							fflush(stdout);
+							MPI_Recv(&leftoverrowcnt, 1, MPI_INT,  0, kLeftoverDataLength, gComm,MPI_STATUS_IGNORE);
+							fflush(stdout);
+							leftoverfacs = calloc(leftoverrowcnt,sizeof(FACSDATA));
+							if (!leftoverfacs)
+							{
+								printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+								goto bail;
+							}
+							leftoverclusterid = calloc(leftoverrowcnt,sizeof(FACSNAME));
+							if (!leftoverclusterid)
+							{
+								printf("LOG:CPU %d Error:Cannot Allocate Memory.\n",idproc);
+								goto bail;
+							}
+							MPI_Recv(leftoverfacs, (int)(leftoverrowcnt*sizeof(FACSDATA)),MPI_CHAR,0, kLeftoverData,gComm,MPI_STATUS_IGNORE);
+							fflush(stdout);
+							DistributeLeftoverToClosestCluster(facsdata,clusterid, loaded, colcnt, leftoverfacs, leftoverclusterid, leftoverrowcnt);
+							fflush(stdout);
+							MPI_Send(&leftoverclusterid[0], leftoverrowcnt, MPI_INT,  0, kLeftoverClusters, gComm);
+						bail:
+							if(leftoverfacs)
+								free(leftoverfacs);
+							if(leftoverclusterid)
+								free(leftoverclusterid);
 							
-					}
-					MPI_Barrier(MPI_COMM_WORLD); 
+						}
+						MPI_Barrier(gComm); 
+					} while (--results > 0);
 					break;
 				}
 			} while(1);
 		}
+
+		/* -d: the clusters found are clustered again, from the rows of the InputFile */
+		if (NextSubset(&subscan,topfacs,clusterid,idproc,&events))
+		{
+			facsdata = subscan.facs;
+			loaded = subscan.cur.cnt;
+			gOutOfCore = 0;
+			cntcutoff = keepCntcutoff;
+			distcutoff = firstdistcutoff;
+			distcutoffincreasestep = firstdistcutoffincreasestep;
+			bestdistcutoff = 0.0;
+			resume = 0;
+			indexfiles = kIndexFilesNone;
+			goto scanSubset;
+		}
+		if ((idproc == 0) && (subscan.depth > 0))
+			WriteSubclusters(&subscan,facsname,ofn);
+
 abort:
-		if (facsdata)
-			free(facsdata);
-		if (facsname)
-			free(facsname);
-		if (clusterid)
-			free(clusterid);
+		DclustFileClose(&inputfile);
+		if (facswin != MPI_WIN_NULL)
+			MPI_Win_free(&facswin);
+		if (leadercomm != MPI_COMM_NULL)
+			MPI_Comm_free(&leadercomm);
+		if (nodecomm != MPI_COMM_NULL)
+			MPI_Comm_free(&nodecomm);
+		if (namewin != MPI_WIN_NULL)
+			MPI_Win_free(&namewin);
+		FreeLabels(clusterid,rowcnt,labelspaged);
+		labelspaged = 0;
 		if (clusterhistory)
 			free(clusterhistory);
+		clusterhistory = NULL;
+		FreeClusterIndices();
+		FreeSweep(&sweep);
+		FreeSubScan(&subscan);
+		if (jobfn[0] != 0)
+		{
+			EndBatchJob(&batch);
+			goto nextJob;
+		}
 		MPI_Finalize();
 		return(0);
 	} // f
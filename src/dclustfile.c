@@ -0,0 +1,732 @@
+/*	------------------------------------------------------------------------------------
+
+		                          * megaclust *
+      unbiased hierarchical density based parallel clustering of large datasets
+
+
+    Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+    Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+	Code:       Nicolas Guex, 2008-2019
+	Contact:    Nicolas.Guex@unil.ch
+	Repository: https://github.com/sib-swiss/megaclust
+
+
+	Articles:   megaclust was used here
+                    https://www.ncbi.nlm.nih.gov/pubmed/29241546
+                    https://www.ncbi.nlm.nih.gov/pubmed/23396282
+
+
+
+
+	Machine :	Unix
+	Language:	C
+	Requires:	mpi, pthread
+
+	Version information
+
+	Version:	1.0  Dec.  2019 Public release of code under GPL2+ license
+
+
+
+
+	Compiling:   (you will need mpi on your system)
+
+	
+	make all
+
+
+
+	Testing:
+
+    ./test/unit_test1.sh
+    ./test/unit_test2.sh
+	
+	------------------------------------------------------------------------------------
+*/
+
+
+	/*------------------------- I N T E R F A C E ----------------------- */
+
+/*
+
+	dclustfile.c: read v1 and v2, write v2 dclust binary files.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dclust.h"
+#include "dclustfile.h"
+
+/* ------------------------------------------------------------------------------------ */
+
+static const char *MagicString(unsigned int filetype,unsigned int version)
+{
+	switch (filetype)
+	{
+		case kDclustSelectedFile:
+			return((version == 1) ? "dclust input file v1.0        \n" : "dclust input file v2.0        \n");
+		case kDclustAssignedFile:
+			return((version == 1) ? "dclust assigned file v1.0     \n" : "dclust assigned file v2.0     \n");
+		case kDclustUnassignedFile:
+			return((version == 1) ? "dclust unassigned file v1.0   \n" : "dclust unassigned file v2.0   \n");
+		case kDclustModelFile:
+			return((version == 1) ? "dclust model file v1.0        \n" : "dclust model file v2.0        \n");
+	}
+	return("");
+
+} /* MagicString */
+/* ------------------------------------------------------------------------------------ */
+
+static const char *FileTypeName(unsigned int filetype)
+{
+	switch (filetype)
+	{
+		case kDclustSelectedFile:
+			return("input");
+		case kDclustAssignedFile:
+			return("assigned");
+		case kDclustModelFile:
+			return("model");
+	}
+	return("unassigned");
+
+} /* FileTypeName */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned int ElementSize(unsigned int datatype)
+{
+	return((datatype == kDclustFloat) ? sizeof(float) : sizeof(unsigned short));
+
+} /* ElementSize */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned long long AlignOffset(unsigned long long offset,unsigned long long align)
+{
+	return(((offset+align-1)/align)*align);
+
+} /* AlignOffset */
+/* ------------------------------------------------------------------------------------ */
+
+static int ReadAt(int fd,void *buf,size_t len,off_t offset)
+{
+	char *p = (char *)buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pread(fd,p,len,offset);
+		if (n <= 0)
+			return(1);
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	return(0);
+
+} /* ReadAt */
+/* ------------------------------------------------------------------------------------ */
+
+static int WriteAt(int fd,const void *buf,size_t len,off_t offset)
+{
+	const char *p = (const char *)buf;
+
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd,p,len,offset);
+		if (n <= 0)
+			return(1);
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	return(0);
+
+} /* WriteAt */
+/* ------------------------------------------------------------------------------------ */
+
+void DclustFileInitHeader(DCLUSTHEADER *hdr,unsigned int filetype,unsigned int datatype,unsigned int colcnt,const char *header)
+{
+	memset(hdr,0,sizeof(DCLUSTHEADER));
+	hdr->filetype = filetype;
+	hdr->datatype = datatype;
+	hdr->colcnt = colcnt;
+	hdr->loadEveryNsample = 1;
+	if (header)
+		strncpy(hdr->header,header,kMaxLineBuf-1);
+
+} /* DclustFileInitHeader */
+/* ------------------------------------------------------------------------------------ */
+
+/* describe the interleaved rows of a v1 file with the fields of a v2 header */
+static int ReadHeaderV1(DCLUSTFILE *df,unsigned int filetype)
+{
+	DCLUSTHEADER *hdr = &df->hdr;
+	int v1[4];
+	unsigned short us[2];
+	unsigned long long rowbase = kHeaderSize+4*sizeof(int)+kMaxLineBuf;
+	unsigned int rowsize;
+
+	if (ReadAt(df->fd,v1,sizeof(v1),kHeaderSize) || ReadAt(df->fd,hdr->header,kMaxLineBuf,kHeaderSize+sizeof(v1)))
+		return(1);
+	hdr->header[kMaxLineBuf-1] = 0;
+	hdr->endian = v1[0];
+	hdr->version = 1;
+	hdr->filetype = filetype;
+	hdr->rowcnt = (unsigned int)v1[1];
+	hdr->colcnt = (unsigned int)v1[2];
+	if (filetype == kDclustSelectedFile)
+	{
+		if (ReadAt(df->fd,us,sizeof(us),rowbase))
+			return(1);
+		hdr->loadEveryNsample = (unsigned int)v1[3];
+		hdr->key = us[0];
+		hdr->cellnamecnt = us[1];
+		hdr->cellnameoffset = rowbase+sizeof(us);
+		rowbase = hdr->cellnameoffset+(unsigned long long)hdr->cellnamecnt*kMaxCellName;
+		hdr->datatype = kDclustUShort;
+	}
+	else
+	{
+		hdr->maxclusterid = (unsigned int)v1[3];
+		hdr->datatype = kDclustFloat;
+	}
+	rowsize = sizeof(CELLNAMEIDX)+hdr->colcnt*ElementSize(hdr->datatype);
+	if (filetype == kDclustAssignedFile)
+	{
+		hdr->clusteridoffset = rowbase+rowsize;
+		rowsize += sizeof(unsigned int);
+	}
+	hdr->stride = rowsize;
+	hdr->indexoffset = rowbase;
+	hdr->dataoffset = rowbase+sizeof(CELLNAMEIDX);
+	hdr->filesize = rowbase+hdr->rowcnt*rowsize;
+	df->indexstride = rowsize;
+	df->clusteridstride = rowsize;
+	return(0);
+
+} /* ReadHeaderV1 */
+/* ------------------------------------------------------------------------------------ */
+
+/* returns 0 when the file is open, -1 if it cannot be opened and 1 if it is not a valid file of that type */
+int DclustFileOpen(DCLUSTFILE *df,const char *fn,unsigned int filetype,int report)
+{
+	DCLUSTHEADER *hdr = &df->hdr;
+	struct stat st;
+	char magic[kHeaderSize];
+
+	memset(df,0,sizeof(DCLUSTFILE));
+	df->fd = open(fn,O_RDONLY);
+	if (df->fd < 0)
+		return(-1);
+	if ((fstat(df->fd,&st) != 0) || ReadAt(df->fd,magic,kHeaderSize,0))
+		goto notvalid;
+	magic[kHeaderSize-1] = 0;
+	if (strcmp(magic,MagicString(filetype,1)) == 0)
+	{
+		if (ReadHeaderV1(df,filetype))
+			goto notvalid;
+	}
+	else if (strcmp(magic,MagicString(filetype,kDclustFileVersion)) == 0)
+	{
+		if (ReadAt(df->fd,hdr,sizeof(DCLUSTHEADER),0))
+			goto notvalid;
+		hdr->header[kMaxLineBuf-1] = 0;
+		df->indexstride = sizeof(CELLNAMEIDX);
+		df->clusteridstride = sizeof(unsigned int);
+	}
+	else
+		goto notvalid;
+
+	if (hdr->endian != 1)
+	{
+		if (report)
+			printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
+		goto bail;
+	}
+	if (hdr->colcnt > kMaxInputCol)
+	{
+		if (report)
+			printf("Error: number of requested data columns exceed maximum allowed (%u > %d)\n",hdr->colcnt,kMaxInputCol);
+		goto bail;
+	}
+	if ((hdr->version != 1) && (hdr->version != kDclustFileVersion))
+		goto notvalid;
+	if (((hdr->datatype != kDclustUShort) && (hdr->datatype != kDclustFloat)) || (hdr->stride < hdr->colcnt*ElementSize(hdr->datatype)))
+		goto notvalid;
+	if (hdr->filesize > (unsigned long long)st.st_size)
+	{
+		if (report)
+			printf("Error: %s is truncated (%llu bytes expected, %llu found)\n",fn,hdr->filesize,(unsigned long long)st.st_size);
+		goto bail;
+	}
+	if ((hdr->clusterrowoffset > 0) && (hdr->clusterrowoffset+(hdr->maxclusterid+2ULL)*sizeof(unsigned long long) > hdr->filesize))
+		goto notvalid;
+	if ((hdr->weightoffset > 0) && ((hdr->weightoffset+hdr->rowcnt*sizeof(unsigned int) > hdr->filesize) ||
+		(hdr->duplicateoffset+hdr->duplicatecnt*sizeof(CELLNAMEIDX) > hdr->filesize)))
+		goto notvalid;
+	if ((hdr->version == kDclustFileVersion) && (hdr->colcnt > 0))
+	{
+		df->column = malloc(hdr->colcnt*sizeof(DCLUSTCOLUMN));
+		if (!df->column || ReadAt(df->fd,df->column,hdr->colcnt*sizeof(DCLUSTCOLUMN),hdr->columnoffset))
+			goto notvalid;
+	}
+	df->mapsize = st.st_size;
+	return(0);
+
+notvalid:
+	if (report)
+		printf("Error: input is not a dclust %s file\n",FileTypeName(filetype));
+bail:
+	DclustFileClose(df);
+	return(1);
+
+} /* DclustFileOpen */
+/* ------------------------------------------------------------------------------------ */
+
+/* map the whole file read-only; pages are shared with every other process mapping it */
+int DclustFileMap(DCLUSTFILE *df)
+{
+	void *map;
+
+	if (df->map)
+		return(0);
+	map = mmap(NULL,df->mapsize,PROT_READ,MAP_SHARED,df->fd,0);
+	if (map == MAP_FAILED)
+		return(1);
+	df->map = (char *)map;
+	return(0);
+
+} /* DclustFileMap */
+/* ------------------------------------------------------------------------------------ */
+
+void DclustFileClose(DCLUSTFILE *df)
+{
+	if (df->map)
+		munmap(df->map,df->mapsize);
+	if (df->fd >= 0)
+		close(df->fd);
+	free(df->column);
+	df->map = NULL;
+	df->fd = -1;
+	df->column = NULL;
+
+} /* DclustFileClose */
+/* ------------------------------------------------------------------------------------ */
+
+/* the accessors below require the file to be mapped */
+const char *DclustFileCellName(const DCLUSTFILE *df,unsigned int cn)
+{
+	return(&df->map[df->hdr.cellnameoffset+(unsigned long long)cn*kMaxCellName]);
+
+} /* DclustFileCellName */
+/* ------------------------------------------------------------------------------------ */
+
+const void *DclustFileData(const DCLUSTFILE *df,unsigned long long row)
+{
+	return(&df->map[df->hdr.dataoffset+row*df->hdr.stride]);
+
+} /* DclustFileData */
+/* ------------------------------------------------------------------------------------ */
+
+CELLNAMEIDX DclustFileCellNameIdx(const DCLUSTFILE *df,unsigned long long row)
+{
+	CELLNAMEIDX cellnameidx;
+
+	memcpy(&cellnameidx,&df->map[df->hdr.indexoffset+row*df->indexstride],sizeof(CELLNAMEIDX));
+	return(cellnameidx);
+
+} /* DclustFileCellNameIdx */
+/* ------------------------------------------------------------------------------------ */
+
+unsigned int DclustFileClusterId(const DCLUSTFILE *df,unsigned long long row)
+{
+	unsigned int clusterid;
+
+	if (df->hdr.clusteridoffset == 0)
+		return(0);
+	memcpy(&clusterid,&df->map[df->hdr.clusteridoffset+row*df->clusteridstride],sizeof(unsigned int));
+	return(clusterid);
+
+} /* DclustFileClusterId */
+/* ------------------------------------------------------------------------------------ */
+
+/* rows first to last-1 hold clusterid; returns 1 if the rows are not grouped by clusterid and the file must be scanned */
+int DclustFileClusterRows(const DCLUSTFILE *df,unsigned int clusterid,unsigned long long *first,unsigned long long *last)
+{
+	const char *p = &df->map[df->hdr.clusterrowoffset];
+
+	if (df->hdr.clusterrowoffset == 0)
+		return(1);
+	*first = 0;
+	*last = 0;
+	if (clusterid <= df->hdr.maxclusterid)
+	{
+		memcpy(first,p+clusterid*sizeof(unsigned long long),sizeof(unsigned long long));
+		memcpy(last,p+(clusterid+1)*sizeof(unsigned long long),sizeof(unsigned long long));
+	}
+	return(0);
+
+} /* DclustFileClusterRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* number of events row stands for; 1 unless identical rows were collapsed */
+unsigned int DclustFileWeight(const DCLUSTFILE *df,unsigned long long row)
+{
+	unsigned int weight;
+
+	if (df->hdr.weightoffset == 0)
+		return(1);
+	memcpy(&weight,&df->map[df->hdr.weightoffset+row*sizeof(unsigned int)],sizeof(unsigned int));
+	return(weight);
+
+} /* DclustFileWeight */
+/* ------------------------------------------------------------------------------------ */
+
+/* the weight-1 events collapsed into a row follow those of the rows before it */
+CELLNAMEIDX DclustFileDuplicate(const DCLUSTFILE *df,unsigned long long dup)
+{
+	CELLNAMEIDX cellnameidx;
+
+	memcpy(&cellnameidx,&df->map[df->hdr.duplicateoffset+dup*sizeof(CELLNAMEIDX)],sizeof(CELLNAMEIDX));
+	return(cellnameidx);
+
+} /* DclustFileDuplicate */
+/* ------------------------------------------------------------------------------------ */
+
+void DclustFileGetRow(const DCLUSTFILE *df,unsigned long long row,float *val)
+{
+	const char *p = (const char *)DclustFileData(df,row);
+	unsigned int col;
+
+	if (df->hdr.datatype == kDclustFloat)
+		memcpy(val,p,df->hdr.colcnt*sizeof(float));
+	else
+	{
+		unsigned short us[kMaxInputCol];
+
+		memcpy(us,p,df->hdr.colcnt*sizeof(unsigned short));
+		for (col = 0; col < df->hdr.colcnt; col++)
+			val[col] = (float)us[col];
+	}
+
+} /* DclustFileGetRow */
+/* ------------------------------------------------------------------------------------ */
+
+static void FlushSection(DCLUSTWRITER *w,DCLUSTSECTION *s)
+{
+	if ((s->cnt > 0) && WriteAt(w->fd,s->buf,s->cnt,s->offset))
+		w->err = 1;
+	s->offset += s->cnt;
+	s->cnt = 0;
+
+} /* FlushSection */
+/* ------------------------------------------------------------------------------------ */
+
+static void PutSection(DCLUSTWRITER *w,DCLUSTSECTION *s,const void *data,size_t len)
+{
+	if (s->cnt+len > kDclustWriteBufSize)
+		FlushSection(w,s);
+	memcpy(&s->buf[s->cnt],data,len);
+	s->cnt += len;
+
+} /* PutSection */
+/* ------------------------------------------------------------------------------------ */
+
+/* buffers for the sections of the rows written from firstrow on */
+static int OpenSections(DCLUSTWRITER *w,unsigned long long firstrow)
+{
+	DCLUSTHEADER *h = &w->hdr;
+	unsigned int col;
+
+	w->rows = 0;
+	w->index.buf = malloc(kDclustWriteBufSize);
+	w->index.cnt = 0;
+	w->index.offset = h->indexoffset+firstrow*sizeof(CELLNAMEIDX);
+	w->clusterid.buf = malloc(kDclustWriteBufSize);
+	w->clusterid.cnt = 0;
+	w->clusterid.offset = h->clusteridoffset+firstrow*sizeof(unsigned int);
+	w->data.buf = malloc(kDclustWriteBufSize);
+	w->data.cnt = 0;
+	w->data.offset = h->dataoffset+firstrow*h->stride;
+	w->row = calloc(1,h->stride);
+	if (!w->index.buf || !w->clusterid.buf || !w->data.buf || !w->row)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		free(w->index.buf);
+		free(w->clusterid.buf);
+		free(w->data.buf);
+		free(w->row);
+		w->index.buf = NULL;
+		w->clusterid.buf = NULL;
+		w->data.buf = NULL;
+		w->row = NULL;
+		w->err = 1;
+		return(1);
+	}
+	for (col = 0; col < h->colcnt; col++)
+	{
+		w->min[col] = 0.0;
+		w->max[col] = 0.0;
+		w->sum[col] = 0.0;
+		w->sum2[col] = 0.0;
+	}
+	return(0);
+
+} /* OpenSections */
+/* ------------------------------------------------------------------------------------ */
+
+static void CloseSections(DCLUSTWRITER *w)
+{
+	FlushSection(w,&w->index);
+	FlushSection(w,&w->clusterid);
+	FlushSection(w,&w->data);
+	free(w->index.buf);
+	free(w->clusterid.buf);
+	free(w->data.buf);
+	free(w->row);
+	w->index.buf = NULL;
+	w->clusterid.buf = NULL;
+	w->data.buf = NULL;
+	w->row = NULL;
+
+} /* CloseSections */
+/* ------------------------------------------------------------------------------------ */
+
+/* start a v2 file; hdr must hold the final row count, cellnames holds cellnamecnt names of kMaxCellName bytes */
+int DclustFileCreate(DCLUSTWRITER *w,FILE *f,const DCLUSTHEADER *hdr,const char *cellnames)
+{
+	DCLUSTHEADER *h = &w->hdr;
+	unsigned long long offset;
+
+	memset(w,0,sizeof(DCLUSTWRITER));
+	memcpy(h,hdr,sizeof(DCLUSTHEADER));
+	memset(h->magic,0,kHeaderSize);
+	strcpy(h->magic,MagicString(h->filetype,kDclustFileVersion));
+	h->endian = 1;
+	h->version = kDclustFileVersion;
+	/* selected rows are padded to the dclust FACSDATA size to be used in place, costing kMaxInputCol */
+	/* values a row whatever colcnt is; the other files are only read row by row and stay packed */
+	if ((h->stride == 0) && (h->filetype == kDclustSelectedFile))
+		h->stride = kMaxInputCol*ElementSize(h->datatype);
+	else if (h->stride == 0)
+		h->stride = h->colcnt*ElementSize(h->datatype);
+
+	h->columnoffset = AlignOffset(sizeof(DCLUSTHEADER),kDclustSectionAlign);
+	h->cellnameoffset = h->columnoffset+h->colcnt*sizeof(DCLUSTCOLUMN);
+	h->indexoffset = AlignOffset(h->cellnameoffset+(unsigned long long)h->cellnamecnt*kMaxCellName,kDclustSectionAlign);
+	offset = h->indexoffset+h->rowcnt*sizeof(CELLNAMEIDX);
+	h->clusteridoffset = 0;
+	h->clusterrowoffset = 0;
+	h->weightoffset = 0;
+	h->duplicateoffset = 0;
+	if ((h->filetype == kDclustAssignedFile) || (h->filetype == kDclustModelFile))
+	{
+		h->clusteridoffset = AlignOffset(offset,kDclustSectionAlign);
+		offset = h->clusteridoffset+h->rowcnt*sizeof(unsigned int);
+		/* reserved; only kept if DclustFileSetClusterRows is called */
+		h->clusterrowoffset = AlignOffset(offset,kDclustSectionAlign);
+		offset = h->clusterrowoffset+(h->maxclusterid+2ULL)*sizeof(unsigned long long);
+	}
+	else if ((h->filetype == kDclustSelectedFile) && (h->duplicatecnt > 0))
+	{
+		/* filled by DclustFileSetDuplicates */
+		h->weightoffset = AlignOffset(offset,kDclustSectionAlign);
+		h->duplicateoffset = AlignOffset(h->weightoffset+h->rowcnt*sizeof(unsigned int),kDclustSectionAlign);
+		offset = h->duplicateoffset+h->duplicatecnt*sizeof(CELLNAMEIDX);
+	}
+	h->dataoffset = AlignOffset(offset,kDclustDataAlign);
+	h->filesize = h->dataoffset+h->rowcnt*h->stride;
+
+	fflush(f);
+	w->fd = fileno(f);
+	if (OpenSections(w,0))
+		return(1);
+	if ((h->cellnamecnt > 0) && WriteAt(w->fd,cellnames,(size_t)h->cellnamecnt*kMaxCellName,h->cellnameoffset))
+		w->err = 1;
+	return(w->err);
+
+} /* DclustFileCreate */
+/* ------------------------------------------------------------------------------------ */
+
+/* a writer for the rows from firstrow on, so that several threads can fill the sections of the same file */
+int DclustFileCreatePart(DCLUSTWRITER *part,const DCLUSTWRITER *w,unsigned long long firstrow)
+{
+	memset(part,0,sizeof(DCLUSTWRITER));
+	memcpy(&part->hdr,&w->hdr,sizeof(DCLUSTHEADER));
+	part->fd = w->fd;
+	return(OpenSections(part,firstrow));
+
+} /* DclustFileCreatePart */
+/* ------------------------------------------------------------------------------------ */
+
+/* flush a part and add its rows and column statistics to the writer of the file */
+int DclustFileFinishPart(DCLUSTWRITER *w,DCLUSTWRITER *part)
+{
+	unsigned int col;
+
+	if (part->row)
+		CloseSections(part);
+	if (part->rows > 0)
+	{
+		for (col = 0; col < w->hdr.colcnt; col++)
+		{
+			if ((w->rows == 0) || (part->min[col] < w->min[col]))
+				w->min[col] = part->min[col];
+			if ((w->rows == 0) || (part->max[col] > w->max[col]))
+				w->max[col] = part->max[col];
+			w->sum[col] += part->sum[col];
+			w->sum2[col] += part->sum2[col];
+		}
+		w->rows += part->rows;
+	}
+	if (part->err)
+		w->err = 1;
+	return(part->err);
+
+} /* DclustFileFinishPart */
+/* ------------------------------------------------------------------------------------ */
+
+/* data holds colcnt values of the file datatype; clusterid is ignored unless the file is an assigned or model file */
+void DclustFilePutRow(DCLUSTWRITER *w,CELLNAMEIDX cellnameidx,const void *data,unsigned int clusterid)
+{
+	unsigned int colcnt = w->hdr.colcnt;
+	unsigned int col;
+
+	memcpy(w->row,data,colcnt*ElementSize(w->hdr.datatype));
+	for (col = 0; col < colcnt; col++)
+	{
+		double v;
+		if (w->hdr.datatype == kDclustFloat)
+			v = ((float *)w->row)[col];
+		else
+			v = ((unsigned short *)w->row)[col];
+		if ((w->rows == 0) || (v < w->min[col]))
+			w->min[col] = v;
+		if ((w->rows == 0) || (v > w->max[col]))
+			w->max[col] = v;
+		w->sum[col] += v;
+		w->sum2[col] += v*v;
+	}
+	PutSection(w,&w->index,&cellnameidx,sizeof(CELLNAMEIDX));
+	if (w->hdr.clusteridoffset)
+		PutSection(w,&w->clusterid,&clusterid,sizeof(unsigned int));
+	PutSection(w,&w->data,w->row,w->hdr.stride);
+	w->rows++;
+
+} /* DclustFilePutRow */
+/* ------------------------------------------------------------------------------------ */
+
+/* the rows are written grouped by clusterid; firstrow[c] is the first row of cluster c, for c = 0 to maxclusterid+1 */
+void DclustFileSetClusterRows(DCLUSTWRITER *w,const unsigned long long *firstrow)
+{
+	if (w->hdr.clusterrowoffset == 0)
+		return;
+	if (WriteAt(w->fd,firstrow,(w->hdr.maxclusterid+2ULL)*sizeof(unsigned long long),w->hdr.clusterrowoffset))
+		w->err = 1;
+	w->clusterrows = 1;
+
+} /* DclustFileSetClusterRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* weight holds one count per row, duplicate the duplicatecnt cellname indices of the collapsed events in row order */
+void DclustFileSetDuplicates(DCLUSTWRITER *w,const unsigned int *weight,const CELLNAMEIDX *duplicate)
+{
+	if (w->hdr.weightoffset == 0)
+		return;
+	if (WriteAt(w->fd,weight,w->hdr.rowcnt*sizeof(unsigned int),w->hdr.weightoffset) ||
+		WriteAt(w->fd,duplicate,w->hdr.duplicatecnt*sizeof(CELLNAMEIDX),w->hdr.duplicateoffset))
+		w->err = 1;
+	w->duplicates = 1;
+
+} /* DclustFileSetDuplicates */
+/* ------------------------------------------------------------------------------------ */
+
+/* write the column descriptions and the header once every row is known; returns 1 on error */
+int DclustFileFinish(DCLUSTWRITER *w)
+{
+	DCLUSTHEADER *h = &w->hdr;
+	DCLUSTCOLUMN column[kMaxInputCol];
+	const char *p;
+	unsigned int col;
+
+	if (w->row)
+	{
+		CloseSections(w);
+		if (w->rows != h->rowcnt)
+		{
+			printf("Error: %llu rows written, %llu expected\n",w->rows,h->rowcnt);
+			w->err = 1;
+		}
+
+		/* column names are taken from the csv header, skipping the cellname column */
+		memset(column,0,sizeof(column));
+		p = strchr(h->header,',');
+		for (col = 0; col < h->colcnt; col++)
+		{
+			DCLUSTCOLUMN *c = &column[col];
+			unsigned int len = 0;
+
+			if (p)
+			{
+				p++;
+				while ((p[len] != ',') && (p[len] != 0))
+					len++;
+				if (len >= kMaxColumnName)
+					memcpy(c->name,p,kMaxColumnName-1);
+				else
+					memcpy(c->name,p,len);
+				p += len;
+				if (*p == 0)
+					p = NULL;
+			}
+			if (w->rows > 0)
+			{
+				double var;
+				c->min = w->min[col];
+				c->max = w->max[col];
+				c->mean = w->sum[col]/w->rows;
+				var = w->sum2[col]/w->rows - c->mean*c->mean;
+				c->stdev = (var > 0.0) ? sqrt(var) : 0.0;
+			}
+		}
+		if (WriteAt(w->fd,column,h->colcnt*sizeof(DCLUSTCOLUMN),h->columnoffset))
+			w->err = 1;
+		if (!w->clusterrows)
+			h->clusterrowoffset = 0;
+		if (!w->duplicates)
+		{
+			h->weightoffset = 0;
+			h->duplicateoffset = 0;
+			h->duplicatecnt = 0;
+		}
+		if (WriteAt(w->fd,h,sizeof(DCLUSTHEADER),0))
+			w->err = 1;
+		if (ftruncate(w->fd,h->filesize) != 0)
+			w->err = 1;
+	}
+	return(w->err);
+
+} /* DclustFileFinish */
+/* ------------------------------------------------------------------------------------ */
@@ -0,0 +1,214 @@
+/*	------------------------------------------------------------------------------------
+
+		                          * megaclust *
+      unbiased hierarchical density based parallel clustering of large datasets
+
+
+    Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+    Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+	Code:       Nicolas Guex, 2008-2019
+	Contact:    Nicolas.Guex@unil.ch
+	Repository: https://github.com/sib-swiss/megaclust
+
+
+	Articles:   megaclust was used here
+                    https://www.ncbi.nlm.nih.gov/pubmed/29241546
+                    https://www.ncbi.nlm.nih.gov/pubmed/23396282
+
+
+
+
+	Machine :	Unix
+	Language:	C
+	Requires:	mpi, pthread
+
+	Version information
+
+	Version:	1.0  Dec.  2019 Public release of code under GPL2+ license
+
+
+
+
+	Compiling:   (you will need mpi on your system)
+
+	
+	make all
+
+
+
+	Testing:
+
+    ./test/unit_test1.sh
+    ./test/unit_test2.sh
+	
+	------------------------------------------------------------------------------------
+*/
+
+
+/*
+
+	dclustfile.h: binary files exchanged between dselect, dclust and cextract.
+
+	v1 files start with a 32 bytes magic string, 4 ints and the csv header, followed by
+	interleaved rows (cellname index, data columns[, clusterid]).
+
+	v2 files start with a DCLUSTHEADER followed by sections located by 64 bit offsets:
+	column descriptions, cellnames, one cellname index per row, one clusterid per row
+	(assigned and model files) and a page aligned block of fixed stride rows of data, so that
+	the data can be used directly from a read-only mapping of the file.
+	Selected files pad each row to the kMaxInputCol columns of the build that wrote them, which dclust
+	maps in place: a few columns through dselect128 take 256 bytes a row. Other files pack the colcnt
+	columns.
+	Assigned files written by dclust keep the rows of a cluster together, and hold the
+	first row of every cluster so that a cluster is read as one contiguous range.
+	Selected files where dselect collapsed identical rows hold the number of events each
+	row stands for, and the cellname indices of the events collapsed into each row.
+	Model files written by dclust -m hold the representative events of every cluster,
+	laid out as an assigned file, and the distance used to assign new events to them.
+
+	DclustFileOpen reads both versions; the row accessors hide the differences.
+
+*/
+
+#ifndef __DCLUSTFILE_H__
+#define __DCLUSTFILE_H__
+
+#define kDclustSelectedFile 1
+#define kDclustAssignedFile 2
+#define kDclustUnassignedFile 3
+#define kDclustModelFile 4
+
+#define kDclustUShort 1
+#define kDclustFloat 2
+
+#define kDclustFileVersion 2
+#define kDclustSectionAlign 64
+#define kDclustDataAlign 4096
+#define kMaxColumnName 64
+#define kDclustWriteBufSize (1024*1024)
+
+/* ------------------------------------------------------------------------------------ */
+
+typedef	struct	DCLUSTCOLUMN_struct	DCLUSTCOLUMN;
+struct	DCLUSTCOLUMN_struct
+{
+	char name[kMaxColumnName];
+	double min;
+	double max;
+	double mean;
+	double stdev;
+};
+
+/* on disk v2 header; every field is naturally aligned so that the layout does not depend on the compiler */
+typedef	struct	DCLUSTHEADER_struct	DCLUSTHEADER;
+struct	DCLUSTHEADER_struct
+{
+	char magic[kHeaderSize];
+	int endian;
+	unsigned int version;
+	unsigned int filetype;
+	unsigned int datatype;
+	unsigned long long rowcnt;
+	unsigned int colcnt;
+	unsigned int stride;			/* bytes between two rows of the data block */
+	unsigned int key;				/* column used to sort a selected file */
+	unsigned int loadEveryNsample;
+	unsigned int maxclusterid;
+	unsigned int cellnamecnt;
+	float distcutoff;				/* model files: distance at which new events are assigned, 0 otherwise */
+	unsigned int testdist;			/* model files: distcutoff*distcutoff*colcnt, compared to squared distances */
+	unsigned long long columnoffset;
+	unsigned long long cellnameoffset;
+	unsigned long long indexoffset;
+	unsigned long long clusteridoffset;	/* 0 if the file has no clusterid */
+	unsigned long long clusterrowoffset;	/* maxclusterid+2 first rows, 0 unless rows are grouped by clusterid */
+	unsigned long long weightoffset;		/* events standing behind each row, 0 unless identical rows were collapsed */
+	unsigned long long duplicateoffset;	/* cellname indices of the collapsed events, grouped by row */
+	unsigned long long duplicatecnt;
+	unsigned long long dataoffset;
+	unsigned long long filesize;
+	char header[kMaxLineBuf];		/* csv header line */
+};
+
+/* an open v1 or v2 file; v1 sections are described with the stride of the interleaved rows */
+typedef	struct	DCLUSTFILE_struct	DCLUSTFILE;
+struct	DCLUSTFILE_struct
+{
+	DCLUSTHEADER hdr;
+	unsigned int indexstride;
+	unsigned int clusteridstride;
+	DCLUSTCOLUMN *column;
+	int fd;
+	char *map;
+	size_t mapsize;
+};
+
+/* a section of a v2 file being written */
+typedef	struct	DCLUSTSECTION_struct	DCLUSTSECTION;
+struct	DCLUSTSECTION_struct
+{
+	char *buf;
+	size_t cnt;
+	off_t offset;
+};
+
+typedef	struct	DCLUSTWRITER_struct	DCLUSTWRITER;
+struct	DCLUSTWRITER_struct
+{
+	DCLUSTHEADER hdr;
+	int fd;
+	int err;
+	unsigned long long rows;
+	DCLUSTSECTION index;
+	DCLUSTSECTION clusterid;
+	DCLUSTSECTION data;
+	int clusterrows;			/* the clusterrow section was written */
+	int duplicates;				/* the weight and duplicate sections were written */
+	char *row;
+	double sum[kMaxInputCol];
+	double sum2[kMaxInputCol];
+	double min[kMaxInputCol];
+	double max[kMaxInputCol];
+};
+
+/* ------------------------------------------------------------------------------------ */
+
+void DclustFileInitHeader(DCLUSTHEADER *hdr,unsigned int filetype,unsigned int datatype,unsigned int colcnt,const char *header);
+int DclustFileOpen(DCLUSTFILE *df,const char *fn,unsigned int filetype,int report);
+int DclustFileMap(DCLUSTFILE *df);
+void DclustFileClose(DCLUSTFILE *df);
+const char *DclustFileCellName(const DCLUSTFILE *df,unsigned int cn);
+const void *DclustFileData(const DCLUSTFILE *df,unsigned long long row);
+CELLNAMEIDX DclustFileCellNameIdx(const DCLUSTFILE *df,unsigned long long row);
+unsigned int DclustFileClusterId(const DCLUSTFILE *df,unsigned long long row);
+int DclustFileClusterRows(const DCLUSTFILE *df,unsigned int clusterid,unsigned long long *first,unsigned long long *last);
+unsigned int DclustFileWeight(const DCLUSTFILE *df,unsigned long long row);
+CELLNAMEIDX DclustFileDuplicate(const DCLUSTFILE *df,unsigned long long dup);
+void DclustFileGetRow(const DCLUSTFILE *df,unsigned long long row,float *val);
+
+int DclustFileCreate(DCLUSTWRITER *w,FILE *f,const DCLUSTHEADER *hdr,const char *cellnames);
+void DclustFilePutRow(DCLUSTWRITER *w,CELLNAMEIDX cellnameidx,const void *data,unsigned int clusterid);
+void DclustFileSetClusterRows(DCLUSTWRITER *w,const unsigned long long *firstrow);
+void DclustFileSetDuplicates(DCLUSTWRITER *w,const unsigned int *weight,const CELLNAMEIDX *duplicate);
+int DclustFileFinish(DCLUSTWRITER *w);
+int DclustFileCreatePart(DCLUSTWRITER *part,const DCLUSTWRITER *w,unsigned long long firstrow);
+int DclustFileFinishPart(DCLUSTWRITER *w,DCLUSTWRITER *part);
+
+#endif
+/* ------------------------------------------------------------------------------------ */
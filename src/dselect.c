@@ -77,9 +77,25 @@
 #include <limits.h>
 #include <float.h>
 #include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dclust.h"
+#include "dclustfile.h"
+#include "fcsfile.h"
 
 #define kLoadingProgressReporting 500000
+#define kMaxParseThreads 64
+#define kLeftoverBufSize (1024*1024)
+#define kPartBytes (64*1024*1024)
+#define kSelectionInitialRows 65536
+#define kMaxSelectionRuns 512
+#define kWriteBufSize (1024*1024)
+#define kMinSortEventsPerThread 65536
+#define kSortBytesPerEvent (3*sizeof(unsigned int))	/* sort values and two index arrays */
+#define kFcsReadEvents 65536
+#define kDuplicateHashLoad 2		/* hash slots per selected event when collapsing identical events */
 
 /* ------------------------------------------------------------------------------------ */
 
@@ -112,81 +128,137 @@ struct	LEFTOVER_struct
 	float val[kMaxInputCol];
 };
 
-/* ------------------------------------------------------------------------------------ */
+/* per column statistics, gathered while parsing so that the sort key can be chosen without a second pass over the events */
+typedef	struct	COLUMNSTATS_struct	COLUMNSTATS;
+struct	COLUMNSTATS_struct
+{
+	long long sum[kMaxInputCol];
+	long long sum2[kMaxInputCol];
+	unsigned short min[kMaxInputCol];
+	unsigned short max[kMaxInputCol];
+};
 
-static unsigned int ReadUnAssignedFileHeader(FILE *uf,unsigned int *rowcnt,unsigned int *colcnt)
+/* selected events; kept in memory up to maxrows, then spilled in runs to a temporary file */
+typedef	struct	SELECTION_struct	SELECTION;
+struct	SELECTION_struct
 {
-	unsigned int ui;
-	unsigned int maxclusterid;
-	int endian;
-	char hdr[kHeaderSize];
+	FACSDATA *facsdata;
+	unsigned int capacity;
+	unsigned int maxrows;		/* memory budget in events, 0 if unlimited */
+	unsigned int cnt;		/* events currently in memory */
+	unsigned int colcnt;
+	FILE *runs;
+	char runsfn[kMaxFilename];
+	unsigned int runcnt;
+	unsigned int runrows[kMaxSelectionRuns];
+};
 
-	fread(&hdr[0],sizeof(char),kHeaderSize,uf);
-	if (strcmp(hdr,"dclust unassigned file v1.0   \n") != 0)
-	{
-		printf("Error: input is not a dclust unassigned file\n");
-		return(0);
-	}	
+/* single pass reservoir sampling (Vitter's algorithm L) of the events that would be selected, */
+/* one reservoir of quota events per stratum (input file); events pushed out go to the leftover file */
+typedef	struct	RESERVOIR_struct	RESERVOIR;
+struct	RESERVOIR_struct
+{
+	unsigned long long rng;		/* splitmix64 state, seeded from the command line */
+	unsigned int stratacnt;
+	unsigned int *quota;		/* events kept per stratum */
+	unsigned int *base;		/* first row of each stratum in the selection */
+	unsigned int *filled;
+	unsigned long long *seen;	/* candidate events offered to each stratum */
+	unsigned long long *next;	/* next candidate taken once a stratum is full */
+	double *w;
+	unsigned int evicted;
+	FILE *lf;
+};
 
-	fread(&endian,sizeof(int),1,uf);
-	if (endian != 1)
-	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
-		return(0);
-	}
-	fread(&ui,sizeof(int),1,uf);
-	*rowcnt = ui;
-		
-	fread(&ui,sizeof(int),1,uf);
-	*colcnt = ui;
-	
-	fread(&maxclusterid,sizeof(int),1,uf);
-	return(maxclusterid);
-	
-} /* ReadUnAssignedFileHeader */
+/* part of the mmapped csv file handled by one thread */
+typedef	struct	PARSECHUNK_struct	PARSECHUNK;
+struct	PARSECHUNK_struct
+{
+	const char *start;
+	const char *end;
+	unsigned int colcnt;
+	unsigned int firstColIsSelectFlag;
+	unsigned int loadEveryNsample;
+	int maxInputVal;
+	/* filled while counting */
+	unsigned int rawlines;
+	unsigned int lines;
+	unsigned int selectable;
+	unsigned int errline;		/* first line with an invalid selection flag, counted from the start of the part */
+	/* set from the counts of the previous chunks before parsing */
+	unsigned int firstline;
+	unsigned int selectedbefore;
+	unsigned int toretain;
+	unsigned int retainedbase;	/* relative to the first part loaded in memory together with this one */
+	unsigned int leftoverbase;
+	FACSDATA *facsdata;
+	int lfd;
+	off_t lfoffset;
+	/* filled while parsing */
+	unsigned int retained;
+	unsigned int leftover;
+	COLUMNSTATS stats;
+	char err[kMaxLineBuf];
+};
 
-/* ------------------------------------------------------------------------------------ */
-static unsigned int ReadAssignedFileHeader(FILE *uf,unsigned int *rowcnt,unsigned int *colcnt)
+/* a thread parsing every stride-th part */
+typedef	struct	PARSEWORKER_struct	PARSEWORKER;
+struct	PARSEWORKER_struct
 {
-	unsigned int ui;
-	unsigned int maxclusterid;
-	int endian;
-	char hdr[kHeaderSize];
+	PARSECHUNK *pc;
+	unsigned int partcnt;
+	unsigned int first;
+	unsigned int stride;
+	void *(*func)(void *);
+};
 
-	fread(&hdr[0],sizeof(char),kHeaderSize,uf);
-	if (strcmp(hdr,"dclust assigned file v1.0     \n") != 0)
-	{
-		printf("Error: input is not a dclust assigned file\n");
-		return(0);
-	}	
+/* one thread's share of a radix sort pass */
+typedef	struct	RADIXSORT_struct	RADIXSORT;
+struct	RADIXSORT_struct
+{
+	const FACSDATA *facsdata;
+	unsigned short key;
+	unsigned short key2;
+	unsigned int *sortval;
+	const unsigned int *src;	/* current order, NULL for input order */
+	unsigned int *dst;
+	unsigned int from;
+	unsigned int to;
+	unsigned int shift;
+	int fill;
+	unsigned int cnt[65536];
+};
 
-	fread(&endian,sizeof(int),1,uf);
-	if (endian != 1)
-	{
-		printf("Error: File not supported: Wrong platform (little/Big endian incompatibility)\n");
-		return(0);
-	}
-	fread(&ui,sizeof(int),1,uf);
-	*rowcnt = ui;
-		
-	fread(&ui,sizeof(int),1,uf);
-	*colcnt = ui;
-	
-	fread(&maxclusterid,sizeof(int),1,uf);
-	return(maxclusterid);
-	
-} /* ReadAssignedFileHeader */
+/* buffered sequential output */
+typedef	struct	OUTBUF_struct	OUTBUF;
+struct	OUTBUF_struct
+{
+	FILE *f;
+	char *buf;
+	size_t cnt;
+	size_t size;
+	int err;
+};
+
+/* one sorted run of spilled events being merged */
+typedef	struct	MERGERUN_struct	MERGERUN;
+struct	MERGERUN_struct
+{
+	char *buf;
+	unsigned int bufcnt;
+	unsigned int bufpos;
+	unsigned int left;		/* events of the run not read yet */
+	off_t offset;			/* where they start in the runs file */
+	unsigned int sortval;
+};
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned short processUnAssignedFile(FILE *f, FILE *af, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt, unsigned int inputrcnt,unsigned int *selectedcnt,unsigned int colcnt,unsigned short *key)
+static unsigned short processUnAssignedFile(DCLUSTFILE *df, DCLUSTHEADER *hdr, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt, unsigned int inputrcnt,unsigned int *selectedcnt,unsigned int colcnt,unsigned short *key)
 {
 	FACSDATA *facsp;
 	unsigned int i;
-	char linbuf[kMaxLineBuf];
-	int endian;
 	unsigned int rcnt;
-	char hdr[kHeaderSize];
 	long long sum[kMaxInputCol];
 	double score[kMaxInputCol];
 	double bestscore;
@@ -196,21 +268,7 @@ static unsigned short processUnAssignedFile(FILE *f, FILE *af, FACSDATA *facsdat
 
 		
 
-	strcpy(hdr,"dclust input file v1.0        \n");
-	fwrite(&hdr[0],sizeof(char),kHeaderSize,af);
-
-	endian = 1;
-	fwrite(&endian,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af); // reserve space for rowcnt
-	fwrite(&colcnt,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af);//place for loadEveryNsample, which is  = 1
-
-	/* read header */
-	fseek(f,(kHeaderSize+4*sizeof(int)),SEEK_SET);
-	fread(&linbuf[0],kMaxLineBuf,1,f);
-
-	/* write header */
-	fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,af);
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,df->hdr.header);
 
 	for (cn = 0; cn<(unsigned short)colcnt;cn++)
 		sum[cn] = 0;
@@ -223,8 +281,8 @@ static unsigned short processUnAssignedFile(FILE *f, FILE *af, FACSDATA *facsdat
 	{
 		float	floatdata[kMaxInputCol];
 
-		fread(&facsp->cellnameidx,sizeof(CELLNAMEIDX),1,f);
-		fread(&floatdata[0],sizeof(float),colcnt,f);
+		facsp->cellnameidx = DclustFileCellNameIdx(df,rcnt);
+		DclustFileGetRow(df,rcnt,&floatdata[0]);
 
 		for (i=0; i<colcnt; i++)
 		{
@@ -235,8 +293,7 @@ static unsigned short processUnAssignedFile(FILE *f, FILE *af, FACSDATA *facsdat
 		selcnt++;
 
 	}
-	fseek(af,36L,SEEK_SET);
-	fwrite(&selcnt,sizeof(int),1,af);
+	hdr->rowcnt = selcnt;
 
 	printf("LOG: %10d columns in input file\n",colcnt);
 	printf("LOG: %10d events in input file\n",inputrcnt);
@@ -278,49 +335,30 @@ static unsigned short processUnAssignedFile(FILE *f, FILE *af, FACSDATA *facsdat
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned short processAssignedFile(FILE *f, FILE *af, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int cluster, unsigned int inputrcnt,unsigned int *selectedcnt,unsigned int colcnt,unsigned short *key)
+static unsigned short processAssignedFile(DCLUSTFILE *df, DCLUSTHEADER *hdr, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int cluster, unsigned int inputrcnt,unsigned int *selectedcnt,unsigned int colcnt,unsigned short *key)
 {
 	FACSDATA *facsp;
 	unsigned int i;
 	char linbuf[kMaxLineBuf];
-	int endian;
 	unsigned int rcnt;
-	char hdr[kHeaderSize];
 	long long sum[kMaxInputCol];
 	double score[kMaxInputCol];
 	double bestscore;
 	unsigned int 	selcnt = 0;
 	unsigned short cn;
+	unsigned long long first = 0;
+	unsigned long long last = inputrcnt;
 
 
 		
 
-	strcpy(hdr,"dclust input file v1.0        \n");
-	fwrite(&hdr[0],sizeof(char),kHeaderSize,af);
-
-	endian = 1;
-	fwrite(&endian,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af); // reserve space for rowcnt
-	fwrite(&colcnt,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af);//place for loadEveryNsample, which is  = 1
-
-	/* read header */
-	fseek(f,(kHeaderSize+4*sizeof(int)),SEEK_SET);
-	fread(&linbuf[0],kMaxLineBuf,1,f);
+	strcpy(linbuf,df->hdr.header);
 	/* remove the ,cluster from header */
 	i=strlen(linbuf);
-	linbuf[i-8] = 0;  /* remove the ,cluster */				
-	linbuf[i-7] = 0;  /* remove the ,cluster */				
-	linbuf[i-6] = 0;  /* remove the ,cluster */				
-	linbuf[i-5] = 0;  /* remove the ,cluster */				
-	linbuf[i-4] = 0;  /* remove the ,cluster */				
-	linbuf[i-3] = 0;  /* remove the ,cluster */				
-	linbuf[i-2] = 0;  /* remove the ,cluster */				
-	linbuf[i-1] = 0;  /* remove the ,cluster */				
-
-	/* write header */
-	fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,af);
+	if (i >= 8)
+		linbuf[i-8] = 0;
 
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,linbuf);
 
 	for (cn = 0; cn<(unsigned short)colcnt;cn++)
 		sum[cn] = 0;
@@ -328,18 +366,17 @@ static unsigned short processAssignedFile(FILE *f, FILE *af, FACSDATA *facsdata,
 	for (cn = 0; cn<cellnamecnt;cn++)
 		uniquecellnames[cn].selcnt = 0;
 
+	/* when the rows are grouped by clusterid only those of the cluster are read */
+	DclustFileClusterRows(df,cluster,&first,&last);
 	facsp = &facsdata[0];
-	for (rcnt = 0; rcnt< inputrcnt ; rcnt++)
+	for (rcnt = (unsigned int)first; rcnt < last ; rcnt++)
 	{
 		float	floatdata[kMaxInputCol];
-		unsigned int clusterid;
-
-		fread(&facsp->cellnameidx,sizeof(CELLNAMEIDX),1,f);
-		fread(&floatdata[0],sizeof(float),colcnt,f);
-		fread(&clusterid,sizeof(int),1,f);
 
-		if (clusterid == cluster)
+		if (DclustFileClusterId(df,rcnt) == cluster)
 		{
+			facsp->cellnameidx = DclustFileCellNameIdx(df,rcnt);
+			DclustFileGetRow(df,rcnt,&floatdata[0]);
 			for (i=0; i<colcnt; i++)
 			{
 				facsp->data[i] = (unsigned short)floatdata[i];
@@ -350,8 +387,7 @@ static unsigned short processAssignedFile(FILE *f, FILE *af, FACSDATA *facsdata,
 		}
 
 	}
-	fseek(af,36L,SEEK_SET);
-	fwrite(&selcnt,sizeof(int),1,af);
+	hdr->rowcnt = selcnt;
 
 	printf("LOG: %10d columns in input file\n",colcnt);
 	printf("LOG: %10d events in input file\n",inputrcnt);
@@ -393,7 +429,358 @@ static unsigned short processAssignedFile(FILE *f, FILE *af, FACSDATA *facsdata,
 
 /* ------------------------------------------------------------------------------------ */
 
-static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int loadEveryNsample, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key,unsigned int firstColIsSelectFlag,unsigned  short *minkeyval,unsigned short *maxkeyval)
+static void ClearColumnStats(COLUMNSTATS *cs,unsigned int colcnt)
+{
+	unsigned int i;
+
+	for (i = 0; i < colcnt; i++)
+	{
+		cs->sum[i] = 0;
+		cs->sum2[i] = 0;
+		cs->min[i] = 65535;
+		cs->max[i] = 0;
+	}
+
+} /* ClearColumnStats */
+/* ------------------------------------------------------------------------------------ */
+
+static void AddColumnStats(COLUMNSTATS *cs,const unsigned short *data,unsigned int colcnt)
+{
+	unsigned int i;
+
+	for (i = 0; i < colcnt; i++)
+	{
+		cs->sum[i] += (long long)data[i];
+		cs->sum2[i] += (long long)data[i]*data[i];
+		if (data[i] < cs->min[i])
+			cs->min[i] = data[i];
+		if (data[i] > cs->max[i])
+			cs->max[i] = data[i];
+	}
+
+} /* AddColumnStats */
+/* ------------------------------------------------------------------------------------ */
+
+static void MergeColumnStats(COLUMNSTATS *cs,const COLUMNSTATS *part,unsigned int colcnt)
+{
+	unsigned int i;
+
+	for (i = 0; i < colcnt; i++)
+	{
+		cs->sum[i] += part->sum[i];
+		cs->sum2[i] += part->sum2[i];
+		if (part->min[i] < cs->min[i])
+			cs->min[i] = part->min[i];
+		if (part->max[i] > cs->max[i])
+			cs->max[i] = part->max[i];
+	}
+
+} /* MergeColumnStats */
+/* ------------------------------------------------------------------------------------ */
+
+/* select column with largest sddev as sorting key */
+static void ChooseSortKey(const COLUMNSTATS *cs,unsigned int rowcnt,unsigned int colcnt,unsigned short *key,unsigned short *minkeyval,unsigned short *maxkeyval)
+{
+	double score[kMaxInputCol];
+	double  bestscore;
+	unsigned short cn;
+
+	for (cn = 0; cn<(unsigned short)colcnt;cn++)
+	{
+		/* sum of squared deviations from the integer mean, expanded so that it only needs the sums */
+		long long mean = (rowcnt > 0) ? cs->sum[cn] / rowcnt : 0;
+
+		score[cn] = (double)(cs->sum2[cn] - 2*mean*cs->sum[cn] + (long long)rowcnt*mean*mean);
+		if (verbose > 0)
+			printf("LOG: column %4d: mean=%5d stdev=%f\n",cn,(int)mean,sqrt(score[cn]/rowcnt));
+	}
+	bestscore = 0.0;
+	for (cn = 0; cn<colcnt;cn++)
+	{
+		if (score[cn] > bestscore)
+		{
+			bestscore = score[cn];
+			*key = cn;
+		}
+	}
+	*minkeyval = (rowcnt > 0) ? cs->min[*key] : 65535;
+	*maxkeyval = (rowcnt > 0) ? cs->max[*key] : 0;
+	if (verbose > 1)
+		printf("LOG: colkey = %d; (%u - %u)\n",*key,*minkeyval,*maxkeyval);	
+
+} /* ChooseSortKey */
+/* identical selected events collapsed into one row; the events of row k other than the kept one */
+/* are id[first[k]] to id[first[k+1]-1] */
+typedef	struct	DUPLICATES_struct	DUPLICATES;
+struct	DUPLICATES_struct
+{
+	unsigned int *weight;
+	unsigned int *first;
+	CELLNAMEIDX *id;
+	unsigned int cnt;
+};
+
+/* ------------------------------------------------------------------------------------ */
+
+static void InitSelection(SELECTION *sel,unsigned int maxrows,const char *ofn)
+{
+	memset(sel,0,sizeof(SELECTION));
+	sel->maxrows = maxrows;
+	sprintf(sel->runsfn,"%s.selected.runs",ofn);
+
+} /* InitSelection */
+/* ------------------------------------------------------------------------------------ */
+
+/* new events are zeroed, as the sort may look at one column past the data when there is a single column */
+static int ReserveSelection(SELECTION *sel,unsigned int rows)
+{
+	FACSDATA *facsdata;
+
+	if (rows <= sel->capacity)
+		return(0);
+	facsdata = realloc(sel->facsdata,(size_t)rows*sizeof(FACSDATA));
+	if (!facsdata)
+	{
+		printf("LOG:Fatal: Cannot Allocate Memory to select %u events\n",rows);
+		return(1);
+	}
+	memset(&facsdata[sel->capacity],0,(size_t)(rows-sel->capacity)*sizeof(FACSDATA));
+	sel->facsdata = facsdata;
+	sel->capacity = rows;
+	return(0);
+
+} /* ReserveSelection */
+/* ------------------------------------------------------------------------------------ */
+
+/* append the events in memory, in input order, as a new run of the runs file */
+static int SpillSelection(SELECTION *sel)
+{
+	unsigned int i;
+
+	if (sel->cnt == 0)
+		return(0);
+	if (sel->runcnt >= kMaxSelectionRuns)
+	{
+		printf("LOG:Fatal: memory budget too small, selected events would need more than %d runs\n",kMaxSelectionRuns);
+		return(1);
+	}
+	if (!sel->runs)
+	{
+		sel->runs = fopen(sel->runsfn,"wb+");
+		if (!sel->runs)
+		{
+			printf("Error:Cannot write temporary File %s\n",sel->runsfn);
+			return(1);
+		}
+	}
+	fseeko(sel->runs,0,SEEK_END);
+	for (i = 0; i < sel->cnt; i++)
+	{
+		fwrite(&sel->facsdata[i].cellnameidx,sizeof(CELLNAMEIDX),1,sel->runs);
+		if (fwrite(&sel->facsdata[i].data,sizeof(unsigned short),sel->colcnt,sel->runs) != sel->colcnt)
+		{
+			printf("Error:Cannot write temporary File %s\n",sel->runsfn);
+			return(1);
+		}
+	}
+	if (verbose > 0)
+		printf("LOG: %10u selected events spilled to run %u\n",sel->cnt,sel->runcnt);
+	sel->runrows[sel->runcnt++] = sel->cnt;
+	sel->cnt = 0;
+	return(0);
+
+} /* SpillSelection */
+/* ------------------------------------------------------------------------------------ */
+
+/* room for one more event, growing the selection or spilling it once the memory budget is reached */
+static FACSDATA *NextSelectedRow(SELECTION *sel)
+{
+	if (sel->cnt >= sel->capacity)
+	{
+		if ((sel->maxrows > 0) && (sel->cnt >= sel->maxrows))
+		{
+			if (SpillSelection(sel))
+				return(NULL);
+		}
+		else
+		{
+			unsigned int rows = (sel->capacity > 0) ? 2*sel->capacity : kSelectionInitialRows;
+
+			if ((sel->maxrows > 0) && (rows > sel->maxrows))
+				rows = sel->maxrows;
+			if (ReserveSelection(sel,rows))
+				return(NULL);
+		}
+	}
+	return(&sel->facsdata[sel->cnt++]);
+
+} /* NextSelectedRow */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeSelection(SELECTION *sel)
+{
+	free(sel->facsdata);
+	sel->facsdata = NULL;
+	if (sel->runs)
+	{
+		fclose(sel->runs);
+		unlink(sel->runsfn);
+		sel->runs = NULL;
+	}
+
+} /* FreeSelection */
+/* ------------------------------------------------------------------------------------ */
+
+/* splitmix64, uniform in ]0..1[ */
+static double ReservoirRandom(RESERVOIR *res)
+{
+	unsigned long long z = (res->rng += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return(((double)(z >> 11) + 0.5) / 9007199254740992.0);
+
+} /* ReservoirRandom */
+/* ------------------------------------------------------------------------------------ */
+
+static void ReservoirSkip(RESERVOIR *res,unsigned int s)
+{
+	double skip = floor(log(ReservoirRandom(res))/log(1.0-res->w[s]));
+
+	if (!(skip < 1e18))
+		skip = 1e18;
+	res->next[s] += (unsigned long long)skip+1;
+
+} /* ReservoirSkip */
+/* ------------------------------------------------------------------------------------ */
+
+/* size events are kept, split evenly between the strata; the selection holds the reservoirs back to back */
+static int InitReservoir(RESERVOIR *res,unsigned int size,unsigned int stratacnt,unsigned int seed,SELECTION *sel,FILE *lf)
+{
+	unsigned int s;
+
+	memset(res,0,sizeof(RESERVOIR));
+	res->rng = seed;
+	res->stratacnt = stratacnt;
+	res->lf = lf;
+	res->quota = calloc(stratacnt,sizeof(unsigned int));
+	res->base = calloc(stratacnt,sizeof(unsigned int));
+	res->filled = calloc(stratacnt,sizeof(unsigned int));
+	res->seen = calloc(stratacnt,sizeof(unsigned long long));
+	res->next = calloc(stratacnt,sizeof(unsigned long long));
+	res->w = calloc(stratacnt,sizeof(double));
+	if (!res->quota || !res->base || !res->filled || !res->seen || !res->next || !res->w)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		return(1);
+	}
+	for (s = 0; s < stratacnt; s++)
+	{
+		res->quota[s] = size/stratacnt + ((s < size%stratacnt) ? 1 : 0);
+		res->base[s] = (s == 0) ? 0 : res->base[s-1]+res->quota[s-1];
+	}
+	/* the reservoirs never grow nor spill */
+	sel->maxrows = 0;
+	return(ReserveSelection(sel,size));
+
+} /* InitReservoir */
+/* ------------------------------------------------------------------------------------ */
+
+/* is the next candidate event of stratum s kept ? */
+static int ReservoirTakes(RESERVOIR *res,unsigned int s)
+{
+	res->seen[s]++;
+	if (res->seen[s] <= res->quota[s])
+		return(1);
+	return(res->seen[s] == res->next[s]);
+
+} /* ReservoirTakes */
+/* ------------------------------------------------------------------------------------ */
+
+/* where to put an event kept by ReservoirTakes; once full, the event it replaces is written to the leftover file */
+static FACSDATA *ReservoirRow(RESERVOIR *res,unsigned int s,SELECTION *sel)
+{
+	FACSDATA *facsp;
+	unsigned int q = res->quota[s];
+	unsigned int j;
+
+	if (res->filled[s] < q)
+	{
+		facsp = &sel->facsdata[res->base[s]+res->filled[s]++];
+		if (res->filled[s] == q)
+		{
+			res->w[s] = exp(log(ReservoirRandom(res))/q);
+			res->next[s] = res->seen[s];
+			ReservoirSkip(res,s);
+		}
+		return(facsp);
+	}
+
+	j = (unsigned int)(ReservoirRandom(res)*q);
+	if (j >= q)
+		j = q-1;
+	facsp = &sel->facsdata[res->base[s]+j];
+	if (res->lf)
+	{
+		LEFTOVER lo;
+		unsigned int i;
+
+		lo.cellnameidx = facsp->cellnameidx;
+		for (i = 0; i < sel->colcnt; i++)
+			lo.val[i] = (float)facsp->data[i];
+		if (fwrite(&lo,sizeof(CELLNAMEIDX)+sel->colcnt*sizeof(float),1,res->lf) != 1)
+		{
+			printf("Error:Cannot write leftover File\n");
+			return(NULL);
+		}
+	}
+	res->evicted++;
+	res->w[s] *= exp(log(ReservoirRandom(res))/q);
+	ReservoirSkip(res,s);
+	return(facsp);
+
+} /* ReservoirRow */
+/* ------------------------------------------------------------------------------------ */
+
+/* pack the reservoirs and recompute the column statistics of the events finally kept */
+static void ReservoirFinish(RESERVOIR *res,SELECTION *sel,COLUMNSTATS *cs,unsigned int *rowcnt,unsigned int *leftovercnt)
+{
+	unsigned int s,i;
+	unsigned int cnt = 0;
+
+	for (s = 0; s < res->stratacnt; s++)
+	{
+		if ((res->filled[s] > 0) && (res->base[s] != cnt))
+			memmove(&sel->facsdata[cnt],&sel->facsdata[res->base[s]],(size_t)res->filled[s]*sizeof(FACSDATA));
+		cnt += res->filled[s];
+		if ((verbose > 0) && (res->stratacnt > 1))
+			printf("LOG: stratum %5u: %10u of %llu events sampled\n",s,res->filled[s],res->seen[s]);
+	}
+	sel->cnt = cnt;
+	ClearColumnStats(cs,sel->colcnt);
+	for (i = 0; i < cnt; i++)
+		AddColumnStats(cs,sel->facsdata[i].data,sel->colcnt);
+	*rowcnt = cnt;
+	*leftovercnt += res->evicted;
+
+} /* ReservoirFinish */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeReservoir(RESERVOIR *res)
+{
+	free(res->quota);
+	free(res->base);
+	free(res->filled);
+	free(res->seen);
+	free(res->next);
+	free(res->w);
+	memset(res,0,sizeof(RESERVOIR));
+
+} /* FreeReservoir */
+/* ------------------------------------------------------------------------------------ */
+
+static unsigned short processInputFile(FILE *f, DCLUSTHEADER *hdr, FILE *lf,unsigned int loadEveryNsample, SELECTION *sel,RESERVOIR *res,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key,unsigned int firstColIsSelectFlag,unsigned  short *minkeyval,unsigned short *maxkeyval)
 {
 	FACSDATA *facsp;
 	unsigned short flt10000[64];
@@ -406,17 +793,12 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 	int endian;
 	unsigned int rowcnt = 0;
 	unsigned int leftovercnt = 0;
-	char hdr[kHeaderSize];
-	long long sum[kMaxInputCol];
-	double score[kMaxInputCol];
-	double  bestscore;
+	char lfhdr[kHeaderSize];
+	COLUMNSTATS cs;
 	unsigned int skip;
-	unsigned short cn;
 	unsigned int nextprintout = kLoadingProgressReporting;
 	unsigned int leftoverstructsize;
 	LEFTOVER lo;
-	unsigned short minval = 65535;
-	unsigned short maxval = 0;
 
 	for (i=0; i<64; i++)
 	{
@@ -433,8 +815,6 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 		flt10[i] =  10*(i-48);
 	}
 		
-	facsp = &facsdata[0];
-	
 	if (firstColIsSelectFlag)
 	{
 		char c;
@@ -451,22 +831,13 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 	} while (linbuf[i++] != 0);
 	while (i++ < kMaxLineBuf) { linbuf[i] = 0; }
 
-	strcpy(hdr,"dclust input file v1.0        \n");
-	fwrite(&hdr[0],sizeof(char),kHeaderSize,af);
-
-	endian = 1;
-	fwrite(&endian,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af); // reserve space for rowcnt
-	fwrite(&colcnt,sizeof(int),1,af);
-	fwrite(&loadEveryNsample,sizeof(int),1,af);
-
-	/* write header */
-	fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,af);
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,linbuf);
+	hdr->loadEveryNsample = loadEveryNsample;
 
 	if (lf)
 	{
-		strcpy(hdr,"dclust unassigned file v1.0   \n");
-		fwrite(&hdr[0],sizeof(char),kHeaderSize,lf);
+		strcpy(lfhdr,"dclust unassigned file v1.0   \n");
+		fwrite(&lfhdr[0],sizeof(char),kHeaderSize,lf);
 
 		endian = 1;
 		fwrite(&endian,sizeof(int),1,lf);
@@ -480,11 +851,10 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 	}
 
 	skip = 0;
-	for (cn = 0; cn<(unsigned short)colcnt;cn++)
-		sum[cn] = 0;
+	sel->colcnt = colcnt;
+	ClearColumnStats(&cs,colcnt);
 
 	leftoverstructsize = sizeof(CELLNAMEIDX) + colcnt*sizeof(float);
-	cn = 0;
 	do
 	{
 		int l;
@@ -501,7 +871,7 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 		else
 			sscanf(&linbuf[0],"%u,%n",&lo.cellnameidx,&l);
 
-		if ((skip != 0) || (canselect == 0)) /* put in leftover */
+		if ((skip != 0) || (canselect == 0) || (res && !ReservoirTakes(res,0))) /* put in leftover */
 		{
 			unsigned short c1,c2,c3,c4,c5;
 			char *cp = &linbuf[l];
@@ -573,14 +943,16 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 		else /* retain */
 		{
 			unsigned short tot = l;
-			facsp->cellnameidx = lo.cellnameidx;
 
+			facsp = (res) ? ReservoirRow(res,0,sel) : NextSelectedRow(sel);
+			if (!facsp)
+				return(0);
+			facsp->cellnameidx = lo.cellnameidx;
 			for (i=0; i<colcnt; i++)
 			{
 				sscanf(&linbuf[tot],"%hu,%n",&facsp->data[i],&l); tot+=l;
-				sum[i]+=(long long)facsp->data[i];
 			}
-			facsp++;
+			AddColumnStats(&cs,facsp->data,colcnt);
 			rowcnt++;
 		}
 		if (canselect) /* otherwise was a no select and does not count */
@@ -597,8 +969,9 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 		}
 
 	} while(1);
-	fseek(af,36L,SEEK_SET);
-	fwrite(&rowcnt,sizeof(int),1,af);
+	if (res)
+		ReservoirFinish(res,sel,&cs,&rowcnt,&leftovercnt);
+	hdr->rowcnt = rowcnt;
 
 	if (lf)
 	{
@@ -610,50 +983,10 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 	printf("LOG: %10d events selected\n",rowcnt);
 	printf("LOG: %10d events leftover\n",leftovercnt);
 
-	for (cn = 0; cn<(unsigned short)colcnt;cn++)
-	{
-		/* compute SDDEV for a column */
-		int mean = (int)(sum[cn] / rowcnt);
-		long long sd = 0;
-		facsp = &facsdata[0];
-		for (i = 0; i<rowcnt;i++)
-		{
-			int diff = (int)facsp->data[cn] - mean;
-			sd += (long long)(diff * diff);
-			facsp++;
-		}
-		score[cn] = (double)sd;
-		if (verbose > 0)
-			printf("LOG: column %4d: mean=%5d stdev=%f\n",cn,mean,sqrt(score[cn]/rowcnt));
-	}
-	/* select column with largest sddev as sorting key */
-	bestscore = 0.0;
-	for (cn = 0; cn<colcnt;cn++)
-	{
-		if (score[cn] > bestscore)
-		{
-			bestscore = score[cn];
-			*key = cn;
-		}
-	}
-	facsp = &facsdata[0];
-	cn = *key;
-	for (i = 0; i<rowcnt;i++)
-	{
-		if (facsp->data[cn] > maxval)
-			maxval = facsp->data[cn]; 
-		if (facsp->data[cn] < minval)
-			minval = facsp->data[cn]; 
-		facsp++;
-	}
-	if (verbose > 1)
-		printf("LOG: colkey = %d; (%u - %u)\n",*key,minval,maxval);	
-	
-	*minkeyval = minval;
-	*maxkeyval = maxval;
+	ChooseSortKey(&cs,rowcnt,colcnt,key,minkeyval,maxkeyval);
 	*selectedcnt = rowcnt;
 	*columns = colcnt;
-	
+
 	cellnamecnt = 1;
 	
 	return(cellnamecnt);
@@ -661,7 +994,7 @@ static unsigned short processInputFile(FILE *f, FILE *af, FILE *lf,unsigned int
 } /* processInputFile */
 
 /* ------------------------------------------------------------------------------------ */
-static unsigned short SafeProcessInputFile(FILE *f, FILE *af, FILE *lf,unsigned int loadEveryNsample, FACSDATA *facsdata,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key, unsigned int firstColIsSelectFlag,unsigned  short *minkeyval,unsigned short *maxkeyval)
+static unsigned short SafeProcessInputFile(FILE *f, DCLUSTHEADER *hdr, FILE *lf,unsigned int loadEveryNsample, SELECTION *sel,RESERVOIR *res,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key, unsigned int firstColIsSelectFlag,unsigned  short *minkeyval,unsigned short *maxkeyval)
 {
 	FACSDATA *facsp;
 	unsigned int i;
@@ -671,19 +1004,13 @@ static unsigned short SafeProcessInputFile(FILE *f, FILE *af, FILE *lf,unsigned
 	int endian;
 	unsigned int rowcnt = 0;
 	unsigned int leftovercnt = 0;
-	char hdr[kHeaderSize];
-	long long sum[kMaxInputCol];
-	double score[kMaxInputCol];
+	char lfhdr[kHeaderSize];
+	COLUMNSTATS cs;
 	unsigned int skip;
 	CELLNAMEIDX cn;
-	double  bestscore;
 	unsigned int nextprintout = kLoadingProgressReporting;
-	unsigned short minval = 65535;
-	unsigned short maxval = 0;
 	int maxInputVal = *maxkeyval;
 		
-	facsp = &facsdata[0];
-	
 	if (firstColIsSelectFlag)
 	{
 		char c;
@@ -706,306 +1033,1515 @@ static unsigned short SafeProcessInputFile(FILE *f, FILE *af, FILE *lf,unsigned
 		return(0);
 	}	
 	
-	strcpy(hdr,"dclust input file v1.0        \n");
-	fwrite(&hdr[0],sizeof(char),kHeaderSize,af);
-
-	endian = 1;
-	fwrite(&endian,sizeof(int),1,af);
-	fwrite(&endian,sizeof(int),1,af); // reserve space for rowcnt
-	fwrite(&colcnt,sizeof(int),1,af);
-	fwrite(&loadEveryNsample,sizeof(int),1,af);
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,linbuf);
+	hdr->loadEveryNsample = loadEveryNsample;
 
-	/* write header */
-	fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,af);
+	if (lf)
+	{
+		strcpy(lfhdr,"dclust unassigned file v1.0   \n");
+		fwrite(&lfhdr[0],sizeof(char),kHeaderSize,lf);
+
+		endian = 1;
+		fwrite(&endian,sizeof(int),1,lf);
+		fwrite(&endian,sizeof(int),1,lf); // reserve space for rowcnt
+		fwrite(&colcnt,sizeof(int),1,lf);
+		/* write spacer */
+		endian = 0;
+		fwrite(&endian,sizeof(int),1,lf);
+		/* write header */
+		fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,lf);
+	}
+	skip = 0;
+
+	sel->colcnt = colcnt;
+	ClearColumnStats(&cs,colcnt);
+
+	cn = 0;
+	do
+	{
+		int tot,l;
+		unsigned int canselect;
+		int inputVal;
+		
+		/* read one line */
+		fgets(linbuf,kMaxLineBuf,f);
+		if (feof(f))
+			break;
+
+		tot = 0;
+
+		canselect = 1;
+		if (firstColIsSelectFlag)
+			sscanf(&linbuf[0],"%u,%u,%n",&canselect,&cn,&l);
+		else
+			sscanf(&linbuf[0],"%u,%n",&cn,&l);
+		tot+=l;
+
+		if ((skip != 0) || (canselect == 0) || (res && !ReservoirTakes(res,0))) /* put in leftover */
+		{
+			for (i=0; i<colcnt; i++)
+			{
+				unsigned int tmp;
+				sscanf(&linbuf[tot],"%u,%n",&tmp,&l); tot+=l;		
+				val[i] = (float)tmp;
+			}
+
+			fwrite(&cn,sizeof(CELLNAMEIDX),1,lf);
+			fwrite(&val[0],sizeof(float),colcnt,lf);
+			leftovercnt++;
+		}
+		else /* retain */
+		{
+			facsp = (res) ? ReservoirRow(res,0,sel) : NextSelectedRow(sel);
+			if (!facsp)
+				return(0);
+			facsp->cellnameidx = cn;
+			for (i=0; i<colcnt; i++)
+			{
+				sscanf(&linbuf[tot],"%d,%n",&inputVal,&l); tot+=l;
+				if ((inputVal < 0) || inputVal > maxInputVal)
+				{
+					printf("LOG:Fatal: input value %d out of valid supported unsigned range [0..%d]. Please rescale your data first\n",inputVal,maxInputVal);
+					return(0);
+				}
+				facsp->data[i] = (unsigned short)inputVal;
+			}
+			AddColumnStats(&cs,facsp->data,colcnt);
+			rowcnt++;
+		}
+		if (canselect) /* otherwise was a no select and does not count */
+			skip++;
+		if (skip == loadEveryNsample)
+		{
+			skip = 0;
+			if (rowcnt > nextprintout)
+			{
+				printf("LOG: %10d events selected so far...\n",nextprintout);
+				fflush(stdout);
+				nextprintout += kLoadingProgressReporting;
+			}
+		}
+
+	} while(1);
+	if (res)
+		ReservoirFinish(res,sel,&cs,&rowcnt,&leftovercnt);
+	hdr->rowcnt = rowcnt;
+
+	if (lf)
+	{
+		fseek(lf,36L,SEEK_SET);
+		fwrite(&leftovercnt,sizeof(int),1,lf);
+	}
+	printf("LOG: %10d columns in input file\n",colcnt);
+	printf("LOG: %10d events in input file\n",rowcnt+leftovercnt);
+	printf("LOG: %10d events selected\n",rowcnt);
+	printf("LOG: %10d events leftover\n",leftovercnt);
+
+	ChooseSortKey(&cs,rowcnt,colcnt,key,minkeyval,maxkeyval);
+	*selectedcnt = rowcnt;
+	*columns = colcnt;
+
+	cellnamecnt = 1;
+
+	return(cellnamecnt);
+	
+} /* SafeProcessInputFile */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* parse one integer field of a csv line, allowing blanks around it. */
+/* returns the character ending the field (',' or '\n', end of data counting as '\n'), or 0 on a syntax error */
+static char ParseCSVInt(const char **pp,const char *end,long long *val)
+{
+	const char *p = *pp;
+	long long v = 0;
+	unsigned int digits = 0;
+	int neg = 0;
+	char c;
+
+	while ((p < end) && ((*p == ' ') || (*p == '\t')))
+		p++;
+	if ((p < end) && ((*p == '-') || (*p == '+')))
+		neg = (*p++ == '-');
+	while ((p < end) && ((unsigned char)(*p - '0') < 10))
+	{
+		if (v < 1000000000LL)
+			v = v*10 + (*p - '0');
+		p++;
+		digits++;
+	}
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+		p++;
+	if (digits == 0)
+		return(0);
+	*val = (neg) ? -v : v;
+	if (p >= end)
+	{
+		*pp = p;
+		return('\n');
+	}
+	c = *p;
+	if ((c != ',') && (c != '\n'))
+		return(0);
+	*pp = p+1;
+	return(c);
+
+} /* ParseCSVInt */
+/* ------------------------------------------------------------------------------------ */
+
+/* next line of a chunk; blank lines are skipped but counted for error messages */
+static const char *NextCSVLine(const char *p,const char *end,unsigned int *rawlines)
+{
+	while (p < end)
+	{
+		const char *q = p;
+
+		while ((q < end) && ((*q == ' ') || (*q == '\t') || (*q == '\r')))
+			q++;
+		if ((q < end) && (*q != '\n'))
+			return(p);
+		(*rawlines)++;
+		p = (q < end) ? q+1 : end;
+	}
+	return(NULL);
+
+} /* NextCSVLine */
+/* ------------------------------------------------------------------------------------ */
+
+static const char *EndOfCSVLine(const char *p,const char *end)
+{
+	const char *eol = memchr(p,'\n',end-p);
+
+	return((eol) ? eol+1 : end);
+
+} /* EndOfCSVLine */
+/* ------------------------------------------------------------------------------------ */
+
+/* first pass: count rows and rows allowed to be selected, so that each thread knows where its rows go */
+static void *CountChunkRows(void *arg)
+{
+	PARSECHUNK *pc = (PARSECHUNK *)arg;
+	const char *p = pc->start;
+
+	while ((p = NextCSVLine(p,pc->end,&pc->rawlines)) != NULL)
+	{
+		long long canselect = 1;
+
+		if (pc->firstColIsSelectFlag)
+		{
+			const char *q = p;
+
+			if (ParseCSVInt(&q,pc->end,&canselect) != ',')
+			{
+				if (pc->errline == 0)
+					pc->errline = pc->rawlines+1;
+				canselect = 0;
+			}
+		}
+		pc->rawlines++;
+		pc->lines++;
+		if (canselect)
+			pc->selectable++;
+		p = EndOfCSVLine(p,pc->end);
+	}
+	return(NULL);
+
+} /* CountChunkRows */
+/* ------------------------------------------------------------------------------------ */
+
+/* second pass: parse the rows, retained ones go straight into the selection, leftover ones are written at their final place */
+static void *ParseChunkRows(void *arg)
+{
+	PARSECHUNK *pc = (PARSECHUNK *)arg;
+	const char *p = pc->start;
+	unsigned int line = pc->firstline;
+	unsigned int selected = pc->selectedbefore;
+	unsigned int leftoverstructsize = sizeof(CELLNAMEIDX) + pc->colcnt*sizeof(float);
+	unsigned int fields = pc->colcnt + ((pc->firstColIsSelectFlag) ? 2 : 1);
+	char *lobuf = NULL;
+	unsigned int lobufcnt = 0;
+	unsigned int lobuffirst = 0;
+	unsigned int i;
+
+	ClearColumnStats(&pc->stats,pc->colcnt);
+	if (pc->lfd >= 0)
+	{
+		lobuf = malloc(kLeftoverBufSize);
+		if (!lobuf)
+		{
+			sprintf(pc->err,"LOG:Fatal: not enough memory to buffer leftover events\n");
+			return(NULL);
+		}
+	}
+
+	while ((p = NextCSVLine(p,pc->end,&line)) != NULL)
+	{
+		long long v[kMaxInputCol+2];
+		unsigned int n = 0;
+		unsigned int canselect;
+		char c;
+
+		line++;
+		do
+		{
+			long long dummy;
+
+			c = ParseCSVInt(&p,pc->end,(n < fields) ? &v[n] : &dummy);
+			n++;
+		} while (c == ',');
+		if (c == 0)
+		{
+			sprintf(pc->err,"LOG:Fatal: line %u: value %u is not an integer\n",line,n);
+			break;
+		}
+		if (n != fields)
+		{
+			sprintf(pc->err,"LOG:Fatal: line %u has %u columns, %u expected\n",line,n,fields);
+			break;
+		}
+
+		canselect = 1;
+		if (pc->firstColIsSelectFlag)
+			canselect = (v[0] != 0);
+		n = (pc->firstColIsSelectFlag) ? 1 : 0;
+
+		if (canselect && ((selected % pc->loadEveryNsample) == 0)) /* retain */
+		{
+			FACSDATA *facsp = &pc->facsdata[pc->retainedbase+pc->retained];
+
+			facsp->cellnameidx = (CELLNAMEIDX)v[n++];
+			for (i=0; i<pc->colcnt; i++)
+			{
+				if ((v[n+i] < 0) || (v[n+i] > pc->maxInputVal))
+				{
+					sprintf(pc->err,"LOG:Fatal: input value %lld out of valid supported unsigned range [0..%d]. Please rescale your data first\n",v[n+i],pc->maxInputVal);
+					goto bail;
+				}
+				facsp->data[i] = (unsigned short)v[n+i];
+			}
+			AddColumnStats(&pc->stats,facsp->data,pc->colcnt);
+			pc->retained++;
+		}
+		else /* put in leftover */
+		{
+			LEFTOVER lo;
+
+			if (!lobuf)
+			{
+				sprintf(pc->err,"LOG:Fatal: line %u: no leftover file to write unselected event\n",line);
+				break;
+			}
+			lo.cellnameidx = (CELLNAMEIDX)v[n++];
+			for (i=0; i<pc->colcnt; i++)
+				lo.val[i] = (float)v[n+i];
+			if ((lobufcnt+1)*leftoverstructsize > kLeftoverBufSize)
+			{
+				if (pwrite(pc->lfd,lobuf,lobufcnt*leftoverstructsize,pc->lfoffset+(off_t)(pc->leftoverbase+lobuffirst)*leftoverstructsize) != (ssize_t)(lobufcnt*leftoverstructsize))
+				{
+					sprintf(pc->err,"LOG:Fatal: cannot write leftover file\n");
+					goto bail;
+				}
+				lobuffirst += lobufcnt;
+				lobufcnt = 0;
+			}
+			memcpy(&lobuf[lobufcnt*leftoverstructsize],&lo,leftoverstructsize);
+			lobufcnt++;
+			pc->leftover++;
+		}
+		if (canselect)
+			selected++;
+	}
+	if (lobufcnt > 0)
+	{
+		if (pwrite(pc->lfd,lobuf,lobufcnt*leftoverstructsize,pc->lfoffset+(off_t)(pc->leftoverbase+lobuffirst)*leftoverstructsize) != (ssize_t)(lobufcnt*leftoverstructsize))
+			sprintf(pc->err,"LOG:Fatal: cannot write leftover file\n");
+	}
+
+bail:
+	free(lobuf);
+	return(NULL);
+
+} /* ParseChunkRows */
+/* ------------------------------------------------------------------------------------ */
+
+static void *PartWorker(void *arg)
+{
+	PARSEWORKER *pw = (PARSEWORKER *)arg;
+	unsigned int t;
+
+	for (t = pw->first; t < pw->partcnt; t += pw->stride)
+		pw->func(&pw->pc[t]);
+	return(NULL);
+
+} /* PartWorker */
+/* ------------------------------------------------------------------------------------ */
+
+/* run func over the parts with at most threadcnt threads */
+static int RunParts(PARSECHUNK *pc,unsigned int partcnt,unsigned int threadcnt,void *(*func)(void *))
+{
+	pthread_t thread[kMaxParseThreads];
+	PARSEWORKER pw[kMaxParseThreads];
+	unsigned int t;
+	int err = 0;
+
+	if (threadcnt > partcnt)
+		threadcnt = partcnt;
+	for (t = 0; t < threadcnt; t++)
+	{
+		pw[t].pc = pc;
+		pw[t].partcnt = partcnt;
+		pw[t].first = t;
+		pw[t].stride = threadcnt;
+		pw[t].func = func;
+		if (pthread_create(&thread[t],NULL,&PartWorker,&pw[t]))
+		{
+			printf("Error: Failed creating thread\n");
+			threadcnt = t;
+			err = 1;
+			break;
+		}
+	}
+	for (t = 0; t < threadcnt; t++)
+		pthread_join(thread[t],NULL);
+	return(err);
+
+} /* RunParts */
+/* ------------------------------------------------------------------------------------ */
+
+/* same as SafeProcessInputFile, but the input is mmapped and parsed by several threads */
+static unsigned short ThreadedProcessInputFile(FILE *f, DCLUSTHEADER *hdr, FILE *lf,unsigned int loadEveryNsample, SELECTION *sel,FACSNAME *uniquecellnames,unsigned short cellnamecnt,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key, unsigned int firstColIsSelectFlag,unsigned  short *minkeyval,unsigned short *maxkeyval,unsigned int threadcnt)
+{
+	PARSECHUNK *pc = NULL;
+	struct stat st;
+	const char *map = NULL;
+	const char *end;
+	const char *p;
+	const char *eol;
+	unsigned int i,t;
+	unsigned int partcnt;
+	unsigned int first;
+	unsigned int colcnt;
+	char linbuf[kMaxLineBuf];
+	int endian;
+	unsigned int rowcnt = 0;
+	unsigned int leftovercnt = 0;
+	unsigned int selectable = 0;
+	unsigned int line;
+	char lfhdr[kHeaderSize];
+	COLUMNSTATS cs;
+	int maxInputVal = *maxkeyval;
+
+	if (loadEveryNsample < 1)
+		loadEveryNsample = 1;
+	if ((fstat(fileno(f),&st) != 0) || (st.st_size == 0))
+	{
+		printf("LOG:Fatal: cannot map empty or irregular input file\n");
+		return(0);
+	}
+	map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+	if (map == MAP_FAILED)
+	{
+		printf("LOG:Fatal: cannot map input file\n");
+		return(0);
+	}
+	madvise((void *)map,st.st_size,MADV_SEQUENTIAL);
+	end = map+st.st_size;
+	p = map;
+
+	if (firstColIsSelectFlag)
+	{
+		/* suppress first column header */
+		while ((p < end) && (*p != ','))
+			p++;
+		if (p < end)
+			p++;
+	}
+	/* retrieve number of columns from  header */
+	eol = EndOfCSVLine(p,end);
+	if ((eol-p) >= kMaxLineBuf)
+	{
+		printf("LOG:Fatal: header line longer than %d characters\n",kMaxLineBuf-1);
+		goto bail;
+	}
+	memset(linbuf,0,kMaxLineBuf);
+	memcpy(linbuf,p,eol-p);
+	colcnt = 0; /* start at 0 to return effective number of columns containing data, thus skipping sample name  */
+	for (i = 0; linbuf[i] != 0; i++)
+	{
+		if (linbuf[i] == ',') colcnt++;
+		if ((linbuf[i] == '\n') || (linbuf[i] == '\r')) linbuf[i] = 0;
+	}
+	if (colcnt > kMaxInputCol)
+	{
+		printf("LOG:Fatal: number of requested columns exceed maximum allowed (%u > %d)\n",colcnt,kMaxInputCol);
+		goto bail;
+	}	
+	p = eol;
+	sel->colcnt = colcnt;
+
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,linbuf);
+	hdr->loadEveryNsample = loadEveryNsample;
+
+	if (lf)
+	{
+		strcpy(lfhdr,"dclust unassigned file v1.0   \n");
+		fwrite(&lfhdr[0],sizeof(char),kHeaderSize,lf);
+
+		endian = 1;
+		fwrite(&endian,sizeof(int),1,lf);
+		fwrite(&endian,sizeof(int),1,lf); // reserve space for rowcnt
+		fwrite(&colcnt,sizeof(int),1,lf);
+		/* write spacer */
+		endian = 0;
+		fwrite(&endian,sizeof(int),1,lf);
+		/* write header */
+		fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,lf);
+		fflush(lf);
+	}
+
+	/* split the data at line boundaries, at least one part per thread and parts small enough to be loaded a few at a time */
+	if (threadcnt > kMaxParseThreads)
+		threadcnt = kMaxParseThreads;
+	partcnt = (unsigned int)((end-p+kPartBytes-1)/kPartBytes);
+	if (partcnt < threadcnt)
+		partcnt = threadcnt;
+	pc = calloc(partcnt,sizeof(PARSECHUNK));
+	if (!pc)
+	{
+		printf("LOG:Fatal: not enough memory\n");
+		goto bail;
+	}
+	for (t = 0; t < partcnt; t++)
+	{
+		pc[t].start = (t == 0) ? p : pc[t-1].end;
+		if (t == partcnt-1)
+			pc[t].end = end;
+		else
+		{
+			const char *cut = p + ((end-p)*(unsigned long long)(t+1))/partcnt;
+
+			if (cut < pc[t].start)
+				cut = pc[t].start;
+			pc[t].end = (cut > p) ? EndOfCSVLine(cut-1,end) : cut;
+		}
+		pc[t].colcnt = colcnt;
+		pc[t].firstColIsSelectFlag = firstColIsSelectFlag;
+		pc[t].loadEveryNsample = loadEveryNsample;
+		pc[t].maxInputVal = maxInputVal;
+		pc[t].lfd = (lf) ? fileno(lf) : -1;
+		pc[t].lfoffset = kHeaderSize+4*sizeof(int)+kMaxLineBuf;
+	}
+
+	if (RunParts(pc,partcnt,threadcnt,&CountChunkRows))
+		goto bail;
+
+	/* the k-th selectable row is retained when k is a multiple of loadEveryNsample */
+	line = 2;
+	for (t = 0; t < partcnt; t++)
+	{
+		if (pc[t].errline)
+		{
+			printf("LOG:Fatal: line %u: invalid selection flag\n",line+pc[t].errline-1);
+			goto bail;
+		}
+		pc[t].toretain = (selectable+pc[t].selectable+loadEveryNsample-1)/loadEveryNsample - (selectable+loadEveryNsample-1)/loadEveryNsample;
+		pc[t].firstline = line-1;
+		pc[t].selectedbefore = selectable;
+		pc[t].leftoverbase = leftovercnt;
+		line += pc[t].rawlines;
+		selectable += pc[t].selectable;
+		rowcnt += pc[t].toretain;
+		leftovercnt += pc[t].lines-pc[t].toretain;
+	}
+
+	/* parse as many consecutive parts as the memory budget allows, spilling them before the next ones */
+	ClearColumnStats(&cs,colcnt);
+	for (first = 0; first < partcnt; )
+	{
+		unsigned int last = first;
+		unsigned int wavecnt = 0;
+
+		while ((last < partcnt) && ((last == first) || (sel->maxrows == 0) || (wavecnt+pc[last].toretain <= sel->maxrows)))
+		{
+			pc[last].retainedbase = wavecnt;
+			wavecnt += pc[last].toretain;
+			last++;
+		}
+		if (ReserveSelection(sel,wavecnt))
+			goto bail;
+		for (t = first; t < last; t++)
+			pc[t].facsdata = sel->facsdata;
+		if (RunParts(&pc[first],last-first,threadcnt,&ParseChunkRows))
+			goto bail;
+		for (t = first; t < last; t++)
+		{
+			if (pc[t].err[0])
+			{
+				printf("%s",pc[t].err);
+				goto bail;
+			}
+			MergeColumnStats(&cs,&pc[t].stats,colcnt);
+		}
+		sel->cnt = wavecnt;
+		if ((last < partcnt) && SpillSelection(sel))
+			goto bail;
+		first = last;
+	}
+	munmap((void *)map,st.st_size);
+	map = NULL;
+	free(pc);
+	pc = NULL;
+
+	hdr->rowcnt = rowcnt;
+
+	if (lf)
+	{
+		fseek(lf,36L,SEEK_SET);
+		fwrite(&leftovercnt,sizeof(int),1,lf);
+	}
+	printf("LOG: %10d columns in input file\n",colcnt);
+	printf("LOG: %10d events in input file\n",rowcnt+leftovercnt);
+	printf("LOG: %10d events selected\n",rowcnt);
+	printf("LOG: %10d events leftover\n",leftovercnt);
+
+	ChooseSortKey(&cs,rowcnt,colcnt,key,minkeyval,maxkeyval);
+	*selectedcnt = rowcnt;
+	*columns = colcnt;
+
+	cellnamecnt = 1;
+
+	return(cellnamecnt);
+
+bail:
+	free(pc);
+	if (map)
+		munmap((void *)map,st.st_size);
+	return(0);
+	
+} /* ThreadedProcessInputFile */
+
+/* ------------------------------------------------------------------------------------ */
+
+/* events of one or several FCS files read as a single input in one pass. The selected channels are */
+/* scaled linearly from [0..$PnR[ of each file onto the valid input range, rowids are numbered from 1 */
+/* across the files, and the cellname of the events of a file is the file name. */
+/* The rowids of every file are listed in OutputFileRootName.files */
+static unsigned short processFCSFiles(char **fcsfn,unsigned int fcscnt,const char *channels,const char *ofn,DCLUSTHEADER *hdr, FILE *lf,unsigned int loadEveryNsample, SELECTION *sel,RESERVOIR *res,FACSNAME *uniquecellnames,unsigned int *selectedcnt,unsigned int *columns,unsigned short *key,unsigned  short *minkeyval,unsigned short *maxkeyval)
+{
+	FCSFILE fcs;
+	FACSDATA *facsp;
+	char linbuf[kMaxLineBuf];
+	char chname[kMaxInputCol][kMaxFcsParName];
+	char fn[kMaxFilename];
+	int par[kMaxInputCol];
+	double scale[kMaxInputCol];
+	unsigned int colcnt = 0;
+	unsigned int i,fi;
+	int endian;
+	unsigned int rowcnt = 0;
+	unsigned int leftovercnt = 0;
+	CELLNAMEIDX rowid = 0;
+	char lfhdr[kHeaderSize];
+	COLUMNSTATS cs;
+	unsigned int skip = 0;
+	unsigned int nextprintout = kLoadingProgressReporting;
+	unsigned int leftoverstructsize;
+	int maxInputVal = *maxkeyval;
+	char *buf = NULL;
+	FILE *ff = NULL;
+	LEFTOVER lo;
+
+	memset(&fcs,0,sizeof(FCSFILE));
+	if (fcscnt > 65535)
+	{
+		printf("LOG:Fatal: too many FCS files (%u > 65535)\n",fcscnt);
+		return(0);
+	}
+
+	/* channels are given by name or number, by default those of the first file */
+	if (FcsFileOpen(&fcs,fcsfn[0]))
+		return(0);
+	if (channels[0])
+	{
+		const char *p = channels;
+
+		while (*p)
+		{
+			unsigned int len = 0;
+
+			while ((p[len] != ',') && (p[len] != 0))
+				len++;
+			if (colcnt >= kMaxInputCol)
+			{
+				colcnt++;
+				break;
+			}
+			if (len >= kMaxFcsParName)
+				len = kMaxFcsParName-1;
+			memcpy(chname[colcnt],p,len);
+			chname[colcnt][len] = 0;
+			colcnt++;
+			p += len;
+			if (*p == ',')
+				p++;
+		}
+	}
+	else
+	{
+		for (colcnt = 0; (colcnt < fcs.parcnt) && (colcnt < kMaxInputCol); colcnt++)
+			strcpy(chname[colcnt],fcs.par[colcnt].name);
+		if (fcs.parcnt > kMaxInputCol)
+			colcnt = fcs.parcnt;
+	}
+	if ((colcnt == 0) || (colcnt > kMaxInputCol))
+	{
+		printf("LOG:Fatal: number of requested columns exceed maximum allowed (%u > %d); select channels with option -c\n",colcnt,kMaxInputCol);
+		FcsFileClose(&fcs);
+		return(0);
+	}
+
+	/* the header holds the $PnN names of the first file */
+	strcpy(linbuf,"event");
+	for (i = 0; i < colcnt; i++)
+	{
+		int p = FcsFileFindPar(&fcs,chname[i]);
+		const char *name = (p >= 0) ? fcs.par[p].name : chname[i];
+
+		if (strlen(linbuf)+strlen(name)+2 > kMaxLineBuf)
+		{
+			printf("LOG:Fatal: channel names too long for the header\n");
+			FcsFileClose(&fcs);
+			return(0);
+		}
+		strcat(linbuf,",");
+		strcat(linbuf,name);
+	}
+	FcsFileClose(&fcs);
+	DclustFileInitHeader(hdr,kDclustSelectedFile,kDclustUShort,colcnt,linbuf);
+	hdr->loadEveryNsample = loadEveryNsample;
+
+	if (lf)
+	{
+		char lfheader[kMaxLineBuf];
+
+		memset(lfheader,0,kMaxLineBuf);
+		strcpy(lfheader,linbuf);
+		memset(lfhdr,0,kHeaderSize);
+		strcpy(lfhdr,"dclust unassigned file v1.0   \n");
+		fwrite(&lfhdr[0],sizeof(char),kHeaderSize,lf);
+
+		endian = 1;
+		fwrite(&endian,sizeof(int),1,lf);
+		fwrite(&endian,sizeof(int),1,lf); // reserve space for rowcnt
+		fwrite(&colcnt,sizeof(int),1,lf);
+		/* write spacer */
+		endian = 0;
+		fwrite(&endian,sizeof(int),1,lf);
+		/* write header */
+		fwrite(&lfheader[0],sizeof(char),kMaxLineBuf,lf);
+	}
+
+	sprintf(fn,"%s.files",ofn);
+	ff = fopen(fn,"w");
+	if (!ff)
+	{
+		printf("Error:Cannot write Output File %s\n",fn);
+		return(0);
+	}
+	fprintf(ff,"cellnameid,firstrowid,lastrowid,file\n");
+
+	sel->colcnt = colcnt;
+	ClearColumnStats(&cs,colcnt);
+	leftoverstructsize = sizeof(CELLNAMEIDX) + colcnt*sizeof(float);
+
+	for (fi = 0; fi < fcscnt; fi++)
+	{
+		const char *name = strrchr(fcsfn[fi],'/');
+		CELLNAMEIDX firstrowid = rowid+1;
+		unsigned int n,e;
+
+		if (FcsFileOpen(&fcs,fcsfn[fi]))
+			goto bail;
+		for (i = 0; i < colcnt; i++)
+		{
+			par[i] = FcsFileFindPar(&fcs,chname[i]);
+			if (par[i] < 0)
+			{
+				printf("LOG:Fatal: channel %s not found in %s\n",chname[i],fcsfn[fi]);
+				goto bail;
+			}
+			scale[i] = (double)(maxInputVal+1)/fcs.par[par[i]].range;
+		}
+		if (fcs.eventcnt > (unsigned long long)(~(CELLNAMEIDX)0)-rowid)
+		{
+			printf("LOG:Fatal: too many events to number them\n");
+			goto bail;
+		}
+		free(buf);
+		buf = malloc((size_t)kFcsReadEvents*fcs.eventsize);
+		if (!buf)
+		{
+			printf("Error:Cannot Allocate Memory.\n");
+			goto bail;
+		}
+		name = name ? name+1 : fcsfn[fi];
+		memset(uniquecellnames[fi].name,0,kMaxCellName);
+		strncpy(uniquecellnames[fi].name,name,kMaxCellName-1);
+		if (verbose > 0)
+			printf("LOG: reading %llu events of %s\n",fcs.eventcnt,fcsfn[fi]);
+
+		while ((n = FcsFileReadEvents(&fcs,buf,kFcsReadEvents)) > 0)
+		{
+			for (e = 0; e < n; e++)
+			{
+				const char *event = &buf[(size_t)e*fcs.eventsize];
+				unsigned short q[kMaxInputCol];
+
+				rowid++;
+				for (i = 0; i < colcnt; i++)
+				{
+					double v = FcsFileValue(&fcs,event,par[i])*scale[i];
+
+					if (!(v > 0.0))	/* also catches NaN */
+						q[i] = 0;
+					else if (v >= maxInputVal)
+						q[i] = (unsigned short)maxInputVal;
+					else
+						q[i] = (unsigned short)v;
+				}
+				if ((skip != 0) || (res && !ReservoirTakes(res,(res->stratacnt > 1) ? fi : 0))) /* put in leftover */
+				{
+					lo.cellnameidx = rowid;
+					for (i = 0; i < colcnt; i++)
+						lo.val[i] = (float)q[i];
+					fwrite(&lo.cellnameidx,leftoverstructsize,1,lf);
+					leftovercnt++;
+				}
+				else /* retain */
+				{
+					facsp = (res) ? ReservoirRow(res,(res->stratacnt > 1) ? fi : 0,sel) : NextSelectedRow(sel);
+					if (!facsp)
+						goto bail;
+					facsp->cellnameidx = rowid;
+					memcpy(facsp->data,q,colcnt*sizeof(unsigned short));
+					AddColumnStats(&cs,facsp->data,colcnt);
+					rowcnt++;
+				}
+				skip++;
+				if (skip == loadEveryNsample)
+				{
+					skip = 0;
+					if (rowcnt > nextprintout)
+					{
+						printf("LOG: %10d events selected so far...\n",nextprintout);
+						fflush(stdout);
+						nextprintout += kLoadingProgressReporting;
+					}
+				}
+			}
+		}
+		if (fcs.eventsread < fcs.eventcnt)
+		{
+			printf("LOG:Fatal: %s is truncated (%llu of %llu events read)\n",fcsfn[fi],fcs.eventsread,fcs.eventcnt);
+			goto bail;
+		}
+		fprintf(ff,"%u,%u,%u,%s\n",fi,firstrowid,rowid,fcsfn[fi]);
+		FcsFileClose(&fcs);
+	}
+	free(buf);
+	fclose(ff);
+	if (res)
+		ReservoirFinish(res,sel,&cs,&rowcnt,&leftovercnt);
+	hdr->rowcnt = rowcnt;
+
+	if (lf)
+	{
+		fseek(lf,36L,SEEK_SET);
+		fwrite(&leftovercnt,sizeof(int),1,lf);
+	}
+	printf("LOG: %10d FCS files\n",fcscnt);
+	printf("LOG: %10d columns in input file\n",colcnt);
+	printf("LOG: %10d events in input file\n",rowcnt+leftovercnt);
+	printf("LOG: %10d events selected\n",rowcnt);
+	printf("LOG: %10d events leftover\n",leftovercnt);
+
+	ChooseSortKey(&cs,rowcnt,colcnt,key,minkeyval,maxkeyval);
+	*selectedcnt = rowcnt;
+	*columns = colcnt;
+
+	return((unsigned short)fcscnt);
+
+bail:
+	FcsFileClose(&fcs);
+	free(buf);
+	fclose(ff);
+	return(0);
+
+} /* processFCSFiles */
+
+/* ------------------------------------------------------------------------------------ */
+/* start the v2 .selected file; rows are then written in key order with DclustFilePutRow */
+static unsigned int HashEvent(const unsigned short *data,unsigned int colcnt)
+{
+	unsigned int h = 2166136261u;
+	unsigned int col;
+
+	for (col = 0; col < colcnt; col++)
+		h = (h ^ data[col]) * 16777619u;
+	return(h);
+
+} /* HashEvent */
+/* ------------------------------------------------------------------------------------ */
+
+/* keep the first of identical events, in input order, and note how many events each kept row stands for */
+static int CollapseDuplicates(FACSDATA *facsdata,unsigned int *rcnt,unsigned int colcnt,DUPLICATES *dups)
+{
+	unsigned int *slot;
+	unsigned int *rep;
+	CELLNAMEIDX *dupid;
+	unsigned int slotcnt = 1;
+	unsigned int n = 0;
+	unsigned int i,k;
+
+	memset(dups,0,sizeof(DUPLICATES));
+	while (slotcnt < kDuplicateHashLoad*(*rcnt))
+		slotcnt *= 2;
+	slot = calloc(slotcnt,sizeof(unsigned int));
+	rep = malloc((size_t)(*rcnt)*sizeof(unsigned int));
+	dupid = malloc((size_t)(*rcnt)*sizeof(CELLNAMEIDX));
+	dups->weight = malloc((size_t)(*rcnt)*sizeof(unsigned int));
+	if (!slot || !rep || !dupid || !dups->weight)
+	{
+		printf("LOG:Fatal: not enough memory to collapse identical events\n");
+		free(slot);
+		free(rep);
+		free(dupid);
+		free(dups->weight);
+		dups->weight = NULL;
+		return(1);
+	}
+
+	for (i = 0; i < *rcnt; i++)
+	{
+		unsigned int h = HashEvent(facsdata[i].data,colcnt) & (slotcnt-1);
+
+		while ((slot[h] != 0) && memcmp(facsdata[slot[h]-1].data,facsdata[i].data,colcnt*sizeof(unsigned short)))
+			h = (h+1) & (slotcnt-1);
+		if (slot[h] == 0)
+		{
+			facsdata[n] = facsdata[i];
+			dups->weight[n] = 1;
+			slot[h] = ++n;
+		}
+		else
+		{
+			k = slot[h]-1;
+			dups->weight[k]++;
+			rep[dups->cnt] = k;
+			dupid[dups->cnt++] = facsdata[i].cellnameidx;
+		}
+	}
+	free(slot);
+
+	/* group the collapsed events by kept row */
+	dups->first = malloc((size_t)(n+1)*sizeof(unsigned int));
+	dups->id = malloc((size_t)(dups->cnt+1)*sizeof(CELLNAMEIDX));
+	if (!dups->first || !dups->id)
+	{
+		printf("LOG:Fatal: not enough memory to collapse identical events\n");
+		free(rep);
+		free(dupid);
+		return(1);
+	}
+	dups->first[0] = 0;
+	for (k = 0; k < n; k++)
+		dups->first[k+1] = dups->first[k]+dups->weight[k]-1;
+	for (i = 0; i < dups->cnt; i++)
+		dups->id[dups->first[rep[i]]++] = dupid[i];
+	for (k = n; k > 0; k--)
+		dups->first[k] = dups->first[k-1];
+	dups->first[0] = 0;
+	free(rep);
+	free(dupid);
+
+	printf("LOG: %10u identical events collapsed, %u distinct events left\n",dups->cnt,n);
+	*rcnt = n;
+	return(0);
+
+} /* CollapseDuplicates */
+/* ------------------------------------------------------------------------------------ */
+
+static void FreeDuplicates(DUPLICATES *dups)
+{
+	free(dups->weight);
+	free(dups->first);
+	free(dups->id);
+	memset(dups,0,sizeof(DUPLICATES));
+
+} /* FreeDuplicates */
+/* ------------------------------------------------------------------------------------ */
+
+/* the weights and collapsed events of the rows written in the order of sortedidx */
+static int SetSortedDuplicates(DCLUSTWRITER *w,const DUPLICATES *dups,const unsigned int *sortedidx,unsigned int rcnt)
+{
+	unsigned int *weight;
+	CELLNAMEIDX *id;
+	unsigned int i,n = 0;
+
+	weight = malloc((size_t)rcnt*sizeof(unsigned int));
+	id = malloc((size_t)(dups->cnt+1)*sizeof(CELLNAMEIDX));
+	if (!weight || !id)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		free(weight);
+		free(id);
+		return(1);
+	}
+	for (i = 0; i < rcnt; i++)
+	{
+		unsigned int k = sortedidx[i];
+
+		weight[i] = dups->weight[k];
+		memcpy(&id[n],&dups->id[dups->first[k]],(size_t)(weight[i]-1)*sizeof(CELLNAMEIDX));
+		n += weight[i]-1;
+	}
+	DclustFileSetDuplicates(w,weight,id);
+	free(weight);
+	free(id);
+	return(0);
+
+} /* SetSortedDuplicates */
+/* ------------------------------------------------------------------------------------ */
+
+/* without facsname, there is a single cellname standing for no categories */
+static int CreateSelectedFile(DCLUSTWRITER *w,FILE *af,DCLUSTHEADER *hdr,FACSNAME *facsname,unsigned short cellnamecnt,unsigned short key)
+{
+	char emptyStr[kMaxCellName]; 
+	char *cellnames = emptyStr;
+	unsigned short cn;
+	int err;
+
+	memset(emptyStr,0,kMaxCellName);
+	strcpy(emptyStr,"!NO_CATEGORIES!");
+	if (facsname)
+	{
+		cellnames = calloc(cellnamecnt,kMaxCellName);
+		if (!cellnames)
+		{
+			printf("Error:Cannot Allocate Memory.\n");
+			return(1);
+		}
+		for (cn = 0; cn < cellnamecnt; cn++)
+			memcpy(&cellnames[cn*kMaxCellName],facsname[cn].name,kMaxCellName);
+	}
+
+	hdr->key = key;
+	hdr->cellnamecnt = cellnamecnt;
+	err = DclustFileCreate(w,af,hdr,cellnames);
+	if (facsname)
+		free(cellnames);
+	if (err)
+	{
+		printf("Error:Cannot write Output File\n");
+		return(1);
+	}
+	return(0);
+
+} /* CreateSelectedFile */
+/* ------------------------------------------------------------------------------------ */
+
+static void PutOutBuf(OUTBUF *ob,const void *data,size_t len)
+{
+	if (ob->cnt+len > ob->size)
+	{
+		if ((ob->cnt > 0) && (fwrite(ob->buf,1,ob->cnt,ob->f) != ob->cnt))
+			ob->err = 1;
+		ob->cnt = 0;
+		if (len > ob->size)
+		{
+			if (fwrite(data,1,len,ob->f) != len)
+				ob->err = 1;
+			return;
+		}
+	}
+	memcpy(&ob->buf[ob->cnt],data,len);
+	ob->cnt += len;
+
+} /* PutOutBuf */
+/* ------------------------------------------------------------------------------------ */
+
+/* rows are written through a buffer of kWriteBufSize bytes, or one by one if it cannot be allocated */
+static void InitOutBuf(OUTBUF *ob,FILE *f)
+{
+	ob->f = f;
+	ob->cnt = 0;
+	ob->err = 0;
+	ob->buf = malloc(kWriteBufSize);
+	ob->size = (ob->buf) ? kWriteBufSize : 0;
+
+} /* InitOutBuf */
+/* ------------------------------------------------------------------------------------ */
+
+static int CloseOutBuf(OUTBUF *ob)
+{
+	if ((ob->cnt > 0) && (fwrite(ob->buf,1,ob->cnt,ob->f) != ob->cnt))
+		ob->err = 1;
+	free(ob->buf);
+	ob->buf = NULL;
+	ob->cnt = 0;
+	return(ob->err);
+
+} /* CloseOutBuf */
+/* ------------------------------------------------------------------------------------ */
+
+static void PutEvent(OUTBUF *ob,const FACSDATA *facsp,unsigned int colcnt)
+{
+	PutOutBuf(ob,&facsp->cellnameidx,sizeof(CELLNAMEIDX));
+	PutOutBuf(ob,&facsp->data,colcnt*sizeof(unsigned short));
+
+} /* PutEvent */
+/* ------------------------------------------------------------------------------------ */
+
+/* count the 16 bit digit of every event of this thread; the first pass also computes the sort values */
+static void *RadixCount(void *arg)
+{
+	RADIXSORT *rs = (RADIXSORT *)arg;
+	unsigned int i;
+
+	memset(rs->cnt,0,sizeof(rs->cnt));
+	if (rs->fill)
+	{
+		for (i = rs->from; i < rs->to; i++)
+		{
+			const FACSDATA *facsp = &rs->facsdata[i];
+
+			rs->sortval[i] = ((unsigned int)facsp->data[rs->key] << 16) | facsp->data[rs->key2];
+			rs->cnt[(rs->sortval[i] >> rs->shift) & 0xffff]++;
+		}
+	}
+	else
+	{
+		for (i = rs->from; i < rs->to; i++)
+		{
+			unsigned int e = (rs->src) ? rs->src[i] : i;
+
+			rs->cnt[(rs->sortval[e] >> rs->shift) & 0xffff]++;
+		}
+	}
+	return(NULL);
+
+} /* RadixCount */
+/* ------------------------------------------------------------------------------------ */
+
+/* move the events of this thread to their place; cnt holds the first free slot of each digit value */
+static void *RadixScatter(void *arg)
+{
+	RADIXSORT *rs = (RADIXSORT *)arg;
+	unsigned int i;
+
+	for (i = rs->from; i < rs->to; i++)
+	{
+		unsigned int e = (rs->src) ? rs->src[i] : i;
+
+		rs->dst[rs->cnt[(rs->sortval[e] >> rs->shift) & 0xffff]++] = e;
+	}
+	return(NULL);
+
+} /* RadixScatter */
+/* ------------------------------------------------------------------------------------ */
+
+/* a thread that cannot be created does its work in the calling thread */
+static void RunRadixThreads(RADIXSORT *rs,unsigned int threadcnt,void *(*func)(void *))
+{
+	pthread_t thread[kMaxParseThreads];
+	int created[kMaxParseThreads];
+	unsigned int t;
+
+	for (t = 1; t < threadcnt; t++)
+		created[t] = (pthread_create(&thread[t],NULL,func,&rs[t]) == 0);
+	func(&rs[0]);
+	for (t = 1; t < threadcnt; t++)
+	{
+		if (created[t])
+			pthread_join(thread[t],NULL);
+		else
+			func(&rs[t]);
+	}
+
+} /* RunRadixThreads */
+/* ------------------------------------------------------------------------------------ */
+
+/* order of the events by key, then by the column before key, then input order; returns NULL if out of memory. */
+/* parallel LSD radix sort on the composite 32 bit value, second key digit first */
+static unsigned int *SortSelectedEvents(const FACSDATA *facsdata,unsigned int rcnt,unsigned short key,unsigned int threadcnt)
+{
+	RADIXSORT *rs;
+	unsigned int *sortval;
+	unsigned int *idx;
+	unsigned int *tmp;
+	unsigned int *src = NULL;
+	unsigned int i,t,d,pass;
+
+	if (threadcnt > rcnt/kMinSortEventsPerThread)
+		threadcnt = rcnt/kMinSortEventsPerThread;
+	if (threadcnt < 1)
+		threadcnt = 1;
+	if (threadcnt > kMaxParseThreads)
+		threadcnt = kMaxParseThreads;
+
+	sortval = malloc((size_t)rcnt*sizeof(unsigned int));
+	idx = malloc((size_t)rcnt*sizeof(unsigned int));
+	tmp = malloc((size_t)rcnt*sizeof(unsigned int));
+	rs = malloc(threadcnt*sizeof(RADIXSORT));
+	if (!sortval || !idx || !tmp || !rs)
+	{
+		free(sortval);
+		free(idx);
+		free(tmp);
+		free(rs);
+		return(NULL);
+	}
+	for (t = 0; t < threadcnt; t++)
+	{
+		rs[t].facsdata = facsdata;
+		rs[t].key = key;
+		rs[t].key2 = (key > 0) ? key-1 : 1;
+		rs[t].sortval = sortval;
+		rs[t].from = (unsigned int)(((unsigned long long)rcnt*t)/threadcnt);
+		rs[t].to = (unsigned int)(((unsigned long long)rcnt*(t+1))/threadcnt);
+	}
 
-	if (lf)
+	for (pass = 0; pass < 2; pass++)
 	{
-		strcpy(hdr,"dclust unassigned file v1.0   \n");
-		fwrite(&hdr[0],sizeof(char),kHeaderSize,lf);
+		unsigned int *dst = (src == idx) ? tmp : idx;
+		unsigned int pos = 0;
+		int single = 0;
 
-		endian = 1;
-		fwrite(&endian,sizeof(int),1,lf);
-		fwrite(&endian,sizeof(int),1,lf); // reserve space for rowcnt
-		fwrite(&colcnt,sizeof(int),1,lf);
-		/* write spacer */
-		endian = 0;
-		fwrite(&endian,sizeof(int),1,lf);
-		/* write header */
-		fwrite(&linbuf[0],sizeof(char),kMaxLineBuf,lf);
+		for (t = 0; t < threadcnt; t++)
+		{
+			rs[t].src = src;
+			rs[t].dst = dst;
+			rs[t].shift = (pass == 0) ? 0 : 16;
+			rs[t].fill = (pass == 0);
+		}
+		RunRadixThreads(rs,threadcnt,&RadixCount);
+
+		/* each thread writes its events of a given digit after those of the previous threads, which keeps the sort stable */
+		for (d = 0; d < 65536; d++)
+		{
+			unsigned int total = 0;
+
+			for (t = 0; t < threadcnt; t++)
+			{
+				unsigned int c = rs[t].cnt[d];
+
+				rs[t].cnt[d] = pos;
+				pos += c;
+				total += c;
+			}
+			if (total == rcnt)
+				single = 1;
+		}
+		if (single)	/* all events share this digit, order unchanged */
+			continue;
+		RunRadixThreads(rs,threadcnt,&RadixScatter);
+		src = dst;
 	}
-	skip = 0;
+	if (!src)
+	{
+		for (i = 0; i < rcnt; i++)
+			idx[i] = i;
+		src = idx;
+	}
+	free((src == idx) ? tmp : idx);
+	free(sortval);
+	free(rs);
+	return(src);
 
-	for (cn = 0; cn<(unsigned short)colcnt;cn++)
-		sum[cn] = 0;
+} /* SortSelectedEvents */
+/* ------------------------------------------------------------------------------------ */
 
-	cn = 0;
-	do
+/* sort value of the next event of a run; same order as SortSelectedEvents, a missing second column reading as 0 */
+static void SetMergeRunSortVal(MERGERUN *mr,unsigned int rowsize,unsigned int colcnt,unsigned short key)
+{
+	unsigned int key2 = (key > 0) ? key-1 : 1;
+	const char *row = &mr->buf[(size_t)mr->bufpos*rowsize+sizeof(CELLNAMEIDX)];
+	unsigned short v1;
+	unsigned short v2 = 0;
+
+	memcpy(&v1,&row[key*sizeof(unsigned short)],sizeof(unsigned short));
+	if (key2 < colcnt)
+		memcpy(&v2,&row[key2*sizeof(unsigned short)],sizeof(unsigned short));
+	mr->sortval = ((unsigned int)v1 << 16) | v2;
+
+} /* SetMergeRunSortVal */
+/* ------------------------------------------------------------------------------------ */
+
+static int FillMergeRun(FILE *runs,MERGERUN *mr,unsigned int bufrows,unsigned int rowsize)
+{
+	mr->bufcnt = (mr->left < bufrows) ? mr->left : bufrows;
+	mr->bufpos = 0;
+	fseeko(runs,mr->offset,SEEK_SET);
+	if (fread(mr->buf,rowsize,mr->bufcnt,runs) != mr->bufcnt)
+		return(1);
+	mr->left -= mr->bufcnt;
+	mr->offset += (off_t)mr->bufcnt*rowsize;
+	return(0);
+
+} /* FillMergeRun */
+/* ------------------------------------------------------------------------------------ */
+
+/* ties between runs go to the earlier run, which keeps the input order of SortSelectedEvents */
+static int MergeRunBefore(const MERGERUN *mr,unsigned int a,unsigned int b)
+{
+	if (mr[a].sortval != mr[b].sortval)
+		return(mr[a].sortval < mr[b].sortval);
+	return(a < b);
+
+} /* MergeRunBefore */
+/* ------------------------------------------------------------------------------------ */
+
+static void SiftDownMergeRun(const MERGERUN *mr,unsigned int *heap,unsigned int heapcnt,unsigned int i)
+{
+	while (2*i+1 < heapcnt)
 	{
-		int tot,l;
-		unsigned int canselect;
-		int inputVal;
-		
-		/* read one line */
-		fgets(linbuf,kMaxLineBuf,f);
-		if (feof(f))
+		unsigned int c = 2*i+1;
+		unsigned int tmp;
+
+		if ((c+1 < heapcnt) && MergeRunBefore(mr,heap[c+1],heap[c]))
+			c++;
+		if (!MergeRunBefore(mr,heap[c],heap[i]))
 			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
 
-		tot = 0;
+} /* SiftDownMergeRun */
+/* ------------------------------------------------------------------------------------ */
 
-		canselect = 1;
-		if (firstColIsSelectFlag)
-			sscanf(&linbuf[0],"%u,%u,%n",&canselect,&cn,&l);
-		else
-			sscanf(&linbuf[0],"%u,%n",&cn,&l);
-		tot+=l;
+/* same output as WriteUniqueCellNames when the selection did not fit in its memory budget: */
+/* every run is sorted in place in the runs file, then the runs are merged into the output */
+static int WriteSpilledSelection(FILE *af,DCLUSTHEADER *hdr,SELECTION *sel,FACSNAME *facsname,unsigned short cellnamecnt,unsigned short key,unsigned int threadcnt)
+{
+	DCLUSTWRITER w;
+	MERGERUN *mr = NULL;
+	unsigned int *heap = NULL;
+	char *buf;
+	unsigned int *sortedcellnameidx;
+	OUTBUF ob;
+	unsigned int rowsize = sizeof(CELLNAMEIDX)+sel->colcnt*sizeof(unsigned short);
+	unsigned int bufrows;
+	unsigned int heapcnt;
+	unsigned int i,r;
+	off_t offset;
+	int err = 1;
+
+	if (SpillSelection(sel))
+		return(1);
+	printf("LOG: Writing Selected Events from %u runs\n",sel->runcnt);
+
+	offset = 0;
+	for (r = 0; r < sel->runcnt; r++)
+	{
+		FACSDATA *facsp;
 
-		if ((skip != 0) || (canselect == 0)) /* put in leftover */
+		fseeko(sel->runs,offset,SEEK_SET);
+		for (i = 0; i < sel->runrows[r]; i++)
 		{
-			for (i=0; i<colcnt; i++)
+			facsp = &sel->facsdata[i];
+			fread(&facsp->cellnameidx,sizeof(CELLNAMEIDX),1,sel->runs);
+			if (fread(&facsp->data,sizeof(unsigned short),sel->colcnt,sel->runs) != sel->colcnt)
 			{
-				unsigned int tmp;
-				sscanf(&linbuf[tot],"%u,%n",&tmp,&l); tot+=l;		
-				val[i] = (float)tmp;
+				printf("Error:Cannot read temporary File %s\n",sel->runsfn);
+				return(1);
 			}
-
-			fwrite(&cn,sizeof(CELLNAMEIDX),1,lf);
-			fwrite(&val[0],sizeof(float),colcnt,lf);
-			leftovercnt++;
 		}
-		else /* retain */
+		sortedcellnameidx = SortSelectedEvents(sel->facsdata,sel->runrows[r],key,threadcnt);
+		if (!sortedcellnameidx)
 		{
-			facsp->cellnameidx = cn;
-			for (i=0; i<colcnt; i++)
-			{
-				sscanf(&linbuf[tot],"%d,%n",&inputVal,&l); tot+=l;
-				if ((inputVal < 0) || inputVal > maxInputVal)
-				{
-					printf("LOG:Fatal: input value %d out of valid supported unsigned range [0..%d]. Please rescale your data first\n",inputVal,maxInputVal);
-					return(0);
-				}
-				facsp->data[i] = (unsigned short)inputVal;
-				sum[i]+=(long long)facsp->data[i];
-			}
-			facsp++;
-			rowcnt++;
+			printf("LOG:Fatal: not enough memory to sort selected events\n");
+			return(1);
 		}
-		if (canselect) /* otherwise was a no select and does not count */
-			skip++;
-		if (skip == loadEveryNsample)
+		fseeko(sel->runs,offset,SEEK_SET);
+		InitOutBuf(&ob,sel->runs);
+		for (i = 0; i < sel->runrows[r]; i++)
+			PutEvent(&ob,&sel->facsdata[sortedcellnameidx[i]],sel->colcnt);
+		free(sortedcellnameidx);
+		if (CloseOutBuf(&ob))
 		{
-			skip = 0;
-			if (rowcnt > nextprintout)
-			{
-				printf("LOG: %10d events selected so far...\n",nextprintout);
-				fflush(stdout);
-				nextprintout += kLoadingProgressReporting;
-			}
+			printf("Error:Cannot write temporary File %s\n",sel->runsfn);
+			return(1);
 		}
-
-	} while(1);
-	fseek(af,36L,SEEK_SET);
-	fwrite(&rowcnt,sizeof(int),1,af);
-
-	if (lf)
+		offset += (off_t)sel->runrows[r]*rowsize;
+	}
+	fflush(sel->runs);
+
+	/* the memory of the selection is reused to buffer the runs */
+	buf = (char *)sel->facsdata;
+	bufrows = (unsigned int)(((size_t)sel->capacity*sizeof(FACSDATA))/((size_t)sel->runcnt*rowsize));
+	mr = calloc(sel->runcnt,sizeof(MERGERUN));
+	heap = malloc(sel->runcnt*sizeof(unsigned int));
+	if (!mr || !heap || (bufrows == 0))
 	{
-		fseek(lf,36L,SEEK_SET);
-		fwrite(&leftovercnt,sizeof(int),1,lf);
+		printf("LOG:Fatal: not enough memory to merge selected events\n");
+		goto bail;
 	}
-	printf("LOG: %10d columns in input file\n",colcnt);
-	printf("LOG: %10d events in input file\n",rowcnt+leftovercnt);
-	printf("LOG: %10d events selected\n",rowcnt);
-	printf("LOG: %10d events leftover\n",leftovercnt);
 
-	for (cn = 0; cn<(unsigned short)colcnt;cn++)
+	if (CreateSelectedFile(&w,af,hdr,facsname,cellnamecnt,key))
+		goto bail;
+	offset = 0;
+	heapcnt = 0;
+	for (r = 0; r < sel->runcnt; r++)
 	{
-		/* compute SDDEV for a column */
-		int mean = (int)(sum[cn] / rowcnt);
-		long long sd = 0;
-		facsp = &facsdata[0];
-		for (i = 0; i<rowcnt;i++)
-		{
-			int diff = (int)facsp->data[cn] - mean;
-			sd += (long long)(diff * diff); 
-			facsp++;
-		}
-		score[cn] = (double)sd;
-		if (verbose > 0)
-			printf("LOG: column %4d: mean=%5d stdev=%f\n",cn,mean,sqrt(score[cn]/rowcnt));
+		mr[r].buf = &buf[(size_t)r*bufrows*rowsize];
+		mr[r].left = sel->runrows[r];
+		mr[r].offset = offset;
+		offset += (off_t)sel->runrows[r]*rowsize;
+		if (FillMergeRun(sel->runs,&mr[r],bufrows,rowsize))
+			goto readerror;
+		SetMergeRunSortVal(&mr[r],rowsize,sel->colcnt,key);
+		heap[heapcnt++] = r;
 	}
-	/* select column with largest sddev as sorting key */
-	bestscore = 0.0;
-	for (cn = 0; cn<colcnt;cn++)
+	for (i = heapcnt/2; i-- > 0; )
+		SiftDownMergeRun(mr,heap,heapcnt,i);
+
+	while (heapcnt > 0)
 	{
-		if (score[cn] > bestscore)
+		MERGERUN *m = &mr[heap[0]];
+		const char *row = &m->buf[(size_t)m->bufpos*rowsize];
+		CELLNAMEIDX cellnameidx;
+
+		memcpy(&cellnameidx,row,sizeof(CELLNAMEIDX));
+		DclustFilePutRow(&w,cellnameidx,row+sizeof(CELLNAMEIDX),0);
+		m->bufpos++;
+		if ((m->bufpos == m->bufcnt) && (m->left > 0))
 		{
-			bestscore = score[cn];
-			*key = cn;
+			if (FillMergeRun(sel->runs,m,bufrows,rowsize))
+				goto readerror;
 		}
+		if (m->bufpos < m->bufcnt)
+			SetMergeRunSortVal(m,rowsize,sel->colcnt,key);
+		else
+			heap[0] = heap[--heapcnt];
+		SiftDownMergeRun(mr,heap,heapcnt,0);
 	}
+	err = DclustFileFinish(&w);
+	if (err)
+		printf("Error:Cannot write Output File\n");
+	goto bail;
+
+readerror:
+	DclustFileFinish(&w);
+	printf("Error:Cannot read temporary File %s\n",sel->runsfn);
+bail:
+	free(heap);
+	free(mr);
+	return(err);
 
-	facsp = &facsdata[0];
-	cn = *key;
-	for (i = 0; i<rowcnt;i++)
+} /* WriteSpilledSelection */
+/* ------------------------------------------------------------------------------------ */
+/* the events did not fit the memory needed to sort them: write them in runs small enough to be sorted */
+/* to a temporary file, then merge them back using facsdata as buffer */
+static int WriteSelectionInRuns(FILE *af,DCLUSTHEADER *hdr,FACSNAME *facsname,FACSDATA *facsdata,unsigned short cellnamecnt,unsigned int rcnt,unsigned int colcnt,unsigned short key,unsigned int threadcnt)
+{
+	SELECTION sel;
+	unsigned int runrows = rcnt;
+	unsigned int minrunrows = (rcnt+kMaxSelectionRuns-1)/kMaxSelectionRuns;
+	unsigned int start;
+	void *probe = NULL;
+	int err;
+
+	while ((runrows > minrunrows) && !probe)
 	{
-		if (facsp->data[cn] > maxval)
-			maxval = facsp->data[cn]; 
-		if (facsp->data[cn] < minval)
-			minval = facsp->data[cn]; 
-		facsp++;
+		runrows = (runrows+1)/2;
+		if (runrows < minrunrows)
+			runrows = minrunrows;
+		probe = malloc((size_t)runrows*kSortBytesPerEvent+kMaxParseThreads*sizeof(RADIXSORT));
 	}
-	if (verbose > 1)
-		printf("LOG: colkey = %d; (%u - %u)\n",*key,minval,maxval);	
-	
-	*selectedcnt = rowcnt;
-	*columns = colcnt;
-	*minkeyval = minval;
-	*maxkeyval = maxval;
-
-	cellnamecnt = 1;
+	if (!probe)
+	{
+		printf("LOG:Fatal: not enough memory to sort selected events\n");
+		return(1);
+	}
+	free(probe);
 
-	return(cellnamecnt);
-	
-} /* SafeProcessInputFile */
+	memset(&sel,0,sizeof(SELECTION));
+	sel.colcnt = colcnt;
+	sel.runs = tmpfile();
+	strcpy(sel.runsfn,"runs");
+	if (!sel.runs)
+	{
+		printf("Error:Cannot create temporary File\n");
+		return(1);
+	}
+	printf("LOG: Sorting Selected Events in runs of %u\n",runrows);
+	for (start = 0; start < rcnt; start += runrows)
+	{
+		sel.facsdata = &facsdata[start];
+		sel.cnt = (rcnt-start < runrows) ? rcnt-start : runrows;
+		if (SpillSelection(&sel))
+		{
+			fclose(sel.runs);
+			return(1);
+		}
+	}
+	sel.facsdata = facsdata;
+	sel.capacity = rcnt;
+	sel.runsfn[0] = 0;
+	err = WriteSpilledSelection(af,hdr,&sel,facsname,cellnamecnt,key,threadcnt);
+	fclose(sel.runs);
+	return(err);
 
+} /* WriteSelectionInRuns */
 /* ------------------------------------------------------------------------------------ */
-static int WriteUniqueCellNames(FILE *af,FACSNAME *facsname,FACSDATA	*facsdata,unsigned short cellnamecnt,unsigned int rcnt,unsigned int colcnt,unsigned short key,unsigned short minkeyval,unsigned short maxkeyval)
+/* dups, when not NULL, holds the identical events collapsed into facsdata */
+static int WriteUniqueCellNames(FILE *af,DCLUSTHEADER *hdr,FACSNAME *facsname,FACSDATA	*facsdata,unsigned short cellnamecnt,unsigned int rcnt,unsigned int colcnt,unsigned short key,unsigned int threadcnt,DUPLICATES *dups)
 {
 	unsigned int i;
-	unsigned short val;
-	FACSDATA	*facsp;
-	unsigned int cnt[65536];
 	unsigned int *sortedcellnameidx=NULL;
-	char emptyStr[kMaxCellName]; 
-	strcpy(emptyStr,"!NO_CATEGORIES!");
+	DCLUSTWRITER w;
 
-		/* skip header */
-		fseek(af,(kHeaderSize+4*sizeof(int)+kMaxLineBuf),SEEK_SET);
-
-		/* write column key */
-		fwrite(&key,sizeof(unsigned short),1,af);
-		/* write unique cellnames count */
-		fwrite(&cellnamecnt,sizeof(unsigned short),1,af);
-		/* add unique cellnames */		
-		fwrite(&emptyStr,sizeof(char),kMaxCellName,af);
-	
-
-		
 		/* write data sorted according to key */
-		printf("LOG: Writing Selected Events\n");
-
-	
-		sortedcellnameidx = malloc(rcnt*sizeof(unsigned int));
-		if (sortedcellnameidx)
-		{
-			unsigned int start;
-			unsigned int last;
-			unsigned short val;
-			unsigned int key2;
-			unsigned int *sortedcellnameidxcopy=NULL;
-			for (i = minkeyval; i <= maxkeyval; i++)
-				cnt[i] = 0;
-
-			facsp = &facsdata[0];
-			for (i = 0; i<rcnt;i++)
-			{
-				cnt[facsp->data[key]]++;
-				facsp++;
-			}
-
-			for (i = minkeyval+1; i <= maxkeyval; i++)
-				cnt[i] += cnt[i-1];
-			for (i = minkeyval; i <= maxkeyval; i++)
-				cnt[i]--;
-
-			for (i = rcnt-1; i>=1;i--)
-			{
-				facsp--;
-				sortedcellnameidx[cnt[facsp->data[key]]--] = i;
-			}
-			facsp--;
-			sortedcellnameidx[cnt[facsp->data[key]]--] = 0;
-
-
-			/* sort by second key */
-			sortedcellnameidxcopy = malloc(rcnt*sizeof(unsigned int));
-			if (sortedcellnameidxcopy)
-			{
-				/* make a copy of the sorted by first key, we will read from here and modify the original as we go */
-				memcpy(sortedcellnameidxcopy,sortedcellnameidx,rcnt*sizeof(unsigned int));
-				if (key > 0)
-					key2 = key-1;
-				else
-					key2 = 1;
-				start = 0;
-				do
-				{
-					
-					for (i = 0; i <= 65535; i++)
-						cnt[i] = 0;
-					val = facsdata[sortedcellnameidxcopy[start]].data[key];
-					minkeyval=65535;
-					maxkeyval=0;
-					last = start;
-					while (facsdata[sortedcellnameidxcopy[last]].data[key] == val)
-					{
-						unsigned short val=facsdata[sortedcellnameidxcopy[last++]].data[key2];
-						if (val > maxkeyval)
-							maxkeyval=val;
-						if (val < minkeyval)
-							minkeyval=val;
-						cnt[val]++;
-						if (last >= rcnt)
-							break;
-					};
-					if (maxkeyval > minkeyval)
-					{
-						unsigned short val;
-						
-						for (i = minkeyval+1; i <= maxkeyval; i++)
-							cnt[i] += cnt[i-1];
-						for (i = minkeyval; i <= maxkeyval; i++)
-							cnt[i]--;
-
-
-						for (i = last-1; i>=(start+1);i--)
-						{
-							val=facsdata[sortedcellnameidxcopy[i]].data[key2];
-							sortedcellnameidx[start+ cnt[val] ] = sortedcellnameidxcopy[i] ;
-							cnt[val]--;
-						}
-						val=facsdata[sortedcellnameidxcopy[start]].data[key2];
-						sortedcellnameidx[start + cnt[val]] = sortedcellnameidxcopy[start];
-					}
-					start=last;
-				} while(last < rcnt);
-				free(sortedcellnameidxcopy);
-			}
-			
+		if (rcnt == 0)
+		{
+			if (CreateSelectedFile(&w,af,hdr,facsname,cellnamecnt,key))
+				return(1);
+			return(DclustFileFinish(&w));
+		}
+		sortedcellnameidx = SortSelectedEvents(facsdata,rcnt,key,threadcnt);
+		if (!sortedcellnameidx && dups)
+		{
+			printf("LOG:Fatal: not enough memory to sort the collapsed events\n");
+			return(1);
+		}
+		if (!sortedcellnameidx)	/* not enough memory to sort all events at once */
+			return(WriteSelectionInRuns(af,hdr,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,threadcnt));
+		if (dups)
+		{
+			hdr->rowcnt = rcnt;
+			hdr->duplicatecnt = dups->cnt;
+		}
 
-			/* write results */
-			for (i = 0; i<rcnt;i++)
-			{
-				facsp = &facsdata[sortedcellnameidx[i]];
-				fwrite(&facsp->cellnameidx,sizeof(CELLNAMEIDX),1,af);
-				fwrite(&facsp->data,sizeof(unsigned short),colcnt,af);
-			}
+		if (CreateSelectedFile(&w,af,hdr,facsname,cellnamecnt,key))
+		{
 			free(sortedcellnameidx);
+			return(1);
 		}
-		else	/* resort to slower sort without memory overhead */
+		printf("LOG: Writing Selected Events\n");
+		for (i = 0; i<rcnt;i++)
 		{
-			for (val = minkeyval; val<= maxkeyval;val++)
-			{
-				facsp = &facsdata[0];
-				for (i = 0; i<rcnt;i++)
-				{
-					if (facsp->data[key] == val)
-					{
-						fwrite(&facsp->cellnameidx,sizeof(CELLNAMEIDX),1,af);
-						fwrite(&facsp->data,sizeof(unsigned short),colcnt,af);
-					}
-					facsp++;
-				}
-			}
+			FACSDATA *facsp = &facsdata[sortedcellnameidx[i]];
+			DclustFilePutRow(&w,facsp->cellnameidx,facsp->data,0);
+		}
+		if (dups && (dups->cnt > 0) && SetSortedDuplicates(&w,dups,sortedcellnameidx,rcnt))
+			w.err = 1;
+		free(sortedcellnameidx);
+		if (DclustFileFinish(&w))
+		{
+			printf("Error:Cannot write Output File\n");
+			return(1);
 		}
 		return(0);
 		
@@ -1014,12 +2550,18 @@ static int WriteUniqueCellNames(FILE *af,FACSNAME *facsname,FACSDATA	*facsdata,u
 
 int main (int argc, char **argv)
 {	
-	FACSDATA	*facsdata;
+	FACSDATA	*facsdata = NULL;
+	SELECTION	sel;
+	DCLUSTHEADER	hdr;
+	DCLUSTFILE	df;
 	char	*version="VERSION 1.0; 2019-12-26";
 	char ifn[kMaxFilename];
 	char wfn[kMaxFilename];
 	char ofn[kMaxFilename];
 	char nfn[kMaxFilename];
+	char channels[kMaxLineBuf];
+	char **fcsfn = NULL;
+	unsigned int fcscnt = 0;
 	unsigned int quickprocess = 0;
 	unsigned int totalrowcnt = 0;
 	unsigned int colcnt = 0;
@@ -1036,6 +2578,15 @@ int main (int argc, char **argv)
 	unsigned int binary = 0;
 	unsigned int readFromUnassigned = 0;
 	int  keyOverride = -1;
+	unsigned int threadcnt = 0;
+	unsigned int memoryMB = 0;
+	unsigned int sortthreadcnt;
+	unsigned int collapse = 0;
+	unsigned int samplesize = 0;
+	unsigned int stratify = 0;
+	unsigned int seed = 1;
+	RESERVOIR res;
+	RESERVOIR *resp = NULL;
 
 	/* --------- process arguments */
 
@@ -1045,9 +2596,10 @@ int main (int argc, char **argv)
 	wfn[0] = 0;
 	ofn[0] = 0;
 	nfn[0] = 0;
+	channels[0] = 0;
 
 	opterr = 0;
-	while ((c = getopt (argc, argv, "i:b:o:s:qfv:k:u:")) != -1)
+	while ((c = getopt (argc, argv, "i:b:o:s:qfv:k:u:t:m:n:c:DS:TR:")) != -1)
 	switch (c)
 	{      
 	  case 'i':
@@ -1089,6 +2641,39 @@ int main (int argc, char **argv)
 	  case 'k':
 			sscanf(optarg,"%d",&keyOverride);
         break;
+
+	  case 't':
+			sscanf(optarg,"%u",&threadcnt);
+        break;
+
+	  case 'm':
+			sscanf(optarg,"%u",&memoryMB);
+        break;
+
+	  case 'n':
+			strcpy(nfn,optarg);
+        break;
+
+	  case 'c':
+			strncpy(channels,optarg,kMaxLineBuf-1);
+			channels[kMaxLineBuf-1] = 0;
+        break;
+
+	  case 'D':
+			collapse = 1;
+        break;
+
+	  case 'S':
+			sscanf(optarg,"%u",&samplesize);
+        break;
+
+	  case 'T':
+			stratify = 1;
+        break;
+
+	  case 'R':
+			sscanf(optarg,"%u",&seed);
+        break;
 	}
 
 	if (ofn[0] == 0)
@@ -1098,9 +2683,13 @@ int main (int argc, char **argv)
 	if (ifn[0] == 0)
 	{
 		printf("usage:\n\n");
-		printf("dselect -i|-b|-u InputFile [-o OutputFileRootName] [-s LoadEveryNsample][-q][-f][-n NamesFile][-v level]\n\n");
+		printf("dselect -i|-b|-u InputFile [-o OutputFileRootName] [-s LoadEveryNsample][-q][-f][-t threads][-m MB][-n NamesFile][-c Channels][-D][-S SampleSize [-T][-R seed]][-v level] [FCSFile ...]\n\n");
 		printf("        -i InputFile           : Comma delimited file. A header is expected.\n");
-		printf("                                 Values must be integers in the [0..1023] range.\n");
+		printf("                                 Values must be integers in the [0..%d] range.\n",kMAX_ALLOWED_INPUT_VALUE-1);
+		printf("                                 InputFile may also be a FCS 3.0 or 3.1 file, followed by more FCS files to be read as one input.\n");
+		printf("                                 FCS values are scaled onto the same range (see -c).\n");
+		printf("                                 Their events are numbered from 1 across the files, the name of its file is the cellname of an event\n");
+		printf("                                 and 'OutputFileRootName.files' lists the rowids of each file. Options -q -f and -t are ignored.\n");
 		printf("        -b InputFile           : should be a dclust .assigned output file.\n");
 		printf("                                 It will produce one dclust binary input file 'OutputFileRootName.clusterID.selected'\n");
 		printf("                                 for each clusterID present in the file specified. Options -s -q and -f are ignored but -n is mandatory.\n");
@@ -1120,6 +2709,19 @@ int main (int argc, char **argv)
 		printf("        -f                     : first column of the InputFile has to be treated as a selection flag\n");
 		printf("                               : a content of 0 will place the event in the leftover bin (transparent for option -s)\n");
 		printf("                               : a content of 1 will select or leave the event depending on option -s\n");
+		printf("        -t threads             : map the InputFile in memory and parse it with that many threads (same checks as default parsing)\n");
+		printf("                                 also the number of threads sorting the selected events; default is one per processor\n");
+		printf("        -m MB                  : memory budget for the selected events and their sort; beyond it they are spilled to the temporary\n");
+		printf("                                 file 'OutputFileRootName.selected.runs' and merged back when written. Default is no limit\n");
+		printf("        -c Channels            : comma separated FCS channels ($PnN or $PnS names, or numbers starting at 1) to use as columns;\n");
+		printf("                                 default is every channel. Values are scaled linearly from [0..$PnR[ to [0..%d].\n",kMAX_ALLOWED_INPUT_VALUE-1);
+		printf("        -D                     : collapse identical selected events into one row standing for all of them; dclust counts\n");
+		printf("                                 every event and cextract writes each of them back. Ignored when events are spilled (-m)\n");
+		printf("        -S SampleSize          : select a uniform random sample of SampleSize events in a single pass (reservoir sampling),\n");
+		printf("                                 among the events options -s and -f would select; the others go to the leftover file.\n");
+		printf("                                 The sample is held in memory (-m is ignored) and the input is parsed by one thread (-t only sorts)\n");
+		printf("        -T                     : with -S, sample the events of every FCS file separately, each keeping SampleSize/files events\n");
+		printf("        -R seed                : seed of the random sample of option -S; the same seed and input give the same sample. Default is 1\n");
 		printf("      -v level                 : specifies the verbose level; default is 0.\n\n");
 		printf("VERSION\n");
 		printf("\n%s\n",version);
@@ -1139,6 +2741,7 @@ int main (int argc, char **argv)
 		return(1);
 	}
 	
+	f = NULL;
 	if (binary || readFromUnassigned)
 	{
 		if (nfn[0]==0)
@@ -1146,47 +2749,67 @@ int main (int argc, char **argv)
 			printf("Error:option -b and -u require use of option -n\n");
 			return(1);
 		}
-		f = fopen(ifn,"rb");
-	}
-	else
-		f = fopen(ifn,"r");
-		
-	if (!f)
-	{
-		printf("Error:Cannot read Input File %s\n",ifn);
-		return(1);
-	}
-	
-
-	if (binary) /* retrieve actual count of events from input file */
-	{
+		/* v1 and v2 .assigned and .unassigned files are read from a mapping of the file */
+		err = DclustFileOpen(&df,ifn,(binary) ? kDclustAssignedFile : kDclustUnassignedFile,1);
+		if ((err == 0) && DclustFileMap(&df))
+		{
+			DclustFileClose(&df);
+			err = -1;
+		}
+		if (err < 0)
+			printf("Error:Cannot read Input File %s\n",ifn);
+		if (err != 0)
+			return(1);
+		/* retrieve actual count of events from input file */
 		loadEveryNsample = 1;
 		firstColIsSelectFlag = 0;
-		lastclusterid = ReadAssignedFileHeader(f,&totalrowcnt,&colcnt);
+		samplesize = 0;
+		totalrowcnt = (unsigned int)df.hdr.rowcnt;
+		colcnt = df.hdr.colcnt;
+		lastclusterid = df.hdr.maxclusterid;
 		facsdata = calloc(totalrowcnt,sizeof(FACSDATA));
+		if (!facsdata)
+		{
+			printf("Error:Cannot Allocate Memory to select up to %u events.\n",totalrowcnt);
+			DclustFileClose(&df);
+			return(1);
+		}
 	}
-	else 	/* allocate memory for input data */
+	else if (FcsFileIsFcs(ifn))
 	{
-		if (readFromUnassigned)
+		/* the FCS files following the options are read after InputFile */
+		fcscnt = 1+(argc-optind);
+		fcsfn = calloc(fcscnt,sizeof(char *));
+		facsname = calloc(fcscnt,sizeof(FACSNAME));
+		if (!fcsfn || !facsname)
 		{
-			loadEveryNsample = 1;
-			ReadUnAssignedFileHeader(f,&totalrowcnt,&colcnt);
-			facsdata = calloc(totalrowcnt,sizeof(FACSDATA));
+			printf("Error:Cannot Allocate Memory.\n");
+			return(1);
 		}
-		else
-			facsdata = calloc(kMAXEVENTS,sizeof(FACSDATA));
+		fcsfn[0] = ifn;
+		for (c = optind; c < argc; c++)
+			fcsfn[1+c-optind] = argv[c];
+		firstColIsSelectFlag = 0;
 	}
-	if (!facsdata)
+	else
 	{
-		printf("Error:Cannot Allocate Memory to select up to %d events.\n",kMAXEVENTS);
-		fclose(f);
-		return(1);
+		f = fopen(ifn,"r");
+		if (!f)
+		{
+			printf("Error:Cannot read Input File %s\n",ifn);
+			return(1);
+		}
 	}
+	/* the budget also covers sorting the events held in memory */
+	InitSelection(&sel,(unsigned int)(((unsigned long long)memoryMB*1024*1024)/(sizeof(FACSDATA)+kSortBytesPerEvent)),ofn);
+	sortthreadcnt = threadcnt;
+	if (sortthreadcnt == 0)
+		sortthreadcnt = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
 
 
 
 	err = 0;		
-	if ((loadEveryNsample > 1) || (firstColIsSelectFlag))
+	if ((loadEveryNsample > 1) || (firstColIsSelectFlag) || (samplesize > 0))
 	{
 		sprintf(wfn,"%s.leftover",ofn);
 		lf = fopen(wfn,"wb");
@@ -1219,8 +2842,8 @@ int main (int argc, char **argv)
 				}
 				else
 				{
-					cellnamecnt = processAssignedFile(f,wf,facsdata,facsname,cellnamecnt,cluster,totalrowcnt,&rcnt,colcnt,&key);
-					err = WriteUniqueCellNames(wf,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,0,kMAX_ALLOWED_INPUT_VALUE);
+					cellnamecnt = processAssignedFile(&df,&hdr,facsdata,facsname,cellnamecnt,cluster,totalrowcnt,&rcnt,colcnt,&key);
+					err = WriteUniqueCellNames(wf,&hdr,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,sortthreadcnt,NULL);
 					fclose(wf);
 				}
 			}
@@ -1238,8 +2861,8 @@ int main (int argc, char **argv)
 				}
 				else
 				{
-					cellnamecnt = processUnAssignedFile(f,wf,facsdata,facsname,cellnamecnt,totalrowcnt,&rcnt,colcnt,&key);
-					err = WriteUniqueCellNames(wf,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,0,kMAX_ALLOWED_INPUT_VALUE);
+					cellnamecnt = processUnAssignedFile(&df,&hdr,facsdata,facsname,cellnamecnt,totalrowcnt,&rcnt,colcnt,&key);
+					err = WriteUniqueCellNames(wf,&hdr,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,sortthreadcnt,NULL);
 					fclose(wf);
 				}
 		}
@@ -1256,15 +2879,47 @@ int main (int argc, char **argv)
 			{
 				unsigned short minkeyval=0;
 				unsigned short maxkeyval=(kMAX_ALLOWED_INPUT_VALUE-1);
-				if (quickprocess)
-					cellnamecnt = processInputFile(f,wf,lf,loadEveryNsample,facsdata,facsname,cellnamecnt,&rcnt,&colcnt,&key,firstColIsSelectFlag,&minkeyval,&maxkeyval);
+
+				/* the reservoirs are filled in input order, so a sample is drawn by a single parsing thread */
+				if (samplesize > 0)
+				{
+					if (InitReservoir(&res,samplesize,(stratify && (fcscnt > 1)) ? fcscnt : 1,seed,&sel,lf) == 0)
+						resp = &res;
+					if ((threadcnt > 0) && (fcscnt == 0))
+						printf("LOG: sampling %u events, input parsed by a single thread\n",samplesize);
+				}
+				if ((samplesize > 0) && !resp)
+					cellnamecnt = 0;
+				else if (fcscnt > 0)
+					cellnamecnt = processFCSFiles(fcsfn,fcscnt,channels,ofn,&hdr,lf,loadEveryNsample,&sel,resp,facsname,&rcnt,&colcnt,&key,&minkeyval,&maxkeyval);
+				else if ((threadcnt > 0) && !resp)
+					cellnamecnt = ThreadedProcessInputFile(f,&hdr,lf,loadEveryNsample,&sel,facsname,cellnamecnt,&rcnt,&colcnt,&key,firstColIsSelectFlag,&minkeyval,&maxkeyval,threadcnt);
+				else if (quickprocess)
+					cellnamecnt = processInputFile(f,&hdr,lf,loadEveryNsample,&sel,resp,facsname,cellnamecnt,&rcnt,&colcnt,&key,firstColIsSelectFlag,&minkeyval,&maxkeyval);
 				else
-					cellnamecnt = SafeProcessInputFile(f,wf,lf,loadEveryNsample,facsdata,facsname,cellnamecnt,&rcnt,&colcnt,&key,firstColIsSelectFlag,&minkeyval,&maxkeyval);
+					cellnamecnt = SafeProcessInputFile(f,&hdr,lf,loadEveryNsample,&sel,resp,facsname,cellnamecnt,&rcnt,&colcnt,&key,firstColIsSelectFlag,&minkeyval,&maxkeyval);
+				if (samplesize > 0)
+					FreeReservoir(&res);
 				if (keyOverride != -1)
 					key = keyOverride;
-				if (cellnamecnt > 0)
+				if ((cellnamecnt > 0) && (sel.runcnt > 0))
+				{
+					if (collapse)
+						printf("LOG: selected events were spilled, identical events are not collapsed\n");
+					err = WriteSpilledSelection(wf,&hdr,&sel,facsname,cellnamecnt,key,sortthreadcnt);
+				}
+				else if ((cellnamecnt > 0) && collapse)
 				{
-					err = WriteUniqueCellNames(wf,facsname,facsdata,cellnamecnt,rcnt,colcnt,key,minkeyval,maxkeyval);
+					DUPLICATES dups;
+
+					err = CollapseDuplicates(sel.facsdata,&rcnt,colcnt,&dups);
+					if (err == 0)
+						err = WriteUniqueCellNames(wf,&hdr,facsname,sel.facsdata,cellnamecnt,rcnt,colcnt,key,sortthreadcnt,&dups);
+					FreeDuplicates(&dups);
+				}
+				else if (cellnamecnt > 0)
+				{
+					err = WriteUniqueCellNames(wf,&hdr,facsname,sel.facsdata,cellnamecnt,rcnt,colcnt,key,sortthreadcnt,NULL);
 				}
 				else
 				{
@@ -1278,8 +2933,13 @@ int main (int argc, char **argv)
 
 
 	free(facsdata);
+	free(facsname);
+	free(fcsfn);
+	FreeSelection(&sel);
 	if (f)
 		fclose(f);
+	if (binary || readFromUnassigned)
+		DclustFileClose(&df);
 	if (lf)
 		fclose(lf);
 
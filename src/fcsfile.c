@@ -0,0 +1,452 @@
+/*	------------------------------------------------------------------------------------
+
+		                          * megaclust *
+      unbiased hierarchical density based parallel clustering of large datasets
+
+
+    Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+    Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+	Code:       Nicolas Guex, 2008-2019
+	Contact:    Nicolas.Guex@unil.ch
+	Repository: https://github.com/sib-swiss/megaclust
+
+
+	Articles:   megaclust was used here
+                    https://www.ncbi.nlm.nih.gov/pubmed/29241546
+                    https://www.ncbi.nlm.nih.gov/pubmed/23396282
+
+
+
+
+	Machine :	Unix
+	Language:	C
+	Requires:	mpi, pthread
+
+	Version information
+
+	Version:	1.0  Dec.  2019 Public release of code under GPL2+ license
+
+
+
+
+	Compiling:   (you will need mpi on your system)
+
+	
+	make all
+
+
+
+	Testing:
+
+    ./test/unit_test1.sh
+    ./test/unit_test2.sh
+	
+	------------------------------------------------------------------------------------
+*/
+
+
+
+	/*------------------------- I N T E R F A C E ----------------------- */
+
+/*
+
+	fcsfile.c: read the list mode events of FCS 3.0 and 3.1 files.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "fcsfile.h"
+
+/* ------------------------------------------------------------------------------------ */
+
+typedef	struct	FCSKEYWORD_struct	FCSKEYWORD;
+struct	FCSKEYWORD_struct
+{
+	const char *key;
+	const char *value;
+};
+
+/* ------------------------------------------------------------------------------------ */
+
+/* split the TEXT segment in place into keyword/value pairs; a doubled delimiter stands for the delimiter itself */
+static unsigned int ParseText(char *text,size_t len,FCSKEYWORD *kw,unsigned int maxkw)
+{
+	char delim = text[0];
+	size_t p = 1;
+	size_t out = 0;
+	unsigned int tokencnt = 0;
+
+	while (p < len)
+	{
+		size_t start = out;
+
+		while (p < len)
+		{
+			if (text[p] == delim)
+			{
+				if ((p+1 < len) && (text[p+1] == delim))
+				{
+					text[out++] = delim;
+					p += 2;
+					continue;
+				}
+				break;
+			}
+			text[out++] = text[p++];
+		}
+		text[out++] = 0;
+		p++;
+		if ((tokencnt/2) >= maxkw)
+			break;
+		if (tokencnt & 1)
+			kw[tokencnt/2].value = &text[start];
+		else
+			kw[tokencnt/2].key = &text[start];
+		tokencnt++;
+	}
+	return(tokencnt/2);
+
+} /* ParseText */
+/* ------------------------------------------------------------------------------------ */
+
+/* keywords are case insensitive */
+static const char *Keyword(const FCSKEYWORD *kw,unsigned int kwcnt,const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < kwcnt; i++)
+	{
+		if (strcasecmp(kw[i].key,key) == 0)
+			return(kw[i].value);
+	}
+	return(NULL);
+
+} /* Keyword */
+/* ------------------------------------------------------------------------------------ */
+
+static const char *ParKeyword(const FCSKEYWORD *kw,unsigned int kwcnt,unsigned int par,char what)
+{
+	char key[32];
+
+	sprintf(key,"$P%u%c",par+1,what);
+	return(Keyword(kw,kwcnt,key));
+
+} /* ParKeyword */
+/* ------------------------------------------------------------------------------------ */
+
+/* one of the 8 characters offsets of the HEADER segment, blank if unused */
+static unsigned long long HeaderOffset(const char *header,unsigned int pos)
+{
+	char field[9];
+
+	memcpy(field,&header[pos],8);
+	field[8] = 0;
+	return(strtoull(field,NULL,10));
+
+} /* HeaderOffset */
+/* ------------------------------------------------------------------------------------ */
+
+/* $BYTEORD is 1,2,3,4 (little endian) or 4,3,2,1 (big endian), or shorter for 16 bits values */
+static int ByteOrder(const char *byteord,int *bigendian)
+{
+	char order[16];
+	unsigned int n = 0;
+
+	while (*byteord && (n < sizeof(order)-1))
+	{
+		if ((*byteord != ' ') && (*byteord != ','))
+			order[n++] = *byteord;
+		byteord++;
+	}
+	order[n] = 0;
+	if ((strcmp(order,"1234") == 0) || (strcmp(order,"12") == 0) || (strcmp(order,"1") == 0))
+		*bigendian = 0;
+	else if ((strcmp(order,"4321") == 0) || (strcmp(order,"21") == 0))
+		*bigendian = 1;
+	else
+		return(1);
+	return(0);
+
+} /* ByteOrder */
+/* ------------------------------------------------------------------------------------ */
+
+/* returns 1 if the file starts like a FCS file, whatever its version */
+int FcsFileIsFcs(const char *fn)
+{
+	FILE *f = fopen(fn,"rb");
+	char magic[3];
+	int isfcs = 0;
+
+	if (f)
+	{
+		isfcs = ((fread(magic,1,3,f) == 3) && (memcmp(magic,"FCS",3) == 0));
+		fclose(f);
+	}
+	return(isfcs);
+
+} /* FcsFileIsFcs */
+/* ------------------------------------------------------------------------------------ */
+
+/* returns 0 once the TEXT segment describes list mode events that can be decoded */
+int FcsFileOpen(FCSFILE *fcs,const char *fn)
+{
+	char header[kFcsHeaderSize];
+	char *text = NULL;
+	FCSKEYWORD *kw = NULL;
+	unsigned int kwcnt;
+	unsigned long long textstart,textend,datastart,dataend;
+	const char *value;
+	unsigned int par;
+
+	memset(fcs,0,sizeof(FCSFILE));
+	fcs->f = fopen(fn,"rb");
+	if (!fcs->f)
+	{
+		printf("Error:Cannot read Input File %s\n",fn);
+		return(1);
+	}
+	if ((fread(header,1,kFcsHeaderSize,fcs->f) != kFcsHeaderSize) || ((memcmp(header,"FCS3.0",6) != 0) && (memcmp(header,"FCS3.1",6) != 0)))
+	{
+		printf("Error: %s is not a FCS 3.0 or 3.1 file\n",fn);
+		goto bail;
+	}
+	textstart = HeaderOffset(header,10);
+	textend = HeaderOffset(header,18);
+	datastart = HeaderOffset(header,26);
+	dataend = HeaderOffset(header,34);
+	if ((textend <= textstart) || (textend-textstart > 64*1024*1024))
+	{
+		printf("Error: %s has an invalid TEXT segment\n",fn);
+		goto bail;
+	}
+
+	text = malloc(textend-textstart+2);
+	kw = malloc((textend-textstart)/2*sizeof(FCSKEYWORD)+sizeof(FCSKEYWORD));
+	if (!text || !kw)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		goto bail;
+	}
+	if ((fseeko(fcs->f,textstart,SEEK_SET) != 0) || (fread(text,1,textend-textstart+1,fcs->f) != textend-textstart+1))
+	{
+		printf("Error: %s is truncated\n",fn);
+		goto bail;
+	}
+	kwcnt = ParseText(text,textend-textstart+1,kw,(textend-textstart)/2+1);
+
+	/* offsets that do not fit in the HEADER are only given in the TEXT */
+	if ((datastart == 0) && (dataend == 0))
+	{
+		value = Keyword(kw,kwcnt,"$BEGINDATA");
+		datastart = value ? strtoull(value,NULL,10) : 0;
+		value = Keyword(kw,kwcnt,"$ENDDATA");
+		dataend = value ? strtoull(value,NULL,10) : 0;
+	}
+	value = Keyword(kw,kwcnt,"$MODE");
+	if (value && (strcasecmp(value,"L") != 0))
+	{
+		printf("Error: %s does not hold list mode data ($MODE=%s)\n",fn,value);
+		goto bail;
+	}
+	value = Keyword(kw,kwcnt,"$DATATYPE");
+	if (!value || ((toupper(value[0]) != 'I') && (toupper(value[0]) != 'F') && (toupper(value[0]) != 'D')))
+	{
+		printf("Error: %s: unsupported $DATATYPE %s\n",fn,value ? value : "(missing)");
+		goto bail;
+	}
+	fcs->datatype = toupper(value[0]);
+	value = Keyword(kw,kwcnt,"$BYTEORD");
+	if (!value || ByteOrder(value,&fcs->bigendian))
+	{
+		printf("Error: %s: unsupported $BYTEORD %s\n",fn,value ? value : "(missing)");
+		goto bail;
+	}
+	value = Keyword(kw,kwcnt,"$PAR");
+	fcs->parcnt = value ? (unsigned int)strtoul(value,NULL,10) : 0;
+	value = Keyword(kw,kwcnt,"$TOT");
+	fcs->eventcnt = value ? strtoull(value,NULL,10) : 0;
+	if ((fcs->parcnt == 0) || (fcs->parcnt > kMaxFcsPar) || !value)
+	{
+		printf("Error: %s: invalid $PAR or $TOT\n",fn);
+		goto bail;
+	}
+
+	fcs->par = calloc(fcs->parcnt,sizeof(FCSPARAM));
+	if (!fcs->par)
+	{
+		printf("Error:Cannot Allocate Memory.\n");
+		goto bail;
+	}
+	for (par = 0; par < fcs->parcnt; par++)
+	{
+		FCSPARAM *p = &fcs->par[par];
+		unsigned int bits;
+
+		value = ParKeyword(kw,kwcnt,par,'B');
+		bits = value ? (unsigned int)strtoul(value,NULL,10) : 0;
+		if ((bits == 0) || (bits % 8) || (bits > 64) || ((fcs->datatype == 'F') && (bits != 32)) || ((fcs->datatype == 'D') && (bits != 64)))
+		{
+			printf("Error: %s: unsupported $P%uB %s\n",fn,par+1,value ? value : "(missing)");
+			goto bail;
+		}
+		p->bytes = bits/8;
+		p->offset = fcs->eventsize;
+		fcs->eventsize += p->bytes;
+
+		value = ParKeyword(kw,kwcnt,par,'R');
+		p->range = value ? strtod(value,NULL) : 0.0;
+		if (p->range <= 0.0)
+		{
+			printf("Error: %s: invalid $P%uR %s\n",fn,par+1,value ? value : "(missing)");
+			goto bail;
+		}
+		/* integer values only use the bits needed for the range */
+		p->mask = (bits == 64) ? ~0ULL : ((1ULL << bits)-1);
+		if (fcs->datatype == 'I')
+		{
+			unsigned long long m = 1;
+
+			while (((double)m < p->range) && (m <= p->mask/2))
+				m <<= 1;
+			if ((double)m >= p->range)
+				p->mask = m-1;
+		}
+
+		value = ParKeyword(kw,kwcnt,par,'N');
+		if (value)
+			strncpy(p->name,value,kMaxFcsParName-1);
+		else
+			sprintf(p->name,"P%u",par+1);
+		value = ParKeyword(kw,kwcnt,par,'S');
+		if (value)
+			strncpy(p->longname,value,kMaxFcsParName-1);
+	}
+
+	if ((dataend < datastart) || (dataend-datastart+1 < fcs->eventcnt*fcs->eventsize))
+	{
+		printf("Error: %s: DATA segment too small for %llu events\n",fn,fcs->eventcnt);
+		goto bail;
+	}
+	fcs->dataoffset = datastart;
+	if (fseeko(fcs->f,fcs->dataoffset,SEEK_SET) != 0)
+	{
+		printf("Error: %s is truncated\n",fn);
+		goto bail;
+	}
+	free(kw);
+	free(text);
+	return(0);
+
+bail:
+	free(kw);
+	free(text);
+	FcsFileClose(fcs);
+	return(1);
+
+} /* FcsFileOpen */
+/* ------------------------------------------------------------------------------------ */
+
+void FcsFileClose(FCSFILE *fcs)
+{
+	if (fcs->f)
+		fclose(fcs->f);
+	free(fcs->par);
+	fcs->f = NULL;
+	fcs->par = NULL;
+
+} /* FcsFileClose */
+/* ------------------------------------------------------------------------------------ */
+
+/* a parameter given by its $PnN or $PnS name, or by its number starting at 1; -1 if there is none */
+int FcsFileFindPar(const FCSFILE *fcs,const char *name)
+{
+	unsigned int par;
+	char *end;
+	unsigned long n;
+
+	for (par = 0; par < fcs->parcnt; par++)
+	{
+		if ((strcmp(fcs->par[par].name,name) == 0) || (strcmp(fcs->par[par].longname,name) == 0))
+			return((int)par);
+	}
+	n = strtoul(name,&end,10);
+	if ((end != name) && (*end == 0) && (n >= 1) && (n <= fcs->parcnt))
+		return((int)(n-1));
+	return(-1);
+
+} /* FcsFileFindPar */
+/* ------------------------------------------------------------------------------------ */
+
+/* read the next events, at most maxevents of eventsize bytes; returns the number read */
+unsigned int FcsFileReadEvents(FCSFILE *fcs,char *buf,unsigned int maxevents)
+{
+	unsigned long long left = fcs->eventcnt-fcs->eventsread;
+	size_t n;
+
+	if (left < maxevents)
+		maxevents = (unsigned int)left;
+	if (maxevents == 0)
+		return(0);
+	n = fread(buf,fcs->eventsize,maxevents,fcs->f);
+	fcs->eventsread += n;
+	return((unsigned int)n);
+
+} /* FcsFileReadEvents */
+/* ------------------------------------------------------------------------------------ */
+
+double FcsFileValue(const FCSFILE *fcs,const char *event,unsigned int par)
+{
+	const FCSPARAM *p = &fcs->par[par];
+	const unsigned char *b = (const unsigned char *)&event[p->offset];
+	unsigned long long u = 0;
+	unsigned int i;
+
+	if (fcs->bigendian)
+	{
+		for (i = 0; i < p->bytes; i++)
+			u = (u << 8) | b[i];
+	}
+	else
+	{
+		for (i = p->bytes; i > 0; i--)
+			u = (u << 8) | b[i-1];
+	}
+	if (fcs->datatype == 'F')
+	{
+		unsigned int u32 = (unsigned int)u;
+		float v;
+
+		memcpy(&v,&u32,sizeof(float));
+		return((double)v);
+	}
+	if (fcs->datatype == 'D')
+	{
+		double v;
+
+		memcpy(&v,&u,sizeof(double));
+		return(v);
+	}
+	return((double)(u & p->mask));
+
+} /* FcsFileValue */
+/* ------------------------------------------------------------------------------------ */
@@ -0,0 +1,119 @@
+/*	------------------------------------------------------------------------------------
+
+		                          * megaclust *
+      unbiased hierarchical density based parallel clustering of large datasets
+
+
+    Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+    Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+	Code:       Nicolas Guex, 2008-2019
+	Contact:    Nicolas.Guex@unil.ch
+	Repository: https://github.com/sib-swiss/megaclust
+
+
+	Articles:   megaclust was used here
+                    https://www.ncbi.nlm.nih.gov/pubmed/29241546
+                    https://www.ncbi.nlm.nih.gov/pubmed/23396282
+
+
+
+
+	Machine :	Unix
+	Language:	C
+	Requires:	mpi, pthread
+
+	Version information
+
+	Version:	1.0  Dec.  2019 Public release of code under GPL2+ license
+
+
+
+
+	Compiling:   (you will need mpi on your system)
+
+	
+	make all
+
+
+
+	Testing:
+
+    ./test/unit_test1.sh
+    ./test/unit_test2.sh
+	
+	------------------------------------------------------------------------------------
+*/
+
+
+
+/*
+
+	fcsfile.h: list mode DATA segments of FCS 3.0 and 3.1 flow cytometry files.
+
+	The TEXT segment is parsed for the keywords describing the events; the events are
+	then read in blocks from the DATA segment and their values decoded one parameter at
+	a time, whatever the data type (I, F or D) and byte order of the file.
+
+*/
+
+#ifndef __FCSFILE_H__
+#define __FCSFILE_H__
+
+#define kMaxFcsPar 1024
+#define kMaxFcsParName 64
+#define kFcsHeaderSize 58
+
+/* ------------------------------------------------------------------------------------ */
+
+typedef	struct	FCSPARAM_struct	FCSPARAM;
+struct	FCSPARAM_struct
+{
+	char name[kMaxFcsParName];		/* $PnN */
+	char longname[kMaxFcsParName];	/* $PnS, may be empty */
+	unsigned int bytes;				/* $PnB / 8 */
+	unsigned int offset;			/* of the value within an event */
+	double range;					/* $PnR */
+	unsigned long long mask;		/* bits of integer values within the range */
+};
+
+typedef	struct	FCSFILE_struct	FCSFILE;
+struct	FCSFILE_struct
+{
+	FILE *f;
+	char datatype;					/* 'I', 'F' or 'D' */
+	int bigendian;
+	unsigned int parcnt;
+	unsigned int eventsize;
+	unsigned long long eventcnt;	/* $TOT */
+	unsigned long long eventsread;
+	unsigned long long dataoffset;
+	FCSPARAM *par;
+};
+
+/* ------------------------------------------------------------------------------------ */
+
+int FcsFileOpen(FCSFILE *fcs,const char *fn);
+void FcsFileClose(FCSFILE *fcs);
+int FcsFileIsFcs(const char *fn);
+int FcsFileFindPar(const FCSFILE *fcs,const char *name);
+unsigned int FcsFileReadEvents(FCSFILE *fcs,char *buf,unsigned int maxevents);
+double FcsFileValue(const FCSFILE *fcs,const char *event,unsigned int par);
+
+#endif
+/* ------------------------------------------------------------------------------------ */
@@ -0,0 +1,117 @@
+#!/bin/sh
+
+#	------------------------------------------------------------------------------------
+#
+#                                 * megaclust *
+#     unbiased hierarchical density based parallel clustering of large datasets
+#
+#
+#   Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+#   Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+#
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+#
+#	Code:       Nicolas Guex, 2008-2019
+#	Contact:    Nicolas.Guex@unil.ch
+#	Repository: https://github.com/sib-swiss/megaclust
+#
+#
+#	------------------------------------------------------------------------------------
+
+#	The same clustering is repeated several times: every run must give the partition
+#	of the expected file, whatever the order in which the slaves complete their chunks.
+#	Cluster numbers are renumbered by first appearance before comparing.
+
+
+if [ $# -eq 0 ]; then
+	CPUs=3
+else
+	CPUs=$1
+fi
+
+if [ $# -lt 2 ]; then
+	RUNS=5
+else
+	RUNS=$2
+fi
+
+OK2RUN=$(which mpirun)
+if [ ! -x "$OK2RUN" ]; then 
+  echo $OK2RUN
+  echo "Error: mpirun is not installed on your system"
+  echo
+  exit 1
+fi
+
+if [ ! -f "./test/blobs.csv" ]; then
+  echo "Error: test input data not found"
+  echo
+  exit 1
+fi
+
+if [ ! -f "./test/unit_test3.expected" ]; then
+  echo "Error: test validation data not found"
+  echo
+  exit 1
+fi
+
+
+### warning, must be an absolute path
+
+DIR=/tmp/megaclust_test.$$
+
+#### remove any previous test ###
+
+if [ -e $DIR ] ; then rm -r $DIR ; fi
+
+#### run Megaclust test ###
+
+echo "Creating result directory: $DIR"
+mkdir $DIR
+
+echo "Preparing clustering"
+cp ./test/blobs.csv $DIR/blobs.csv
+./bin/dselect4 -i $DIR/blobs.csv -o $DIR/blobs > $DIR/blobs.dselect.log
+
+ERR=`grep ^Error $DIR/blobs.dselect.log | wc -l`
+if [ $ERR != 0 ]; then
+  echo "FAILED: dselect error"
+  exit 1
+fi
+
+FAILED=0
+RUN=1
+while [ $RUN -le $RUNS ]; do
+	echo "Run $RUN of $RUNS using $CPUs processors"
+	bash ./megaclust.sh -N $CPUs -C 3 -d $DIR/blobs -f 0.5 -l 5 -s 0.25 -k 0.5 -p 30 -v 0 > $DIR/blobs.megaclust.log
+	awk -F, '$1 == "id" { next } $2 != 0 { if (!($2 in id)) id[$2] = ++cnt; $2 = id[$2] } { print $1 "," $2 }' $DIR/blobs.clusters.sort > $DIR/unit_test3.obtained.$RUN
+
+	ERR=`diff ./test/unit_test3.expected $DIR/unit_test3.obtained.$RUN | wc -l`
+	if [ $ERR != 0 ]; then
+		echo "FAILED: run $RUN differs from the expected partition; see $DIR/unit_test3.obtained.$RUN"
+		FAILED=1
+	fi
+	RUN=`expr $RUN + 1`
+done
+
+if [ $FAILED = 0 ]; then
+	echo "PASSED: $RUNS runs gave the expected partition"
+fi
+
+echo ""
+echo "results are not erased, you can do it yourself with the following command"
+echo "rm -r $DIR"
+echo
@@ -0,0 +1,89 @@
+#!/bin/sh
+
+#	------------------------------------------------------------------------------------
+#
+#                                 * megaclust *
+#     unbiased hierarchical density based parallel clustering of large datasets
+#
+#
+#   Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+#   Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+#
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+#
+#	Code:       Nicolas Guex, 2008-2019
+#	Contact:    Nicolas.Guex@unil.ch
+#	Repository: https://github.com/sib-swiss/megaclust
+#
+#
+#	------------------------------------------------------------------------------------
+
+#	dselect reads three FCS files as one input:
+#	  fcs_int16.fcs  $DATATYPE I, 16 bits, little endian, $PnR 1024 (values scaled x16)
+#	  fcs_int32.fcs  $DATATYPE I, 32 bits, big endian, $PnR 16384 (values unchanged)
+#	  fcs_float.fcs  $DATATYPE F, 32 bits, big endian, $PnR 262144 (values scaled /16)
+#	Channel names and keyword values of their TEXT segment contain doubled delimiters (FSC//A).
+#	All events but the first go to the leftover file, extracted with cextract.
+
+
+if [ ! -f "./test/fcs_int16.fcs" ] || [ ! -f "./test/fcs_int32.fcs" ] || [ ! -f "./test/fcs_float.fcs" ]; then
+  echo "Error: test input data not found"
+  echo
+  exit 1
+fi
+
+if [ ! -f "./test/unit_test4.expected" ]; then
+  echo "Error: test validation data not found"
+  echo
+  exit 1
+fi
+
+
+### warning, must be an absolute path
+
+DIR=/tmp/megaclust_test.$$
+
+#### remove any previous test ###
+
+if [ -e $DIR ] ; then rm -r $DIR ; fi
+
+echo "Creating result directory: $DIR"
+mkdir $DIR
+
+echo "Reading FCS files"
+./bin/dselect4 -i ./test/fcs_int16.fcs -o $DIR/fcs -s 1000 -c FSC/A,SSC,CD3/4 ./test/fcs_int32.fcs ./test/fcs_float.fcs > $DIR/fcs.dselect.log
+
+ERR=`grep "^Error\|Fatal" $DIR/fcs.dselect.log | wc -l`
+if [ $ERR != 0 ]; then
+  echo "FAILED: dselect error"
+  cat $DIR/fcs.dselect.log
+  exit 1
+fi
+
+./bin/cextract4 -U $DIR/fcs.leftover -o $DIR/unit_test4.obtained > $DIR/fcs.cextract.log
+
+ERR=`diff ./test/unit_test4.expected $DIR/unit_test4.obtained | wc -l`
+if [ $ERR = 0 ]; then
+	echo "PASSED: FCS events were read and scaled as expected"
+else
+	echo "FAILED: Validation failed; see differences with expected results:"
+	sdiff ./test/unit_test4.expected $DIR/unit_test4.obtained
+fi
+
+echo ""
+echo "results are not erased, you can do it yourself with the following command"
+echo "rm -r $DIR"
+echo
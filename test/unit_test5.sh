@@ -0,0 +1,103 @@
+#!/bin/sh
+
+#	------------------------------------------------------------------------------------
+#
+#                                 * megaclust *
+#     unbiased hierarchical density based parallel clustering of large datasets
+#
+#
+#   Copyright (C) SIB  - Swiss Institute of Bioinformatics,   2008-2019 Nicolas Guex
+#   Copyright (C) UNIL - University of Lausanne, Switzerland       2019 Nicolas Guex
+#
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#	but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+#
+#	Code:       Nicolas Guex, 2008-2019
+#	Contact:    Nicolas.Guex@unil.ch
+#	Repository: https://github.com/sib-swiss/megaclust
+#
+#
+#	------------------------------------------------------------------------------------
+
+#	The events left over by dselect are assigned by dclust -L and, from the model written
+#	with -m 1, by dclassify: both must give byte for byte the same rowid,cluster file.
+
+
+if [ $# -eq 0 ]; then
+	CPUs=3
+else
+	CPUs=$1
+fi
+
+OK2RUN=$(which mpirun)
+if [ ! -x "$OK2RUN" ]; then 
+  echo $OK2RUN
+  echo "Error: mpirun is not installed on your system"
+  echo
+  exit 1
+fi
+
+if [ ! -f "./test/blobs.csv" ]; then
+  echo "Error: test input data not found"
+  echo
+  exit 1
+fi
+
+
+### warning, must be an absolute path
+
+DIR=/tmp/megaclust_test.$$
+
+#### remove any previous test ###
+
+if [ -e $DIR ] ; then rm -r $DIR ; fi
+
+#### run Megaclust test ###
+
+echo "Creating result directory: $DIR"
+mkdir $DIR
+
+echo "Preparing clustering"
+cp ./test/blobs.csv $DIR/blobs.csv
+./bin/dselect4 -i $DIR/blobs.csv -o $DIR/blobs -s 3 > $DIR/blobs.dselect.log
+
+ERR=`grep ^Error $DIR/blobs.dselect.log | wc -l`
+if [ $ERR != 0 ]; then
+  echo "FAILED: dselect error"
+  exit 1
+fi
+
+echo "Running using $CPUs processors"
+mpirun -n $CPUs ./bin/dclust4 -i $DIR/blobs.selected -f 0.5 -l 5 -s 0.25 -k 0.5 -p 30 -L -m 1 -g > $DIR/blobs.dclust
+
+if [ ! -f $DIR/blobs.leftover.clusters ] || [ ! -f $DIR/blobs.selected.model ]; then
+  echo "FAILED: dclust error; see $DIR/blobs.dclust"
+  exit 1
+fi
+
+echo "Classifying leftover events"
+./bin/dclassify4 -m $DIR/blobs.selected.model -i $DIR/blobs.leftover -o $DIR/blobs.leftover.dclassify > $DIR/blobs.dclassify.log
+
+if cmp -s $DIR/blobs.leftover.clusters $DIR/blobs.leftover.dclassify; then
+	echo "PASSED: dclassify assigned the leftover events as dclust -L"
+else
+	echo "FAILED: Validation failed; see differences with dclust -L:"
+	diff $DIR/blobs.leftover.clusters $DIR/blobs.leftover.dclassify | head -20
+fi
+
+echo ""
+echo "results are not erased, you can do it yourself with the following command"
+echo "rm -r $DIR"
+echo